@@ -4,10 +4,80 @@
 
 */
 
+// the Python module needs Python.h before any system header
+#ifdef SAVTEST_PYTHON
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <string.h>
+#include <ctype.h>
+#include <math.h>     // log10, log, pow, ceil; link with -lm where needed
+
+// sockets for the query server
+#ifdef _WIN32
+#include <winsock.h>
+#define CLOSESOCKET closesocket
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define CLOSESOCKET close
+#endif
+
+// file change notification for watch mode
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>     // _setmode, for writing binary to stdout
+#include <fcntl.h>
+#else
+#include <dirent.h>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+#endif
+
+// timers for SAVTEST_METRICS and -bench, and threads for the read-ahead;
+// Windows gets both from windows.h
+#ifndef _WIN32
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#endif
+
+// io_uring for the read-ahead, driven with the raw system calls; define
+// NO_IO_URING to leave it out
+#if defined(__linux__) && !defined(NO_IO_URING)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(IORING_TIMEOUT_ETIME_SUCCESS)
+#define USE_IO_URING
+#endif
+#endif
+
+#ifdef _MSC_VER
+#define vsnprintf _vsnprintf
+#endif
+
+// the SQLite virtual table; link with -lsqlite3
+#ifdef SAVTEST_SQLITE
+#include <sqlite3.h>
+#endif
 
 // basic types
 typedef unsigned char byte;
@@ -52,6 +122,9 @@ unsigned int fileoffsets[NUMSAVEFILES] =
 #define OFFSET_NAME 0x0001
 #define NAME_LENGTH 8
 
+// converted names can be longer, as the 'Jr' character takes two letters
+#define NAME_TEXT_LENGTH (NAME_LENGTH * 2)
+
 // Offset 0x0009 is the single-byte checksum, which is calculated by adding
 // all bytes of the savefile together with normal unsigned overflow behavior
 // after zeroing the current value of the checksum. If the checksum is not
@@ -220,6 +293,41 @@ dsscard_t dsscards[NUMDSS] =
 
 #define NUMABILITIES 100
 
+// DSS combinations: any action card may be paired with any attribute card.
+// The used abilities array in the save has one byte per combination, which
+// I'm assuming to be in action-major order (Mercury/Salamander, 
+// Mercury/Serpent, ...). Note -- the order needs to be verified.
+
+#define NUMACTIONCARDS    10
+#define NUMATTRIBCARDS    10
+#define FIRSTACTIONCARD   CARD_MERCURY
+#define FIRSTATTRIBCARD   CARD_SALAMANDER
+
+#define DSSCOMBO(action, attrib) \
+   (((action) - FIRSTACTIONCARD) * NUMATTRIBCARDS + ((attrib) - FIRSTATTRIBCARD))
+
+// The in-game name and effect of each combination, indexed by DSSCOMBO.
+// Note -- the game's own list of combinations hasn't been transcribed and
+// checked yet, so nothing is built in; rather than make effects up, they are
+// shown as unknown unless a catalog file is loaded with --dss (see
+// ReadDSSCatalog).
+
+#define DSSCOMBO_NAMELEN   32
+#define DSSCOMBO_EFFECTLEN 96
+#define DSSCOMBO_TEXTLEN   (DSSCOMBO_NAMELEN + DSSCOMBO_EFFECTLEN + 32)
+
+typedef struct dsscombo_s
+{
+   char name[DSSCOMBO_NAMELEN];     // empty if not catalogued
+   char effect[DSSCOMBO_EFFECTLEN];
+} dsscombo_t;
+
+dsscombo_t dsscombos[NUMABILITIES];
+
+// Used DSS abilities are kept in a 128-bit mask made of 32-bit words, and
+// owned cards in a 20-bit mask where bit (card - 1) is set for each card.
+#define DSSUSEDWORDS 4
+
 // Inventory enumeration
 enum
 {
@@ -502,6 +610,35 @@ const char *modenames[NUMMODES] =
    "Thief",
 };
 
+// header flag for each raw mode value; Vampire Killer is always available
+int modeflags[NUMMODES] =
+{
+   MODE_FLAG_VAMPIREKILLER,
+   MODE_FLAG_SHOOTER,
+   MODE_FLAG_MAGICIAN,
+   MODE_FLAG_FIGHTER,
+   MODE_FLAG_THIEF,
+};
+
+#define HEADER_MAGIC     "DRACULA AGB"
+#define HEADER_MAGIC_LEN 11
+#define HEADER_EXTRA_LEN (sizeof(fileheader) - HEADER_MODES_OFFSET - 1)
+
+//
+// cartridge_t
+//
+// The decoded 16-byte header, which holds state shared by all the files.
+//
+typedef struct cartridge_s
+{
+   char magic[HEADER_MAGIC_LEN + 1]; // "DRACULA AGB"
+   byte modeflags;                   // raw MODE_FLAG_* bits
+   bool unlocked[NUMMODES];          // which modes are unlocked
+   byte extra[4];                    // bytes 0x0C - 0x0F; unknown
+} cartridge_t;
+
+cartridge_t cartridge;
+
 //
 // savefile_t
 //
@@ -513,9 +650,11 @@ typedef struct savefile_s
    byte data[SAVEFILESIZE]; // raw data from the disk file
    bool exists;             // if true, this file is valid
    byte checksum;           // original checksum stored at offset 0x0009
-   char name[9];            // converted file name
+   byte checksum_calc;      // checksum computed from the data when read
+   char name[NAME_TEXT_LENGTH + 1]; // converted file name
    long time;               // elapsed time in tics (60 Hz)
    long mode;               // 03/13/07: game mode being played
+   bool mode_locked;        // mode isn't unlocked in the header (tampered?)
    long map_pct;            // 03/13/07: map percentage
    
    // haleyjd 03/14/07: the unpacked map
@@ -547,6 +686,8 @@ typedef struct savefile_s
 
    bool  dss_owned[NUMDSS];      // owned DSS cards
    bool  dss_used[NUMABILITIES]; // used DSS abilities
+   unsigned int dss_ownedmask;             // owned cards as bits
+   unsigned int dss_usedmask[DSSUSEDWORDS]; // used abilities as bits
 
    // Inventory
 
@@ -579,6 +720,152 @@ void SaveFileError(const char *str, ...)
    exit(1);
 }
 
+//
+// SaveFileWarning
+//
+// Prints an error message to stderr without exiting. Always returns false, so
+// that functions which fail can return it directly.
+//
+bool SaveFileWarning(const char *str, ...)
+{
+   va_list va;
+
+   va_start(va, str);
+
+   vfprintf(stderr, str, va);
+
+   va_end(va);
+
+   return false;
+}
+
+//
+// Metrics
+//
+// Build with SAVTEST_METRICS defined to time each stage of reading and
+// reporting on save RAM, and to count files, bytes, and errors. The results
+// are written out in Prometheus' text format: at exit with --stats, from
+// the server's /metrics, and periodically in watch mode. Without
+// SAVTEST_METRICS, the METRIC_ macros expand to nothing. They include their
+// own semicolons, so METRIC_TIMER can go last among a block's declarations.
+//
+
+enum
+{
+   METRIC_READ,      // reading a file into memory
+   METRIC_LOCATE,    // searching it for a save RAM image
+   METRIC_HEADER,    // decoding the header
+   METRIC_CHECKSUM,  // checksumming the slots
+   METRIC_DECODE,    // decoding a slot, including its map
+   METRIC_MAP,       // unpacking a slot's map
+   METRIC_RENDER,    // writing out a report or response
+   NUMMETRICSTAGES
+};
+
+enum
+{
+   METRIC_ERR_OPEN,  // couldn't open the file
+   METRIC_ERR_FORMAT,// no save RAM image found
+   METRIC_ERR_EMPTY, // no games in it
+   NUMMETRICERRORS
+};
+
+typedef double metrictime_t; // seconds
+
+//
+// MetricsNow
+//
+// Returns a monotonic time in seconds.
+//
+metrictime_t MetricsNow(void)
+{
+#ifdef _WIN32
+   static LARGE_INTEGER freq;
+   LARGE_INTEGER now;
+
+   if(!freq.QuadPart)
+      QueryPerformanceFrequency(&freq);
+   QueryPerformanceCounter(&now);
+
+   return (double)now.QuadPart / (double)freq.QuadPart;
+#else
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+#ifdef SAVTEST_METRICS
+
+const char *metricstagenames[NUMMETRICSTAGES] =
+{
+   "read", "locate", "header", "checksum", "decode", "map", "render"
+};
+
+const char *metricerrornames[NUMMETRICERRORS] =
+{
+   "open", "format", "empty"
+};
+
+// histogram buckets go up by powers of 4 from a microsecond to 4 seconds
+#define METRIC_BUCKETS    12
+#define METRIC_FIRSTBOUND 0.000001
+
+typedef struct stagemetric_s
+{
+   unsigned long count;
+   double        sum;
+   unsigned long buckets[METRIC_BUCKETS + 1]; // last one is +Inf
+} stagemetric_t;
+
+typedef struct metrics_s
+{
+   stagemetric_t stages[NUMMETRICSTAGES];
+   unsigned long errors[NUMMETRICERRORS];
+   unsigned long files;    // files read
+   unsigned long bytes;    // bytes read
+   unsigned long slots;    // slots decoded that had games in them
+} metrics_t;
+
+metrics_t metrics;
+
+//
+// MetricsTime
+//
+// Records the time since start against a stage.
+//
+void MetricsTime(int stage, metrictime_t start)
+{
+   stagemetric_t *sm = &metrics.stages[stage];
+   double elapsed = MetricsNow() - start, bound = METRIC_FIRSTBOUND;
+   int i;
+
+   for(i = 0; i < METRIC_BUCKETS && elapsed > bound; ++i)
+      bound *= 4;
+
+   ++sm->buckets[i];
+   ++sm->count;
+   sm->sum += elapsed;
+}
+
+#define METRIC_TIMER(t)        metrictime_t t;
+#define METRIC_START(t)        t = MetricsNow();
+#define METRIC_STOP(stage, t)  MetricsTime(stage, t);
+#define METRIC_COUNT(c, n)     metrics.c += (n);
+#define METRIC_ERROR(e)        ++metrics.errors[e];
+
+#else
+
+#define METRIC_TIMER(t)
+#define METRIC_START(t)
+#define METRIC_STOP(stage, t)
+#define METRIC_COUNT(c, n)
+#define METRIC_ERROR(e)
+
+#endif
+
 //
 // SaveFileShort
 //
@@ -618,829 +905,12806 @@ long SaveFileLong(savefile_t *sf, unsigned int offset)
 }
 
 //
-// CalculateChecksum
+// SaveFileSetShort
 //
-// Re-calculates the checksum for a savefile.
-// Returns true if the new checksum is the same as the previous one
+// Stores a short int into 2 consecutive bytes of the savefile, little endian.
 //
-bool CalculateChecksum(savefile_t *file)
+void SaveFileSetShort(savefile_t *sf, unsigned int offset, short value)
 {
-   byte checksum = 0;
-   int i;
-
-   // clear the old checksum byte first
-   file->data[OFFSET_CHECKSUM] = 0;
-
-   for(i = 0; i < SAVEFILESIZE; ++i)
-      checksum += file->data[i];
-
-   // store it in the data
-   file->data[OFFSET_CHECKSUM] = checksum;
-
-   return (checksum == file->checksum);
+   sf->data[offset]     = (byte)(value & 0xff);
+   sf->data[offset + 1] = (byte)((value >> 8) & 0xff);
 }
 
-// 03/14/07: use a string to convert all font characters
-const char font_convert_table[] = " ABCDEFGHIJKLMNOPQRSTUVWXYZ&.'-!*";
-
 //
-// ReadPlayerName
+// SaveFileSetLong
 //
-// Small routine to read out and convert the player name into ASCII
+// Stores a long int into 4 consecutive bytes of the savefile, little endian.
 //
-// 03/13/07: rewritten to support all characters in CotM name font
-// (except 'Jr' which cannot be represented; I replace it with a ?)
+void SaveFileSetLong(savefile_t *sf, unsigned int offset, long value)
+{
+   sf->data[offset]     = (byte)(value & 0xff);
+   sf->data[offset + 1] = (byte)((value >>  8) & 0xff);
+   sf->data[offset + 2] = (byte)((value >> 16) & 0xff);
+   sf->data[offset + 3] = (byte)((value >> 24) & 0xff);
+}
+
 //
-void ReadPlayerName(savefile_t *sf)
+// SaveFileChecksums
+//
+// Computes what the checksum bytes of several savefiles should be, all in
+// one pass, without touching the data. Rather than adding up one byte at a
+// time, the data is read a word at a time and the even and odd bytes are
+// added into two accumulators per file, each of which holds two 16-bit
+// sums. Only the low 8 bits of the sums matter, so they're masked back
+// down often enough that they can never carry into each other. The files
+// are the inner loop, so they all go through the data together.
+//
+
+#define CHECKSUM_LANES 0x00FF00FFu
+#define CHECKSUM_WORDS (SAVEFILESIZE / 4)
+#define CHECKSUM_FOLD  256  // words before a 16-bit sum could overflow
+
+void SaveFileChecksums(savefile_t *files, int numfiles, byte *sums)
 {
-   int i;
-   byte c;
+   unsigned int even[NUMSAVEFILES], odd[NUMSAVEFILES];
+   unsigned int w;
+   int i, j;
+
+   memset(even, 0, sizeof(even));
+   memset(odd, 0, sizeof(odd));
 
-   for(i = OFFSET_NAME; i < OFFSET_NAME + NAME_LENGTH; ++i)
+   for(j = 0; j < CHECKSUM_WORDS; ++j)
    {
-      c = sf->data[i];
+      for(i = 0; i < numfiles; ++i)
+      {
+         memcpy(&w, files[i].data + 4 * j, 4);
+         even[i] += w & CHECKSUM_LANES;
+         odd[i]  += (w >> 8) & CHECKSUM_LANES;
+      }
 
-      if(c >= 0 && c <= 32)
-         sf->name[i - OFFSET_NAME] = font_convert_table[c];
-      else
-         sf->name[i - OFFSET_NAME] = '?';
+      if(!((j + 1) % CHECKSUM_FOLD))
+      {
+         for(i = 0; i < numfiles; ++i)
+         {
+            even[i] &= CHECKSUM_LANES;
+            odd[i]  &= CHECKSUM_LANES;
+         }
+      }
    }
 
-   // 03/16/07: for beautification, strip spaces off the end
-   for(i = NAME_LENGTH - 1; i >= 0; --i)
+   for(i = 0; i < numfiles; ++i)
    {
-      if(sf->name[i] != ' ')
-         break;
-      sf->name[i] = '\0';
-   }
-}
-
-//
-// ReadPlayerStats
-//
-// Reads the player's basic stats and current equipment.
-//
-void ReadPlayerStats(savefile_t *sf)
-{
-   sf->hp             = SaveFileLong(sf, OFFSET_HP1);
-   sf->mp             = SaveFileLong(sf, OFFSET_MP1);
-   sf->hearts_current = SaveFileShort(sf, OFFSET_HEARTS_CUR);
-   sf->hearts_max     = SaveFileShort(sf, OFFSET_HEARTS_MAX);
-   sf->subweapon      = SaveFileLong(sf, OFFSET_SUBWEAPON);
-   sf->str[0]         = SaveFileShort(sf, OFFSET_STR_BASE);
-   sf->str[1]         = SaveFileShort(sf, OFFSET_STR_EQUIP);
-   sf->str[2]         = SaveFileShort(sf, OFFSET_STR_DSS);
-   sf->str[3]         = SaveFileShort(sf, OFFSET_STR_UNKNOWN);
-   sf->def[0]         = SaveFileShort(sf, OFFSET_DEF_BASE);
-   sf->def[1]         = SaveFileShort(sf, OFFSET_DEF_EQUIP);
-   sf->def[2]         = SaveFileShort(sf, OFFSET_DEF_DSS);
-   sf->def[3]         = SaveFileShort(sf, OFFSET_DEF_UNKNOWN);
-   sf->intel[0]       = SaveFileShort(sf, OFFSET_INT_BASE);
-   sf->intel[1]       = SaveFileShort(sf, OFFSET_INT_EQUIP);
-   sf->intel[2]       = SaveFileShort(sf, OFFSET_INT_DSS);
-   sf->intel[3]       = SaveFileShort(sf, OFFSET_INT_UNKNOWN);
-   sf->lck[0]         = SaveFileShort(sf, OFFSET_LCK_BASE);
-   sf->lck[1]         = SaveFileShort(sf, OFFSET_LCK_EQUIP);
-   sf->lck[2]         = SaveFileShort(sf, OFFSET_LCK_DSS);
-   sf->lck[3]         = SaveFileShort(sf, OFFSET_LCK_UNKNOWN);
-   sf->lv             = SaveFileLong(sf, OFFSET_LEVEL);
-   sf->exp            = SaveFileLong(sf, OFFSET_EXP);
-   sf->attribute_card = sf->data[OFFSET_EQUIP_ATTRIB];
-   sf->action_card    = sf->data[OFFSET_EQUIP_ACTION];
-   sf->armor          = sf->data[OFFSET_EQUIP_ARMOR];
-   sf->arm_first      = sf->data[OFFSET_EQUIP_ARM1];
-   sf->arm_second     = sf->data[OFFSET_EQUIP_ARM2];
-   sf->numheartups    = sf->data[OFFSET_HEART_UP]; // 03/16/07: Up items
-   sf->numhpups       = sf->data[OFFSET_HP_UP];
-   sf->nummpups       = sf->data[OFFSET_MP_UP];
+      byte checksum;
 
-   // adjust the action card index by 10 (action cards come after attributes)
-   if(sf->action_card)
-      sf->action_card += 10;
+      w = (even[i] & CHECKSUM_LANES) + (odd[i] & CHECKSUM_LANES);
+      checksum = (byte)(w + (w >> 16));
 
-   // 03/16/07: hack - adjust subweapon if it is the homing dagger
-   if(sf->subweapon == SUBWEAPON_HOMINGDAGGER_FILEVAL)
-      sf->subweapon = SUBWEAPON_HOMINGDAGGER;
+      for(j = 4 * CHECKSUM_WORDS; j < SAVEFILESIZE; ++j)
+         checksum += files[i].data[j];
+
+      // the checksum is computed as if its own byte were zero
+      sums[i] = checksum - files[i].data[OFFSET_CHECKSUM];
+   }
 }
 
 //
-// ReadDSS
+// SaveFileChecksum
 //
-// Reads out the DSS data
+// Computes what the checksum byte of a savefile should be without touching
+// the data.
 //
-void ReadDSS(savefile_t *sf)
+byte SaveFileChecksum(savefile_t *file)
 {
-   int i;
+   byte checksum;
 
-   for(i = 1; i < NUMDSS; ++i)
-      sf->dss_owned[i] = sf->data[OFFSET_CARDS + (i - 1)];
+   SaveFileChecksums(file, 1, &checksum);
 
-   for(i = 0; i < NUMABILITIES; ++i)
-      sf->dss_used[i] = sf->data[OFFSET_ABILITIES + i];
+   return checksum;
 }
 
 //
-// ReadInventory
+// CalculateChecksum
 //
-// Reads out the inventory data
+// Re-calculates the checksum for a savefile.
+// Returns true if the new checksum is the same as the previous one
 //
-void ReadInventory(savefile_t *sf)
+bool CalculateChecksum(savefile_t *file)
 {
-   int i;
+   byte checksum = SaveFileChecksum(file);
 
-   for(i = 0; i < NUMINV; ++i)
-      sf->inventory[i] = sf->data[OFFSET_INVENTORY + i];
-}
+   // store it in the data
+   file->data[OFFSET_CHECKSUM] = checksum;
 
-//
-// ReadRelics
-//
-void ReadRelics(savefile_t *sf)
-{
-   int i;
-   
-   for(i = 0; i < NUMRELICS; ++i)
-      sf->relics[i] = sf->data[OFFSET_RELICS + i];
+   return (checksum == file->checksum);
 }
 
+// 03/14/07: use a string to convert all font characters
+const char font_convert_table[] = " ABCDEFGHIJKLMNOPQRSTUVWXYZ&.'-!*";
+
+// The 'Jr' character comes right after the ones in the table. It's written
+// out as "Jr" (capital J, small r), which can't be mistaken for anything
+// else since there are no small letters in the font. Note -- the value
+// needs to be verified; the verify command lists any name codes past it.
+#define NAME_CODE_JR ((int)sizeof(font_convert_table) - 1)
+
 //
-// ReadMap
+// DecodeName
 //
-// haleyjd 03/14/07: Decompresses the map data into a byte array
+// Converts the font codes of a name into ASCII. Codes outside of the font
+// come out as '?'; everything else round-trips through EncodeName.
 //
-void ReadMap(savefile_t *sf)
+void DecodeName(const byte *codes, char *text)
 {
-   int word, row;
-   int offset = OFFSET_MAP;
-
-   memset(sf->map, 0, MAP_WIDTH * MAP_HEIGHT);
+   int i, len = 0;
 
-   for(row = 0; row < MAP_HEIGHT; ++row)
+   for(i = 0; i < NAME_LENGTH; ++i)
    {
-      for(word = 0; word < PACKED_MAP_WIDTH; ++word, ++offset)
+      if(codes[i] < NAME_CODE_JR)
+         text[len++] = font_convert_table[codes[i]];
+      else if(codes[i] == NAME_CODE_JR)
       {
-         int bit;
-
-         for(bit = 0; bit < 8; ++bit)
-         {
-            sf->map[8 * word + bit][row] = 
-               ((sf->data[offset] >> bit) & 1) ? '*' : ' ';
-         }
+         text[len++] = 'J';
+         text[len++] = 'r';
       }
+      else
+         text[len++] = '?';
    }
+
+   // 03/16/07: for beautification, strip spaces off the end
+   while(len > 0 && text[len - 1] == ' ')
+      --len;
+
+   text[len] = '\0';
 }
 
 //
-// ReadSaveFiles
+// EncodeName
 //
-// Reads all the save files from the input file one by one.
+// Converts ASCII into the font codes of a name, padded out with zeros.
+// Letters can be either case. Returns the number of characters, or -1 if
+// the text has something not in the font or is too long.
 //
-void ReadSaveFiles(FILE *f)
+int EncodeName(const char *text, byte *codes)
 {
-   int i;
-   savefile_t *sf;
-   size_t c;
-   bool found_file = false;
-
-   // init everything to zero
-   memset(savefiles, 0, NUMSAVEFILES * sizeof(savefile_t));
-
-   // 03/13/07: read 16-byte file header first
-   if(fread(fileheader, 1, sizeof(fileheader), f) != sizeof(fileheader))
-      SaveFileError("Error: couldn't read 16-byte header\n");
+   const char *c;
+   int len = 0;
 
-   // verify header contents
-   if(strncmp(fileheader, "DRACULA AGB", 11))
-      SaveFileError("Error: this is not a valid CotM save RAM file!\n");
+   memset(codes, 0, NAME_LENGTH);
 
-   for(i = 0; i < NUMSAVEFILES; ++i)
+   for(; *text; ++text)
    {
-      sf = &savefiles[i];
-
-      // seek to position
-      if(fseek(f, fileoffsets[i], SEEK_SET))
-         SaveFileError("Error: couldn't seek to position for savefile %d\n", i);
+      if(len == NAME_LENGTH)
+         return -1;
 
-      // read the raw save data
-      if((c = fread(sf->data, 1, SAVEFILESIZE, f)) != SAVEFILESIZE)
+      if(text[0] == 'J' && text[1] == 'r')
       {
-         SaveFileError("Error: read %d of %d bytes for file %d\n", 
-                       c, SAVEFILESIZE, i);
+         codes[len++] = NAME_CODE_JR;
+         ++text;
       }
+      else if(*text && (c = strchr(font_convert_table, 
+                                    toupper((unsigned char)*text))))
+         codes[len++] = (byte)(c - font_convert_table);
+      else
+         return -1;
+   }
 
-      // check if this file exists; 
-      // if not, we have no more processing to do for this one.
-      if(!(sf->exists = (sf->data[OFFSET_EXISTS] == EXISTS_YES)))
-         continue;
-
-      // 03/13/07: mark if we've found at least one valid file...
-      found_file = true;
-
-      // get & convert player name
-      ReadPlayerName(sf);
-
-      // set original checksum
-      sf->checksum = sf->data[OFFSET_CHECKSUM];
-
-      // get time
-      sf->time = SaveFileLong(sf, OFFSET_TIME);
+   // trailing spaces aren't part of the name
+   while(len > 0 && !codes[len - 1])
+      --len;
 
-      // 03/13/07: get game mode
-      sf->mode = SaveFileLong(sf, OFFSET_GAMEMODE);
+   return len;
+}
 
-      // 03/13/07: get map percentage
-      sf->map_pct = SaveFileLong(sf, OFFSET_MAP_PCT);
+//
+// ReadPlayerName
+//
+// Small routine to read out and convert the player name into ASCII
+//
+// 03/13/07: rewritten to support all characters in CotM name font
+//
+void ReadPlayerName(savefile_t *sf)
+{
+   DecodeName(sf->data + OFFSET_NAME, sf->name);
+}
 
-      // 03/14/07: read map
-      ReadMap(sf);
+//
+// Field Schema
+//
+// A format's fixed-size fields are described by a table: where each one is
+// in a slot, how wide it is there, and which savefile_t member it goes into.
+// ReadSaveFields fills savefile_ts from any format's table, so another
+// game's driver can list its own offsets instead of needing its own reader.
+//
 
-      // get stats
-      ReadPlayerStats(sf);
+enum
+{
+   FIELD_BYTE = 1,
+   FIELD_SHORT,
+   FIELD_LONG
+};
 
-      // get dss
-      ReadDSS(sf);
+typedef struct savefield_s
+{
+   unsigned int offset;   // within the slot
+   int          width;    // FIELD_ size in the save data
+   size_t       member;   // offsetof the savefile_t member
+   int          type;     // FIELD_ size of the member
+} savefield_t;
 
-      // get inventory
-      ReadInventory(sf);
+#define SF_MEMBER(m) offsetof(savefile_t, m)
 
-      // get relics
-      ReadRelics(sf);
-   }
+savefield_t cotmfields[] =
+{
+   { OFFSET_GAMEMODE,     FIELD_LONG,  SF_MEMBER(mode),           FIELD_LONG  },
+   { OFFSET_TIME,         FIELD_LONG,  SF_MEMBER(time),           FIELD_LONG  },
+   { OFFSET_MAP_PCT,      FIELD_LONG,  SF_MEMBER(map_pct),        FIELD_LONG  },
+   { OFFSET_HP1,          FIELD_LONG,  SF_MEMBER(hp),             FIELD_LONG  },
+   { OFFSET_MP1,          FIELD_LONG,  SF_MEMBER(mp),             FIELD_LONG  },
+   { OFFSET_HEARTS_CUR,   FIELD_SHORT, SF_MEMBER(hearts_current), FIELD_SHORT },
+   { OFFSET_HEARTS_MAX,   FIELD_SHORT, SF_MEMBER(hearts_max),     FIELD_SHORT },
+   { OFFSET_SUBWEAPON,    FIELD_LONG,  SF_MEMBER(subweapon),      FIELD_LONG  },
+   { OFFSET_STR_BASE,     FIELD_SHORT, SF_MEMBER(str[0]),         FIELD_SHORT },
+   { OFFSET_STR_EQUIP,    FIELD_SHORT, SF_MEMBER(str[1]),         FIELD_SHORT },
+   { OFFSET_STR_DSS,      FIELD_SHORT, SF_MEMBER(str[2]),         FIELD_SHORT },
+   { OFFSET_STR_UNKNOWN,  FIELD_SHORT, SF_MEMBER(str[3]),         FIELD_SHORT },
+   { OFFSET_DEF_BASE,     FIELD_SHORT, SF_MEMBER(def[0]),         FIELD_SHORT },
+   { OFFSET_DEF_EQUIP,    FIELD_SHORT, SF_MEMBER(def[1]),         FIELD_SHORT },
+   { OFFSET_DEF_DSS,      FIELD_SHORT, SF_MEMBER(def[2]),         FIELD_SHORT },
+   { OFFSET_DEF_UNKNOWN,  FIELD_SHORT, SF_MEMBER(def[3]),         FIELD_SHORT },
+   { OFFSET_INT_BASE,     FIELD_SHORT, SF_MEMBER(intel[0]),       FIELD_SHORT },
+   { OFFSET_INT_EQUIP,    FIELD_SHORT, SF_MEMBER(intel[1]),       FIELD_SHORT },
+   { OFFSET_INT_DSS,      FIELD_SHORT, SF_MEMBER(intel[2]),       FIELD_SHORT },
+   { OFFSET_INT_UNKNOWN,  FIELD_SHORT, SF_MEMBER(intel[3]),       FIELD_SHORT },
+   { OFFSET_LCK_BASE,     FIELD_SHORT, SF_MEMBER(lck[0]),         FIELD_SHORT },
+   { OFFSET_LCK_EQUIP,    FIELD_SHORT, SF_MEMBER(lck[1]),         FIELD_SHORT },
+   { OFFSET_LCK_DSS,      FIELD_SHORT, SF_MEMBER(lck[2]),         FIELD_SHORT },
+   { OFFSET_LCK_UNKNOWN,  FIELD_SHORT, SF_MEMBER(lck[3]),         FIELD_SHORT },
+   { OFFSET_LEVEL,        FIELD_LONG,  SF_MEMBER(lv),             FIELD_LONG  },
+   { OFFSET_EXP,          FIELD_LONG,  SF_MEMBER(exp),            FIELD_LONG  },
+   { OFFSET_EQUIP_ATTRIB, FIELD_BYTE,  SF_MEMBER(attribute_card), FIELD_BYTE  },
+   { OFFSET_EQUIP_ACTION, FIELD_BYTE,  SF_MEMBER(action_card),    FIELD_BYTE  },
+   { OFFSET_EQUIP_ARMOR,  FIELD_BYTE,  SF_MEMBER(armor),          FIELD_BYTE  },
+   { OFFSET_EQUIP_ARM1,   FIELD_BYTE,  SF_MEMBER(arm_first),      FIELD_BYTE  },
+   { OFFSET_EQUIP_ARM2,   FIELD_BYTE,  SF_MEMBER(arm_second),     FIELD_BYTE  },
+   { OFFSET_HEART_UP,     FIELD_BYTE,  SF_MEMBER(numheartups),    FIELD_BYTE  },
+   { OFFSET_HP_UP,        FIELD_BYTE,  SF_MEMBER(numhpups),       FIELD_BYTE  },
+   { OFFSET_MP_UP,        FIELD_BYTE,  SF_MEMBER(nummpups),       FIELD_BYTE  },
+};
 
-   // 03/13/07: don't go on if all files are empty
-   if(!found_file)
-   {
-      SaveFileError("Error: There must be at least one valid game in the "
-                    "savefile.\n");
-   }
-}
+#define NUMCOTMFIELDS ((int)(sizeof(cotmfields) / sizeof(savefield_t)))
 
-// the current file the player has selected to view
-int current_file;
+// one game's save RAM layout; see Save Format Drivers
+typedef struct saveformat_s
+{
+   const char   *name;
+   const char   *magic;          // identifying bytes at offset 0
+   int           magiclen;
+   int           headersize;     // must be <= sizeof(fileheader)
+   int           slotsize;       // must be <= SAVEFILESIZE
+   int           numslots;       // must be <= NUMSAVEFILES
+   unsigned int *slotoffsets;    // where each slot starts
+   int           existsoffset;   // byte in a slot that says it's in use
+   int           existsvalue;    // ...and what it holds when it is
+   int           checksumoffset; // stored checksum byte in a slot
+   savefield_t  *fields;         // fixed-size fields in a slot
+   int           numfields;
+   void (*readheader)(void);          // decodes fileheader
+   void (*decode)(savefile_t *);      // game-specific decoding of a slot
+   void (*checksums)(savefile_t *, int, byte *); // computes slots' checksums
+   size_t        imagesize;      // bytes from the magic to the last slot's end
+   struct saveformat_s *next;    // next format with the same first byte
+} saveformat_t;
 
 //
-// SelectFile
+// ReadSaveFields
 //
-// Allows the user to pick a file which the main menu will use for all functions.
+// Reads the fields in a schema out of the raw data of every slot in a bit
+// mask. The work goes a field at a time across all the slots rather than a
+// slot at a time: each field's column of values is gathered from every slot
+// and then stored into every slot, so the decisions about widths are made
+// once per field instead of once per slot.
 //
-void SelectFile(void)
+void ReadSaveFields(savefile_t *files, unsigned int slots, 
+                    const savefield_t *fields, int count)
 {
-   int filenum;
-   bool exitflag = false;
-   char c, choice;
+   long values[NUMSAVEFILES];
+   int i, s;
 
-   while(!exitflag)
+   for(i = 0; i < count; ++i)
    {
-      printf("\nChoose a file\n"
-             "--------------------------------------------------\n"
-             "1. %s\n"
-             "2. %s\n"
-             "3. %s\n"
-             "4. %s\n"
-             "5. %s\n"
-             "6. %s\n"
-             "7. %s\n"
-             "8. %s\n\n",
-             savefiles[0].exists ? savefiles[0].name : "no file",
-             savefiles[1].exists ? savefiles[1].name : "no file",
-             savefiles[2].exists ? savefiles[2].name : "no file",
-             savefiles[3].exists ? savefiles[3].name : "no file",
-             savefiles[4].exists ? savefiles[4].name : "no file",
-             savefiles[5].exists ? savefiles[5].name : "no file",
-             savefiles[6].exists ? savefiles[6].name : "no file",
-             savefiles[7].exists ? savefiles[7].name : "no file");
+      const savefield_t *f = &fields[i];
 
-      printf("Current file selected: #%d\n", current_file + 1);
-      
-      fflush(stdout);
-      
-      while((c = getchar()) != '\n')
-         choice = c;
-      
-      switch(choice)
+      switch(f->width)
       {
-      case '1':
-      case '2':
-      case '3':
-      case '4':
-      case '5':
-      case '6':
-      case '7':
-      case '8':
-         filenum = choice - '0' - 1;
-         if(!savefiles[filenum].exists)
-         {
-            puts("This file doesn't exist, pick a different one.\n");
-            break;
-         }
-         current_file = filenum;
-         exitflag = true;
+      case FIELD_BYTE:
+         for(s = 0; s < NUMSAVEFILES; ++s)
+            values[s] = files[s].data[f->offset];
+         break;
+      case FIELD_SHORT:
+         for(s = 0; s < NUMSAVEFILES; ++s)
+            values[s] = SaveFileShort(&files[s], f->offset);
          break;
       default:
-         puts("Bad choice, try again.\n");
+         for(s = 0; s < NUMSAVEFILES; ++s)
+            values[s] = SaveFileLong(&files[s], f->offset);
          break;
       }
+
+      for(s = 0; s < NUMSAVEFILES; ++s)
+      {
+         byte *member = (byte *)&files[s] + f->member;
+
+         if(!(slots & (1u << s)))
+            continue;
+
+         switch(f->type)
+         {
+         case FIELD_BYTE:
+            *member = (byte)values[s];
+            break;
+         case FIELD_SHORT:
+            *(short *)member = (short)values[s];
+            break;
+         default:
+            *(long *)member = values[s];
+            break;
+         }
+      }
    }
 }
 
 //
-// ViewStats
+// FixPlayerStats
 //
-// Prints out all the basic stats for the current file.
+// Turns the game's own encodings of some fields read by the schema into
+// the ones this program uses.
 //
-void ViewStats(void)
+void FixPlayerStats(savefile_t *sf)
 {
-   savefile_t *sf = &savefiles[current_file];
-   char timestr[16];
-   int s;
+   // adjust the action card index by 10 (action cards come after attributes)
+   if(sf->action_card)
+      sf->action_card += 10;
 
-   // create time string
-   memset(timestr, 0, sizeof(timestr));
-   
-   // CotM uses a 60 Hz timer
-   s = sf->time / 60;
-   sprintf(timestr, "%02d:%02d:%02d", s / 3600, (s % 3600) / 60, s % 60);
+   // 03/16/07: hack - adjust subweapon if it is the homing dagger
+   if(sf->subweapon == SUBWEAPON_HOMINGDAGGER_FILEVAL)
+      sf->subweapon = SUBWEAPON_HOMINGDAGGER;
+}
 
-   // 03/12/07: found the correct sequence of subweapon names
+//
+// ReadDSS
+//
+// Reads out the DSS data
+//
+void ReadDSS(savefile_t *sf)
+{
+   int i;
 
-   printf("\nFile %d: %s - Stats\n"
-          "------------------------------------------------------------\n"
-          "Game mode: %s\n"
-          "Elapsed time: %s\n"
-          "Map coverage: %.1f%%\n"
-          "LV: %d  EXP: %d\n"
-          "HP: %d  MP: %d  Hearts: %d/%d  Subweapon: %s\n\n"
-          "Base Stats:  STR = %4d, DEF = %4d, INT = %4d, LCK = %4d\n"
-          "Equip Stats: STR = %4d, DEF = %4d, INT = %4d, LCK = %4d\n"
-          "DSS Stats:   STR = %4d, DEF = %4d, INT = %4d, LCK = %4d\n"
-          "???? Stats:  STR = %4d, DEF = %4d, INT = %4d, LCK = %4d\n\n",
-          current_file + 1, sf->name,
-          modenames[sf->mode],
-          timestr,
-          ((float)sf->map_pct) / 10.0f,
-          sf->lv, sf->exp,
-          sf->hp, sf->mp, sf->hearts_current, sf->hearts_max, 
-          subweapons[sf->subweapon],
-          sf->str[0], sf->def[0], sf->intel[0], sf->lck[0],
-          sf->str[1], sf->def[1], sf->intel[1], sf->lck[1],
-          sf->str[2], sf->def[2], sf->intel[2], sf->lck[2],
-          sf->str[3], sf->def[3], sf->intel[3], sf->lck[3]);
+   for(i = 1; i < NUMDSS; ++i)
+      sf->dss_owned[i] = sf->data[OFFSET_CARDS + (i - 1)];
 
-   fflush(stdout);
-   
-   puts("Press enter to return.");
-   while(getchar() != '\n');
+   for(i = 0; i < NUMABILITIES; ++i)
+      sf->dss_used[i] = sf->data[OFFSET_ABILITIES + i];
+
+   // pack them into bit masks for fast queries
+   sf->dss_ownedmask = 0;
+   for(i = 1; i < NUMDSS; ++i)
+   {
+      if(sf->dss_owned[i])
+         sf->dss_ownedmask |= 1u << (i - 1);
+   }
+
+   memset(sf->dss_usedmask, 0, sizeof(sf->dss_usedmask));
+   for(i = 0; i < NUMABILITIES; ++i)
+   {
+      if(sf->dss_used[i])
+         sf->dss_usedmask[i >> 5] |= 1u << (i & 31);
+   }
 }
 
 //
-// ViewEquip
+// BitCount
 //
-// Prints out currently equipped items for the current file.
+// Counts the set bits in a 32-bit value.
 //
-void ViewEquip(void)
+int BitCount(unsigned int x)
 {
-   savefile_t *sf = &savefiles[current_file];
-   inventoryitem_t *armor = &inventory_items[sf->armor];
-   inventoryitem_t *arm1  = &inventory_items[sf->arm_first];
-   inventoryitem_t *arm2  = &inventory_items[sf->arm_second];
+   x = x - ((x >> 1) & 0x55555555u);
+   x = (x & 0x33333333u) + ((x >> 2) & 0x33333333u);
+   x = (x + (x >> 4)) & 0x0F0F0F0Fu;
 
-   printf("\nFile %d: %s - Current Equipment\n"
-          "------------------------------------------------------------\n"
-          "Action Card    = %s\n"
-          "\"%s\"\n"
-          "Attribute Card = %s\n"
-          "\"%s\"\n"
-          "Armor: %s\n"
-          "* %s\n"
-          "* STR: %+4d, DEF: %+4d, INT: %+4d, LCK: %+4d, Rarity: %d\n"
-          "Arm 1: %s\n"
-          "* %s\n"
-          "* STR: %+4d, DEF: %+4d, INT: %+4d, LCK: %+4d, Rarity: %d\n"
-          "Arm 2: %s\n"
-          "* %s\n"
-          "* STR: %+4d, DEF: %+4d, INT: %+4d, LCK: %+4d, Rarity: %d\n\n",
-          current_file + 1, sf->name,
-          dsscards[sf->action_card].name, 
-          dsscards[sf->action_card].description,
-          dsscards[sf->attribute_card].name,
-          dsscards[sf->attribute_card].description,
-          armor->name, armor->description,
-          armor->atk, armor->def, armor->intel, armor->lck, armor->rarity,
-          arm1->name, arm1->description,
-          arm1->atk, arm1->def, arm1->intel, arm1->lck, arm1->rarity,
-          arm2->name, arm2->description,
-          arm2->atk, arm2->def, arm2->intel, arm2->lck, arm2->rarity);
+   return (int)((x * 0x01010101u) >> 24);
+}
 
-   fflush(stdout);
-   
-   puts("Press enter to return.");
-   while(getchar() != '\n');
+//
+// DSSComboCards
+//
+// Returns the owned-card mask bits needed to use a combination.
+//
+unsigned int DSSComboCards(int action, int attrib)
+{
+   return (1u << (action - 1)) | (1u << (attrib - 1));
 }
 
 //
-// ViewDSS
+// DSSComboName
 //
-// Displays the player's DSS card stock and allows viewing of generic info
-// on all the cards.
+// Writes the cards, name and effect of a combination into a buffer of at
+// least DSSCOMBO_TEXTLEN characters.
 //
-void ViewDSS(void)
+void DSSComboName(int action, int attrib, char *buf)
 {
-   bool exitflag = false;
-   char c, choice;
-   savefile_t *sf = &savefiles[current_file];
+   dsscombo_t *combo = &dsscombos[DSSCOMBO(action, attrib)];
 
-   while(!exitflag)
+   if(!combo->name[0])
    {
-      printf("\nFile %d: %s - Owned DSS Cards\n"
-             "------------------------------------------------------------\n"
-             "1. Mercury: %c      B. Salamander:  %c\n"
-             "2. Venus:   %c      C. Serpent:     %c\n"
-             "3. Jupiter: %c      D. Mandragora:  %c\n"
-             "4. Mars:    %c      E. Golem:       %c\n"
-             "5. Diana:   %c      F. Cockatrice:  %c\n" 
-             "6. Apollo:  %c      G. Manticore:   %c\n"
-             "7. Neptune: %c      H. Griffin:     %c\n"
-             "8. Saturn:  %c      I. Thunderbird: %c\n"
-             "9. Uranus:  %c      J. Unicorn:     %c\n"
-             "A. Pluto:   %c      K. Black Dog:   %c\n\n",
-             current_file + 1, sf->name,
-             sf->dss_owned[CARD_MERCURY]     ? 'X' : ' ',
-             sf->dss_owned[CARD_SALAMANDER]  ? 'X' : ' ',
-             sf->dss_owned[CARD_VENUS]       ? 'X' : ' ',
-             sf->dss_owned[CARD_SERPENT]     ? 'X' : ' ',
-             sf->dss_owned[CARD_JUPITER]     ? 'X' : ' ',
-             sf->dss_owned[CARD_MANDRAGORA]  ? 'X' : ' ',
-             sf->dss_owned[CARD_MARS]        ? 'X' : ' ',
-             sf->dss_owned[CARD_GOLEM]       ? 'X' : ' ',
-             sf->dss_owned[CARD_DIANA]       ? 'X' : ' ',
-             sf->dss_owned[CARD_COCKATRICE]  ? 'X' : ' ',
-             sf->dss_owned[CARD_APOLLO]      ? 'X' : ' ',
-             sf->dss_owned[CARD_MANTICORE]   ? 'X' : ' ',
-             sf->dss_owned[CARD_NEPTUNE]     ? 'X' : ' ',
-             sf->dss_owned[CARD_GRIFFIN]     ? 'X' : ' ',
-             sf->dss_owned[CARD_SATURN]      ? 'X' : ' ',
-             sf->dss_owned[CARD_THUNDERBIRD] ? 'X' : ' ',
-             sf->dss_owned[CARD_URANUS]      ? 'X' : ' ',
-             sf->dss_owned[CARD_UNICORN]     ? 'X' : ' ',
-             sf->dss_owned[CARD_PLUTO]       ? 'X' : ' ',
-             sf->dss_owned[CARD_BLACKDOG]    ? 'X' : ' ');
+      sprintf(buf, "%s/%s: (not catalogued)", dsscards[action].name, 
+              dsscards[attrib].name);
+   }
+   else
+   {
+      sprintf(buf, "%s/%s: %s - %s", dsscards[action].name, 
+              dsscards[attrib].name, combo->name, combo->effect);
+   }
+}
 
-      fflush(stdout);
-      
-      puts("Enter a character for more info or press enter to return.");
-      while((c = getchar()) != '\n')
-         choice = c;
+//
+// DSSFindCard
+//
+// Looks up a card by its name, ignoring case, within a range of the card
+// enum. Returns CARD_NONE if it's not there.
+//
+int DSSFindCard(const char *name, int len, int first, int last)
+{
+   int card, i;
 
-      choice = toupper(choice);
-      
-      if(choice >= '1' && choice <= '9' || choice == 'A')
+   for(card = first; card <= last; ++card)
+   {
+      const char *cardname = dsscards[card].name;
+
+      for(i = 0; i < len && cardname[i]; ++i)
       {
-         int cardnum;
+         if(tolower((unsigned char)name[i]) != 
+            tolower((unsigned char)cardname[i]))
+            break;
+      }
 
-         if(choice >= '1' && choice <= '9')
-            cardnum = choice - '0' + 10;
-         else
-            cardnum = 20;
+      if(i == len && !cardname[i])
+         return card;
+   }
 
-         printf("\nAction Card - %s\n"
-                "------------------------------------------------------------\n"
-                "%s\n\n", 
-                dsscards[cardnum].name, dsscards[cardnum].description);
+   return CARD_NONE;
+}
 
-         fflush(stdout);
-         
-         puts("Press enter to return.");
-         while(getchar() != '\n');
-      }
-      else if(choice >= 'B' && choice <= 'K')
-      {
-         int cardnum = choice - 'A';
+//
+// DSSCopyField
+//
+// Copies one tab-separated field, stopping at a tab or the end of the line.
+// Returns a pointer to the next field, or NULL if the field was too long.
+//
+char *DSSCopyField(char *in, char *out, int outlen)
+{
+   int len = 0;
 
-         printf("\nAttribute Card - %s\n"
-                "------------------------------------------------------------\n"
-                "%s\n\n",
-                dsscards[cardnum].name, dsscards[cardnum].description);
+   while(*in && *in != '\t' && *in != '\r' && *in != '\n')
+   {
+      if(len == outlen - 1)
+         return NULL;
+      out[len++] = *in++;
+   }
 
-         fflush(stdout);
-         
-         puts("Press enter to return.");
-         while(getchar() != '\n');
-      }
-      else
-         exitflag = true;
+   out[len] = '\0';
 
-      choice = 0;
-   }
+   return *in == '\t' ? in + 1 : in;
 }
 
 //
-// ViewInventoryRange
+// ReadDSSCatalog
 //
-// This gets pretty hairy. Automatically generates a menu for all the
-// inventory items within the indicated range inclusive.
+// Reads combination names and effects from a text file. Each line has the
+// action and attribute cards, the name, and the effect, separated by tabs:
 //
-void ViewInventoryRange(const char *rangename, int minitem, int maxitem)
+// Mercury/Salamander<tab>name<tab>effect
+//
+// Blank lines and lines starting with # are skipped. Combinations the file
+// doesn't mention stay uncatalogued.
+//
+bool ReadDSSCatalog(const char *path)
 {
-   savefile_t *sf = &savefiles[current_file];
-   char c, choice = 0;
-   bool exitflag = false;
-   int i, invnum;
+   FILE *f;
+   char line[256];
+   int linenum = 0;
+   bool ok = true;
 
-   while(!exitflag)
+   if(!(f = fopen(path, "r")))
+      return SaveFileWarning("Error: couldn't open DSS catalog %s\n", path);
+
+   while(ok && fgets(line, sizeof(line), f))
    {
-      printf("\nFile %d: %s - %s\n"
-             "--------------------------------------------------\n",
-             current_file + 1, sf->name, rangename);
+      char *slash, *tab, *next;
+      int action, attrib;
+      dsscombo_t combo;
+
+      ++linenum;
 
-      for(i = minitem; i <= maxitem; ++i)
+      if(line[0] == '#' || line[0] == '\r' || line[0] == '\n')
+         continue;
+
+      slash = strchr(line, '/');
+      tab   = strchr(line, '\t');
+
+      if(!slash || !tab || tab < slash)
       {
-         int menuidx = i - minitem + 1;
+         ok = false;
+         break;
+      }
+
+      action = DSSFindCard(line, (int)(slash - line), FIRSTACTIONCARD, 
+                           NUMDSS - 1);
+      attrib = DSSFindCard(slash + 1, (int)(tab - slash - 1), 
+                           FIRSTATTRIBCARD, FIRSTACTIONCARD - 1);
 
-         printf("%c. %-17s [%2d]\n",
-                menuidx > 9 ? 'A' + (menuidx - 10) : '0' + menuidx,
-                inventory_items[i].name,
-                sf->inventory[i]);
+      if(action == CARD_NONE || attrib == CARD_NONE ||
+         !(next = DSSCopyField(tab + 1, combo.name, DSSCOMBO_NAMELEN)) ||
+         !DSSCopyField(next, combo.effect, DSSCOMBO_EFFECTLEN) || 
+         !combo.name[0])
+      {
+         ok = false;
+         break;
       }
-      putchar('\n');
 
-      fflush(stdout);
-      
-      puts("Select an inventory item or press enter to return.");
-      while((c = getchar()) != '\n')
-         choice = c;
+      dsscombos[DSSCOMBO(action, attrib)] = combo;
+   }
 
-      choice = toupper(choice);
+   fclose(f);
 
-      invnum = 
-         (choice >= '1' && choice <= '9') ? minitem + choice - '1' :
-         (choice >= 'A' && choice <= 'Z') ? minitem + choice - 'A' + 9 :
-         ((exitflag = true), 0);
+   if(!ok)
+   {
+      SaveFileWarning("Error: line %d of %s is not a valid catalog line\n",
+                      linenum, path);
+   }
+
+   return ok;
+}
+
+//
+// DSSComboUsable
+//
+// Returns true if the file owns both cards of a combination.
+//
+bool DSSComboUsable(savefile_t *sf, int action, int attrib)
+{
+   unsigned int need = DSSComboCards(action, attrib);
+
+   return (sf->dss_ownedmask & need) == need;
+}
+
+//
+// DSSComboUsed
+//
+// Returns true if the file has used a combination.
+//
+bool DSSComboUsed(savefile_t *sf, int action, int attrib)
+{
+   int combo = DSSCOMBO(action, attrib);
+
+   return (sf->dss_usedmask[combo >> 5] >> (combo & 31)) & 1;
+}
+
+//
+// DSS queries
+//
+// A query is a set of required and forbidden bits over both masks, so a
+// question such as "used Mars/Golem but doesn't own Pluto yet" is a couple of
+// ANDs and compares per file.
+//
+typedef struct dssquery_s
+{
+   unsigned int cards_have;                  // must own all of these
+   unsigned int cards_lack;                  // must own none of these
+   unsigned int used_have[DSSUSEDWORDS];     // must have used all of these
+   unsigned int used_lack[DSSUSEDWORDS];     // must have used none of these
+} dssquery_t;
+
+//
+// DSSQueryMatch
+//
+// Returns true if a file matches a DSS query.
+//
+bool DSSQueryMatch(savefile_t *sf, dssquery_t *q)
+{
+   unsigned int bad;
+   int i;
+
+   bad  = (sf->dss_ownedmask & q->cards_have) ^ q->cards_have;
+   bad |= sf->dss_ownedmask & q->cards_lack;
+
+   for(i = 0; i < DSSUSEDWORDS; ++i)
+   {
+      bad |= (sf->dss_usedmask[i] & q->used_have[i]) ^ q->used_have[i];
+      bad |= sf->dss_usedmask[i] & q->used_lack[i];
+   }
+
+   return !bad;
+}
+
+//
+// DSSCountUsed
+//
+// Returns the number of combinations a file has used.
+//
+int DSSCountUsed(savefile_t *sf)
+{
+   int i, count = 0;
+
+   for(i = 0; i < DSSUSEDWORDS; ++i)
+      count += BitCount(sf->dss_usedmask[i]);
+
+   return count;
+}
+
+//
+// ReadInventory
+//
+// Reads out the inventory data
+//
+void ReadInventory(savefile_t *sf)
+{
+   int i;
+
+   for(i = 0; i < NUMINV; ++i)
+      sf->inventory[i] = sf->data[OFFSET_INVENTORY + i];
+}
+
+//
+// ReadRelics
+//
+void ReadRelics(savefile_t *sf)
+{
+   int i;
+   
+   for(i = 0; i < NUMRELICS; ++i)
+      sf->relics[i] = sf->data[OFFSET_RELICS + i];
+}
+
+//
+// ReadMap
+//
+// haleyjd 03/14/07: Decompresses the map data into a byte array
+//
+void ReadMap(savefile_t *sf)
+{
+   int word, row;
+   int offset = OFFSET_MAP;
+
+   memset(sf->map, 0, MAP_WIDTH * MAP_HEIGHT);
+
+   for(row = 0; row < MAP_HEIGHT; ++row)
+   {
+      for(word = 0; word < PACKED_MAP_WIDTH; ++word, ++offset)
+      {
+         int bit;
+
+         for(bit = 0; bit < 8; ++bit)
+         {
+            sf->map[8 * word + bit][row] = 
+               ((sf->data[offset] >> bit) & 1) ? '*' : ' ';
+         }
+      }
+   }
+}
+
+//
+// Map Areas
+//
+// The map has no area information of its own, so each castle area is given
+// as a few rectangles of map cells. These are turned into a bitmask per area
+// in the same layout as the packed map at OFFSET_MAP. That way the explored
+// cells in an area are just an AND and a bit count over the map words, and
+// the map never has to be unpacked.
+//
+// Note -- the rectangles are rough boxes read off the in-game map and need
+// to be verified. A box also takes in empty cells, so an area may not reach
+// 100% even after every room in it has been seen. The verify command
+// compares the number of cells the boxes cover with the number the game's
+// own map percentage implies.
+//
+
+enum
+{
+   AREA_CATACOMB,
+   AREA_ABYSS_STAIRCASE,
+   AREA_AUDIENCE_ROOM,
+   AREA_OUTER_WALL,
+   AREA_TRIUMPH_HALLWAY,
+   AREA_MACHINE_TOWER,
+   AREA_ETERNAL_CORRIDOR,
+   AREA_CHAPEL_TOWER,
+   AREA_UNDERGROUND_GALLERY,
+   AREA_UNDERGROUND_WAREHOUSE,
+   AREA_UNDERGROUND_WATERWAY,
+   AREA_OBSERVATION_TOWER,
+   AREA_CEREMONIAL_ROOM,
+   AREA_BATTLE_ARENA,
+   NUMAREAS
+};
+
+const char *areanames[NUMAREAS] =
+{
+   "Catacomb",
+   "Abyss Staircase",
+   "Audience Room",
+   "Outer Wall",
+   "Triumph Hallway",
+   "Machine Tower",
+   "Eternal Corridor",
+   "Chapel Tower",
+   "Underground Gallery",
+   "Underground Warehouse",
+   "Underground Waterway",
+   "Observation Tower",
+   "Ceremonial Room",
+   "Battle Arena",
+};
+
+typedef struct maprect_s
+{
+   int area;
+   int x, y, w, h;  // in map cells
+} maprect_t;
+
+// where rectangles overlap, the first one listed wins
+maprect_t maprects[] =
+{
+   { AREA_OBSERVATION_TOWER,      0,  0, 10, 14 },
+   { AREA_TRIUMPH_HALLWAY,       10,  0, 18, 10 },
+   { AREA_CEREMONIAL_ROOM,       28,  0,  8,  6 },
+   { AREA_ETERNAL_CORRIDOR,      28,  6, 16,  4 },
+   { AREA_ETERNAL_CORRIDOR,      36,  0,  8,  6 },
+   { AREA_CHAPEL_TOWER,          44,  0, 10, 24 },
+   { AREA_MACHINE_TOWER,         54,  0, 10, 24 },
+   { AREA_OUTER_WALL,             0, 14,  6, 16 },
+   { AREA_AUDIENCE_ROOM,          6, 10, 38, 10 },
+   { AREA_UNDERGROUND_GALLERY,    6, 20, 10, 10 },
+   { AREA_UNDERGROUND_WAREHOUSE, 16, 20, 24, 12 },
+   { AREA_UNDERGROUND_WATERWAY,   0, 30, 16, 10 },
+   { AREA_CATACOMB,              16, 32, 24,  8 },
+   { AREA_ABYSS_STAIRCASE,       40, 20, 14, 20 },
+   { AREA_BATTLE_ARENA,          54, 24, 10, 16 },
+};
+
+#define NUMMAPRECTS ((int)(sizeof(maprects) / sizeof(maprect_t)))
+
+#define MAP_MASK_SIZE  (PACKED_MAP_WIDTH * MAP_HEIGHT)
+#define MAP_MASK_WORDS (MAP_MASK_SIZE / 4)
+
+// area of each map cell, or NUMAREAS for none
+byte mapcellareas[MAP_HEIGHT][MAP_WIDTH];
+
+// per-area masks over the packed map, and the range of words each one uses
+unsigned int areamasks[NUMAREAS][MAP_MASK_WORDS];
+int areafirstword[NUMAREAS];
+int arealastword[NUMAREAS];
+int areacells[NUMAREAS];
+
+//
+// InitMapAreas
+//
+// Fills in the cell table from the rectangles and builds the area masks.
+//
+void InitMapAreas(void)
+{
+   int i, x, y, area;
+
+   memset(mapcellareas, NUMAREAS, sizeof(mapcellareas));
+   memset(areamasks, 0, sizeof(areamasks));
+   memset(areacells, 0, sizeof(areacells));
+
+   for(i = NUMMAPRECTS - 1; i >= 0; --i)
+   {
+      maprect_t *r = &maprects[i];
+
+      for(y = r->y; y < r->y + r->h; ++y)
+      {
+         for(x = r->x; x < r->x + r->w; ++x)
+            mapcellareas[y][x] = (byte)r->area;
+      }
+   }
+
+   for(y = 0; y < MAP_HEIGHT; ++y)
+   {
+      for(x = 0; x < MAP_WIDTH; ++x)
+      {
+         if((area = mapcellareas[y][x]) == NUMAREAS)
+            continue;
+
+         // same bit as ReadMap reads the cell from
+         ((byte *)areamasks[area])[y * PACKED_MAP_WIDTH + x / 8] |= 
+            1 << (x & 7);
+         ++areacells[area];
+      }
+   }
+
+   for(area = 0; area < NUMAREAS; ++area)
+   {
+      areafirstword[area] = MAP_MASK_WORDS;
+      arealastword[area]  = -1;
+
+      for(i = 0; i < MAP_MASK_WORDS; ++i)
+      {
+         if(!areamasks[area][i])
+            continue;
+         if(i < areafirstword[area])
+            areafirstword[area] = i;
+         arealastword[area] = i;
+      }
+   }
+}
+
+//
+// CalculateAreaExplored
+//
+// Counts the explored cells in every area straight from the packed map.
+//
+void CalculateAreaExplored(savefile_t *sf, int *explored)
+{
+   unsigned int map[MAP_MASK_WORDS];
+   int area, i;
+
+   memcpy(map, sf->data + OFFSET_MAP, MAP_MASK_SIZE);
+
+   for(area = 0; area < NUMAREAS; ++area)
+   {
+      const unsigned int *mask = areamasks[area];
+      int count = 0;
+
+      for(i = areafirstword[area]; i <= arealastword[area]; ++i)
+         count += BitCount(map[i] & mask[i]);
+
+      explored[area] = count;
+   }
+}
+
+//
+// Reachability
+//
+// Works out where a file can still go with the relics it has. The map is
+// handled as a bitboard, two 32-bit words per row, and the castle cells an
+// area covers are open once the file has every relic the area needs. The
+// explored cells are flooded out through the open cells, and whatever
+// unexplored cells the flood reaches can be visited now. A file with none
+// left is stuck until it finds another relic.
+//
+// The save doesn't say where the player is, so routes are measured from the
+// castle entrance.
+//
+// Note -- the relics each area needs and the entrance cell are from memory
+// and need to be verified. The verify command lists files that have been in
+// an area without the relics it is supposed to need, or that have explored
+// something but not the entrance.
+//
+
+#define RELICBIT(r) (1u << (r))
+
+typedef struct mapboard_s
+{
+   unsigned int rows[MAP_HEIGHT][2];  // bit x of a row is cell x
+} mapboard_t;
+
+// relics needed to get into each area
+unsigned int areagates[NUMAREAS] =
+{
+   0,                                                  // Catacomb
+   RELICBIT(RELIC_DASHBOOTS),                          // Abyss Staircase
+   RELICBIT(RELIC_DASHBOOTS),                          // Audience Room
+   RELICBIT(RELIC_DOUBLEJUMP),                         // Outer Wall
+   RELICBIT(RELIC_DOUBLEJUMP),                         // Triumph Hallway
+   RELICBIT(RELIC_DOUBLEJUMP) | RELICBIT(RELIC_TACKLE), // Machine Tower
+   RELICBIT(RELIC_TACKLE),                             // Eternal Corridor
+   RELICBIT(RELIC_DOUBLEJUMP) | RELICBIT(RELIC_KICKBOOTS), // Chapel Tower
+   RELICBIT(RELIC_HEAVYRING),                          // Underground Gallery
+   RELICBIT(RELIC_KICKBOOTS),                          // Underground Warehouse
+   RELICBIT(RELIC_CLEANSING),                          // Underground Waterway
+   RELICBIT(RELIC_ROCWING),                            // Observation Tower
+   RELICBIT(RELIC_LASTKEY),                            // Ceremonial Room
+   RELICBIT(RELIC_ROCWING),                            // Battle Arena
+};
+
+#define ENTRANCE_X 20
+#define ENTRANCE_Y 34
+
+// each area as a bitboard, and every castle cell
+mapboard_t areaboards[NUMAREAS];
+mapboard_t castleboard;
+
+typedef struct reach_s
+{
+   int  unexplored;  // unexplored castle cells
+   int  reachable;   // of those, how many can be reached now
+   int  route;       // steps from the entrance to the nearest, or -1
+   int  bestrelic;   // missing relic that opens up the most, or -1
+   int  bestgain;    // how many more cells it makes reachable
+   bool stuck;       // nothing left to reach without another relic
+} reach_t;
+
+//
+// MapBoardFromPacked
+//
+// Converts a packed map, as stored at OFFSET_MAP, into a bitboard.
+//
+void MapBoardFromPacked(mapboard_t *mb, const byte *packed)
+{
+   int row, half;
+
+   for(row = 0; row < MAP_HEIGHT; ++row)
+   {
+      for(half = 0; half < 2; ++half, packed += 4)
+      {
+         mb->rows[row][half] = 
+            (unsigned int)packed[0]         | 
+            ((unsigned int)packed[1] << 8)  |
+            ((unsigned int)packed[2] << 16) | 
+            ((unsigned int)packed[3] << 24);
+      }
+   }
+}
+
+//
+// MapBoardCount
+//
+int MapBoardCount(const mapboard_t *mb)
+{
+   int row, count = 0;
+
+   for(row = 0; row < MAP_HEIGHT; ++row)
+      count += BitCount(mb->rows[row][0]) + BitCount(mb->rows[row][1]);
+
+   return count;
+}
+
+//
+// MapRowFill
+//
+// Spreads a row's set bits left and right through the open cells.
+//
+void MapRowFill(unsigned int *row, const unsigned int *open)
+{
+   unsigned int lo = row[0], hi = row[1], nlo, nhi;
+
+   for(;;)
+   {
+      nlo = (lo | (lo << 1) | (lo >> 1) | (hi << 31)) & open[0];
+      nhi = (hi | (hi << 1) | (hi >> 1) | (lo >> 31)) & open[1];
+
+      if(nlo == lo && nhi == hi)
+         break;
+
+      lo = nlo;
+      hi = nhi;
+   }
+
+   row[0] = lo;
+   row[1] = hi;
+}
+
+//
+// MapBoardFlood
+//
+// Floods the set cells out through the open ones. Each pass sweeps down
+// and then back up the rows, filling each row as it goes, so most maps need
+// only a few passes.
+//
+void MapBoardFlood(mapboard_t *mb, const mapboard_t *open)
+{
+   bool changed;
+   int row;
+
+   do
+   {
+      changed = false;
+
+      for(row = 0; row < MAP_HEIGHT; ++row)
+      {
+         unsigned int r[2];
+
+         r[0] = mb->rows[row][0];
+         r[1] = mb->rows[row][1];
+
+         if(row > 0)
+         {
+            r[0] |= mb->rows[row - 1][0] & open->rows[row][0];
+            r[1] |= mb->rows[row - 1][1] & open->rows[row][1];
+         }
+         if(row < MAP_HEIGHT - 1)
+         {
+            r[0] |= mb->rows[row + 1][0] & open->rows[row][0];
+            r[1] |= mb->rows[row + 1][1] & open->rows[row][1];
+         }
+
+         MapRowFill(r, open->rows[row]);
+
+         if(r[0] != mb->rows[row][0] || r[1] != mb->rows[row][1])
+         {
+            mb->rows[row][0] = r[0];
+            mb->rows[row][1] = r[1];
+            changed = true;
+         }
+      }
+
+      for(row = MAP_HEIGHT - 2; row >= 0; --row)
+      {
+         unsigned int r[2];
+
+         r[0] = mb->rows[row][0] | (mb->rows[row + 1][0] & open->rows[row][0]);
+         r[1] = mb->rows[row][1] | (mb->rows[row + 1][1] & open->rows[row][1]);
+
+         MapRowFill(r, open->rows[row]);
+
+         if(r[0] != mb->rows[row][0] || r[1] != mb->rows[row][1])
+         {
+            mb->rows[row][0] = r[0];
+            mb->rows[row][1] = r[1];
+            changed = true;
+         }
+      }
+   }
+   while(changed);
+}
+
+//
+// MapBoardStep
+//
+// Moves a BFS frontier one cell in every direction through the open cells,
+// leaving out those already visited. Returns false once it's empty.
+//
+bool MapBoardStep(mapboard_t *frontier, mapboard_t *visited, 
+                  const mapboard_t *open)
+{
+   mapboard_t next;
+   unsigned int any = 0;
+   int row;
+
+   for(row = 0; row < MAP_HEIGHT; ++row)
+   {
+      unsigned int lo = frontier->rows[row][0], hi = frontier->rows[row][1];
+      unsigned int nlo, nhi;
+
+      nlo = (lo << 1) | (lo >> 1) | (hi << 31);
+      nhi = (hi << 1) | (hi >> 1) | (lo >> 31);
+
+      if(row > 0)
+      {
+         nlo |= frontier->rows[row - 1][0];
+         nhi |= frontier->rows[row - 1][1];
+      }
+      if(row < MAP_HEIGHT - 1)
+      {
+         nlo |= frontier->rows[row + 1][0];
+         nhi |= frontier->rows[row + 1][1];
+      }
+
+      next.rows[row][0] = nlo & open->rows[row][0] & ~visited->rows[row][0];
+      next.rows[row][1] = nhi & open->rows[row][1] & ~visited->rows[row][1];
+      visited->rows[row][0] |= next.rows[row][0];
+      visited->rows[row][1] |= next.rows[row][1];
+      any |= next.rows[row][0] | next.rows[row][1];
+   }
+
+   *frontier = next;
+
+   return any != 0;
+}
+
+//
+// InitReachability
+//
+// Builds the area bitboards from the area masks. Must come after
+// InitMapAreas.
+//
+void InitReachability(void)
+{
+   int area, row, half;
+
+   memset(&castleboard, 0, sizeof(castleboard));
+
+   for(area = 0; area < NUMAREAS; ++area)
+   {
+      MapBoardFromPacked(&areaboards[area], (byte *)areamasks[area]);
+
+      for(row = 0; row < MAP_HEIGHT; ++row)
+      {
+         for(half = 0; half < 2; ++half)
+            castleboard.rows[row][half] |= areaboards[area].rows[row][half];
+      }
+   }
+}
+
+//
+// SaveFileRelicBits
+//
+unsigned int SaveFileRelicBits(savefile_t *sf)
+{
+   unsigned int bits = 0;
+   int i;
+
+   for(i = 0; i < NUMRELICS; ++i)
+   {
+      if(sf->relics[i])
+         bits |= RELICBIT(i);
+   }
+
+   return bits;
+}
+
+//
+// OpenMapBoard
+//
+// The cells a file can move through: everything it has explored, and every
+// area it has the relics for.
+//
+void OpenMapBoard(mapboard_t *open, const mapboard_t *explored, 
+                  unsigned int relicbits)
+{
+   int area, row;
+
+   *open = *explored;
+
+   for(area = 0; area < NUMAREAS; ++area)
+   {
+      if(areagates[area] & ~relicbits)
+         continue;
+
+      for(row = 0; row < MAP_HEIGHT; ++row)
+      {
+         open->rows[row][0] |= areaboards[area].rows[row][0];
+         open->rows[row][1] |= areaboards[area].rows[row][1];
+      }
+   }
+}
+
+//
+// ReachableUnexplored
+//
+// Floods out from the explored cells and the entrance and counts the
+// unexplored castle cells that were reached.
+//
+int ReachableUnexplored(const mapboard_t *explored, unsigned int relicbits)
+{
+   mapboard_t open, reach;
+   int row, count = 0;
+
+   OpenMapBoard(&open, explored, relicbits);
+
+   reach = *explored;
+   reach.rows[ENTRANCE_Y][ENTRANCE_X / 32] |= 1u << (ENTRANCE_X & 31);
+   MapBoardFlood(&reach, &open);
+
+   for(row = 0; row < MAP_HEIGHT; ++row)
+   {
+      count += BitCount(reach.rows[row][0] & ~explored->rows[row][0] & 
+                        castleboard.rows[row][0]);
+      count += BitCount(reach.rows[row][1] & ~explored->rows[row][1] & 
+                        castleboard.rows[row][1]);
+   }
+
+   return count;
+}
+
+//
+// NearestUnexplored
+//
+// Steps a BFS out from the entrance until it finds an unexplored castle
+// cell. Returns the number of steps, or -1 if it never does.
+//
+int NearestUnexplored(const mapboard_t *explored, unsigned int relicbits)
+{
+   mapboard_t open, frontier, visited;
+   int row, steps = 0;
+
+   OpenMapBoard(&open, explored, relicbits);
+
+   memset(&frontier, 0, sizeof(frontier));
+   frontier.rows[ENTRANCE_Y][ENTRANCE_X / 32] = 1u << (ENTRANCE_X & 31);
+   visited = frontier;
+
+   do
+   {
+      for(row = 0; row < MAP_HEIGHT; ++row)
+      {
+         if((frontier.rows[row][0] & ~explored->rows[row][0] & 
+             castleboard.rows[row][0]) ||
+            (frontier.rows[row][1] & ~explored->rows[row][1] & 
+             castleboard.rows[row][1]))
+            return steps;
+      }
+      ++steps;
+   }
+   while(MapBoardStep(&frontier, &visited, &open));
+
+   return -1;
+}
+
+//
+// CalculateReach
+//
+// Fills in a file's reach_t, including which missing relic would help most.
+//
+void CalculateReach(savefile_t *sf, reach_t *reach)
+{
+   mapboard_t explored;
+   unsigned int relicbits = SaveFileRelicBits(sf);
+   int row, i;
+
+   MapBoardFromPacked(&explored, sf->data + OFFSET_MAP);
+
+   reach->unexplored = 0;
+   for(row = 0; row < MAP_HEIGHT; ++row)
+   {
+      reach->unexplored += 
+         BitCount(castleboard.rows[row][0] & ~explored.rows[row][0]) +
+         BitCount(castleboard.rows[row][1] & ~explored.rows[row][1]);
+   }
+
+   reach->reachable = ReachableUnexplored(&explored, relicbits);
+   reach->route     = reach->reachable ? 
+                      NearestUnexplored(&explored, relicbits) : -1;
+   reach->stuck     = (reach->reachable == 0 && reach->unexplored > 0);
+   reach->bestrelic = -1;
+   reach->bestgain  = 0;
+
+   for(i = 0; i < NUMRELICS; ++i)
+   {
+      int gain;
+
+      if(relicbits & RELICBIT(i))
+         continue;
+
+      gain = ReachableUnexplored(&explored, relicbits | RELICBIT(i)) - 
+             reach->reachable;
+
+      if(gain > reach->bestgain)
+      {
+         reach->bestrelic = i;
+         reach->bestgain  = gain;
+      }
+   }
+}
+
+//
+// ReadCartridgeHeader
+//
+// Decodes the 16-byte header into the cartridge record.
+//
+void ReadCartridgeHeader(void)
+{
+   int i;
+
+   memcpy(cartridge.magic, fileheader, HEADER_MAGIC_LEN);
+   cartridge.magic[HEADER_MAGIC_LEN] = '\0';
+
+   cartridge.modeflags = fileheader[HEADER_MODES_OFFSET];
+
+   for(i = 0; i < NUMMODES; ++i)
+   {
+      cartridge.unlocked[i] = 
+         !modeflags[i] || (cartridge.modeflags & modeflags[i]);
+   }
+
+   memcpy(cartridge.extra, fileheader + HEADER_MODES_OFFSET + 1, 
+          HEADER_EXTRA_LEN);
+}
+
+//
+// SaveFileModeName
+//
+// Returns the name of a file's game mode, even if it's garbage.
+//
+const char *SaveFileModeName(savefile_t *sf)
+{
+   return (sf->mode >= 0 && sf->mode < NUMMODES) ? 
+      modenames[sf->mode] : "Unknown";
+}
+
+//
+// CheckSaveFileMode
+//
+// A file can only be playing a mode that the header says is unlocked; if not,
+// somebody has been editing the file.
+//
+void CheckSaveFileMode(savefile_t *sf)
+{
+   sf->mode_locked = 
+      !(sf->mode >= 0 && sf->mode < NUMMODES && cartridge.unlocked[sf->mode]);
+}
+
+//
+// DecodeCotMSave
+//
+// The Circle of the Moon parts of decoding a file that its field schema
+// doesn't cover.
+//
+void DecodeCotMSave(savefile_t *sf)
+{
+   METRIC_TIMER(t)
+
+   // get & convert player name
+   ReadPlayerName(sf);
+
+   FixPlayerStats(sf);
+   CheckSaveFileMode(sf);
+
+   // 03/14/07: read map
+   METRIC_START(t)
+   ReadMap(sf);
+   METRIC_STOP(METRIC_MAP, t)
+
+   // get dss
+   ReadDSS(sf);
+
+   // get inventory
+   ReadInventory(sf);
+
+   // get relics
+   ReadRelics(sf);
+}
+
+//
+// CheckSaveFileExists
+//
+// Clears out anything decoded from a file's earlier data and checks if the
+// file exists. If it does, its stored checksum is taken as well.
+//
+bool CheckSaveFileExists(saveformat_t *fmt, savefile_t *sf)
+{
+   memset(&sf->exists, 0, sizeof(savefile_t) - offsetof(savefile_t, exists));
+
+   // check if this file exists; 
+   // if not, we have no more processing to do for this one.
+   sf->exists = (sf->data[fmt->existsoffset] == fmt->existsvalue);
+   if(!sf->exists)
+      return false;
+
+   // set original checksum
+   sf->checksum = sf->data[fmt->checksumoffset];
+
+   return true;
+}
+
+//
+// Save Format Drivers
+//
+// Everything that is specific to one game's save RAM layout is reached
+// through a saveformat_t: how to recognize it, where the header and file
+// slots are, how to decode a slot, and how its checksum works. The format of
+// an image is found by looking up the first byte of the image in a dispatch
+// table, so only the formats that could possibly match are compared, no
+// matter how many drivers there are.
+//
+// Only Circle of the Moon is supported so far. Another game's driver needs
+// its header magic, slot layout, where a slot's in-use flag and checksum
+// are, field schema (see Field Schema), decoder for whatever the schema
+// can't describe, and checksum routine; slots must fit within the
+// SAVEFILESIZE data buffer and there can be no more than NUMSAVEFILES of
+// them. The views and the derived data above them are still Circle of the
+// Moon's own.
+//
+// Note -- Harmony of Dissonance and Aria of Sorrow saves are still turned
+// away. Their layouts haven't been worked out from real save RAM, and
+// guessed offsets would be worse than an honest "unsupported".
+//
+
+saveformat_t saveformats[] =
+{
+   {
+      "Castlevania: Circle of the Moon",
+      HEADER_MAGIC, HEADER_MAGIC_LEN, sizeof(fileheader),
+      SAVEFILESIZE, NUMSAVEFILES, fileoffsets, 
+      OFFSET_EXISTS, EXISTS_YES, OFFSET_CHECKSUM, cotmfields, NUMCOTMFIELDS,
+      ReadCartridgeHeader, DecodeCotMSave, SaveFileChecksums,
+   },
+};
+
+#define NUMSAVEFORMATS ((int)(sizeof(saveformats) / sizeof(saveformat_t)))
+
+// formats indexed by the first byte of their magic
+saveformat_t *formatdispatch[256];
+
+// format of the save RAM that was last read
+saveformat_t *saveformat;
+
+// first byte shared by every format's magic, or -1 if they differ
+int formatsearchbyte;
+
+//
+// InitSaveFormats
+//
+// Builds the first-byte dispatch table.
+//
+void InitSaveFormats(void)
+{
+   int i;
+
+   memset(formatdispatch, 0, sizeof(formatdispatch));
+
+   formatsearchbyte = (byte)saveformats[0].magic[0];
+
+   for(i = NUMSAVEFORMATS - 1; i >= 0; --i)
+   {
+      saveformat_t *fmt = &saveformats[i];
+      byte first = (byte)fmt->magic[0];
+      int j;
+
+      fmt->next = formatdispatch[first];
+      formatdispatch[first] = fmt;
+
+      if(first != formatsearchbyte)
+         formatsearchbyte = -1;
+
+      // work out how much of a container the image takes up
+      fmt->imagesize = fmt->headersize;
+      for(j = 0; j < fmt->numslots; ++j)
+      {
+         if(fmt->slotoffsets[j] + fmt->slotsize > fmt->imagesize)
+            fmt->imagesize = fmt->slotoffsets[j] + fmt->slotsize;
+      }
+   }
+}
+
+//
+// SniffSaveFormat
+//
+// Identifies the format of a save RAM image from its first bytes. Returns
+// NULL if it isn't one that's supported.
+//
+saveformat_t *SniffSaveFormat(const byte *image, size_t len)
+{
+   saveformat_t *fmt;
+
+   if(!len)
+      return NULL;
+
+   for(fmt = formatdispatch[image[0]]; fmt; fmt = fmt->next)
+   {
+      if(len >= (size_t)fmt->magiclen && 
+         !memcmp(image, fmt->magic, fmt->magiclen))
+         return fmt;
+   }
+
+   return NULL;
+}
+
+//
+// Save Containers
+//
+// The save RAM image doesn't always start at the beginning of the file.
+// Emulators write out the whole 32 KB SRAM or a 64 KB/128 KB flash chip,
+// flash cart dumps are padded out to the chip size, and some tools put a
+// header of their own in front. Rather than make people strip all that off
+// first, the whole file is read into memory and searched for a format's
+// magic, and the image is decoded from wherever it's found.
+//
+// Compressed containers (such as emulator save states) aren't handled; the
+// magic has to appear in the file as-is.
+//
+
+enum
+{
+   CONTAINER_RAW,       // the image by itself, possibly with trailing junk
+   CONTAINER_SRAM,      // whole 32 KB SRAM
+   CONTAINER_FLASH64,   // whole 64 KB flash chip
+   CONTAINER_FLASH128,  // whole 128 KB flash chip
+   CONTAINER_WRAPPED,   // image preceded by something else
+   NUMCONTAINERS
+};
+
+const char *containernames[NUMCONTAINERS] =
+{
+   "Raw save RAM image",
+   "32 KB SRAM dump",
+   "64 KB flash dump",
+   "128 KB flash dump",
+   "Wrapped save RAM image",
+};
+
+// largest file that will be searched for an image
+#define MAXCONTAINERSIZE (256 * 1024)
+
+typedef struct container_s
+{
+   int    type;
+   size_t offset;    // where the image starts in the file
+   size_t size;      // size of the whole file
+   bool   truncated; // file was bigger than MAXCONTAINERSIZE
+} container_t;
+
+// container of the save RAM that was last read
+container_t container;
+
+// the last file read, in full
+byte containerbuf[MAXCONTAINERSIZE];
+
+//
+// ReadContainer
+//
+// Reads a whole file into containerbuf. Returns the number of bytes read.
+//
+size_t ReadContainer(FILE *f, bool *truncated)
+{
+   size_t c;
+   METRIC_TIMER(t)
+
+   METRIC_START(t)
+   c = fread(containerbuf, 1, MAXCONTAINERSIZE, f);
+
+   *truncated = (c == MAXCONTAINERSIZE && fgetc(f) != EOF);
+   METRIC_STOP(METRIC_READ, t)
+
+   METRIC_COUNT(files, 1)
+   METRIC_COUNT(bytes, c)
+
+   return c;
+}
+
+//
+// LocateSaveRAM
+//
+// Finds the first save RAM image in a buffer that's recognized by a format
+// driver and fits in what's left of the buffer. When all the formats' magic
+// starts with the same byte, memchr does the scanning, which the C library
+// does a word or more at a time; otherwise the dispatch table rules out
+// most bytes with a single lookup. Returns NULL if there's no image.
+//
+saveformat_t *LocateSaveRAM(const byte *buf, size_t len, size_t *offset)
+{
+   const byte *p = buf, *end = buf + len;
+   saveformat_t *fmt = NULL;
+   METRIC_TIMER(t)
+
+   METRIC_START(t)
+
+   while(p < end)
+   {
+      if(formatsearchbyte >= 0)
+      {
+         if(!(p = memchr(p, formatsearchbyte, end - p)))
+            break;
+      }
+      else if(!formatdispatch[*p])
+      {
+         ++p;
+         continue;
+      }
+
+      if((fmt = SniffSaveFormat(p, end - p)) && 
+         (size_t)(end - p) >= fmt->imagesize)
+      {
+         *offset = p - buf;
+         break;
+      }
+
+      fmt = NULL;
+      ++p;
+   }
+
+   METRIC_STOP(METRIC_LOCATE, t)
+
+   return fmt;
+}
+
+//
+// ContainerType
+//
+// Works out what kind of container an image was found in.
+//
+int ContainerType(size_t offset, size_t size)
+{
+   if(offset)
+      return CONTAINER_WRAPPED;
+
+   switch(size)
+   {
+   case 32 * 1024:
+      return CONTAINER_SRAM;
+   case 64 * 1024:
+      return CONTAINER_FLASH64;
+   case 128 * 1024:
+      return CONTAINER_FLASH128;
+   default:
+      return CONTAINER_RAW;
+   }
+}
+
+//
+// ContainerName
+//
+// Describes the container of the save RAM that was last read.
+//
+const char *ContainerName(char *buf)
+{
+   if(container.type == CONTAINER_WRAPPED)
+   {
+      sprintf(buf, "%s at offset 0x%lx", containernames[container.type],
+              (unsigned long)container.offset);
+      return buf;
+   }
+
+   return containernames[container.type];
+}
+
+//
+// DecodeSaveSlots
+//
+// Decodes the slots in a bit mask. The format's checksums and the fields in
+// its schema are done for all of the slots together; only what the format's
+// decode callback does (the name, map, DSS, inventory and relics for Circle
+// of the Moon) is still done a slot at a time. Returns a mask of the slots
+// that turned out to have a game in them.
+//
+unsigned int DecodeSaveSlots(saveformat_t *fmt, savefile_t *files, 
+                             unsigned int slots)
+{
+   byte sums[NUMSAVEFILES];
+   unsigned int found = 0;
+   int i;
+   METRIC_TIMER(t)
+
+   METRIC_START(t)
+   fmt->checksums(files, fmt->numslots, sums);
+   METRIC_STOP(METRIC_CHECKSUM, t)
+
+   METRIC_START(t)
+
+   // if a file doesn't exist, there's nothing else to do for it
+   for(i = 0; i < fmt->numslots; ++i)
+   {
+      if((slots & (1u << i)) && CheckSaveFileExists(fmt, &files[i]))
+         found |= 1u << i;
+   }
+
+   // get time, game mode, map percentage, stats and equipment
+   ReadSaveFields(files, found, fmt->fields, fmt->numfields);
+
+   // and whatever else the game keeps
+   for(i = 0; i < fmt->numslots; ++i)
+   {
+      if(!(found & (1u << i)))
+         continue;
+
+      fmt->decode(&files[i]);
+      files[i].checksum_calc = sums[i];
+      METRIC_COUNT(slots, 1)
+   }
+
+   METRIC_STOP(METRIC_DECODE, t)
+
+   return found;
+}
+
+//
+// FindSaveRAMImage
+//
+// Finds the save RAM image in the first len bytes of containerbuf, and
+// copies the slots into savefiles without decoding them, for callers that
+// only want some of the slots. Returns false if there's no image, after
+// printing why.
+//
+bool FindSaveRAMImage(size_t len, bool truncated)
+{
+   int i;
+   const byte *image;
+   METRIC_TIMER(t)
+
+   // init everything to zero
+   memset(savefiles, 0, NUMSAVEFILES * sizeof(savefile_t));
+   memset(&container, 0, sizeof(container));
+
+   container.size = len;
+   container.truncated = truncated;
+
+   // work out what game it's from and where the image is
+   if(!(saveformat = LocateSaveRAM(containerbuf, len, &container.offset)))
+   {
+      METRIC_ERROR(METRIC_ERR_FORMAT)
+      return SaveFileWarning("Error: this is not a supported save RAM file!\n");
+   }
+
+   container.type = ContainerType(container.offset, len);
+   image = containerbuf + container.offset;
+
+   // 03/13/07: decode 16-byte file header first
+   METRIC_START(t)
+   memcpy(fileheader, image, saveformat->headersize);
+   saveformat->readheader();
+   METRIC_STOP(METRIC_HEADER, t)
+
+   for(i = 0; i < saveformat->numslots; ++i)
+   {
+      memcpy(savefiles[i].data, image + saveformat->slotoffsets[i], 
+             saveformat->slotsize);
+   }
+
+   return true;
+}
+
+//
+// ReadSaveRAMImage
+//
+// Reads the input file and finds the save RAM image in it, as above.
+//
+bool ReadSaveRAMImage(FILE *f)
+{
+   bool truncated;
+   size_t len = ReadContainer(f, &truncated);
+
+   return FindSaveRAMImage(len, truncated);
+}
+
+//
+// DecodeSaveRAM
+//
+// Decodes all the save files of the image found last. Returns false if
+// none of them has a game in it, after printing why.
+//
+bool DecodeSaveRAM(void)
+{
+   // 03/13/07: don't go on if all files are empty
+   if(!DecodeSaveSlots(saveformat, savefiles, ~0u))
+   {
+      METRIC_ERROR(METRIC_ERR_EMPTY)
+      return SaveFileWarning("Error: There must be at least one valid game "
+                             "in the savefile.\n");
+   }
+
+   return true;
+}
+
+//
+// ReadSaveRAM
+//
+// Reads the input file, finds the save RAM image inside it, and decodes all
+// the save files. The slots are taken straight from the file's buffer. 
+// Returns false if the input isn't usable, after printing why.
+//
+bool ReadSaveRAM(FILE *f)
+{
+   return ReadSaveRAMImage(f) && DecodeSaveRAM();
+}
+
+//
+// ReadSaveFiles
+//
+// Reads the save RAM for the menus, exiting if it isn't usable.
+//
+void ReadSaveFiles(FILE *f)
+{
+   if(!ReadSaveRAM(f))
+      exit(1);
+}
+
+//
+// LoadSaveRAMFile
+//
+// Opens and reads a save RAM file by name. Returns false on failure.
+//
+bool LoadSaveRAMFile(const char *path)
+{
+   FILE *f;
+   bool ret;
+
+   if(!(f = fopen(path, "rb")))
+   {
+      METRIC_ERROR(METRIC_ERR_OPEN)
+      return SaveFileWarning("Error: couldn't open %s\n", path);
+   }
+
+   ret = ReadSaveRAM(f);
+   fclose(f);
+
+   return ret;
+}
+
+//
+// Derived Stat Engine
+//
+// The save file stores the game's own equip and DSS stat deltas, but those
+// only describe the loadout that is currently equipped. The code below can
+// compute effective STR/DEF/INT/LCK for any combination of armor, arm
+// equips, and DSS cards. Everything is done through lookup tables built once
+// at startup, so evaluating a loadout is a handful of adds and a multiply per
+// stat with no item-specific branching.
+//
+
+// stat indices
+enum
+{
+   STAT_STR,
+   STAT_DEF,
+   STAT_INT,
+   STAT_LCK,
+   NUMSTATS
+};
+
+const char *statnames[NUMSTATS] = { "STR", "DEF", "INT", "LCK" };
+
+// DSS multipliers are fixed point with 8 bits of fraction
+#define FRACBITS 8
+#define FRACUNIT (1 << FRACBITS)
+
+typedef struct statvec_s
+{
+   int s[NUMSTATS];
+} statvec_t;
+
+// DSS combination effect: effective = (stat * mul) / FRACUNIT + add
+typedef struct dsseffect_s
+{
+   int mul[NUMSTATS];
+   int add[NUMSTATS];
+} dsseffect_t;
+
+// Stat tables. Items which cannot go into a given equipment slot have a zero
+// vector there, so no range checks are needed while evaluating.
+statvec_t armorstats[NUMINV];   // deltas when worn as armor
+statvec_t armstats[2][NUMINV];  // deltas when worn on arm 1 / arm 2
+statvec_t gripstats;            // bonus when both arms hold Double Grips
+
+// indexed by [action card][attribute card] using the CARD_ enum values
+dsseffect_t dsseffects[NUMDSS][NUMDSS];
+
+// Star Bracelet: percentage of its listed bonuses applied on each arm.
+// Note -- this needs to be verified against a save with the bracelet on each
+// arm; the verify command checks it against the equip stats stored in saves.
+int starbracelet_pct[2][NUMSTATS] =
+{
+   { 100,   0, 100,   0 }, // arm 1: offense
+   {   0, 100,   0, 100 }, // arm 2: defense
+};
+
+// DSS combinations that modify stats, in percent. Venus is the card with the
+// "potential of enchantment". Note -- these also still need to be verified;
+// the verify command compares them with the DSS stats stored in saves.
+typedef struct dssstatmod_s
+{
+   int action, attribute, stat, pct;
+} dssstatmod_t;
+
+dssstatmod_t dssstatmods[] =
+{
+   { CARD_VENUS, CARD_SALAMANDER, STAT_STR, 150 },
+   { CARD_VENUS, CARD_GOLEM,      STAT_DEF, 150 },
+   { CARD_VENUS, CARD_UNICORN,    STAT_INT, 150 },
+   { CARD_VENUS, CARD_COCKATRICE, STAT_LCK, 150 },
+};
+
+#define NUMDSSSTATMODS ((int)(sizeof(dssstatmods) / sizeof(dssstatmod_t)))
+
+//
+// ItemStats
+//
+// Fills a stat vector from an inventory item definition.
+//
+void ItemStats(int item, statvec_t *vec)
+{
+   vec->s[STAT_STR] = inventory_items[item].atk;
+   vec->s[STAT_DEF] = inventory_items[item].def;
+   vec->s[STAT_INT] = inventory_items[item].intel;
+   vec->s[STAT_LCK] = inventory_items[item].lck;
+}
+
+//
+// InitStatTables
+//
+// Builds the lookup tables used by the derived stat engine.
+//
+void InitStatTables(void)
+{
+   int i, j, s;
+   statvec_t vec;
+
+   memset(armorstats, 0, sizeof(armorstats));
+   memset(armstats, 0, sizeof(armstats));
+
+   // armor, robes, and clothes all go in the armor slot
+   for(i = INV_LEATHER_ARMOR; i <= INV_SOLDIER_FATIGUES; ++i)
+      ItemStats(i, &armorstats[i]);
+
+   // everything from the Double Grips through the Bear Ring goes on an arm
+   for(i = INV_DOUBLE_GRIPS; i <= INV_BEAR_RING; ++i)
+   {
+      ItemStats(i, &armstats[0][i]);
+      armstats[1][i] = armstats[0][i];
+   }
+
+   // a single Double Grip does nothing; the pair applies its bonus once
+   memset(&armstats[0][INV_DOUBLE_GRIPS], 0, sizeof(statvec_t));
+   memset(&armstats[1][INV_DOUBLE_GRIPS], 0, sizeof(statvec_t));
+   ItemStats(INV_DOUBLE_GRIPS, &gripstats);
+
+   // Star Bracelet depends on which arm it is on
+   ItemStats(INV_STAR_BRACELET, &vec);
+   for(i = 0; i < 2; ++i)
+   {
+      for(s = 0; s < NUMSTATS; ++s)
+      {
+         armstats[i][INV_STAR_BRACELET].s[s] = 
+            vec.s[s] * starbracelet_pct[i][s] / 100;
+      }
+   }
+
+   // all DSS combinations start out neutral
+   for(i = 0; i < NUMDSS; ++i)
+   {
+      for(j = 0; j < NUMDSS; ++j)
+      {
+         for(s = 0; s < NUMSTATS; ++s)
+         {
+            dsseffects[i][j].mul[s] = FRACUNIT;
+            dsseffects[i][j].add[s] = 0;
+         }
+      }
+   }
+
+   for(i = 0; i < NUMDSSSTATMODS; ++i)
+   {
+      dssstatmod_t *mod = &dssstatmods[i];
+
+      dsseffects[mod->action][mod->attribute].mul[mod->stat] =
+         mod->pct * FRACUNIT / 100;
+   }
+}
+
+//
+// CalculateEquipStats
+//
+// Computes the combined stat deltas of an armor and two arm equips.
+//
+void CalculateEquipStats(int armor, int arm1, int arm2, statvec_t *out)
+{
+   int s;
+   int grips = (arm1 == INV_DOUBLE_GRIPS) & (arm2 == INV_DOUBLE_GRIPS);
+
+   for(s = 0; s < NUMSTATS; ++s)
+   {
+      out->s[s] = armorstats[armor].s[s] + armstats[0][arm1].s[s] +
+                  armstats[1][arm2].s[s] + grips * gripstats.s[s];
+   }
+}
+
+//
+// CalculateLoadoutStats
+//
+// Computes effective stats for base stats plus a complete loadout. The action
+// card index is the adjusted one (ie. CARD_MERCURY through CARD_PLUTO).
+//
+void CalculateLoadoutStats(const statvec_t *base, int armor, int arm1, 
+                           int arm2, int attribute, int action, 
+                           statvec_t *out)
+{
+   int s;
+   dsseffect_t *effect = &dsseffects[action][attribute];
+
+   CalculateEquipStats(armor, arm1, arm2, out);
+
+   for(s = 0; s < NUMSTATS; ++s)
+   {
+      out->s[s] = (base->s[s] + out->s[s]) * effect->mul[s] / FRACUNIT +
+                  effect->add[s];
+   }
+}
+
+//
+// SaveFileBaseStats
+//
+// Gets the base stats out of a savefile as a stat vector.
+//
+void SaveFileBaseStats(savefile_t *sf, statvec_t *base)
+{
+   base->s[STAT_STR] = sf->str[0];
+   base->s[STAT_DEF] = sf->def[0];
+   base->s[STAT_INT] = sf->intel[0];
+   base->s[STAT_LCK] = sf->lck[0];
+}
+
+//
+// SaveFileValidItem
+//
+// Returns the item number if it is in range, or INV_NONE if not.
+//
+int SaveFileValidItem(int item)
+{
+   return (item >= 0 && item < NUMINV) ? item : INV_NONE;
+}
+
+//
+// SaveFileValidCard
+//
+// Returns the card number if it is in range, or CARD_NONE if not.
+//
+int SaveFileValidCard(int card)
+{
+   return (card >= 0 && card < NUMDSS) ? card : CARD_NONE;
+}
+
+//
+// SaveFileEffectiveStats
+//
+// Computes effective stats for the loadout currently equipped in a savefile.
+//
+void SaveFileEffectiveStats(savefile_t *sf, statvec_t *out)
+{
+   statvec_t base;
+
+   SaveFileBaseStats(sf, &base);
+
+   CalculateLoadoutStats(&base, 
+                         SaveFileValidItem(sf->armor),
+                         SaveFileValidItem(sf->arm_first),
+                         SaveFileValidItem(sf->arm_second),
+                         SaveFileValidCard(sf->attribute_card),
+                         SaveFileValidCard(sf->action_card),
+                         out);
+}
+
+//
+// Loadout Optimizer
+//
+// Searches the items a file owns for the armor + arm equip combination that
+// maximizes one stat, optionally subject to a minimum on another stat. The
+// current DSS cards are kept. Candidate lists are built per armor class and
+// per arm with dominated items thrown out, and the search over armor and arm
+// pairs is pruned against the best result found so far.
+//
+
+// inventory ranges which go into the armor slot (same as ViewInventory)
+typedef struct invrange_s
+{
+   const char *name;
+   int first;
+   int last;
+} invrange_t;
+
+invrange_t armorclasses[] =
+{
+   { "Armor",   INV_LEATHER_ARMOR,  INV_SHINING_ARMOR    },
+   { "Robes",   INV_COTTON_ROBE,    INV_SAGE_ROBE        },
+   { "Clothes", INV_COTTON_CLOTHES, INV_SOLDIER_FATIGUES },
+};
+
+#define NUMARMORCLASSES ((int)(sizeof(armorclasses) / sizeof(invrange_t)))
+
+typedef struct loadoutquery_s
+{
+   int stat;     // stat to maximize
+   int minstat;  // stat to constrain, or -1 for none
+   int minvalue; // minimum value of the constrained stat
+} loadoutquery_t;
+
+typedef struct loadout_s
+{
+   int armor;
+   int arm1;
+   int arm2;
+   statvec_t stats; // effective stats
+} loadout_t;
+
+// an arm pair candidate with its combined stats
+typedef struct armpair_s
+{
+   int arm1;
+   int arm2;
+   statvec_t stats;
+} armpair_t;
+
+#define MAXARMPAIRS (NUMINV * NUMINV)
+
+armpair_t armpairs[MAXARMPAIRS];
+
+//
+// SaveFileOwnedCount
+//
+// Returns how many of an item a file has, including any that are equipped.
+// Note -- this assumes the inventory counts don't include equipped items.
+//
+int SaveFileOwnedCount(savefile_t *sf, int item)
+{
+   int count;
+
+   if(item == INV_NONE)
+      return 2; // "nothing" can go in every slot
+
+   count = sf->inventory[item];
+   count += (sf->armor == item) + (sf->arm_first == item) + 
+            (sf->arm_second == item);
+
+   return count;
+}
+
+//
+// StatsDominate
+//
+// Returns true if a is at least as good as b in every stat.
+//
+bool StatsDominate(const statvec_t *a, const statvec_t *b)
+{
+   int s;
+
+   for(s = 0; s < NUMSTATS; ++s)
+   {
+      if(a->s[s] < b->s[s])
+         return false;
+   }
+
+   return true;
+}
+
+//
+// FilterDominated
+//
+// Removes items from a candidate list that are dominated by other items in
+// the list according to the given stat table. An item is only removed if the
+// file owns at least "need" of the items that dominate it, so that a choice
+// used up by one arm still leaves something as good for the other. For items
+// with identical stats, the first one is treated as the better one. Returns
+// the new list length.
+//
+int FilterDominated(savefile_t *sf, int *items, int numitems, 
+                    statvec_t *table, int need)
+{
+   int i, j, count = 0;
+   int keep[NUMINV];
+
+   for(i = 0; i < numitems; ++i)
+   {
+      int dominators = 0;
+
+      for(j = 0; j < numitems && dominators < need; ++j)
+      {
+         if(i == j || !StatsDominate(&table[items[j]], &table[items[i]]))
+            continue;
+
+         // j beats i unless the two are equal and i comes first
+         if(!StatsDominate(&table[items[i]], &table[items[j]]) || j < i)
+            dominators += SaveFileOwnedCount(sf, items[j]);
+      }
+
+      if(dominators < need)
+         keep[count++] = items[i];
+   }
+
+   memcpy(items, keep, count * sizeof(int));
+
+   return count;
+}
+
+//
+// BuildArmorCandidates
+//
+// Builds the dominance-filtered list of armor slot choices for one armor
+// class. Taking no armor at all is always a candidate.
+//
+int BuildArmorCandidates(savefile_t *sf, invrange_t *range, int *items)
+{
+   int i, count = 0;
+
+   items[count++] = INV_NONE;
+
+   for(i = range->first; i <= range->last; ++i)
+   {
+      if(SaveFileOwnedCount(sf, i) > 0)
+         items[count++] = i;
+   }
+
+   return FilterDominated(sf, items, count, armorstats, 1);
+}
+
+//
+// BuildArmPairs
+//
+// Builds the list of arm equip pairs worth considering, sorted by the stat
+// that is being maximized.
+//
+int BuildArmPairs(savefile_t *sf, int stat)
+{
+   int cands[2][NUMINV];
+   int numcands[2];
+   int i, j, pos, numpairs = 0;
+
+   // Double Grips only do something as a pair, so they're handled separately
+   for(pos = 0; pos < 2; ++pos)
+   {
+      numcands[pos] = 0;
+      cands[pos][numcands[pos]++] = INV_NONE;
+
+      for(i = INV_STAR_BRACELET; i <= INV_BEAR_RING; ++i)
+      {
+         if(SaveFileOwnedCount(sf, i) > 0)
+            cands[pos][numcands[pos]++] = i;
+      }
+
+      numcands[pos] = FilterDominated(sf, cands[pos], numcands[pos], 
+                                      armstats[pos], 2);
+   }
+
+   for(i = 0; i < numcands[0]; ++i)
+   {
+      for(j = 0; j < numcands[1]; ++j)
+      {
+         int a1 = cands[0][i], a2 = cands[1][j];
+
+         // need two of an item to wear it on both arms
+         if(a1 == a2 && a1 != INV_NONE && SaveFileOwnedCount(sf, a1) < 2)
+            continue;
+
+         armpairs[numpairs].arm1 = a1;
+         armpairs[numpairs].arm2 = a2;
+         CalculateEquipStats(INV_NONE, a1, a2, &armpairs[numpairs].stats);
+         ++numpairs;
+      }
+   }
+
+   if(SaveFileOwnedCount(sf, INV_DOUBLE_GRIPS) >= 2)
+   {
+      armpairs[numpairs].arm1 = INV_DOUBLE_GRIPS;
+      armpairs[numpairs].arm2 = INV_DOUBLE_GRIPS;
+      CalculateEquipStats(INV_NONE, INV_DOUBLE_GRIPS, INV_DOUBLE_GRIPS,
+                          &armpairs[numpairs].stats);
+      ++numpairs;
+   }
+
+   // sort by the objective stat, best first (insertion sort; lists are short)
+   for(i = 1; i < numpairs; ++i)
+   {
+      armpair_t tmp = armpairs[i];
+
+      for(j = i; j > 0 && armpairs[j-1].stats.s[stat] < tmp.stats.s[stat]; --j)
+         armpairs[j] = armpairs[j-1];
+
+      armpairs[j] = tmp;
+   }
+
+   return numpairs;
+}
+
+//
+// OptimizeLoadout
+//
+// Finds the best loadout for the query among the items the file owns.
+// Returns false if no loadout satisfies the constraint.
+//
+bool OptimizeLoadout(savefile_t *sf, loadoutquery_t *query, loadout_t *best)
+{
+   int armors[NUMINV];
+   int numarmors, numpairs, c, i, j;
+   int attribute = SaveFileValidCard(sf->attribute_card);
+   int action    = SaveFileValidCard(sf->action_card);
+   bool found = false;
+   statvec_t base, stats;
+
+   SaveFileBaseStats(sf, &base);
+   numpairs = BuildArmPairs(sf, query->stat);
+
+   for(c = 0; c < NUMARMORCLASSES; ++c)
+   {
+      numarmors = BuildArmorCandidates(sf, &armorclasses[c], armors);
+
+      for(i = 0; i < numarmors; ++i)
+      {
+         for(j = 0; j < numpairs; ++j)
+         {
+            armpair_t *pair = &armpairs[j];
+
+            CalculateLoadoutStats(&base, armors[i], pair->arm1, pair->arm2,
+                                  attribute, action, &stats);
+
+            // pairs are sorted by the objective, so once one can't beat the
+            // best loadout found so far, none of the rest can either
+            if(found && stats.s[query->stat] <= best->stats.s[query->stat])
+               break;
+
+            if(query->minstat >= 0 && 
+               stats.s[query->minstat] < query->minvalue)
+               continue;
+
+            best->armor = armors[i];
+            best->arm1  = pair->arm1;
+            best->arm2  = pair->arm2;
+            best->stats = stats;
+            found = true;
+         }
+      }
+   }
+
+   return found;
+}
+
+//
+// FindStatName
+//
+// Looks up a stat by name, ignoring case. Returns -1 if there's no such stat.
+//
+int FindStatName(const char *name)
+{
+   int s, i;
+
+   for(s = 0; s < NUMSTATS; ++s)
+   {
+      for(i = 0; statnames[s][i]; ++i)
+      {
+         if(toupper((unsigned char)name[i]) != statnames[s][i])
+            break;
+      }
+
+      if(!statnames[s][i] && !name[i])
+         return s;
+   }
+
+   return -1;
+}
+
+//
+// PrintOptimized
+//
+// Prints the best loadout for one file slot on a single line, for the
+// optimize command. Returns false if nothing the file owns fits the query.
+//
+bool PrintOptimized(savefile_t *sf, loadoutquery_t *query, const char *path,
+                    int slot)
+{
+   loadout_t best;
+
+   if(!OptimizeLoadout(sf, query, &best))
+   {
+      printf("%s:%d %s: no loadout fits\n", path, slot + 1, sf->name);
+      return false;
+   }
+
+   printf("%s:%d %s: %s, %s, %s: STR %d DEF %d INT %d LCK %d\n", 
+          path, slot + 1, sf->name, inventory_items[best.armor].name,
+          inventory_items[best.arm1].name, inventory_items[best.arm2].name,
+          best.stats.s[STAT_STR], best.stats.s[STAT_DEF],
+          best.stats.s[STAT_INT], best.stats.s[STAT_LCK]);
+
+   return true;
+}
+
+//
+// Completion Scoring
+//
+// Rates how complete a file is as a weighted sum of what fraction of each
+// collectible category the player has. Scores are in tenths of a percent so
+// that everything stays in integer math.
+//
+
+enum
+{
+   SCORE_MAP,
+   SCORE_RELICS,
+   SCORE_CARDS,
+   SCORE_COMBOS,
+   SCORE_ITEMS,
+   SCORE_HEARTUPS,
+   SCORE_HPUPS,
+   SCORE_MPUPS,
+   NUMSCORECATS
+};
+
+// Note -- the max-up totals are what I've counted so far and need to be
+// verified against a 100% file; the verify command checks them against any
+// complete files it's given. Counts above the total score as complete.
+#define TOTAL_HEARTUPS 25
+#define TOTAL_HPUPS    22
+#define TOTAL_MPUPS    21
+
+typedef struct scorecat_s
+{
+   const char *name;  // short enough for a 6-column report
+   int total;   // amount needed for the category to be complete
+   int weight;  // relative weight in the combined score
+} scorecat_t;
+
+scorecat_t scorecats[NUMSCORECATS] =
+{
+   { "Map",        1000,             40 }, // map_pct is mul'd by 10
+   { "Relics",     NUMRELICS,        15 },
+   { "Cards",      NUMDSS - 1,       15 },
+   { "Combos",     NUMABILITIES,     10 },
+   { "Items",      NUMINV - 1,       10 },
+   { "Hearts",     TOTAL_HEARTUPS,    4 },
+   { "HP Ups",     TOTAL_HPUPS,       3 },
+   { "MP Ups",     TOTAL_MPUPS,       3 },
+};
+
+typedef struct completion_s
+{
+   int have[NUMSCORECATS];  // raw amount collected
+   int pct[NUMSCORECATS];   // 0 - 1000
+   int score;               // weighted total, 0 - 1000
+} completion_t;
+
+//
+// CalculateCompletion
+//
+// Fills in the per-category breakdown and total score for a file.
+//
+void CalculateCompletion(savefile_t *sf, completion_t *comp)
+{
+   int i, weights = 0;
+   long total = 0;
+
+   comp->have[SCORE_MAP]    = sf->map_pct;
+   comp->have[SCORE_CARDS]  = BitCount(sf->dss_ownedmask);
+   comp->have[SCORE_COMBOS] = DSSCountUsed(sf);
+   comp->have[SCORE_RELICS] = 0;
+   comp->have[SCORE_ITEMS]  = 0;
+
+   for(i = 0; i < NUMRELICS; ++i)
+      comp->have[SCORE_RELICS] += (sf->relics[i] != 0);
+
+   for(i = 1; i < NUMINV; ++i)
+      comp->have[SCORE_ITEMS] += (sf->inventory[i] != 0);
+
+   comp->have[SCORE_HEARTUPS] = sf->numheartups;
+   comp->have[SCORE_HPUPS]    = sf->numhpups;
+   comp->have[SCORE_MPUPS]    = sf->nummpups;
+
+   for(i = 0; i < NUMSCORECATS; ++i)
+   {
+      int have = comp->have[i];
+
+      if(have < 0)
+         have = 0;
+      if(have > scorecats[i].total)
+         have = scorecats[i].total;
+
+      comp->pct[i] = have * 1000 / scorecats[i].total;
+
+      total   += (long)comp->pct[i] * scorecats[i].weight;
+      weights += scorecats[i].weight;
+   }
+
+   comp->score = weights ? (int)(total / weights) : 0;
+}
+
+//
+// Top-K Ranking
+//
+// A bounded min-heap keeps the K best entries seen so far, so ranking any
+// number of files takes O(n log K) time and K entries of memory.
+//
+
+typedef struct rankentry_s
+{
+   int score;
+   int file;   // which input file
+   int slot;   // which save slot in that file
+   char name[NAME_TEXT_LENGTH + 1];
+} rankentry_t;
+
+typedef struct rankheap_s
+{
+   rankentry_t *entries;
+   int size;
+   int max;
+} rankheap_t;
+
+//
+// RankBetter
+//
+// Returns true if a ranks above b. Ties go to the earlier file and slot.
+//
+bool RankBetter(rankentry_t *a, rankentry_t *b)
+{
+   if(a->score != b->score)
+      return a->score > b->score;
+   if(a->file != b->file)
+      return a->file < b->file;
+   return a->slot < b->slot;
+}
+
+//
+// RankSiftDown
+//
+// Restores the heap property below position i; the worst entry is on top.
+//
+void RankSiftDown(rankentry_t *entries, int size, int i)
+{
+   rankentry_t tmp = entries[i];
+   int child;
+
+   while((child = 2 * i + 1) < size)
+   {
+      if(child + 1 < size && RankBetter(&entries[child], &entries[child + 1]))
+         ++child;
+
+      if(!RankBetter(&tmp, &entries[child]))
+         break;
+
+      entries[i] = entries[child];
+      i = child;
+   }
+
+   entries[i] = tmp;
+}
+
+//
+// RankHeapInit
+//
+void RankHeapInit(rankheap_t *heap, rankentry_t *entries, int max)
+{
+   heap->entries = entries;
+   heap->size    = 0;
+   heap->max     = max;
+}
+
+//
+// RankHeapAdd
+//
+// Offers an entry to the heap; it's kept only if it's among the K best.
+//
+void RankHeapAdd(rankheap_t *heap, rankentry_t *entry)
+{
+   rankentry_t *entries = heap->entries;
+   int i, parent;
+
+   if(heap->size < heap->max)
+   {
+      // sift up
+      i = heap->size++;
+
+      while(i > 0)
+      {
+         parent = (i - 1) / 2;
+
+         if(!RankBetter(&entries[parent], entry))
+            break;
+
+         entries[i] = entries[parent];
+         i = parent;
+      }
+
+      entries[i] = *entry;
+   }
+   else if(heap->max > 0 && RankBetter(entry, &entries[0]))
+   {
+      entries[0] = *entry;
+      RankSiftDown(entries, heap->size, 0);
+   }
+}
+
+//
+// RankHeapSort
+//
+// Sorts the heap contents in place, best first. The heap is empty afterward
+// but the entries array holds the sorted results. Returns the entry count.
+//
+int RankHeapSort(rankheap_t *heap)
+{
+   int count = heap->size;
+   rankentry_t tmp;
+
+   while(heap->size > 1)
+   {
+      // move the worst remaining entry to the end
+      tmp = heap->entries[0];
+      heap->entries[0] = heap->entries[--heap->size];
+      heap->entries[heap->size] = tmp;
+      RankSiftDown(heap->entries, heap->size, 0);
+   }
+
+   heap->size = 0;
+
+   return count;
+}
+
+// the current file the player has selected to view
+int current_file;
+
+// when true, screens are being printed by a command rather than the menus,
+// so nothing waits for input
+bool batchmode;
+
+//
+// WaitForEnter
+//
+// Lets the user read a screen before going back to the menu.
+//
+void WaitForEnter(void)
+{
+   fflush(stdout);
+
+   if(batchmode)
+      return;
+
+   puts("Press enter to return.");
+   while(getchar() != '\n');
+}
+
+//
+// PrintCartridgeInfo
+//
+// Prints the unlocked modes from the header and warns about any files that
+// are playing a mode which isn't unlocked.
+//
+void PrintCartridgeInfo(void)
+{
+   int i;
+   bool first = true, warned = false;
+   char buf[64];
+
+   printf("Container: %s (%lu bytes%s)\n", ContainerName(buf),
+          (unsigned long)container.size, 
+          container.truncated ? ", only the start was searched" : "");
+
+   printf("Unlocked modes (flags 0x%02x):", cartridge.modeflags);
+   for(i = 0; i < NUMMODES; ++i)
+   {
+      if(cartridge.unlocked[i])
+      {
+         printf("%s %s", first ? "" : ",", modenames[i]);
+         first = false;
+      }
+   }
+   printf("\nOther header bytes: %02x %02x %02x %02x\n\n",
+          cartridge.extra[0], cartridge.extra[1], 
+          cartridge.extra[2], cartridge.extra[3]);
+
+   for(i = 0; i < NUMSAVEFILES; ++i)
+   {
+      if(savefiles[i].exists && savefiles[i].mode_locked)
+      {
+         printf("Warning: file %d is playing %s, which is not unlocked!\n",
+                i + 1, SaveFileModeName(&savefiles[i]));
+         warned = true;
+      }
+   }
+
+   if(warned)
+      putchar('\n');
+}
+
+//
+// SelectFile
+//
+// Allows the user to pick a file which the main menu will use for all functions.
+//
+void SelectFile(void)
+{
+   int filenum;
+   bool exitflag = false;
+   char c, choice;
+
+   while(!exitflag)
+   {
+      printf("\nChoose a file\n"
+             "--------------------------------------------------\n"
+             "1. %s\n"
+             "2. %s\n"
+             "3. %s\n"
+             "4. %s\n"
+             "5. %s\n"
+             "6. %s\n"
+             "7. %s\n"
+             "8. %s\n\n",
+             savefiles[0].exists ? savefiles[0].name : "no file",
+             savefiles[1].exists ? savefiles[1].name : "no file",
+             savefiles[2].exists ? savefiles[2].name : "no file",
+             savefiles[3].exists ? savefiles[3].name : "no file",
+             savefiles[4].exists ? savefiles[4].name : "no file",
+             savefiles[5].exists ? savefiles[5].name : "no file",
+             savefiles[6].exists ? savefiles[6].name : "no file",
+             savefiles[7].exists ? savefiles[7].name : "no file");
+
+      PrintCartridgeInfo();
+
+      printf("Current file selected: #%d\n", current_file + 1);
+      
+      fflush(stdout);
+      
+      while((c = getchar()) != '\n')
+         choice = c;
+      
+      switch(choice)
+      {
+      case '1':
+      case '2':
+      case '3':
+      case '4':
+      case '5':
+      case '6':
+      case '7':
+      case '8':
+         filenum = choice - '0' - 1;
+         if(!savefiles[filenum].exists)
+         {
+            puts("This file doesn't exist, pick a different one.\n");
+            break;
+         }
+         current_file = filenum;
+         exitflag = true;
+         break;
+      default:
+         puts("Bad choice, try again.\n");
+         break;
+      }
+   }
+}
+
+//
+// ViewStats
+//
+// Prints out all the basic stats for the current file.
+//
+void ViewStats(void)
+{
+   savefile_t *sf = &savefiles[current_file];
+   char timestr[16];
+   const char *subweapon = "Unknown";
+   int s;
+
+   // create time string
+   memset(timestr, 0, sizeof(timestr));
+   
+   // CotM uses a 60 Hz timer
+   s = sf->time / 60;
+   sprintf(timestr, "%02d:%02d:%02d", s / 3600, (s % 3600) / 60, s % 60);
+
+   // 03/12/07: found the correct sequence of subweapon names
+   if(sf->subweapon >= 0 && sf->subweapon < NUMSUBWEAPONS)
+      subweapon = subweapons[sf->subweapon];
+
+   printf("\nFile %d: %s - Stats\n"
+          "------------------------------------------------------------\n"
+          "Game mode: %s\n"
+          "Elapsed time: %s\n"
+          "Map coverage: %.1f%%\n"
+          "LV: %d  EXP: %d\n"
+          "HP: %d  MP: %d  Hearts: %d/%d  Subweapon: %s\n\n"
+          "Base Stats:  STR = %4d, DEF = %4d, INT = %4d, LCK = %4d\n"
+          "Equip Stats: STR = %4d, DEF = %4d, INT = %4d, LCK = %4d\n"
+          "DSS Stats:   STR = %4d, DEF = %4d, INT = %4d, LCK = %4d\n"
+          "???? Stats:  STR = %4d, DEF = %4d, INT = %4d, LCK = %4d\n\n",
+          current_file + 1, sf->name,
+          SaveFileModeName(sf),
+          timestr,
+          ((float)sf->map_pct) / 10.0f,
+          sf->lv, sf->exp,
+          sf->hp, sf->mp, sf->hearts_current, sf->hearts_max, subweapon,
+          sf->str[0], sf->def[0], sf->intel[0], sf->lck[0],
+          sf->str[1], sf->def[1], sf->intel[1], sf->lck[1],
+          sf->str[2], sf->def[2], sf->intel[2], sf->lck[2],
+          sf->str[3], sf->def[3], sf->intel[3], sf->lck[3]);
+
+   if(sf->mode_locked)
+   {
+      puts("Warning! This file's game mode is not unlocked in the save RAM "
+           "header. The file\nhas probably been edited.\n");
+   }
+
+   WaitForEnter();
+}
+
+//
+// ViewEquip
+//
+// Prints out currently equipped items for the current file.
+//
+void ViewEquip(void)
+{
+   static inventoryitem_t unknownitem = { "Unknown", "Not a valid item." };
+   static dsscard_t unknowncard = { "Unknown", "Not a valid card." };
+   savefile_t *sf = &savefiles[current_file];
+   inventoryitem_t *armor = &unknownitem, *arm1 = &unknownitem;
+   inventoryitem_t *arm2 = &unknownitem;
+   dsscard_t *action = &unknowncard, *attrib = &unknowncard;
+   statvec_t equip, eff;
+
+   // a damaged file can hold anything, so look before indexing
+   if(SaveFileValidItem(sf->armor) == sf->armor)
+      armor = &inventory_items[sf->armor];
+   if(SaveFileValidItem(sf->arm_first) == sf->arm_first)
+      arm1 = &inventory_items[sf->arm_first];
+   if(SaveFileValidItem(sf->arm_second) == sf->arm_second)
+      arm2 = &inventory_items[sf->arm_second];
+   if(SaveFileValidCard(sf->action_card) == sf->action_card)
+      action = &dsscards[sf->action_card];
+   if(SaveFileValidCard(sf->attribute_card) == sf->attribute_card)
+      attrib = &dsscards[sf->attribute_card];
+
+   printf("\nFile %d: %s - Current Equipment\n"
+          "------------------------------------------------------------\n"
+          "Action Card    = %s\n"
+          "\"%s\"\n"
+          "Attribute Card = %s\n"
+          "\"%s\"\n"
+          "Armor: %s\n"
+          "* %s\n"
+          "* STR: %+4d, DEF: %+4d, INT: %+4d, LCK: %+4d, Rarity: %d\n"
+          "Arm 1: %s\n"
+          "* %s\n"
+          "* STR: %+4d, DEF: %+4d, INT: %+4d, LCK: %+4d, Rarity: %d\n"
+          "Arm 2: %s\n"
+          "* %s\n"
+          "* STR: %+4d, DEF: %+4d, INT: %+4d, LCK: %+4d, Rarity: %d\n\n",
+          current_file + 1, sf->name,
+          action->name, action->description,
+          attrib->name, attrib->description,
+          armor->name, armor->description,
+          armor->atk, armor->def, armor->intel, armor->lck, armor->rarity,
+          arm1->name, arm1->description,
+          arm1->atk, arm1->def, arm1->intel, arm1->lck, arm1->rarity,
+          arm2->name, arm2->description,
+          arm2->atk, arm2->def, arm2->intel, arm2->lck, arm2->rarity);
+
+   // show what the stat engine computes for this loadout
+   CalculateEquipStats(SaveFileValidItem(sf->armor),
+                       SaveFileValidItem(sf->arm_first),
+                       SaveFileValidItem(sf->arm_second), &equip);
+   SaveFileEffectiveStats(sf, &eff);
+
+   printf("Equip Total: STR = %4d, DEF = %4d, INT = %4d, LCK = %4d\n"
+          "Effective:   STR = %4d, DEF = %4d, INT = %4d, LCK = %4d\n\n",
+          equip.s[STAT_STR], equip.s[STAT_DEF], 
+          equip.s[STAT_INT], equip.s[STAT_LCK],
+          eff.s[STAT_STR], eff.s[STAT_DEF], eff.s[STAT_INT], eff.s[STAT_LCK]);
+
+   // the game stores its own equip totals; they should agree
+   if(equip.s[STAT_STR] != sf->str[1] || equip.s[STAT_DEF] != sf->def[1] ||
+      equip.s[STAT_INT] != sf->intel[1] || equip.s[STAT_LCK] != sf->lck[1])
+   {
+      printf("Note: the equip stats stored in the file are "
+             "%d/%d/%d/%d.\n\n",
+             sf->str[1], sf->def[1], sf->intel[1], sf->lck[1]);
+   }
+
+   WaitForEnter();
+}
+
+//
+// ViewDSSCombos
+//
+// Shows which of the 100 DSS combinations the current file can use and which
+// ones it has used, followed by the names of all the usable ones.
+//
+void ViewDSSCombos(void)
+{
+   savefile_t *sf = &savefiles[current_file];
+   int action, attrib;
+   char name[DSSCOMBO_TEXTLEN];
+
+   printf("\nFile %d: %s - DSS Combinations\n"
+          "------------------------------------------------------------\n"
+          "U = used, o = usable, . = missing a card\n\n"
+          "         ", current_file + 1, sf->name);
+
+   for(attrib = FIRSTATTRIBCARD; attrib < FIRSTACTIONCARD; ++attrib)
+      printf(" %.4s", dsscards[attrib].name);
+   putchar('\n');
+
+   for(action = FIRSTACTIONCARD; action < NUMDSS; ++action)
+   {
+      printf("%-9s", dsscards[action].name);
+
+      for(attrib = FIRSTATTRIBCARD; attrib < FIRSTACTIONCARD; ++attrib)
+      {
+         printf("    %c", 
+                DSSComboUsed(sf, action, attrib)   ? 'U' :
+                DSSComboUsable(sf, action, attrib) ? 'o' : '.');
+      }
+      putchar('\n');
+   }
+   putchar('\n');
+
+   for(action = FIRSTACTIONCARD; action < NUMDSS; ++action)
+   {
+      for(attrib = FIRSTATTRIBCARD; attrib < FIRSTACTIONCARD; ++attrib)
+      {
+         if(!DSSComboUsable(sf, action, attrib))
+            continue;
+
+         DSSComboName(action, attrib, name);
+         printf("%c %s\n", DSSComboUsed(sf, action, attrib) ? 'U' : ' ', 
+                name);
+      }
+   }
+   putchar('\n');
+
+   WaitForEnter();
+}
+
+//
+// PrintDSSCards
+//
+// Prints the owned DSS card table for the current file, along with the menu
+// choice for the combinations if it's for the menu.
+//
+void PrintDSSCards(bool menu)
+{
+   savefile_t *sf = &savefiles[current_file];
+
+   printf("\nFile %d: %s - Owned DSS Cards\n"
+          "------------------------------------------------------------\n"
+          "1. Mercury: %c      B. Salamander:  %c\n"
+          "2. Venus:   %c      C. Serpent:     %c\n"
+          "3. Jupiter: %c      D. Mandragora:  %c\n"
+          "4. Mars:    %c      E. Golem:       %c\n"
+          "5. Diana:   %c      F. Cockatrice:  %c\n" 
+          "6. Apollo:  %c      G. Manticore:   %c\n"
+          "7. Neptune: %c      H. Griffin:     %c\n"
+          "8. Saturn:  %c      I. Thunderbird: %c\n"
+          "9. Uranus:  %c      J. Unicorn:     %c\n"
+          "A. Pluto:   %c      K. Black Dog:   %c\n\n",
+          current_file + 1, sf->name,
+          sf->dss_owned[CARD_MERCURY]     ? 'X' : ' ',
+          sf->dss_owned[CARD_SALAMANDER]  ? 'X' : ' ',
+          sf->dss_owned[CARD_VENUS]       ? 'X' : ' ',
+          sf->dss_owned[CARD_SERPENT]     ? 'X' : ' ',
+          sf->dss_owned[CARD_JUPITER]     ? 'X' : ' ',
+          sf->dss_owned[CARD_MANDRAGORA]  ? 'X' : ' ',
+          sf->dss_owned[CARD_MARS]        ? 'X' : ' ',
+          sf->dss_owned[CARD_GOLEM]       ? 'X' : ' ',
+          sf->dss_owned[CARD_DIANA]       ? 'X' : ' ',
+          sf->dss_owned[CARD_COCKATRICE]  ? 'X' : ' ',
+          sf->dss_owned[CARD_APOLLO]      ? 'X' : ' ',
+          sf->dss_owned[CARD_MANTICORE]   ? 'X' : ' ',
+          sf->dss_owned[CARD_NEPTUNE]     ? 'X' : ' ',
+          sf->dss_owned[CARD_GRIFFIN]     ? 'X' : ' ',
+          sf->dss_owned[CARD_SATURN]      ? 'X' : ' ',
+          sf->dss_owned[CARD_THUNDERBIRD] ? 'X' : ' ',
+          sf->dss_owned[CARD_URANUS]      ? 'X' : ' ',
+          sf->dss_owned[CARD_UNICORN]     ? 'X' : ' ',
+          sf->dss_owned[CARD_PLUTO]       ? 'X' : ' ',
+          sf->dss_owned[CARD_BLACKDOG]    ? 'X' : ' ');
+
+   if(menu)
+   {
+      printf("L. View combinations (%d of %d used)\n\n", 
+             DSSCountUsed(sf), NUMABILITIES);
+   }
+   else
+      printf("Combinations used: %d of %d\n\n", DSSCountUsed(sf), NUMABILITIES);
+}
+
+//
+// ViewDSS
+//
+// Displays the player's DSS card stock and allows viewing of generic info
+// on all the cards.
+//
+void ViewDSS(void)
+{
+   bool exitflag = false;
+   char c, choice;
+
+   while(!exitflag)
+   {
+      PrintDSSCards(true);
+
+      fflush(stdout);
+      
+      puts("Enter a character for more info or press enter to return.");
+      while((c = getchar()) != '\n')
+         choice = c;
+
+      choice = toupper(choice);
+      
+      if(choice >= '1' && choice <= '9' || choice == 'A')
+      {
+         int cardnum;
+
+         if(choice >= '1' && choice <= '9')
+            cardnum = choice - '0' + 10;
+         else
+            cardnum = 20;
+
+         printf("\nAction Card - %s\n"
+                "------------------------------------------------------------\n"
+                "%s\n\n", 
+                dsscards[cardnum].name, dsscards[cardnum].description);
+
+         WaitForEnter();
+      }
+      else if(choice == 'L')
+         ViewDSSCombos();
+      else if(choice >= 'B' && choice <= 'K')
+      {
+         int cardnum = choice - 'A';
+
+         printf("\nAttribute Card - %s\n"
+                "------------------------------------------------------------\n"
+                "%s\n\n",
+                dsscards[cardnum].name, dsscards[cardnum].description);
+
+         WaitForEnter();
+      }
+      else
+         exitflag = true;
+
+      choice = 0;
+   }
+}
+
+//
+// PrintInventoryRange
+//
+// Prints the menu of inventory items within the indicated range inclusive.
+//
+void PrintInventoryRange(const char *rangename, int minitem, int maxitem)
+{
+   savefile_t *sf = &savefiles[current_file];
+   int i;
+
+   printf("\nFile %d: %s - %s\n"
+          "--------------------------------------------------\n",
+          current_file + 1, sf->name, rangename);
+
+   for(i = minitem; i <= maxitem; ++i)
+   {
+      int menuidx = i - minitem + 1;
+
+      printf("%c. %-17s [%2d]\n",
+             menuidx > 9 ? 'A' + (menuidx - 10) : '0' + menuidx,
+             inventory_items[i].name,
+             sf->inventory[i]);
+   }
+   putchar('\n');
+}
+
+//
+// ViewInventoryRange
+//
+// This gets pretty hairy. Automatically generates a menu for all the
+// inventory items within the indicated range inclusive.
+//
+void ViewInventoryRange(const char *rangename, int minitem, int maxitem)
+{
+   savefile_t *sf = &savefiles[current_file];
+   char c, choice = 0;
+   bool exitflag = false;
+   int invnum;
+
+   while(!exitflag)
+   {
+      PrintInventoryRange(rangename, minitem, maxitem);
+
+      fflush(stdout);
+      
+      puts("Select an inventory item or press enter to return.");
+      while((c = getchar()) != '\n')
+         choice = c;
+
+      choice = toupper(choice);
+
+      invnum = 
+         (choice >= '1' && choice <= '9') ? minitem + choice - '1' :
+         (choice >= 'A' && choice <= 'Z') ? minitem + choice - 'A' + 9 :
+         ((exitflag = true), 0);
+
+      if(invnum > maxitem)
+      {
+         exitflag = true;
+         invnum = 0;
+      }
+
+      if(invnum != 0)
+      {
+         printf("\nItem - %s [%2d]\n"
+                "------------------------------------------------------------\n"
+                "Description: %s\n"
+                "STR: %+4d, DEF: %+4d, INT: %+4d, LCK: %+4d, Rarity: %d\n\n",
+                inventory_items[invnum].name,
+                sf->inventory[invnum],
+                inventory_items[invnum].description,
+                inventory_items[invnum].atk,
+                inventory_items[invnum].def,
+                inventory_items[invnum].intel,
+                inventory_items[invnum].lck,
+                inventory_items[invnum].rarity);
+
+         WaitForEnter();
+      }
+
+      invnum = 0;
+      choice = 0;
+   }
+}
+
+//
+// ViewRelics
+//
+// Displays the player's magic items (aka relics in most CV games; I use this
+// term to disambiguate them from everything else that's magical, which is
+// pretty much everything in the game).
+//
+void ViewRelics(void)
+{
+   savefile_t *sf = &savefiles[current_file];
+   int i;
+
+   printf("\nFile %d: %s - Relics\n"
+          "------------------------------------------------------------\n",
+          current_file + 1, sf->name);
+   
+   for(i = 0; i < NUMRELICS; ++i)
+   {
+      printf("%d. %-11s [%c]\n   %s\n",
+             i+1, relics[i].name, sf->relics[i] ? 'X' : ' ', 
+             relics[i].description);
+   }
+   putchar('\n');
+
+   WaitForEnter();
+}
+
+//
+// ViewUps
+//
+// 03/16/07: Displays information on the player's collected Heart, HP, and MP
+// up items.
+//
+void ViewUps(void)
+{
+   savefile_t *sf = &savefiles[current_file];
+
+   printf("\nFile %d: %s - Max Increase Items\n"
+          "------------------------------------------------------------\n"
+          "Heart Max Increase: %d\n"
+          "HP Max Increase:    %d\n"
+          "MP Max Increase:    %d\n\n",
+          current_file + 1, sf->name,
+          sf->numheartups, sf->numhpups, sf->nummpups);
+
+   WaitForEnter();
+}
+
+//
+// ViewInventory
+//
+// Routine to display various subsets of the player's inventory.
+//
+void ViewInventory(void)
+{
+   savefile_t *sf = &savefiles[current_file];
+   char c, choice;
+   bool exitflag = false;
+
+   while(!exitflag)
+   {
+      printf("\nFile %d: %s - Inventory\n"
+             "--------------------------------------------------\n"
+             "1. View Armor\n"
+             "2. View Robes\n"
+             "3. View Clothes\n"
+             "4. View Armbands\n"
+             "5. View Paired Armbands\n"
+             "6. View Rings\n"
+             "7. View Odd Rings\n"
+             "8. View Usable Items\n"
+             "9. View Relics\n"
+             "A. View Max Increase Items\n\n",
+             current_file + 1, sf->name);
+
+      fflush(stdout);
+      
+      puts("Select an inventory class or press enter to return.");
+      while((c = getchar()) != '\n')
+         choice = c;
+      
+      choice = toupper(choice);
+
+      switch(choice)
+      {
+      case '1':
+         ViewInventoryRange("Armor", INV_LEATHER_ARMOR, INV_SHINING_ARMOR);
+         break;
+      case '2':
+         ViewInventoryRange("Robes", INV_COTTON_ROBE, INV_SAGE_ROBE);
+         break;
+      case '3':
+         ViewInventoryRange("Clothes", INV_COTTON_CLOTHES, INV_SOLDIER_FATIGUES);
+         break;
+      case '4':
+         ViewInventoryRange("Armbands", INV_STRENGTH_ARMBAND, INV_MIRACLE_ARMBAND);
+         break;
+      case '5':
+         ViewInventoryRange("Paired Armbands", INV_DOUBLE_GRIPS, INV_STAR_BRACELET);
+         break;
+      case '6':
+         ViewInventoryRange("Rings", INV_STRENGTH_RING, INV_CURSED_RING);
+         break;
+      case '7':
+         ViewInventoryRange("Odd Rings", INV_TOY_RING, INV_BEAR_RING);
+         break;
+      case '8':
+         ViewInventoryRange("Usable Items", INV_POTION, INV_HEART_MEGA);
+         break;
+      case '9':
+         ViewRelics();
+         break;
+      case 'A':
+         ViewUps();
+         break;
+      default:
+         exitflag = true;
+         break;
+      }
+
+      choice = 0;
+   }
+}
+
+//
+// PrintReach
+//
+// Where the file can still go with the relics it has.
+//
+void PrintReach(savefile_t *sf)
+{
+   reach_t reach;
+
+   CalculateReach(sf, &reach);
+
+   printf("Unexplored cells:    %d\n"
+          "Reachable now:       %d\n", reach.unexplored, reach.reachable);
+
+   if(reach.route >= 0)
+      printf("Nearest from start:  %d steps\n", reach.route);
+   else
+      puts("Nearest from start:  none");
+
+   printf("Status:              %s\n", reach.stuck ? "stuck" : 
+          reach.unexplored ? "progressing" : "complete");
+
+   if(reach.bestrelic >= 0)
+   {
+      printf("Best next relic:     %s (+%d cells)\n", 
+             relics[reach.bestrelic].name, reach.bestgain);
+   }
+   else
+      puts("Best next relic:     none");
+}
+
+//
+// ViewMap
+//
+// 03/14/07: Ability to view map, although it's not too pretty in text mode :)
+//
+void ViewMap(void)
+{
+   savefile_t *sf = &savefiles[current_file];
+   int explored[NUMAREAS];
+   int block, row, area;
+
+   for(row = 0; row < MAP_HEIGHT; ++row)
+   {
+      for(block = 0; block < MAP_WIDTH; ++block)
+         putchar(sf->map[block][row]);
+
+      putchar('\n');
+   }
+
+   putchar('\n');
+
+   CalculateAreaExplored(sf, explored);
+
+   for(area = 0; area < NUMAREAS; ++area)
+   {
+      printf("%-22s %4d/%-4d %5.1f%%\n", areanames[area], explored[area],
+             areacells[area], explored[area] * 100.0 / areacells[area]);
+   }
+
+   putchar('\n');
+   PrintReach(sf);
+   putchar('\n');
+   WaitForEnter();
+}
+
+void ViewChecksum(void)
+{
+   savefile_t *sf = &savefiles[current_file];
+   bool match;
+
+   match = CalculateChecksum(sf);
+
+   if(!match)
+      printf("\nWarning! The calculated value %d doesn't match the original "
+             "checksum value of %d. Using this file will erase your save "
+             "games!\n\n", sf->data[OFFSET_CHECKSUM], sf->checksum);
+   else
+      printf("\nThe file checksum value is %d.\n\n", sf->data[OFFSET_CHECKSUM]);
+
+   WaitForEnter();
+}
+
+//
+// ViewOptimize
+//
+// Asks for an objective and shows the best loadout the file's inventory
+// allows with its current DSS cards.
+//
+void ViewOptimize(void)
+{
+   savefile_t *sf = &savefiles[current_file];
+   loadoutquery_t query;
+   loadout_t best;
+   char c, choice = 0;
+   char line[32];
+
+   printf("\nFile %d: %s - Optimize Equipment\n"
+          "------------------------------------------------------------\n"
+          "1. STR  2. DEF  3. INT  4. LCK\n\n", 
+          current_file + 1, sf->name);
+
+   puts("Select the stat to maximize or press enter to return.");
+   fflush(stdout);
+   while((c = getchar()) != '\n')
+      choice = c;
+
+   if(choice < '1' || choice > '4')
+      return;
+
+   query.stat = choice - '1';
+   choice = 0;
+
+   puts("Select a stat to keep above a minimum, or press enter for none.");
+   fflush(stdout);
+   while((c = getchar()) != '\n')
+      choice = c;
+
+   query.minstat  = (choice >= '1' && choice <= '4') ? choice - '1' : -1;
+   query.minvalue = 0;
+
+   if(query.minstat >= 0)
+   {
+      printf("Minimum %s (default 0): ", statnames[query.minstat]);
+      fflush(stdout);
+      if(fgets(line, sizeof(line), stdin))
+         query.minvalue = atoi(line);
+   }
+
+   if(!OptimizeLoadout(sf, &query, &best))
+      puts("\nNo combination of owned equipment meets that requirement.\n");
+   else
+   {
+      printf("\nBest loadout for %s",  statnames[query.stat]);
+      if(query.minstat >= 0)
+         printf(" with %s >= %d", statnames[query.minstat], query.minvalue);
+      printf(":\n"
+             "Armor: %s\n"
+             "Arm 1: %s\n"
+             "Arm 2: %s\n"
+             "Effective: STR = %4d, DEF = %4d, INT = %4d, LCK = %4d\n\n",
+             inventory_items[best.armor].name,
+             inventory_items[best.arm1].name,
+             inventory_items[best.arm2].name,
+             best.stats.s[STAT_STR], best.stats.s[STAT_DEF],
+             best.stats.s[STAT_INT], best.stats.s[STAT_LCK]);
+   }
+
+   WaitForEnter();
+}
+
+//
+// ViewCompletion
+//
+// Ranks all the files in the save RAM by completion score and shows the
+// breakdown for each one.
+//
+void ViewCompletion(void)
+{
+   rankentry_t entries[NUMSAVEFILES];
+   rankentry_t entry;
+   rankheap_t heap;
+   completion_t comp;
+   int i, j, count;
+
+   RankHeapInit(&heap, entries, NUMSAVEFILES);
+
+   for(i = 0; i < NUMSAVEFILES; ++i)
+   {
+      if(!savefiles[i].exists)
+         continue;
+
+      CalculateCompletion(&savefiles[i], &comp);
+      entry.score = comp.score;
+      entry.file  = 0;
+      entry.slot  = i;
+      RankHeapAdd(&heap, &entry);
+   }
+
+   count = RankHeapSort(&heap);
+
+   printf("\nCompletion Ranking\n"
+          "------------------------------------------------------------\n"
+          "    %-11s  %6s", "File", "Score");
+   for(j = 0; j < NUMSCORECATS; ++j)
+      printf(" %6.6s", scorecats[j].name);
+   putchar('\n');
+
+   for(i = 0; i < count; ++i)
+   {
+      savefile_t *sf = &savefiles[entries[i].slot];
+
+      CalculateCompletion(sf, &comp);
+
+      printf("%2d. %d: %-8s  %5.1f%%", i + 1, entries[i].slot + 1, sf->name,
+             comp.score / 10.0);
+      for(j = 0; j < NUMSCORECATS; ++j)
+         printf(" %5.1f%%", comp.pct[j] / 10.0);
+      putchar('\n');
+   }
+   putchar('\n');
+
+   WaitForEnter();
+}
+
+void MainMenu(void)
+{
+   char c, choice;
+   bool exitflag = false;
+
+   while(!exitflag)
+   {
+      puts("\nCastlevania: Circle of the Moon Save RAM Inspector\n"
+           "--------------------------------------------------\n"
+           "1. Select file\n"
+           "2. View stats\n"
+           "3. View current equipment\n"
+           "4. View DSS\n"
+           "5. View inventory\n"
+           "6. View map\n"
+           "7. Recalculate file checksum\n"
+           "8. Exit\n"
+           "O. Optimize equipment\n"
+           "R. Completion ranking\n");
+
+      printf("Current file selected: #%d\n", current_file + 1);
+      
+      fflush(stdout);
+      
+      while((c = getchar()) != '\n')
+         choice = c;
+      
+      switch(toupper(choice))
+      {
+      case '1':
+         SelectFile();
+         break;
+      case '2':
+         ViewStats();
+         break;
+      case '3':
+         ViewEquip();
+         break;
+      case '4':
+         ViewDSS();
+         break;
+      case '5':
+         ViewInventory();
+         break;
+      case '6':
+         ViewMap();
+         break;
+      case '7':
+         ViewChecksum();
+         break;
+      case '8':
+         puts("Bye!\n");
+         exitflag = true;
+         break;
+      case 'O':
+         ViewOptimize();
+         break;
+      case 'R':
+         ViewCompletion();
+         break;
+      default:
+         puts("Bad choice, try again.\n\n");
+         break;
+      }
+
+      choice = 0;
+   }
+}
+
+//
+// Query Expressions
+//
+// expr := and { "||" and }
+// and  := not { "&&" not }
+// not  := "!" not | "(" expr ")" | term
+// term := key ":" value | field op number
+//
+// keys:   relic, mode, card, used (action/attribute), item, equip, name,
+//         checksum (ok/bad), modecheck (ok/bad)
+// fields: lv, exp, hp, mp, time (minutes), map (%), score (%), relics, cards,
+//         combos, items, heartups, hpups, mpups
+// ops:    < <= > >= = == !=
+//
+// Names are matched ignoring case, spaces and punctuation, so "roc_wing",
+// "RocWing" and "Roc Wing" all name the same relic.
+//
+
+enum
+{
+   QN_AND,
+   QN_OR,
+   QN_NOT,
+   QN_PRED
+};
+
+enum
+{
+   QP_RELIC,
+   QP_MODE,
+   QP_DSS,
+   QP_ITEM,
+   QP_EQUIP,
+   QP_NAME,
+   QP_CHECKSUM,
+   QP_MODECHECK,
+   QP_FIELD
+};
+
+enum
+{
+   QF_LV,
+   QF_EXP,
+   QF_HP,
+   QF_MP,
+   QF_TIME,
+   QF_MAP,
+   QF_SCORE,
+   QF_RELICS,
+   QF_CARDS,
+   QF_COMBOS,
+   QF_ITEMS,
+   QF_HEARTUPS,
+   QF_HPUPS,
+   QF_MPUPS,
+   NUMQUERYFIELDS
+};
+
+typedef struct queryfield_s
+{
+   const char *name;
+   long scale;        // number given in the query * scale = stored units
+} queryfield_t;
+
+queryfield_t queryfields[NUMQUERYFIELDS] =
+{
+   { "lv",       1    },
+   { "exp",      1    },
+   { "hp",       1    },
+   { "mp",       1    },
+   { "time",     3600 }, // minutes -> 60 Hz tics
+   { "map",      10   }, // map_pct is mul'd by 10
+   { "score",    10   }, // scores are in tenths of a percent
+   { "relics",   1    },
+   { "cards",    1    },
+   { "combos",   1    },
+   { "items",    1    },
+   { "heartups", 1    },
+   { "hpups",    1    },
+   { "mpups",    1    },
+};
+
+enum
+{
+   QO_LT,
+   QO_LE,
+   QO_GT,
+   QO_GE,
+   QO_EQ,
+   QO_NE
+};
+
+typedef struct querynode_s
+{
+   int  type;        // QN_ value
+   int  left, right; // child nodes
+   int  pred;        // QP_ value for predicates
+   int  arg;         // relic, mode, item, or field number
+   int  op;          // QO_ value for fields
+   long value;       // comparison value, in stored units
+   bool flag;        // for ok/bad tests: true means "bad"
+   char str[NAME_TEXT_LENGTH + 1];
+   dssquery_t dss;
+} querynode_t;
+
+#define MAXQUERYNODES 128
+
+typedef struct query_s
+{
+   querynode_t nodes[MAXQUERYNODES];
+   int numnodes;
+   int root;
+   const char *p;    // parse position
+} query_t;
+
+//
+// QueryNormalize
+//
+// Lowercases a name and drops everything but letters and digits.
+//
+void QueryNormalize(const char *in, char *out, int outlen)
+{
+   int len = 0;
+
+   for(; *in && len < outlen - 1; ++in)
+   {
+      if(isalnum((unsigned char)*in))
+         out[len++] = tolower((unsigned char)*in);
+   }
+
+   out[len] = '\0';
+}
+
+//
+// QueryNameIs
+//
+// Checks a name from one of the tables against an already normalized word.
+//
+bool QueryNameIs(const char *name, const char *word)
+{
+   char norm[64];
+
+   QueryNormalize(name, norm, sizeof(norm));
+
+   return !strcmp(norm, word);
+}
+
+//
+// QueryFindCard
+//
+int QueryFindCard(const char *word)
+{
+   int i;
+
+   for(i = 1; i < NUMDSS; ++i)
+   {
+      if(QueryNameIs(dsscards[i].name, word))
+         return i;
+   }
+
+   return -1;
+}
+
+//
+// QueryNewNode
+//
+int QueryNewNode(query_t *q, int type)
+{
+   querynode_t *node;
+
+   if(q->numnodes == MAXQUERYNODES)
+   {
+      SaveFileWarning("Error: query is too long\n");
+      return -1;
+   }
+
+   node = &q->nodes[q->numnodes];
+   memset(node, 0, sizeof(*node));
+   node->type = type;
+
+   return q->numnodes++;
+}
+
+//
+// QuerySkipSpace
+//
+void QuerySkipSpace(query_t *q)
+{
+   while(*q->p && isspace((unsigned char)*q->p))
+      ++q->p;
+}
+
+//
+// QueryParseTerm
+//
+// Parses a single "key:value" or "field op number" test.
+//
+int QueryParseTerm(query_t *q)
+{
+   char key[32], value[64], word[64];
+   int len, n, i;
+   double d;
+   bool known = true;
+   querynode_t *node;
+
+   QuerySkipSpace(q);
+
+   for(len = 0; (isalpha((unsigned char)*q->p) || *q->p == '_') && 
+                len < (int)sizeof(key) - 1; ++q->p)
+      key[len++] = tolower((unsigned char)*q->p);
+   key[len] = '\0';
+
+   if(!len)
+   {
+      SaveFileWarning("Error: expected a test at \"%s\"\n", q->p);
+      return -1;
+   }
+
+   if((n = QueryNewNode(q, QN_PRED)) < 0)
+      return -1;
+   node = &q->nodes[n];
+
+   if(*q->p == ':')
+   {
+      // key:value; the value may be quoted if it has spaces in it
+      ++q->p;
+      if(*q->p == '"' || *q->p == '\'')
+      {
+         char quote = *q->p++;
+
+         for(len = 0; *q->p && *q->p != quote && 
+             len < (int)sizeof(value) - 1; ++q->p)
+            value[len++] = *q->p;
+
+         if(*q->p == quote)
+            ++q->p;
+      }
+      else
+      {
+         for(len = 0; *q->p && !isspace((unsigned char)*q->p) && 
+             !strchr("()&|", *q->p) && len < (int)sizeof(value) - 1; ++q->p)
+            value[len++] = *q->p;
+      }
+      value[len] = '\0';
+
+      QueryNormalize(value, word, sizeof(word));
+
+      if(!strcmp(key, "relic"))
+      {
+         node->pred = QP_RELIC;
+         for(i = 0; i < NUMRELICS && !QueryNameIs(relics[i].name, word); ++i);
+         node->arg = i;
+         known = (i < NUMRELICS);
+      }
+      else if(!strcmp(key, "mode"))
+      {
+         node->pred = QP_MODE;
+         for(i = 0; i < NUMMODES && !QueryNameIs(modenames[i], word); ++i);
+         node->arg = i;
+         known = (i < NUMMODES);
+      }
+      else if(!strcmp(key, "card"))
+      {
+         int card = QueryFindCard(word);
+
+         node->pred = QP_DSS;
+         if((known = (card > 0)))
+            node->dss.cards_have = 1u << (card - 1);
+      }
+      else if(!strcmp(key, "used"))
+      {
+         // action/attribute, in either order
+         char *sep = strpbrk(value, "/+");
+         char first[64], second[64];
+         int a, b, combo = -1;
+
+         node->pred = QP_DSS;
+
+         if(sep)
+         {
+            *sep = '\0';
+            QueryNormalize(value, first, sizeof(first));
+            QueryNormalize(sep + 1, second, sizeof(second));
+            a = QueryFindCard(first);
+            b = QueryFindCard(second);
+
+            if(a >= FIRSTACTIONCARD && b > 0 && b < FIRSTACTIONCARD)
+               combo = DSSCOMBO(a, b);
+            else if(b >= FIRSTACTIONCARD && a > 0 && a < FIRSTACTIONCARD)
+               combo = DSSCOMBO(b, a);
+            *sep = '/';
+         }
+
+         if((known = (combo >= 0)))
+            node->dss.used_have[combo >> 5] = 1u << (combo & 31);
+      }
+      else if(!strcmp(key, "item") || !strcmp(key, "equip"))
+      {
+         node->pred = key[0] == 'i' ? QP_ITEM : QP_EQUIP;
+         for(i = 1; i < NUMINV && !QueryNameIs(inventory_items[i].name, word);
+             ++i);
+         node->arg = i;
+         known = (i < NUMINV);
+      }
+      else if(!strcmp(key, "name"))
+      {
+         node->pred = QP_NAME;
+         if((len = (int)strlen(word)) > NAME_TEXT_LENGTH)
+         {
+            SaveFileWarning("Error: name \"%s\" is too long\n", value);
+            return -1;
+         }
+         memcpy(node->str, word, len);
+         node->str[len] = '\0';
+      }
+      else if(!strcmp(key, "checksum") || !strcmp(key, "modecheck"))
+      {
+         node->pred = key[0] == 'c' ? QP_CHECKSUM : QP_MODECHECK;
+         node->flag = !strcmp(word, "bad");
+         known = node->flag || !strcmp(word, "ok");
+      }
+      else
+      {
+         SaveFileWarning("Error: unknown query key \"%s\"\n", key);
+         return -1;
+      }
+
+      if(!known)
+      {
+         SaveFileWarning("Error: unknown %s \"%s\"\n", key, value);
+         return -1;
+      }
+   }
+   else
+   {
+      // field op number
+      for(i = 0; i < NUMQUERYFIELDS && strcmp(queryfields[i].name, key); ++i);
+
+      if(i == NUMQUERYFIELDS)
+      {
+         SaveFileWarning("Error: unknown query field \"%s\"\n", key);
+         return -1;
+      }
+
+      node->pred = QP_FIELD;
+      node->arg  = i;
+
+      QuerySkipSpace(q);
+
+      if(!strncmp(q->p, "<=", 2))
+         node->op = QO_LE, q->p += 2;
+      else if(!strncmp(q->p, ">=", 2))
+         node->op = QO_GE, q->p += 2;
+      else if(!strncmp(q->p, "!=", 2))
+         node->op = QO_NE, q->p += 2;
+      else if(!strncmp(q->p, "==", 2))
+         node->op = QO_EQ, q->p += 2;
+      else if(*q->p == '<')
+         node->op = QO_LT, ++q->p;
+      else if(*q->p == '>')
+         node->op = QO_GT, ++q->p;
+      else if(*q->p == '=')
+         node->op = QO_EQ, ++q->p;
+      else
+      {
+         SaveFileWarning("Error: expected a comparison after \"%s\"\n", key);
+         return -1;
+      }
+
+      QuerySkipSpace(q);
+
+      if(!isdigit((unsigned char)*q->p) && *q->p != '.' && *q->p != '-')
+      {
+         SaveFileWarning("Error: expected a number after \"%s\"\n", key);
+         return -1;
+      }
+
+      // round to the nearest unit, away from zero at halves
+      d = strtod(q->p, (char **)&q->p) * queryfields[i].scale;
+      node->value = (long)(d < 0 ? d - 0.5 : d + 0.5);
+   }
+
+   return n;
+}
+
+int QueryParseOr(query_t *q);
+
+//
+// QueryParseNot
+//
+int QueryParseNot(query_t *q)
+{
+   int n, child;
+
+   QuerySkipSpace(q);
+
+   if(*q->p == '!')
+   {
+      ++q->p;
+      if((child = QueryParseNot(q)) < 0 || (n = QueryNewNode(q, QN_NOT)) < 0)
+         return -1;
+      q->nodes[n].left = child;
+      return n;
+   }
+
+   if(*q->p == '(')
+   {
+      ++q->p;
+      if((n = QueryParseOr(q)) < 0)
+         return -1;
+
+      QuerySkipSpace(q);
+      if(*q->p != ')')
+      {
+         SaveFileWarning("Error: missing ')' in query\n");
+         return -1;
+      }
+      ++q->p;
+      return n;
+   }
+
+   return QueryParseTerm(q);
+}
+
+//
+// QueryParseAnd
+//
+int QueryParseAnd(query_t *q)
+{
+   int left, right, n;
+
+   if((left = QueryParseNot(q)) < 0)
+      return -1;
+
+   for(;;)
+   {
+      QuerySkipSpace(q);
+      if(strncmp(q->p, "&&", 2))
+         return left;
+      q->p += 2;
+
+      if((right = QueryParseNot(q)) < 0 || (n = QueryNewNode(q, QN_AND)) < 0)
+         return -1;
+
+      q->nodes[n].left  = left;
+      q->nodes[n].right = right;
+      left = n;
+   }
+}
+
+//
+// QueryParseOr
+//
+int QueryParseOr(query_t *q)
+{
+   int left, right, n;
+
+   if((left = QueryParseAnd(q)) < 0)
+      return -1;
+
+   for(;;)
+   {
+      QuerySkipSpace(q);
+      if(strncmp(q->p, "||", 2))
+         return left;
+      q->p += 2;
+
+      if((right = QueryParseAnd(q)) < 0 || (n = QueryNewNode(q, QN_OR)) < 0)
+         return -1;
+
+      q->nodes[n].left  = left;
+      q->nodes[n].right = right;
+      left = n;
+   }
+}
+
+//
+// QueryParse
+//
+// Compiles a query expression. Returns false if it has errors.
+//
+bool QueryParse(query_t *q, const char *text)
+{
+   q->numnodes = 0;
+   q->p = text;
+
+   if((q->root = QueryParseOr(q)) < 0)
+      return false;
+
+   QuerySkipSpace(q);
+   if(*q->p)
+      return SaveFileWarning("Error: unexpected \"%s\" in query\n", q->p);
+
+   return true;
+}
+
+//
+// QueryFieldValue
+//
+// Gets the value of a numeric query field for a file, in stored units.
+//
+long QueryFieldValue(savefile_t *sf, int field)
+{
+   completion_t comp;
+
+   switch(field)
+   {
+   case QF_LV:       return sf->lv;
+   case QF_EXP:      return sf->exp;
+   case QF_HP:       return sf->hp;
+   case QF_MP:       return sf->mp;
+   case QF_TIME:     return sf->time;
+   case QF_MAP:      return sf->map_pct;
+   case QF_HEARTUPS: return sf->numheartups;
+   case QF_HPUPS:    return sf->numhpups;
+   case QF_MPUPS:    return sf->nummpups;
+   case QF_CARDS:    return BitCount(sf->dss_ownedmask);
+   case QF_COMBOS:   return DSSCountUsed(sf);
+   default:
+      break;
+   }
+
+   CalculateCompletion(sf, &comp);
+
+   switch(field)
+   {
+   case QF_SCORE:    return comp.score;
+   case QF_RELICS:   return comp.have[SCORE_RELICS];
+   case QF_ITEMS:    return comp.have[SCORE_ITEMS];
+   default:
+      return 0;
+   }
+}
+
+//
+// QueryEvalNode
+//
+bool QueryEvalNode(query_t *q, int n, savefile_t *sf)
+{
+   querynode_t *node = &q->nodes[n];
+   char norm[NAME_TEXT_LENGTH + 1];
+   long v;
+
+   switch(node->type)
+   {
+   case QN_AND:
+      return QueryEvalNode(q, node->left, sf) && 
+             QueryEvalNode(q, node->right, sf);
+   case QN_OR:
+      return QueryEvalNode(q, node->left, sf) || 
+             QueryEvalNode(q, node->right, sf);
+   case QN_NOT:
+      return !QueryEvalNode(q, node->left, sf);
+   default:
+      break;
+   }
+
+   switch(node->pred)
+   {
+   case QP_RELIC:
+      return sf->relics[node->arg] != 0;
+   case QP_MODE:
+      return sf->mode == node->arg;
+   case QP_DSS:
+      return DSSQueryMatch(sf, &node->dss);
+   case QP_ITEM:
+      return sf->inventory[node->arg] != 0;
+   case QP_EQUIP:
+      return sf->armor == node->arg || sf->arm_first == node->arg ||
+             sf->arm_second == node->arg;
+   case QP_NAME:
+      QueryNormalize(sf->name, norm, sizeof(norm));
+      return !strcmp(norm, node->str);
+   case QP_CHECKSUM:
+      return (sf->checksum_calc != sf->checksum) == node->flag;
+   case QP_MODECHECK:
+      return sf->mode_locked == node->flag;
+   default:
+      break;
+   }
+
+   v = QueryFieldValue(sf, node->arg);
+
+   switch(node->op)
+   {
+   case QO_LT: return v <  node->value;
+   case QO_LE: return v <= node->value;
+   case QO_GT: return v >  node->value;
+   case QO_GE: return v >= node->value;
+   case QO_EQ: return v == node->value;
+   default:    return v != node->value;
+   }
+}
+
+//
+// QueryMatch
+//
+// Evaluates a compiled query against a file.
+//
+bool QueryMatch(query_t *q, savefile_t *sf)
+{
+   return QueryEvalNode(q, q->root, sf);
+}
+
+//
+// Memory
+//
+// All heap memory goes through these so that the server and watch modes can
+// report how much they're holding. Running out of memory is fatal.
+//
+
+typedef struct memstats_s
+{
+   unsigned long allocs;   // calls to MemAlloc and MemRealloc
+   unsigned long frees;
+   size_t        bytes;    // live heap bytes
+   size_t        peak;
+} memstats_t;
+
+memstats_t memstats;
+
+//
+// MemRealloc
+//
+// Resizes a heap block, or allocates one if p is NULL.
+//
+void *MemRealloc(void *p, size_t oldsize, size_t newsize)
+{
+   if(!(p = realloc(p, newsize)))
+      SaveFileError("Error: out of memory\n");
+
+   ++memstats.allocs;
+   memstats.bytes += newsize - oldsize;
+   if(memstats.bytes > memstats.peak)
+      memstats.peak = memstats.bytes;
+
+   return p;
+}
+
+//
+// MemAlloc
+//
+void *MemAlloc(size_t size)
+{
+   return MemRealloc(NULL, 0, size);
+}
+
+//
+// MemFree
+//
+void MemFree(void *p, size_t size)
+{
+   if(!p)
+      return;
+
+   free(p);
+   ++memstats.frees;
+   memstats.bytes -= size;
+}
+
+//
+// Read-Ahead
+//
+// A scan over many files on slow or networked storage spends most of its
+// time waiting for each file in turn. The read-ahead keeps the files after
+// the one being decoded in flight, up to READAHEAD_DEPTH of them, each read
+// whole into a buffer of its own. Their opens and reads overlap each other
+// and the decoding, but files are still decoded one at a time, in order.
+// There are three ways of getting them in:
+//
+// io_uring  On Linux, where the kernel allows it (containers often don't),
+//           through the raw system calls. A file's open is queued as soon
+//           as it's in the window, and its read as soon as the open is
+//           done, so there are no threads at all.
+// threads   Elsewhere, or when io_uring can't be set up, a pool of
+//           READAHEAD_THREADS threads each open and read a file at a time.
+// sync      Each file is opened and read when its turn comes, as if there
+//           were no read-ahead. -bench uses it to compare against.
+//
+// Open errors are reported when the file's turn comes, so messages stay in
+// order. For -bench, a latency can be added before every open and every
+// file's read, in all three, to stand in for slow storage.
+//
+
+#define READAHEAD_DEPTH   64
+#define READAHEAD_THREADS 16
+#define READAHEAD_BUFSIZE (MAXCONTAINERSIZE + 1) // one more shows truncation
+
+enum
+{
+   READAHEAD_AUTO,    // io_uring if it can be had, else threads
+   READAHEAD_SYNC,
+   READAHEAD_POOL,
+   READAHEAD_URING,
+   NUMREADAHEADS
+};
+
+const char *readaheadnames[NUMREADAHEADS] = 
+{
+   "auto", "sync", "threads", "io_uring"
+};
+
+enum
+{
+   RASLOT_EMPTY,
+   RASLOT_QUEUED,     // waiting for a thread, or its turn with sync
+   RASLOT_OPENING,    // io_uring open in flight
+   RASLOT_READING,    // io_uring read in flight
+   RASLOT_DONE
+};
+
+typedef struct raslot_s
+{
+   int     file;      // index into the paths
+   int     state;
+   bool    failed;    // couldn't be opened
+   size_t  len;       // bytes read into buf
+   byte   *buf;       // READAHEAD_BUFSIZE bytes
+#ifdef _WIN32
+   HANDLE  done;      // set once state is RASLOT_DONE, for threads
+#else
+   int     fd;        // for io_uring
+#endif
+} raslot_t;
+
+#ifdef USE_IO_URING
+typedef struct rauring_s
+{
+   int       fd;
+   unsigned *sqtail, *sqmask, *sqarray;
+   unsigned *cqhead, *cqtail, *cqmask;
+   struct io_uring_sqe *sqes;
+   struct io_uring_cqe *cqes;
+   byte     *rings;      // both rings, mapped together
+   size_t    ringsize;
+   size_t    sqesize;
+   unsigned  queued;     // entries not submitted yet
+   int       inflight;   // slots with an open or read outstanding
+   struct __kernel_timespec delay;
+} rauring_t;
+
+// user_data of the timeouts that add latency
+#define RAURING_TIMER (~(__u64)0)
+#endif
+
+typedef struct readahead_s
+{
+   char      **paths;
+   int         numpaths;
+   int         depth;      // files in flight, at most READAHEAD_DEPTH
+   int         opened;     // files queued so far
+   int         method;     // READAHEAD_ way in use
+   long        latency;    // milliseconds added to each open and read
+   raslot_t    slots[READAHEAD_DEPTH];   // indexed by file number % depth
+   byte       *bufs;
+   const bool *skip;       // files not to read, or NULL
+
+   // the thread pool
+   int         numthreads;
+   int         jobs[READAHEAD_DEPTH];    // slots waiting for a thread
+   int         jobhead;
+   int         numjobs;
+   bool        stop;
+#ifdef _WIN32
+   CRITICAL_SECTION lock;
+   HANDLE      jobready;   // semaphore counting jobs
+   HANDLE      threads[READAHEAD_THREADS];
+#else
+   pthread_mutex_t lock;
+   pthread_cond_t  jobready;
+   pthread_cond_t  jobdone;
+   pthread_t   threads[READAHEAD_THREADS];
+#endif
+
+#ifdef USE_IO_URING
+   rauring_t   uring;
+#endif
+} readahead_t;
+
+//
+// ReadAheadDelay
+//
+// Waits out the added latency, if there is any.
+//
+void ReadAheadDelay(readahead_t *ra)
+{
+#ifdef _WIN32
+   if(ra->latency)
+      Sleep(ra->latency);
+#else
+   struct timespec ts;
+
+   if(!ra->latency)
+      return;
+
+   ts.tv_sec  = ra->latency / 1000;
+   ts.tv_nsec = (ra->latency % 1000) * 1000000L;
+   while(nanosleep(&ts, &ts) && errno == EINTR);
+#endif
+}
+
+//
+// ReadAheadFile
+//
+// Opens and reads a slot's file into its buffer, for the threads and sync.
+// Uses the OS calls rather than stdio, so that the threads don't need a
+// thread-safe C library on Windows.
+//
+void ReadAheadFile(readahead_t *ra, raslot_t *slot)
+{
+   const char *path = ra->paths[slot->file];
+#ifdef _WIN32
+   HANDLE h;
+   DWORD got;
+
+   ReadAheadDelay(ra);
+   h = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                   NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+   if(h == INVALID_HANDLE_VALUE)
+   {
+      slot->failed = true;
+      return;
+   }
+
+   ReadAheadDelay(ra);
+   while(slot->len < READAHEAD_BUFSIZE &&
+         ReadFile(h, slot->buf + slot->len, 
+                  (DWORD)(READAHEAD_BUFSIZE - slot->len), &got, NULL) && got)
+      slot->len += got;
+
+   CloseHandle(h);
+#else
+   ssize_t got;
+   int fd;
+
+   ReadAheadDelay(ra);
+   if((fd = open(path, O_RDONLY)) < 0)
+   {
+      slot->failed = true;
+      return;
+   }
+
+   ReadAheadDelay(ra);
+   while(slot->len < READAHEAD_BUFSIZE)
+   {
+      got = read(fd, slot->buf + slot->len, READAHEAD_BUFSIZE - slot->len);
+      if(got < 0 && errno == EINTR)
+         continue;
+      if(got <= 0)
+         break;
+      slot->len += got;
+   }
+
+   close(fd);
+#endif
+}
+
+//
+// Thread pool
+//
+
+//
+// ReadAheadNextJob
+//
+// Waits for a slot to read, for a thread. Returns -1 once it's time to stop.
+//
+int ReadAheadNextJob(readahead_t *ra)
+{
+   int job = -1;
+
+#ifdef _WIN32
+   WaitForSingleObject(ra->jobready, INFINITE);
+   EnterCriticalSection(&ra->lock);
+#else
+   pthread_mutex_lock(&ra->lock);
+   while(!ra->numjobs && !ra->stop)
+      pthread_cond_wait(&ra->jobready, &ra->lock);
+#endif
+
+   if(ra->numjobs && !ra->stop)
+   {
+      job = ra->jobs[ra->jobhead];
+      ra->jobhead = (ra->jobhead + 1) % READAHEAD_DEPTH;
+      --ra->numjobs;
+   }
+
+#ifdef _WIN32
+   LeaveCriticalSection(&ra->lock);
+#else
+   pthread_mutex_unlock(&ra->lock);
+#endif
+
+   return job;
+}
+
+//
+// ReadAheadJobDone
+//
+void ReadAheadJobDone(readahead_t *ra, raslot_t *slot)
+{
+#ifdef _WIN32
+   EnterCriticalSection(&ra->lock);
+   slot->state = RASLOT_DONE;
+   LeaveCriticalSection(&ra->lock);
+   SetEvent(slot->done);
+#else
+   pthread_mutex_lock(&ra->lock);
+   slot->state = RASLOT_DONE;
+   pthread_cond_broadcast(&ra->jobdone);
+   pthread_mutex_unlock(&ra->lock);
+#endif
+}
+
+//
+// ReadAheadThread
+//
+#ifdef _WIN32
+DWORD WINAPI ReadAheadThread(LPVOID arg)
+#else
+void *ReadAheadThread(void *arg)
+#endif
+{
+   readahead_t *ra = arg;
+   int job;
+
+   while((job = ReadAheadNextJob(ra)) >= 0)
+   {
+      ReadAheadFile(ra, &ra->slots[job]);
+      ReadAheadJobDone(ra, &ra->slots[job]);
+   }
+
+   return 0;
+}
+
+//
+// ReadAheadPushJob
+//
+// Hands a slot to the threads.
+//
+void ReadAheadPushJob(readahead_t *ra, int s)
+{
+#ifdef _WIN32
+   EnterCriticalSection(&ra->lock);
+   ResetEvent(ra->slots[s].done);
+#else
+   pthread_mutex_lock(&ra->lock);
+#endif
+
+   ra->slots[s].state = RASLOT_QUEUED;
+   ra->jobs[(ra->jobhead + ra->numjobs++) % READAHEAD_DEPTH] = s;
+
+#ifdef _WIN32
+   LeaveCriticalSection(&ra->lock);
+   ReleaseSemaphore(ra->jobready, 1, NULL);
+#else
+   pthread_cond_signal(&ra->jobready);
+   pthread_mutex_unlock(&ra->lock);
+#endif
+}
+
+//
+// ReadAheadWaitJob
+//
+void ReadAheadWaitJob(readahead_t *ra, raslot_t *slot)
+{
+#ifdef _WIN32
+   WaitForSingleObject(slot->done, INFINITE);
+#else
+   pthread_mutex_lock(&ra->lock);
+   while(slot->state != RASLOT_DONE)
+      pthread_cond_wait(&ra->jobdone, &ra->lock);
+   pthread_mutex_unlock(&ra->lock);
+#endif
+}
+
+//
+// ReadAheadStartThreads
+//
+// Returns false if not even one thread could be started.
+//
+bool ReadAheadStartThreads(readahead_t *ra)
+{
+   int i, count = READAHEAD_THREADS < ra->depth ? 
+      READAHEAD_THREADS : ra->depth;
+#ifdef _WIN32
+   DWORD id;
+
+   InitializeCriticalSection(&ra->lock);
+   ra->jobready = CreateSemaphore(NULL, 0, 0x7fffffff, NULL);
+   for(i = 0; i < ra->depth; ++i)
+      ra->slots[i].done = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+   for(i = 0; i < count; ++i)
+   {
+      if(!(ra->threads[i] = CreateThread(NULL, 0, ReadAheadThread, ra, 0, 
+                                         &id)))
+         break;
+   }
+#else
+   pthread_mutex_init(&ra->lock, NULL);
+   pthread_cond_init(&ra->jobready, NULL);
+   pthread_cond_init(&ra->jobdone, NULL);
+
+   for(i = 0; i < count; ++i)
+   {
+      if(pthread_create(&ra->threads[i], NULL, ReadAheadThread, ra))
+         break;
+   }
+#endif
+
+   ra->numthreads = i;
+
+   return i > 0;
+}
+
+//
+// ReadAheadStopThreads
+//
+// Stops the threads once they've finished the files they're on.
+//
+void ReadAheadStopThreads(readahead_t *ra)
+{
+   int i;
+
+#ifdef _WIN32
+   EnterCriticalSection(&ra->lock);
+   ra->stop = true;
+   LeaveCriticalSection(&ra->lock);
+   ReleaseSemaphore(ra->jobready, READAHEAD_THREADS, NULL);
+
+   for(i = 0; i < ra->numthreads; ++i)
+   {
+      WaitForSingleObject(ra->threads[i], INFINITE);
+      CloseHandle(ra->threads[i]);
+   }
+
+   for(i = 0; i < ra->depth; ++i)
+      CloseHandle(ra->slots[i].done);
+   CloseHandle(ra->jobready);
+   DeleteCriticalSection(&ra->lock);
+#else
+   pthread_mutex_lock(&ra->lock);
+   ra->stop = true;
+   pthread_cond_broadcast(&ra->jobready);
+   pthread_mutex_unlock(&ra->lock);
+
+   for(i = 0; i < ra->numthreads; ++i)
+      pthread_join(ra->threads[i], NULL);
+
+   pthread_cond_destroy(&ra->jobdone);
+   pthread_cond_destroy(&ra->jobready);
+   pthread_mutex_destroy(&ra->lock);
+#endif
+}
+
+//
+// io_uring
+//
+
+#ifdef USE_IO_URING
+
+//
+// RAUringInit
+//
+// Sets up the rings. Returns false if the kernel won't, or if latency has
+// been asked for and it's too old to link an open or read to a timeout.
+//
+bool RAUringInit(readahead_t *ra)
+{
+   rauring_t *u = &ra->uring;
+   struct io_uring_params p;
+   size_t cqsize;
+   void *map;
+
+   memset(&p, 0, sizeof(p));
+   if((u->fd = syscall(__NR_io_uring_setup, 4 * READAHEAD_DEPTH, &p)) < 0)
+      return false;
+
+   // CQE_SKIP came after the timeout flag the latency needs
+   if(!(p.features & IORING_FEAT_SINGLE_MMAP) || 
+      !(p.features & IORING_FEAT_NATIVE_WORKERS) ||
+      (ra->latency && !(p.features & IORING_FEAT_CQE_SKIP)))
+   {
+      close(u->fd);
+      return false;
+   }
+
+   u->ringsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+   cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+   if(cqsize > u->ringsize)
+      u->ringsize = cqsize;
+
+   map = mmap(NULL, u->ringsize, PROT_READ | PROT_WRITE, 
+              MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+   if(map == MAP_FAILED)
+   {
+      close(u->fd);
+      return false;
+   }
+   u->rings = map;
+
+   u->sqesize = p.sq_entries * sizeof(struct io_uring_sqe);
+   map = mmap(NULL, u->sqesize, PROT_READ | PROT_WRITE, 
+              MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+   if(map == MAP_FAILED)
+   {
+      munmap(u->rings, u->ringsize);
+      close(u->fd);
+      return false;
+   }
+   u->sqes = map;
+
+   u->sqtail  = (unsigned *)(u->rings + p.sq_off.tail);
+   u->sqmask  = (unsigned *)(u->rings + p.sq_off.ring_mask);
+   u->sqarray = (unsigned *)(u->rings + p.sq_off.array);
+   u->cqhead  = (unsigned *)(u->rings + p.cq_off.head);
+   u->cqtail  = (unsigned *)(u->rings + p.cq_off.tail);
+   u->cqmask  = (unsigned *)(u->rings + p.cq_off.ring_mask);
+   u->cqes    = (struct io_uring_cqe *)(u->rings + p.cq_off.cqes);
+
+   u->delay.tv_sec  = ra->latency / 1000;
+   u->delay.tv_nsec = (ra->latency % 1000) * 1000000L;
+
+   return true;
+}
+
+//
+// RAUringEnter
+//
+// Submits whatever is queued, and waits for a completion if asked to.
+//
+void RAUringEnter(rauring_t *u, bool wait)
+{
+   int ret;
+
+   for(;;)
+   {
+      ret = syscall(__NR_io_uring_enter, u->fd, u->queued, wait ? 1 : 0, 
+                    wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+      if(ret >= 0)
+         break;
+      if(errno != EINTR && errno != EAGAIN && errno != EBUSY)
+         SaveFileError("Error: io_uring failed (%s)\n", strerror(errno));
+   }
+
+   u->queued -= ret;
+}
+
+//
+// RAUringNext
+//
+// Fills in the basics of the next submission queue entry. The kernel
+// doesn't see it until the tail is stored.
+//
+struct io_uring_sqe *RAUringNext(rauring_t *u, unsigned *tail, __u64 data)
+{
+   unsigned i = (*tail)++ & *u->sqmask;
+   struct io_uring_sqe *sqe = &u->sqes[i];
+
+   memset(sqe, 0, sizeof(*sqe));
+   sqe->user_data = data;
+   u->sqarray[i] = i;
+   ++u->queued;
+
+   return sqe;
+}
+
+//
+// RAUringQueue
+//
+// Queues the next thing a slot needs: its open, or a read.
+//
+void RAUringQueue(readahead_t *ra, int s)
+{
+   rauring_t *u = &ra->uring;
+   raslot_t *slot = &ra->slots[s];
+   struct io_uring_sqe *sqe;
+   unsigned tail = *u->sqtail;
+
+   // the open or first read is linked to a timeout, so it waits for it
+   if(ra->latency && (slot->state == RASLOT_OPENING || !slot->len))
+   {
+      sqe = RAUringNext(u, &tail, RAURING_TIMER);
+      sqe->opcode = IORING_OP_TIMEOUT;
+      sqe->flags = IOSQE_IO_LINK;
+      sqe->addr = (unsigned long)&u->delay;
+      sqe->len = 1;
+      sqe->timeout_flags = IORING_TIMEOUT_ETIME_SUCCESS;
+   }
+
+   sqe = RAUringNext(u, &tail, s);
+   if(slot->state == RASLOT_OPENING)
+   {
+      sqe->opcode = IORING_OP_OPENAT;
+      sqe->fd = AT_FDCWD;
+      sqe->addr = (unsigned long)ra->paths[slot->file];
+      sqe->open_flags = O_RDONLY;
+   }
+   else
+   {
+      sqe->opcode = IORING_OP_READ;
+      sqe->fd = slot->fd;
+      sqe->addr = (unsigned long)(slot->buf + slot->len);
+      sqe->len = (unsigned)(READAHEAD_BUFSIZE - slot->len);
+      sqe->off = slot->len;
+   }
+
+   __atomic_store_n(u->sqtail, tail, __ATOMIC_RELEASE);
+}
+
+//
+// RAUringComplete
+//
+// Moves a slot on once its open or read is done. A read of nothing is the
+// end of the file, and one that fails ends it early.
+//
+void RAUringComplete(readahead_t *ra, int s, int res)
+{
+   raslot_t *slot = &ra->slots[s];
+   bool more;
+
+   if(slot->state == RASLOT_OPENING)
+   {
+      if((more = res >= 0))
+      {
+         slot->fd = res;
+         slot->state = RASLOT_READING;
+      }
+      else
+         slot->failed = true;
+   }
+   else
+   {
+      if(res > 0)
+         slot->len += res;
+      more = res > 0 && slot->len < READAHEAD_BUFSIZE;
+   }
+
+   if(more && !ra->stop)
+   {
+      RAUringQueue(ra, s);
+      return;
+   }
+
+   if(slot->state == RASLOT_READING)
+      close(slot->fd);
+   slot->state = RASLOT_DONE;
+   --ra->uring.inflight;
+}
+
+//
+// RAUringReap
+//
+// Handles every completion that's waiting.
+//
+void RAUringReap(readahead_t *ra)
+{
+   rauring_t *u = &ra->uring;
+   unsigned head = *u->cqhead;
+   struct io_uring_cqe *cqe;
+
+   while(head != __atomic_load_n(u->cqtail, __ATOMIC_ACQUIRE))
+   {
+      cqe = &u->cqes[head++ & *u->cqmask];
+      if(cqe->user_data != RAURING_TIMER)
+         RAUringComplete(ra, (int)cqe->user_data, cqe->res);
+   }
+
+   __atomic_store_n(u->cqhead, head, __ATOMIC_RELEASE);
+}
+
+//
+// RAUringWait
+//
+// Waits for a slot's file to be read, keeping the others moving meanwhile.
+//
+void RAUringWait(readahead_t *ra, raslot_t *slot)
+{
+   for(;;)
+   {
+      RAUringReap(ra);
+      if(slot->state == RASLOT_DONE)
+         break;
+      RAUringEnter(&ra->uring, true);
+   }
+
+   // reads queued for other files while reaping
+   if(ra->uring.queued)
+      RAUringEnter(&ra->uring, false);
+}
+
+//
+// RAUringFree
+//
+// Waits for everything in flight, since it's going into the buffers, and
+// takes down the rings.
+//
+void RAUringFree(readahead_t *ra)
+{
+   rauring_t *u = &ra->uring;
+
+   ra->stop = true;
+   while(u->inflight)
+   {
+      RAUringEnter(u, true);
+      RAUringReap(ra);
+   }
+
+   munmap(u->sqes, u->sqesize);
+   munmap(u->rings, u->ringsize);
+   close(u->fd);
+}
+
+#else
+
+bool RAUringInit(readahead_t *ra)
+{
+   return false;
+}
+
+#endif
+
+//
+// ReadAheadInit
+//
+// Sets up to read the files in order, in one of the READAHEAD_ ways. With
+// READAHEAD_AUTO this always works, even if it comes down to sync; asking
+// for a particular way returns false if it isn't available.
+//
+bool ReadAheadInit(readahead_t *ra, int numpaths, char **paths, int depth,
+                   int method, long latency)
+{
+   int i;
+
+   memset(ra, 0, sizeof(*ra));
+   ra->paths    = paths;
+   ra->numpaths = numpaths;
+   ra->depth    = depth < 1 ? 1 : depth > READAHEAD_DEPTH ? 
+                  READAHEAD_DEPTH : depth;
+   ra->latency  = latency;
+   ra->method   = method;
+
+   if(method == READAHEAD_AUTO || method == READAHEAD_URING)
+      ra->method = RAUringInit(ra) ? READAHEAD_URING : READAHEAD_POOL;
+
+   if(method != READAHEAD_AUTO && ra->method != method)
+      return false;
+
+   if(ra->method == READAHEAD_POOL && !ReadAheadStartThreads(ra))
+   {
+      ReadAheadStopThreads(ra);
+      if(method == READAHEAD_POOL)
+         return false;
+      ra->method = READAHEAD_SYNC;
+   }
+
+   if(ra->method == READAHEAD_SYNC)
+      ra->depth = 1;
+
+   ra->bufs = MemAlloc(ra->depth * READAHEAD_BUFSIZE);
+   for(i = 0; i < ra->depth; ++i)
+      ra->slots[i].buf = ra->bufs + i * READAHEAD_BUFSIZE;
+
+   return true;
+}
+
+//
+// ReadAheadQueue
+//
+// Starts on the files up to depth - 1 after file i that aren't skipped.
+//
+void ReadAheadQueue(readahead_t *ra, int i)
+{
+   raslot_t *slot;
+   int n;
+
+   while(ra->opened < ra->numpaths && ra->opened <= i + ra->depth - 1)
+   {
+      n = ra->opened++;
+      if(ra->skip && ra->skip[n])
+         continue;
+
+      slot = &ra->slots[n % ra->depth];
+      slot->file = n;
+      slot->len = 0;
+      slot->failed = false;
+
+      switch(ra->method)
+      {
+      case READAHEAD_POOL:
+         ReadAheadPushJob(ra, n % ra->depth);
+         break;
+#ifdef USE_IO_URING
+      case READAHEAD_URING:
+         slot->state = RASLOT_OPENING;
+         ++ra->uring.inflight;
+         RAUringQueue(ra, n % ra->depth);
+         break;
+#endif
+      default:
+         slot->state = RASLOT_QUEUED;
+         break;
+      }
+   }
+
+#ifdef USE_IO_URING
+   if(ra->method == READAHEAD_URING && ra->uring.queued)
+      RAUringEnter(&ra->uring, false);
+#endif
+}
+
+//
+// ReadAheadLoad
+//
+// Reads file i, which must be the next one that isn't skipped, after making
+// sure the files after it are on their way. Returns false on failure.
+//
+bool ReadAheadLoad(readahead_t *ra, int i)
+{
+   raslot_t *slot = &ra->slots[i % ra->depth];
+   size_t len;
+   METRIC_TIMER(t)
+
+   ReadAheadQueue(ra, i);
+
+   METRIC_START(t)
+
+   switch(ra->method)
+   {
+   case READAHEAD_POOL:
+      ReadAheadWaitJob(ra, slot);
+      break;
+#ifdef USE_IO_URING
+   case READAHEAD_URING:
+      RAUringWait(ra, slot);
+      break;
+#endif
+   default:
+      ReadAheadFile(ra, slot);
+      break;
+   }
+
+   slot->state = RASLOT_EMPTY;
+
+   if(slot->failed)
+   {
+      METRIC_ERROR(METRIC_ERR_OPEN)
+      return SaveFileWarning("Error: couldn't open %s\n", ra->paths[i]);
+   }
+
+   len = slot->len < MAXCONTAINERSIZE ? slot->len : MAXCONTAINERSIZE;
+   memcpy(containerbuf, slot->buf, len);
+
+   METRIC_STOP(METRIC_READ, t)
+   METRIC_COUNT(files, 1)
+   METRIC_COUNT(bytes, len)
+
+   return FindSaveRAMImage(len, slot->len > MAXCONTAINERSIZE) && 
+      DecodeSaveRAM();
+}
+
+//
+// ReadAheadFree
+//
+// Stops the threads or the rings, and drops files that were never asked
+// for.
+//
+void ReadAheadFree(readahead_t *ra)
+{
+   switch(ra->method)
+   {
+   case READAHEAD_POOL:
+      ReadAheadStopThreads(ra);
+      break;
+#ifdef USE_IO_URING
+   case READAHEAD_URING:
+      RAUringFree(ra);
+      break;
+#endif
+   }
+
+   MemFree(ra->bufs, ra->depth * READAHEAD_BUFSIZE);
+   ra->bufs = NULL;
+}
+
+//
+// Arenas
+//
+// A long-running mode gets one fixed block of memory up front and carves
+// the storage for each request or update out of it, then throws it all
+// away at once before the next one, so nothing in the loop touches the heap.
+// Something that won't fit in what's left of the arena goes to the heap
+// instead; those are counted as spills, and a non-zero count means the
+// arena should be bigger.
+//
+
+#define ARENA_ALIGN 8
+
+typedef struct arena_s
+{
+   const char   *name;
+   byte         *base;
+   size_t        size;
+   size_t        used;
+   size_t        last;     // offset of the most recent allocation
+   size_t        peak;     // most ever used between resets
+   unsigned long allocs;
+   unsigned long resets;
+   unsigned long spills;   // allocations that had to go to the heap
+} arena_t;
+
+//
+// ArenaInit
+//
+void ArenaInit(arena_t *a, const char *name, size_t size)
+{
+   memset(a, 0, sizeof(*a));
+   a->name = name;
+   a->base = MemAlloc(size);
+   a->size = size;
+}
+
+//
+// ArenaReset
+//
+// Frees everything allocated from an arena.
+//
+void ArenaReset(arena_t *a)
+{
+   a->used = a->last = 0;
+   ++a->resets;
+}
+
+//
+// ArenaAlloc
+//
+// Returns NULL if the arena doesn't have room.
+//
+void *ArenaAlloc(arena_t *a, size_t size)
+{
+   size_t start = (a->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+   if(start > a->size || size > a->size - start)
+      return NULL;
+
+   a->last = start;
+   a->used = start + size;
+   if(a->used > a->peak)
+      a->peak = a->used;
+   ++a->allocs;
+
+   return a->base + start;
+}
+
+//
+// ArenaRealloc
+//
+// Grows an allocation from the arena. The most recent allocation is grown
+// where it is; anything else is copied to a new spot. Returns NULL if the
+// arena doesn't have room, in which case the old allocation is untouched.
+//
+void *ArenaRealloc(arena_t *a, void *p, size_t oldsize, size_t newsize)
+{
+   byte *newp;
+
+   if(p && (byte *)p == a->base + a->last && a->used == a->last + oldsize)
+   {
+      if(newsize > a->size - a->last)
+         return NULL;
+
+      a->used = a->last + newsize;
+      if(a->used > a->peak)
+         a->peak = a->used;
+      return p;
+   }
+
+   if(!(newp = ArenaAlloc(a, newsize)))
+      return NULL;
+
+   if(p)
+      memcpy(newp, p, oldsize);
+
+   return newp;
+}
+
+//
+// String Buffers
+//
+// Growable text buffers used to build query responses. A buffer can live on
+// the heap or in an arena; one that outgrows its arena moves to the heap.
+//
+
+typedef struct strbuf_s
+{
+   char    *buf;
+   size_t   len;
+   size_t   alloc;
+   arena_t *arena;   // NULL if buf is on the heap
+} strbuf_t;
+
+//
+// SB_Init
+//
+void SB_Init(strbuf_t *sb)
+{
+   sb->buf   = NULL;
+   sb->len   = 0;
+   sb->alloc = 0;
+   sb->arena = NULL;
+}
+
+//
+// SB_InitArena
+//
+// Sets up a buffer to be allocated from an arena. It goes away when the
+// arena is reset.
+//
+void SB_InitArena(strbuf_t *sb, arena_t *arena)
+{
+   SB_Init(sb);
+   sb->arena = arena;
+}
+
+//
+// SB_Free
+//
+void SB_Free(strbuf_t *sb)
+{
+   if(!sb->arena)
+      MemFree(sb->buf, sb->alloc);
+   SB_Init(sb);
+}
+
+//
+// SB_Reserve
+//
+// Makes sure there is room for at least n more characters plus a null.
+//
+void SB_Reserve(strbuf_t *sb, size_t n)
+{
+   size_t newalloc = sb->alloc ? sb->alloc : 256;
+   char *newbuf;
+
+   if(sb->len + n + 1 <= sb->alloc)
+      return;
+
+   while(newalloc < sb->len + n + 1)
+      newalloc *= 2;
+
+   if(sb->arena)
+   {
+      if((newbuf = ArenaRealloc(sb->arena, sb->buf, sb->alloc, newalloc)))
+      {
+         sb->buf   = newbuf;
+         sb->alloc = newalloc;
+         return;
+      }
+
+      // out of room; the rest of this buffer's life is on the heap
+      ++sb->arena->spills;
+      newbuf = MemAlloc(newalloc);
+      if(sb->len)
+         memcpy(newbuf, sb->buf, sb->len + 1);
+      sb->buf   = newbuf;
+      sb->arena = NULL;
+   }
+   else
+      sb->buf = MemRealloc(sb->buf, sb->alloc, newalloc);
+
+   sb->alloc = newalloc;
+}
+
+//
+// SB_Printf
+//
+// Appends formatted text to the buffer.
+//
+void SB_Printf(strbuf_t *sb, const char *fmt, ...)
+{
+   va_list va;
+   int n;
+
+   SB_Reserve(sb, 64);
+
+   for(;;)
+   {
+      size_t space = sb->alloc - sb->len;
+
+      va_start(va, fmt);
+      n = vsnprintf(sb->buf + sb->len, space, fmt, va);
+      va_end(va);
+
+      // some C libraries return -1 rather than the needed size
+      if(n >= 0 && (size_t)n < space)
+         break;
+
+      SB_Reserve(sb, n >= 0 ? (size_t)n : sb->alloc);
+   }
+
+   sb->len += n;
+}
+
+//
+// SB_Append
+//
+// Appends raw bytes to the buffer.
+//
+void SB_Append(strbuf_t *sb, const char *buf, size_t len)
+{
+   SB_Reserve(sb, len);
+   memcpy(sb->buf + sb->len, buf, len);
+   sb->len += len;
+   sb->buf[sb->len] = '\0';
+}
+
+//
+// SB_JSONString
+//
+// Appends a quoted and escaped JSON string.
+//
+void SB_JSONString(strbuf_t *sb, const char *str)
+{
+   SB_Reserve(sb, strlen(str) * 2 + 2);
+
+   sb->buf[sb->len++] = '"';
+
+   for(; *str; ++str)
+   {
+      switch(*str)
+      {
+      case '"':
+      case '\\':
+         sb->buf[sb->len++] = '\\';
+         sb->buf[sb->len++] = *str;
+         break;
+      case '\n':
+         sb->buf[sb->len++] = '\\';
+         sb->buf[sb->len++] = 'n';
+         break;
+      default:
+         sb->buf[sb->len++] = *str;
+         break;
+      }
+   }
+
+   sb->buf[sb->len++] = '"';
+   sb->buf[sb->len] = '\0';
+}
+
+//
+// SB_SQLString
+//
+// Appends a quoted SQL string literal. Quotes are doubled.
+//
+void SB_SQLString(strbuf_t *sb, const char *str)
+{
+   SB_Reserve(sb, strlen(str) * 2 + 2);
+
+   sb->buf[sb->len++] = '\'';
+
+   for(; *str; ++str)
+   {
+      if(*str == '\'')
+         sb->buf[sb->len++] = '\'';
+      sb->buf[sb->len++] = *str;
+   }
+
+   sb->buf[sb->len++] = '\'';
+   sb->buf[sb->len] = '\0';
+}
+
+//
+// SB_JSONStats
+//
+// Appends a stat vector as a JSON object.
+//
+void SB_JSONStats(strbuf_t *sb, statvec_t *vec)
+{
+   SB_Printf(sb, "{\"str\":%d,\"def\":%d,\"int\":%d,\"lck\":%d}",
+             vec->s[STAT_STR], vec->s[STAT_DEF], 
+             vec->s[STAT_INT], vec->s[STAT_LCK]);
+}
+
+//
+// SB_JSONMemStats
+//
+// Appends the heap's and an arena's allocation stats as a JSON object.
+//
+void SB_JSONMemStats(strbuf_t *sb, arena_t *a)
+{
+   SB_Printf(sb, "{\"heap\":{\"allocs\":%lu,\"frees\":%lu,"
+             "\"bytes\":%lu,\"peak\":%lu}",
+             memstats.allocs, memstats.frees, 
+             (unsigned long)memstats.bytes, (unsigned long)memstats.peak);
+   SB_Printf(sb, ",\"arena\":{\"name\":");
+   SB_JSONString(sb, a->name);
+   SB_Printf(sb, ",\"size\":%lu,\"used\":%lu,\"peak\":%lu,"
+             "\"allocs\":%lu,\"resets\":%lu,\"spills\":%lu}}",
+             (unsigned long)a->size, (unsigned long)a->used, 
+             (unsigned long)a->peak, a->allocs, a->resets, a->spills);
+}
+
+#ifdef SAVTEST_METRICS
+
+// where --stats sends its output; "-" is stderr
+const char *statspath;
+
+//
+// SB_Metrics
+//
+// Appends all the metrics in Prometheus' text format.
+//
+void SB_Metrics(strbuf_t *sb)
+{
+   int i, j;
+
+   SB_Printf(sb, "# HELP savtest_stage_seconds Time spent in each stage.\n"
+                 "# TYPE savtest_stage_seconds histogram\n");
+   for(i = 0; i < NUMMETRICSTAGES; ++i)
+   {
+      stagemetric_t *sm = &metrics.stages[i];
+      unsigned long total = 0;
+      double bound = METRIC_FIRSTBOUND;
+
+      for(j = 0; j < METRIC_BUCKETS; ++j, bound *= 4)
+      {
+         total += sm->buckets[j];
+         SB_Printf(sb, "savtest_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} "
+                   "%lu\n", metricstagenames[i], bound, total);
+      }
+      SB_Printf(sb, "savtest_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} "
+                "%lu\n", metricstagenames[i], sm->count);
+      SB_Printf(sb, "savtest_stage_seconds_sum{stage=\"%s\"} %.9f\n", 
+                metricstagenames[i], sm->sum);
+      SB_Printf(sb, "savtest_stage_seconds_count{stage=\"%s\"} %lu\n", 
+                metricstagenames[i], sm->count);
+   }
+
+   SB_Printf(sb, "# HELP savtest_file_errors_total Files that couldn't be "
+                 "used.\n# TYPE savtest_file_errors_total counter\n");
+   for(i = 0; i < NUMMETRICERRORS; ++i)
+   {
+      SB_Printf(sb, "savtest_file_errors_total{reason=\"%s\"} %lu\n",
+                metricerrornames[i], metrics.errors[i]);
+   }
+
+   SB_Printf(sb, "# TYPE savtest_files_read_total counter\n"
+                 "savtest_files_read_total %lu\n"
+                 "# TYPE savtest_bytes_read_total counter\n"
+                 "savtest_bytes_read_total %lu\n"
+                 "# TYPE savtest_slots_decoded_total counter\n"
+                 "savtest_slots_decoded_total %lu\n",
+             metrics.files, metrics.bytes, metrics.slots);
+
+   SB_Printf(sb, "# TYPE savtest_heap_bytes gauge\n"
+                 "savtest_heap_bytes %lu\n"
+                 "# TYPE savtest_heap_allocs_total counter\n"
+                 "savtest_heap_allocs_total %lu\n",
+             (unsigned long)memstats.bytes, memstats.allocs);
+}
+
+//
+// WriteMetrics
+//
+// Writes the metrics to the --stats destination, if there is one.
+//
+void WriteMetrics(void)
+{
+   strbuf_t sb;
+   FILE *f;
+
+   if(!statspath)
+      return;
+
+   SB_Init(&sb);
+   SB_Metrics(&sb);
+
+   if(!strcmp(statspath, "-"))
+      fwrite(sb.buf, 1, sb.len, stderr);
+   else if((f = fopen(statspath, "w")))
+   {
+      fwrite(sb.buf, 1, sb.len, f);
+      fclose(f);
+   }
+   else
+      SaveFileWarning("Warning: couldn't write stats to %s\n", statspath);
+
+   SB_Free(&sb);
+}
+
+#endif
+
+//
+// JSON Views
+//
+// Each menu screen has a JSON equivalent used by the query server. These
+// write a complete JSON object for one file.
+//
+
+enum
+{
+   JSON_STATS,
+   JSON_EQUIP,
+   JSON_DSS,
+   JSON_INVENTORY,
+   JSON_RELICS,
+   JSON_MAP,
+   JSON_CHECKSUM,
+   JSON_COMPLETION,
+   JSON_AREAS,
+   JSON_REACH,
+   NUMJSONVIEWS
+};
+
+const char *jsonviewnames[NUMJSONVIEWS] =
+{
+   "stats", "equip", "dss", "inventory", "relics", "map", "checksum",
+   "completion", "areas", "reach",
+};
+
+//
+// JSONStats
+//
+void JSONStats(strbuf_t *sb, savefile_t *sf)
+{
+   statvec_t eff;
+
+   SaveFileEffectiveStats(sf, &eff);
+
+   SB_Printf(sb, "{\"name\":");
+   SB_JSONString(sb, sf->name);
+   SB_Printf(sb, ",\"mode\":");
+   SB_JSONString(sb, SaveFileModeName(sf));
+   SB_Printf(sb, ",\"mode_locked\":%s,\"time\":%ld,\"map_pct\":%ld,"
+             "\"lv\":%ld,\"exp\":%ld,\"hp\":%ld,\"mp\":%ld,"
+             "\"hearts\":%d,\"hearts_max\":%d,\"subweapon\":",
+             sf->mode_locked ? "true" : "false", sf->time, sf->map_pct,
+             sf->lv, sf->exp, sf->hp, sf->mp, 
+             sf->hearts_current, sf->hearts_max);
+   SB_JSONString(sb, (sf->subweapon >= 0 && sf->subweapon < NUMSUBWEAPONS) ?
+                 subweapons[sf->subweapon] : "Unknown");
+   SB_Printf(sb, ",\"str\":[%d,%d,%d,%d],\"def\":[%d,%d,%d,%d],"
+             "\"int\":[%d,%d,%d,%d],\"lck\":[%d,%d,%d,%d],\"effective\":",
+             sf->str[0], sf->str[1], sf->str[2], sf->str[3],
+             sf->def[0], sf->def[1], sf->def[2], sf->def[3],
+             sf->intel[0], sf->intel[1], sf->intel[2], sf->intel[3],
+             sf->lck[0], sf->lck[1], sf->lck[2], sf->lck[3]);
+   SB_JSONStats(sb, &eff);
+   SB_Printf(sb, "}");
+}
+
+//
+// JSONEquip
+//
+void JSONEquip(strbuf_t *sb, savefile_t *sf)
+{
+   statvec_t equip, eff;
+   int armor = SaveFileValidItem(sf->armor);
+   int arm1  = SaveFileValidItem(sf->arm_first);
+   int arm2  = SaveFileValidItem(sf->arm_second);
+
+   CalculateEquipStats(armor, arm1, arm2, &equip);
+   SaveFileEffectiveStats(sf, &eff);
+
+   SB_Printf(sb, "{\"action\":");
+   SB_JSONString(sb, dsscards[SaveFileValidCard(sf->action_card)].name);
+   SB_Printf(sb, ",\"attribute\":");
+   SB_JSONString(sb, dsscards[SaveFileValidCard(sf->attribute_card)].name);
+   SB_Printf(sb, ",\"armor\":");
+   SB_JSONString(sb, inventory_items[armor].name);
+   SB_Printf(sb, ",\"arm1\":");
+   SB_JSONString(sb, inventory_items[arm1].name);
+   SB_Printf(sb, ",\"arm2\":");
+   SB_JSONString(sb, inventory_items[arm2].name);
+   SB_Printf(sb, ",\"equip_total\":");
+   SB_JSONStats(sb, &equip);
+   SB_Printf(sb, ",\"effective\":");
+   SB_JSONStats(sb, &eff);
+   SB_Printf(sb, "}");
+}
+
+//
+// JSONDSS
+//
+void JSONDSS(strbuf_t *sb, savefile_t *sf)
+{
+   int i, action, attrib;
+   bool first = true;
+   char name[DSSCOMBO_TEXTLEN];
+
+   SB_Printf(sb, "{\"owned\":[");
+   for(i = 1; i < NUMDSS; ++i)
+   {
+      if(!sf->dss_owned[i])
+         continue;
+      SB_Printf(sb, first ? "" : ",");
+      SB_JSONString(sb, dsscards[i].name);
+      first = false;
+   }
+
+   SB_Printf(sb, "],\"used_count\":%d,\"combos\":[", DSSCountUsed(sf));
+   first = true;
+   for(action = FIRSTACTIONCARD; action < NUMDSS; ++action)
+   {
+      for(attrib = FIRSTATTRIBCARD; attrib < FIRSTACTIONCARD; ++attrib)
+      {
+         bool usable = DSSComboUsable(sf, action, attrib);
+         bool used   = DSSComboUsed(sf, action, attrib);
+
+         if(!usable && !used)
+            continue;
+
+         DSSComboName(action, attrib, name);
+         SB_Printf(sb, "%s{\"name\":", first ? "" : ",");
+         SB_JSONString(sb, name);
+         SB_Printf(sb, ",\"usable\":%s,\"used\":%s}", 
+                   usable ? "true" : "false", used ? "true" : "false");
+         first = false;
+      }
+   }
+   SB_Printf(sb, "]}");
+}
+
+//
+// JSONInventory
+//
+void JSONInventory(strbuf_t *sb, savefile_t *sf)
+{
+   int i;
+   bool first = true;
+
+   SB_Printf(sb, "{\"items\":{");
+   for(i = 1; i < NUMINV; ++i)
+   {
+      if(!sf->inventory[i])
+         continue;
+      SB_Printf(sb, first ? "" : ",");
+      SB_JSONString(sb, inventory_items[i].name);
+      SB_Printf(sb, ":%d", sf->inventory[i]);
+      first = false;
+   }
+   SB_Printf(sb, "}}");
+}
+
+//
+// JSONRelics
+//
+void JSONRelics(strbuf_t *sb, savefile_t *sf)
+{
+   int i;
+
+   SB_Printf(sb, "{\"relics\":{");
+   for(i = 0; i < NUMRELICS; ++i)
+   {
+      SB_Printf(sb, i ? "," : "");
+      SB_JSONString(sb, relics[i].name);
+      SB_Printf(sb, ":%s", sf->relics[i] ? "true" : "false");
+   }
+   SB_Printf(sb, "},\"heart_ups\":%d,\"hp_ups\":%d,\"mp_ups\":%d}",
+             sf->numheartups, sf->numhpups, sf->nummpups);
+}
+
+//
+// JSONMap
+//
+void JSONMap(strbuf_t *sb, savefile_t *sf)
+{
+   int row, block;
+   char line[MAP_WIDTH + 1];
+
+   SB_Printf(sb, "{\"width\":%d,\"height\":%d,\"rows\":[", 
+             MAP_WIDTH, MAP_HEIGHT);
+   for(row = 0; row < MAP_HEIGHT; ++row)
+   {
+      for(block = 0; block < MAP_WIDTH; ++block)
+         line[block] = sf->map[block][row];
+      line[MAP_WIDTH] = '\0';
+
+      SB_Printf(sb, row ? "," : "");
+      SB_JSONString(sb, line);
+   }
+   SB_Printf(sb, "]}");
+}
+
+//
+// JSONChecksum
+//
+void JSONChecksum(strbuf_t *sb, savefile_t *sf)
+{
+   byte calculated = sf->checksum_calc;
+
+   SB_Printf(sb, "{\"stored\":%d,\"calculated\":%d,\"valid\":%s}",
+             sf->checksum, calculated, 
+             calculated == sf->checksum ? "true" : "false");
+}
+
+//
+// JSONCompletion
+//
+void JSONCompletion(strbuf_t *sb, savefile_t *sf)
+{
+   completion_t comp;
+   int i;
+
+   CalculateCompletion(sf, &comp);
+
+   SB_Printf(sb, "{\"score\":%d,\"categories\":{", comp.score);
+   for(i = 0; i < NUMSCORECATS; ++i)
+   {
+      SB_Printf(sb, i ? "," : "");
+      SB_JSONString(sb, scorecats[i].name);
+      SB_Printf(sb, ":{\"have\":%d,\"total\":%d,\"pct\":%d}",
+                comp.have[i], scorecats[i].total, comp.pct[i]);
+   }
+   SB_Printf(sb, "}}");
+}
+
+//
+// JSONAreas
+//
+void JSONAreas(strbuf_t *sb, savefile_t *sf)
+{
+   int explored[NUMAREAS];
+   int area;
+
+   CalculateAreaExplored(sf, explored);
+
+   SB_Printf(sb, "[");
+   for(area = 0; area < NUMAREAS; ++area)
+   {
+      SB_Printf(sb, area ? ",{\"name\":" : "{\"name\":");
+      SB_JSONString(sb, areanames[area]);
+      SB_Printf(sb, ",\"explored\":%d,\"cells\":%d}", 
+                explored[area], areacells[area]);
+   }
+   SB_Printf(sb, "]");
+}
+
+//
+// JSONReach
+//
+void JSONReach(strbuf_t *sb, savefile_t *sf)
+{
+   reach_t reach;
+
+   CalculateReach(sf, &reach);
+
+   SB_Printf(sb, "{\"unexplored\":%d,\"reachable\":%d,\"route\":%d,"
+             "\"stuck\":%s,\"best_relic\":", reach.unexplored, 
+             reach.reachable, reach.route, reach.stuck ? "true" : "false");
+
+   if(reach.bestrelic >= 0)
+      SB_JSONString(sb, relics[reach.bestrelic].name);
+   else
+      SB_Printf(sb, "null");
+
+   SB_Printf(sb, ",\"best_gain\":%d}", reach.bestgain);
+}
+
+typedef void (*jsonview_t)(strbuf_t *, savefile_t *);
+
+jsonview_t jsonviews[NUMJSONVIEWS] =
+{
+   JSONStats,
+   JSONEquip,
+   JSONDSS,
+   JSONInventory,
+   JSONRelics,
+   JSONMap,
+   JSONChecksum,
+   JSONCompletion,
+   JSONAreas,
+   JSONReach,
+};
+
+//
+// SaveFileHash
+//
+// FNV-1a hash of a file's raw data. Used to tell when cached output for a
+// file has gone stale.
+//
+unsigned int SaveFileHash(savefile_t *sf)
+{
+   unsigned int hash = 2166136261u;
+   int i;
+
+   for(i = 0; i < SAVEFILESIZE; ++i)
+   {
+      hash ^= sf->data[i];
+      hash *= 16777619u;
+   }
+
+   return hash;
+}
+
+//
+// Query Server
+//
+// A small HTTP server that keeps one save RAM image loaded and answers
+// requests about its eight file slots with the same information as the menu
+// screens, as JSON. To serve many images, run a server for each or use the
+// command interface. A single select() loop serves all the connections,
+// which are kept alive between requests unless the client asks otherwise or
+// sits idle for SERVER_IDLETIME seconds. The sockets don't block: responses are
+// queued per connection and written as the client takes them, so a slow
+// reader only holds up itself, and a client that hangs up early only loses
+// its own connection. Each file's responses are serialized once and cached,
+// keyed by a hash of the file's raw data.
+//
+// GET /files                  - list of files
+// GET /cartridge              - decoded header
+// GET /rank                   - completion ranking
+// GET /query?q=<expression>   - files matching a query expression
+// GET /file/<1-8>/<view>      - stats, equip, dss, inventory, relics, map,
+//                               checksum, completion, areas, or reach
+//
+
+#define MAXCLIENTS    32
+#define CLIENTBUFSIZE 4096
+
+// seconds a connection may go without sending or taking anything before
+// it's closed, so idle keep-alive clients can't hold every slot
+#define SERVER_IDLETIME 15
+
+typedef struct client_s
+{
+   SOCKET   sock;
+   char     buf[CLIENTBUFSIZE];
+   int      len;
+   strbuf_t out;      // responses not yet sent
+   size_t   outpos;   // how much of them has been
+   bool     closing;  // close once they're all sent
+   time_t   active;   // last time anything was read or written
+} client_t;
+
+typedef struct cachedview_s
+{
+   bool         valid;
+   unsigned int hash; // SaveFileHash of the data it was built from
+   strbuf_t     body;
+} cachedview_t;
+
+client_t     clients[MAXCLIENTS];
+cachedview_t viewcache[NUMSAVEFILES][NUMJSONVIEWS];
+
+// response bodies that aren't cached are built here, one request at a time
+#define SERVERARENASIZE (64 * 1024)
+
+arena_t serverarena;
+
+//
+// ServerGetView
+//
+// Returns the cached JSON for one view of one file, rebuilding it if the
+// file's data has changed since it was made.
+//
+strbuf_t *ServerGetView(int filenum, int view)
+{
+   savefile_t   *sf    = &savefiles[filenum];
+   cachedview_t *cache = &viewcache[filenum][view];
+   unsigned int  hash  = SaveFileHash(sf);
+
+   if(!cache->valid || cache->hash != hash)
+   {
+      cache->body.len = 0;
+      jsonviews[view](&cache->body, sf);
+      cache->hash  = hash;
+      cache->valid = true;
+   }
+
+   return &cache->body;
+}
+
+//
+// ServerFiles
+//
+void ServerFiles(strbuf_t *sb)
+{
+   int i;
+
+   SB_Printf(sb, "[");
+   for(i = 0; i < NUMSAVEFILES; ++i)
+   {
+      savefile_t *sf = &savefiles[i];
+
+      SB_Printf(sb, "%s{\"file\":%d,\"exists\":%s", i ? "," : "", i + 1,
+                sf->exists ? "true" : "false");
+      if(sf->exists)
+      {
+         SB_Printf(sb, ",\"name\":");
+         SB_JSONString(sb, sf->name);
+         SB_Printf(sb, ",\"mode\":");
+         SB_JSONString(sb, SaveFileModeName(sf));
+         SB_Printf(sb, ",\"hash\":\"%08x\"", SaveFileHash(sf));
+      }
+      SB_Printf(sb, "}");
+   }
+   SB_Printf(sb, "]");
+}
+
+//
+// ServerCartridge
+//
+void ServerCartridge(strbuf_t *sb)
+{
+   int i;
+   bool first = true;
+
+   SB_Printf(sb, "{\"magic\":");
+   SB_JSONString(sb, cartridge.magic);
+   SB_Printf(sb, ",\"mode_flags\":%d,\"unlocked\":[", cartridge.modeflags);
+   for(i = 0; i < NUMMODES; ++i)
+   {
+      if(!cartridge.unlocked[i])
+         continue;
+      SB_Printf(sb, first ? "" : ",");
+      SB_JSONString(sb, modenames[i]);
+      first = false;
+   }
+   SB_Printf(sb, "],\"extra\":[%d,%d,%d,%d]", 
+             cartridge.extra[0], cartridge.extra[1],
+             cartridge.extra[2], cartridge.extra[3]);
+   SB_Printf(sb, ",\"container\":{\"type\":");
+   SB_JSONString(sb, containernames[container.type]);
+   SB_Printf(sb, ",\"offset\":%lu,\"size\":%lu,\"truncated\":%s}}",
+             (unsigned long)container.offset, (unsigned long)container.size,
+             container.truncated ? "true" : "false");
+}
+
+//
+// ServerRank
+//
+void ServerRank(strbuf_t *sb)
+{
+   rankentry_t entries[NUMSAVEFILES];
+   rankentry_t entry;
+   rankheap_t heap;
+   completion_t comp;
+   int i, count;
+
+   RankHeapInit(&heap, entries, NUMSAVEFILES);
+
+   for(i = 0; i < NUMSAVEFILES; ++i)
+   {
+      if(!savefiles[i].exists)
+         continue;
+
+      CalculateCompletion(&savefiles[i], &comp);
+      entry.score = comp.score;
+      entry.file  = 0;
+      entry.slot  = i;
+      RankHeapAdd(&heap, &entry);
+   }
+
+   count = RankHeapSort(&heap);
+
+   SB_Printf(sb, "[");
+   for(i = 0; i < count; ++i)
+   {
+      SB_Printf(sb, "%s{\"file\":%d,\"name\":", i ? "," : "", 
+                entries[i].slot + 1);
+      SB_JSONString(sb, savefiles[entries[i].slot].name);
+      SB_Printf(sb, ",\"score\":%d}", entries[i].score);
+   }
+   SB_Printf(sb, "]");
+}
+
+//
+// ServerURLDecode
+//
+// Gets a parameter from a URL query string and decodes it. Returns false if
+// the parameter isn't there.
+//
+bool ServerURLDecode(const char *args, const char *name, char *out, int outlen)
+{
+   size_t namelen = strlen(name);
+   int len = 0;
+
+   while(args && *args)
+   {
+      if(!strncmp(args, name, namelen) && args[namelen] == '=')
+      {
+         for(args += namelen + 1; *args && *args != '&' && len < outlen - 1;
+             ++args)
+         {
+            unsigned int c;
+
+            if(*args == '%' && sscanf(args + 1, "%2x", &c) == 1)
+            {
+               out[len++] = (char)c;
+               args += 2;
+            }
+            else
+               out[len++] = (*args == '+') ? ' ' : *args;
+         }
+
+         out[len] = '\0';
+         return true;
+      }
+
+      if((args = strchr(args, '&')) != NULL)
+         ++args;
+   }
+
+   return false;
+}
+
+//
+// ServerQuery
+//
+// Lists the files matching a query expression. Returns the HTTP status.
+//
+int ServerQuery(const char *args, strbuf_t *sb)
+{
+   static query_t query;
+   char expr[512];
+   bool first = true;
+   int i;
+
+   if(!ServerURLDecode(args, "q", expr, sizeof(expr)) || 
+      !QueryParse(&query, expr))
+   {
+      SB_Printf(sb, "{\"error\":\"bad query\"}");
+      return 400;
+   }
+
+   SB_Printf(sb, "[");
+   for(i = 0; i < NUMSAVEFILES; ++i)
+   {
+      if(!savefiles[i].exists || !QueryMatch(&query, &savefiles[i]))
+         continue;
+
+      SB_Printf(sb, "%s{\"file\":%d,\"name\":", first ? "" : ",", i + 1);
+      SB_JSONString(sb, savefiles[i].name);
+      SB_Printf(sb, "}");
+      first = false;
+   }
+   SB_Printf(sb, "]");
+
+   return 200;
+}
+
+//
+// ServerRoute
+//
+// Works out the response body for a request path. Returns the HTTP status
+// code. The body is either built into "scratch" or is a cached view.
+//
+int ServerRoute(const char *path, const char *args, strbuf_t *scratch, 
+                strbuf_t **body)
+{
+   int filenum, view;
+   char viewname[32];
+
+   *body = scratch;
+   scratch->len = 0;
+
+   if(!strcmp(path, "/files"))
+      ServerFiles(scratch);
+   else if(!strcmp(path, "/cartridge"))
+      ServerCartridge(scratch);
+   else if(!strcmp(path, "/rank"))
+      ServerRank(scratch);
+   else if(!strcmp(path, "/stats"))
+      SB_JSONMemStats(scratch, &serverarena);
+#ifdef SAVTEST_METRICS
+   else if(!strcmp(path, "/metrics"))
+      SB_Metrics(scratch);
+#endif
+   else if(!strcmp(path, "/query"))
+      return ServerQuery(args, scratch);
+   else if(sscanf(path, "/file/%d/%31s", &filenum, viewname) == 2)
+   {
+      if(filenum < 1 || filenum > NUMSAVEFILES || 
+         !savefiles[filenum - 1].exists)
+      {
+         SB_Printf(scratch, "{\"error\":\"no such file\"}");
+         return 404;
+      }
+
+      for(view = 0; view < NUMJSONVIEWS; ++view)
+      {
+         if(!strcmp(viewname, jsonviewnames[view]))
+         {
+            *body = ServerGetView(filenum - 1, view);
+            return 200;
+         }
+      }
+
+      SB_Printf(scratch, "{\"error\":\"no such view\"}");
+      return 404;
+   }
+   else
+   {
+      SB_Printf(scratch, "{\"error\":\"not found\"}");
+      return 404;
+   }
+
+   return 200;
+}
+
+//
+// ServerSetNonBlocking
+//
+void ServerSetNonBlocking(SOCKET sock)
+{
+#ifdef _WIN32
+   u_long on = 1;
+
+   ioctlsocket(sock, FIONBIO, &on);
+#else
+   fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+#endif
+}
+
+//
+// ServerWouldBlock
+//
+// Returns true if the last socket call failed only because it would have
+// had to wait.
+//
+bool ServerWouldBlock(void)
+{
+#ifdef _WIN32
+   return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+   return errno == EWOULDBLOCK || errno == EAGAIN || errno == EINTR;
+#endif
+}
+
+//
+// ServerSend
+//
+// Sends as much of a connection's queued output as the socket will take
+// without waiting. Returns false if the connection failed, or if it's done
+// and should be closed.
+//
+bool ServerSend(client_t *cl)
+{
+   while(cl->outpos < cl->out.len)
+   {
+      int n = send(cl->sock, cl->out.buf + cl->outpos, 
+                   (int)(cl->out.len - cl->outpos), 0);
+
+      if(n < 0 && ServerWouldBlock())
+         return true;
+      if(n <= 0)
+         return false;
+
+      cl->active  = time(NULL);
+      cl->outpos += n;
+   }
+
+   cl->out.len = cl->outpos = 0;
+
+   return !cl->closing;
+}
+
+//
+// ServerKeepAlive
+//
+// Decides if a connection stays open after a request, from the HTTP version
+// and any Connection header.
+//
+bool ServerKeepAlive(const char *request)
+{
+   char line[256];
+   const char *p = request;
+   size_t len = strcspn(request, "\r");
+   bool keepalive = len >= 8 && !strncmp(request + len - 8, "HTTP/1.1", 8);
+
+   while((p = strstr(p, "\r\n")) != NULL)
+   {
+      int i;
+
+      p += 2;
+      for(i = 0; i < (int)sizeof(line) - 1 && p[i] && p[i] != '\r'; ++i)
+         line[i] = tolower(p[i]);
+      line[i] = '\0';
+
+      if(!strncmp(line, "connection:", 11))
+      {
+         if(strstr(line, "close"))
+            keepalive = false;
+         else if(strstr(line, "keep-alive"))
+            keepalive = true;
+      }
+   }
+
+   return keepalive;
+}
+
+//
+// ServerHandleRequest
+//
+// Answers one complete request, queueing the response. Returns false if the
+// connection should be closed once it's sent.
+//
+bool ServerHandleRequest(client_t *cl, char *request)
+{
+   char method[8], path[256], header[160];
+   char *args;
+   strbuf_t scratch, *body;
+   int status;
+   bool keepalive = ServerKeepAlive(request);
+   METRIC_TIMER(t)
+
+   ArenaReset(&serverarena);
+   SB_InitArena(&scratch, &serverarena);
+
+   if(sscanf(request, "%7s %255s", method, path) != 2)
+   {
+      // nothing after this can be trusted to line up with a request
+      SB_Printf(&scratch, "{\"error\":\"malformed request line\"}");
+      body      = &scratch;
+      status    = 400;
+      keepalive = false;
+      path[0]   = '\0';
+   }
+   else if(strcmp(method, "GET"))
+   {
+      SB_Printf(&scratch, "{\"error\":\"only GET is supported\"}");
+      body   = &scratch;
+      status = 405;
+   }
+   else
+   {
+      // split off any query string
+      if((args = strchr(path, '?')) != NULL)
+         *args++ = '\0';
+
+      METRIC_START(t)
+      status = ServerRoute(path, args, &scratch, &body);
+      METRIC_STOP(METRIC_RENDER, t)
+   }
+
+   sprintf(header, 
+           "HTTP/1.1 %d %s\r\n"
+           "Content-Type: %s\r\n"
+           "Content-Length: %lu\r\n"
+           "Connection: %s\r\n\r\n",
+           status, status == 200 ? "OK" : 
+                   status == 400 ? "Bad Request" :
+                   status == 404 ? "Not Found" : "Method Not Allowed",
+           strcmp(path, "/metrics") ? "application/json" : 
+                                      "text/plain; version=0.0.4",
+           (unsigned long)body->len, keepalive ? "keep-alive" : "close");
+
+   SB_Append(&cl->out, header, strlen(header));
+   SB_Append(&cl->out, body->buf, body->len);
+
+   SB_Free(&scratch);
+
+   return keepalive;
+}
+
+//
+// ServerReadClient
+//
+// Reads what's waiting on a connection, answers any complete requests in it
+// and starts sending the responses. Returns false if the connection should
+// be closed.
+//
+bool ServerReadClient(client_t *cl)
+{
+   char *end;
+   int n = recv(cl->sock, cl->buf + cl->len, CLIENTBUFSIZE - 1 - cl->len, 0);
+
+   if(n < 0 && ServerWouldBlock())
+      return true;
+   if(n <= 0)
+      return false;
+
+   cl->active = time(NULL);
+   cl->len += n;
+   cl->buf[cl->len] = '\0';
+
+   // handle every complete request in the buffer (pipelining)
+   while(!cl->closing && (end = strstr(cl->buf, "\r\n\r\n")) != NULL)
+   {
+      int reqlen = (int)(end - cl->buf) + 4;
+
+      *end = '\0';
+      if(!ServerHandleRequest(cl, cl->buf))
+         cl->closing = true;
+
+      memmove(cl->buf, cl->buf + reqlen, cl->len - reqlen + 1);
+      cl->len -= reqlen;
+   }
+
+   // a request too large for the buffer isn't one of ours
+   if(cl->len >= CLIENTBUFSIZE - 1)
+      return false;
+
+   if(!cl->out.len)
+      return !cl->closing;
+
+   return ServerSend(cl);
+}
+
+//
+// ServerCloseClient
+//
+void ServerCloseClient(client_t *cl)
+{
+   CLOSESOCKET(cl->sock);
+   cl->sock = INVALID_SOCKET;
+   SB_Free(&cl->out);
+}
+
+//
+// RunServer
+//
+// Serves requests on localhost until killed.
+//
+void RunServer(int port)
+{
+   SOCKET listener;
+   struct sockaddr_in addr;
+   int i, on = 1;
+
+#ifdef _WIN32
+   WSADATA wsadata;
+
+   if(WSAStartup(MAKEWORD(1, 1), &wsadata))
+      SaveFileError("Error: couldn't start Winsock\n");
+#else
+   // a client hanging up mid-response is an error on its socket, not a
+   // reason to stop serving
+   signal(SIGPIPE, SIG_IGN);
+#endif
+
+   if((listener = socket(AF_INET, SOCK_STREAM, 0)) == INVALID_SOCKET)
+      SaveFileError("Error: couldn't create socket\n");
+
+   setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (char *)&on, sizeof(on));
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family      = AF_INET;
+   addr.sin_port        = htons((unsigned short)port);
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+   if(bind(listener, (struct sockaddr *)&addr, sizeof(addr)) ||
+      listen(listener, 64))
+      SaveFileError("Error: couldn't listen on port %d\n", port);
+
+   ServerSetNonBlocking(listener);
+
+   for(i = 0; i < MAXCLIENTS; ++i)
+   {
+      clients[i].sock = INVALID_SOCKET;
+      SB_Init(&clients[i].out);
+   }
+
+   ArenaInit(&serverarena, "server", SERVERARENASIZE);
+
+   printf("Serving on http://127.0.0.1:%d/\n", port);
+   fflush(stdout);
+
+   for(;;)
+   {
+      fd_set readfds, writefds;
+      SOCKET maxsock = listener;
+      struct timeval timeout;
+      time_t now = time(NULL);
+
+      FD_ZERO(&readfds);
+      FD_ZERO(&writefds);
+      FD_SET(listener, &readfds);
+
+      for(i = 0; i < MAXCLIENTS; ++i)
+      {
+         if(clients[i].sock == INVALID_SOCKET)
+            continue;
+
+         if(now - clients[i].active >= SERVER_IDLETIME)
+         {
+            ServerCloseClient(&clients[i]);
+            continue;
+         }
+
+         // no more requests are read from a client until it has taken the
+         // responses it already has
+         if(clients[i].out.len)
+            FD_SET(clients[i].sock, &writefds);
+         else
+            FD_SET(clients[i].sock, &readfds);
+         if(clients[i].sock > maxsock)
+            maxsock = clients[i].sock;
+      }
+
+      // wake up once a second to look for idle connections
+      timeout.tv_sec  = 1;
+      timeout.tv_usec = 0;
+
+      if(select((int)maxsock + 1, &readfds, &writefds, NULL, &timeout) <= 0)
+         continue;
+
+      if(FD_ISSET(listener, &readfds))
+      {
+         SOCKET sock = accept(listener, NULL, NULL);
+
+         if(sock != INVALID_SOCKET)
+         {
+            ServerSetNonBlocking(sock);
+
+            for(i = 0; i < MAXCLIENTS; ++i)
+            {
+               if(clients[i].sock == INVALID_SOCKET)
+               {
+                  clients[i].sock    = sock;
+                  clients[i].len     = 0;
+                  clients[i].outpos  = 0;
+                  clients[i].closing = false;
+                  clients[i].active  = time(NULL);
+                  break;
+               }
+            }
+
+            // full up; turn it away
+            if(i == MAXCLIENTS)
+               CLOSESOCKET(sock);
+         }
+      }
+
+      for(i = 0; i < MAXCLIENTS; ++i)
+      {
+         client_t *cl = &clients[i];
+
+         if(cl->sock == INVALID_SOCKET)
+            continue;
+
+         if(FD_ISSET(cl->sock, &writefds) && !ServerSend(cl))
+            ServerCloseClient(cl);
+         else if(FD_ISSET(cl->sock, &readfds) && !ServerReadClient(cl))
+            ServerCloseClient(cl);
+      }
+   }
+}
+
+//
+// PathJoin
+//
+// Puts a directory and a file name together with a slash between them.
+// Returns false, leaving out alone, if they won't fit in outlen characters.
+//
+bool PathJoin(char *out, size_t outlen, const char *dir, const char *name)
+{
+   size_t dirlen = strlen(dir), namelen = strlen(name);
+
+   if(dirlen + namelen + 2 > outlen)
+      return false;
+
+   memcpy(out, dir, dirlen);
+   out[dirlen] = '/';
+   memcpy(out + dirlen + 1, name, namelen + 1);
+
+   return true;
+}
+
+//
+// Watch Mode
+//
+// Keeps an eye on save RAM files that an emulator is writing to and prints
+// one line of JSON for every file slot whose data changes. The last data seen
+// for every slot is kept, so only the slots which actually changed are
+// decoded again. Directories can be given as well as files; every .sav file
+// in them is watched, including new ones. Files are watched through their
+// directories, so emulators that write a temporary file and rename it over
+// the old one are followed too. On Linux, inotify reports when a writer
+// closes a file or one is renamed into place; elsewhere the files' sizes
+// and modification times are polled. Either way, bursts of changes to one
+// file are collapsed into one update.
+//
+//   savtest -watch <files or directories...>
+//
+
+#if defined(__linux__) && !defined(NO_INOTIFY)
+#define WATCH_INOTIFY
+#endif
+
+#define WATCH_DEBOUNCE_MS 2   // quiet time before a changed file is read
+#define WATCH_POLL_MS     50  // polling interval without inotify
+#define WATCH_MAXPATH     1024
+
+// memory for the output of one update
+#define WATCHARENASIZE    (64 * 1024)
+
+// how often memory stats go to stderr, and metrics to --stats
+#define WATCH_STATS_UPDATES 10000
+
+typedef struct watchdir_s
+{
+   char *path;
+   bool  all;                           // every .sav in it, not just some
+   int   wd;                            // inotify watch descriptor, or -1
+} watchdir_t;
+
+typedef struct watchimage_s
+{
+   char       *path;
+   const char *name;                    // file name part of path
+   int         dir;                     // index into watchdirs
+   bool        loaded;                  // files[] holds data from this path
+   bool        pending;                 // changed; waiting to be read
+   long        mtime;                   // for polling
+   long        size;
+   savefile_t  files[NUMSAVEFILES];     // last data seen, decoded
+} watchimage_t;
+
+watchdir_t    *watchdirs;
+int            numwatchdirs, allocwatchdirs;
+
+watchimage_t **watchimages;
+int            numwatchimages, allocwatchimages;
+
+arena_t watcharena;
+
+//
+// WatchSleep
+//
+void WatchSleep(int ms)
+{
+#ifdef _WIN32
+   Sleep(ms);
+#else
+   usleep(ms * 1000);
+#endif
+}
+
+//
+// WatchStat
+//
+// Gets the size and modification time of a file. Returns false if it can't.
+//
+bool WatchStat(const char *path, long *mtime, long *size)
+{
+   struct stat st;
+
+   if(stat(path, &st))
+      return false;
+
+   *mtime = (long)st.st_mtime;
+   *size  = (long)st.st_size;
+
+   return true;
+}
+
+//
+// WatchIsSaveName
+//
+// Returns true if a file name ends in .sav, in any case.
+//
+bool WatchIsSaveName(const char *name)
+{
+   size_t len = strlen(name);
+   const char *ext = name + len - 4;
+
+   return len > 4 && ext[0] == '.' && tolower(ext[1]) == 's' &&
+          tolower(ext[2]) == 'a' && tolower(ext[3]) == 'v';
+}
+
+//
+// WatchAddDir
+//
+// Adds a directory to watch, if it isn't already, and returns its index.
+// With "all", every save RAM file in it is watched, including ones that
+// turn up later.
+//
+int WatchAddDir(const char *path, bool all)
+{
+   watchdir_t *wd;
+   int i;
+
+   for(i = 0; i < numwatchdirs; ++i)
+   {
+      if(!strcmp(watchdirs[i].path, path))
+      {
+         watchdirs[i].all |= all;
+         return i;
+      }
+   }
+
+   if(numwatchdirs == allocwatchdirs)
+   {
+      int newalloc = allocwatchdirs ? allocwatchdirs * 2 : 8;
+
+      watchdirs = MemRealloc(watchdirs, allocwatchdirs * sizeof(watchdir_t),
+                             newalloc * sizeof(watchdir_t));
+      allocwatchdirs = newalloc;
+   }
+
+   wd = &watchdirs[numwatchdirs];
+   wd->path = MemAlloc(strlen(path) + 1);
+   strcpy(wd->path, path);
+   wd->all = all;
+   wd->wd  = -1;
+
+   return numwatchdirs++;
+}
+
+//
+// WatchFindImage
+//
+// Looks for a watched file by its directory and name.
+//
+watchimage_t *WatchFindImage(int dir, const char *name)
+{
+   int i;
+
+   for(i = 0; i < numwatchimages; ++i)
+   {
+      if(watchimages[i]->dir == dir && !strcmp(watchimages[i]->name, name))
+         return watchimages[i];
+   }
+
+   return NULL;
+}
+
+//
+// WatchAddImage
+//
+// Starts watching a file in one of the watched directories. It's marked as
+// changed, so it's read at the next chance.
+//
+watchimage_t *WatchAddImage(int dir, const char *path)
+{
+   watchimage_t *wi;
+   const char *p;
+
+   if(numwatchimages == allocwatchimages)
+   {
+      int newalloc = allocwatchimages ? allocwatchimages * 2 : 16;
+
+      watchimages = MemRealloc(watchimages, 
+                               allocwatchimages * sizeof(watchimage_t *),
+                               newalloc * sizeof(watchimage_t *));
+      allocwatchimages = newalloc;
+   }
+
+   wi = MemAlloc(sizeof(watchimage_t));
+   memset(wi, 0, sizeof(watchimage_t));
+
+   wi->path = MemAlloc(strlen(path) + 1);
+   strcpy(wi->path, path);
+   for(wi->name = p = wi->path; *p; ++p)
+   {
+      if(*p == '/' || *p == '\\')
+         wi->name = p + 1;
+   }
+
+   wi->dir     = dir;
+   wi->pending = true;
+   WatchStat(wi->path, &wi->mtime, &wi->size);
+
+   watchimages[numwatchimages++] = wi;
+
+   return wi;
+}
+
+//
+// WatchAddName
+//
+// Starts watching a file that has turned up in a directory, if it's a save
+// RAM file and the directory is being watched as a whole. Returns NULL if
+// it isn't wanted.
+//
+watchimage_t *WatchAddName(int dir, const char *name)
+{
+   char path[WATCH_MAXPATH];
+
+   if(!watchdirs[dir].all || !WatchIsSaveName(name))
+      return NULL;
+
+   if(!PathJoin(path, sizeof(path), watchdirs[dir].path, name))
+   {
+      fprintf(stderr, "Warning: path to %s is too long\n", name);
+      return NULL;
+   }
+
+   return WatchAddImage(dir, path);
+}
+
+//
+// WatchScanDir
+//
+// Picks up any save RAM files in a directory that aren't being watched yet.
+//
+void WatchScanDir(int dir)
+{
+#ifdef _WIN32
+   char pattern[WATCH_MAXPATH];
+   WIN32_FIND_DATA fd;
+   HANDLE h;
+
+   if(strlen(watchdirs[dir].path) + 7 > sizeof(pattern))
+      return;
+
+   sprintf(pattern, "%s\\*.sav", watchdirs[dir].path);
+
+   if((h = FindFirstFile(pattern, &fd)) == INVALID_HANDLE_VALUE)
+      return;
+
+   do
+   {
+      if(!WatchFindImage(dir, fd.cFileName))
+         WatchAddName(dir, fd.cFileName);
+   }
+   while(FindNextFile(h, &fd));
+
+   FindClose(h);
+#else
+   DIR *d;
+   struct dirent *de;
+
+   if(!(d = opendir(watchdirs[dir].path)))
+      return;
+
+   while((de = readdir(d)) != NULL)
+   {
+      if(!WatchFindImage(dir, de->d_name))
+         WatchAddName(dir, de->d_name);
+   }
+
+   closedir(d);
+#endif
+}
+
+//
+// WatchEmit
+//
+// Prints the NDJSON record for one file slot.
+//
+void WatchEmit(watchimage_t *wi, int filenum, strbuf_t *sb)
+{
+   savefile_t *sf = &wi->files[filenum];
+   static const int views[] = 
+   { 
+      JSON_STATS, JSON_EQUIP, JSON_RELICS, JSON_CHECKSUM, JSON_COMPLETION 
+   };
+   int i;
+   METRIC_TIMER(t)
+
+   METRIC_START(t)
+   sb->len = 0;
+   SB_Printf(sb, "{\"path\":");
+   SB_JSONString(sb, wi->path);
+   SB_Printf(sb, ",\"file\":%d,\"exists\":%s,\"hash\":\"%08x\"", 
+             filenum + 1, sf->exists ? "true" : "false", SaveFileHash(sf));
+
+   if(sf->exists)
+   {
+      for(i = 0; i < (int)(sizeof(views) / sizeof(int)); ++i)
+      {
+         SB_Printf(sb, ",\"%s\":", jsonviewnames[views[i]]);
+         jsonviews[views[i]](sb, sf);
+      }
+   }
+
+   SB_Printf(sb, "}\n");
+   METRIC_STOP(METRIC_RENDER, t)
+
+   fwrite(sb->buf, 1, sb->len, stdout);
+}
+
+//
+// WatchUpdate
+//
+// Reads a changed image, decodes the slots whose data is different from last
+// time, and prints them.
+//
+void WatchUpdate(watchimage_t *wi)
+{
+   static unsigned long updates;
+   saveformat_t *fmt;
+   strbuf_t sb;
+   const byte *image;
+   FILE *f;
+   size_t c, offset;
+   bool truncated;
+   unsigned int changed = 0;
+   int i;
+   METRIC_TIMER(t)
+
+   wi->pending = false;
+
+   if(!(f = fopen(wi->path, "rb")))
+   {
+      METRIC_ERROR(METRIC_ERR_OPEN)
+      fprintf(stderr, "Warning: couldn't open %s\n", wi->path);
+      return;
+   }
+
+   c = ReadContainer(f, &truncated);
+   fclose(f);
+
+   if(!(fmt = LocateSaveRAM(containerbuf, c, &offset)))
+   {
+      METRIC_ERROR(METRIC_ERR_FORMAT)
+      fprintf(stderr, "Warning: %s is not a valid save RAM file\n", 
+              wi->path);
+      return;
+   }
+
+   image = containerbuf + offset;
+
+   // the header is needed to check the slots' game modes
+   METRIC_START(t)
+   memcpy(fileheader, image, fmt->headersize);
+   fmt->readheader();
+   METRIC_STOP(METRIC_HEADER, t)
+
+   for(i = 0; i < fmt->numslots; ++i)
+   {
+      savefile_t *sf = &wi->files[i];
+      const byte *data = image + fmt->slotoffsets[i];
+
+      if(wi->loaded && !memcmp(sf->data, data, fmt->slotsize))
+         continue;
+
+      memcpy(sf->data, data, fmt->slotsize);
+      changed |= 1u << i;
+   }
+
+   DecodeSaveSlots(fmt, wi->files, changed);
+
+   ArenaReset(&watcharena);
+   SB_InitArena(&sb, &watcharena);
+
+   for(i = 0; i < fmt->numslots; ++i)
+   {
+      if(changed & (1u << i))
+         WatchEmit(wi, i, &sb);
+   }
+
+   if(!(++updates % WATCH_STATS_UPDATES))
+   {
+      sb.len = 0;
+      SB_JSONMemStats(&sb, &watcharena);
+      fprintf(stderr, "%s\n", sb.buf);
+#ifdef SAVTEST_METRICS
+      WriteMetrics();
+#endif
+   }
+
+   SB_Free(&sb);
+
+   wi->loaded = true;
+   fflush(stdout);
+}
+
+#ifdef WATCH_INOTIFY
+
+//
+// WatchEvent
+//
+// Handles one inotify event. Returns true if a file is now waiting to be
+// read.
+//
+bool WatchEvent(int fd, struct inotify_event *ev)
+{
+   watchimage_t *wi;
+   int i, dir;
+
+   // events were dropped; anything might have changed
+   if(ev->mask & IN_Q_OVERFLOW)
+   {
+      for(i = 0; i < numwatchdirs; ++i)
+      {
+         if(watchdirs[i].wd >= 0 && watchdirs[i].all)
+            WatchScanDir(i);
+      }
+      for(i = 0; i < numwatchimages; ++i)
+         watchimages[i]->pending = true;
+      return numwatchimages > 0;
+   }
+
+   for(dir = 0; dir < numwatchdirs; ++dir)
+   {
+      if(watchdirs[dir].wd == ev->wd)
+         break;
+   }
+
+   if(dir == numwatchdirs)
+      return false;
+
+   // a directory that's moved away is dropped too, since its path no
+   // longer leads to it
+   if(ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+      inotify_rm_watch(fd, ev->wd);
+
+   if(ev->mask & IN_IGNORED)
+   {
+      fprintf(stderr, "Warning: %s has gone; no longer watching it\n",
+              watchdirs[dir].path);
+      watchdirs[dir].wd = -1;
+
+      for(i = 0; i < numwatchdirs; ++i)
+      {
+         if(watchdirs[i].wd >= 0)
+            return false;
+      }
+      SaveFileError("Error: nothing left to watch\n");
+   }
+
+   if(!ev->len || !(ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)))
+      return false;
+
+   if(!(wi = WatchFindImage(dir, ev->name)) && 
+      !(wi = WatchAddName(dir, ev->name)))
+      return false;
+
+   wi->pending = true;
+   return true;
+}
+
+//
+// WatchLoop
+//
+// inotify version: waits for writers to close files in the directories, or
+// for finished files to be renamed into them.
+//
+void WatchLoop(void)
+{
+   char buf[4096];
+   int fd, i, n;
+   struct pollfd pfd;
+
+   if((fd = inotify_init()) < 0)
+      SaveFileError("Error: couldn't initialize inotify\n");
+
+   for(i = 0; i < numwatchdirs; ++i)
+   {
+      watchdirs[i].wd = inotify_add_watch(fd, watchdirs[i].path, 
+                                          IN_CLOSE_WRITE | IN_MOVED_TO | 
+                                          IN_DELETE_SELF | IN_MOVE_SELF);
+
+      if(watchdirs[i].wd < 0)
+         SaveFileError("Error: couldn't watch %s\n", watchdirs[i].path);
+   }
+
+   pfd.fd     = fd;
+   pfd.events = POLLIN;
+
+   for(;;)
+   {
+      bool any = false;
+
+      // block for the first event, then keep collecting until things are
+      // quiet for the debounce period
+      while(poll(&pfd, 1, any ? WATCH_DEBOUNCE_MS : -1) > 0)
+      {
+         char *p;
+
+         if((n = read(fd, buf, sizeof(buf))) <= 0)
+            break;
+
+         for(p = buf; p < buf + n; 
+             p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len)
+         {
+            if(WatchEvent(fd, (struct inotify_event *)p))
+               any = true;
+         }
+      }
+
+      for(i = 0; i < numwatchimages; ++i)
+      {
+         if(watchimages[i]->pending)
+            WatchUpdate(watchimages[i]);
+      }
+   }
+}
+
+#else
+
+//
+// WatchLoop
+//
+// Polling version: a file is read once its size and time stop changing.
+// Directories watched as a whole are looked through for new files each
+// time.
+//
+void WatchLoop(void)
+{
+   int i;
+
+   for(;;)
+   {
+      WatchSleep(WATCH_POLL_MS);
+
+      for(i = 0; i < numwatchdirs; ++i)
+      {
+         if(watchdirs[i].all)
+            WatchScanDir(i);
+      }
+
+      for(i = 0; i < numwatchimages; ++i)
+      {
+         watchimage_t *wi = watchimages[i];
+         long mtime, size;
+
+         if(!WatchStat(wi->path, &mtime, &size))
+            continue;
+
+         if(mtime != wi->mtime || size != wi->size)
+         {
+            // still changing; look again next time
+            wi->mtime   = mtime;
+            wi->size    = size;
+            wi->pending = true;
+         }
+         else if(wi->pending)
+            WatchUpdate(wi);
+      }
+   }
+}
+
+#endif
+
+//
+// RunWatch
+//
+// Prints every slot of each file once, then reports changes until killed.
+// Directories are watched for any save RAM file in them. A file is watched
+// through its directory, so that it's still seen after being replaced by
+// a rename.
+//
+void RunWatch(int numpaths, char **paths)
+{
+   char dir[WATCH_MAXPATH];
+   struct stat st;
+   int i;
+
+   ArenaInit(&watcharena, "watch", WATCHARENASIZE);
+
+   for(i = 0; i < numpaths; ++i)
+   {
+      const char *p, *sep = NULL;
+
+      if(!stat(paths[i], &st) && (st.st_mode & S_IFMT) == S_IFDIR)
+      {
+         WatchAddDir(paths[i], true);
+         continue;
+      }
+
+      for(p = paths[i]; *p; ++p)
+      {
+         if(*p == '/' || *p == '\\')
+            sep = p;
+      }
+
+      if(!sep)
+         strcpy(dir, ".");
+      else if(sep - paths[i] < (int)sizeof(dir))
+      {
+         // keep the separator if it's the root
+         memcpy(dir, paths[i], sep - paths[i] + (sep == paths[i]));
+         dir[sep - paths[i] + (sep == paths[i])] = '\0';
+      }
+      else
+         SaveFileError("Error: path to %s is too long\n", paths[i]);
+
+      WatchAddImage(WatchAddDir(dir, false), paths[i]);
+   }
+
+   for(i = 0; i < numwatchdirs; ++i)
+   {
+      if(watchdirs[i].all)
+         WatchScanDir(i);
+   }
+
+   for(i = 0; i < numwatchimages; ++i)
+      WatchUpdate(watchimages[i]);
+
+   WatchLoop();
+}
+
+//
+// Sanitizer
+//
+// Scrubs the player names out of save RAM so it can be handed to other
+// people. Each name is replaced by letters made from a keyed hash of it, so
+// the same name always turns into the same made-up one under the same key,
+// files from one player still go together, and without the key there's no
+// way back. Times can also be moved by up to a given number of seconds.
+//
+// The keyed hash is SipHash-2-4 with a 128-bit key, worked out from the
+// --key text. Names are short, so the key is the only thing standing
+// between a sanitized file and a table of every possible name; it should be
+// long and random, not a word.
+//
+// Only the bytes that change are rewritten, and the checksum is adjusted by
+// the difference instead of being summed again, so a file whose checksum
+// was good stays good (and one that was bad stays bad).
+//
+
+#define SANITIZE_MAXPATH 1024
+#define SANITIZE_MINKEY  16   // shortest --key that isn't warned about
+
+//
+// DataHash
+//
+// FNV-1a over some data. It isn't keyed; it's for telling contents apart.
+//
+unsigned int DataHash(const byte *data, int len)
+{
+   unsigned int h = 2166136261u;
+   int i;
+
+   for(i = 0; i < len; ++i)
+      h = (h ^ data[i]) * 16777619u;
+
+   return h ? h : 1;
+}
+
+// SipHash works on 64-bit words, which C89 doesn't have, so they're kept
+// as two 32-bit halves
+typedef struct sipword_s
+{
+   unsigned int hi, lo;
+} sipword_t;
+
+typedef struct sipkey_s
+{
+   sipword_t k0, k1;
+} sipkey_t;
+
+#define SIP_ADD(a, b) \
+   ((a).lo += (b).lo, (a).hi += (b).hi + ((a).lo < (b).lo))
+#define SIP_XOR(a, b) \
+   ((a).hi ^= (b).hi, (a).lo ^= (b).lo)
+
+//
+// SipRotate
+//
+// Rotates a 64-bit word left by 1 to 63 bits.
+//
+sipword_t SipRotate(sipword_t w, int n)
+{
+   sipword_t r;
+
+   if(n >= 32)
+   {
+      unsigned int t = w.hi;
+
+      w.hi = w.lo;
+      w.lo = t;
+      n -= 32;
+   }
+
+   if(!n)
+      return w;
+
+   r.hi = (w.hi << n) | (w.lo >> (32 - n));
+   r.lo = (w.lo << n) | (w.hi >> (32 - n));
+
+   return r;
+}
+
+//
+// SipRounds
+//
+void SipRounds(sipword_t *v, int rounds)
+{
+   while(rounds--)
+   {
+      SIP_ADD(v[0], v[1]); v[1] = SipRotate(v[1], 13); SIP_XOR(v[1], v[0]);
+      v[0] = SipRotate(v[0], 32);
+      SIP_ADD(v[2], v[3]); v[3] = SipRotate(v[3], 16); SIP_XOR(v[3], v[2]);
+      SIP_ADD(v[0], v[3]); v[3] = SipRotate(v[3], 21); SIP_XOR(v[3], v[0]);
+      SIP_ADD(v[2], v[1]); v[1] = SipRotate(v[1], 17); SIP_XOR(v[1], v[2]);
+      v[2] = SipRotate(v[2], 32);
+   }
+}
+
+//
+// SipLoad
+//
+// Reads up to 8 bytes as a little-endian 64-bit word.
+//
+sipword_t SipLoad(const byte *p, int len)
+{
+   sipword_t m;
+   int i;
+
+   m.hi = m.lo = 0;
+
+   for(i = 0; i < len; ++i)
+   {
+      if(i < 4)
+         m.lo |= (unsigned int)p[i] << (8 * i);
+      else
+         m.hi |= (unsigned int)p[i] << (8 * (i - 4));
+   }
+
+   return m;
+}
+
+//
+// SipHash
+//
+// SipHash-2-4 of some data under a 128-bit key.
+//
+sipword_t SipHash(const sipkey_t *key, const byte *data, int len)
+{
+   sipword_t v[4], m;
+   int i;
+
+   v[0].hi = 0x736f6d65u; v[0].lo = 0x70736575u;
+   v[1].hi = 0x646f7261u; v[1].lo = 0x6e646f6du;
+   v[2].hi = 0x6c796765u; v[2].lo = 0x6e657261u;
+   v[3].hi = 0x74656462u; v[3].lo = 0x79746573u;
+
+   SIP_XOR(v[0], key->k0);
+   SIP_XOR(v[1], key->k1);
+   SIP_XOR(v[2], key->k0);
+   SIP_XOR(v[3], key->k1);
+
+   for(i = 0; i + 8 <= len; i += 8)
+   {
+      m = SipLoad(data + i, 8);
+      SIP_XOR(v[3], m);
+      SipRounds(v, 2);
+      SIP_XOR(v[0], m);
+   }
+
+   // the last block holds what's left and the length in its top byte
+   m = SipLoad(data + i, len - i);
+   m.hi |= (unsigned int)(len & 0xff) << 24;
+   SIP_XOR(v[3], m);
+   SipRounds(v, 2);
+   SIP_XOR(v[0], m);
+
+   v[2].lo ^= 0xff;
+   SipRounds(v, 4);
+
+   SIP_XOR(v[0], v[1]);
+   SIP_XOR(v[2], v[3]);
+   SIP_XOR(v[0], v[2]);
+
+   return v[0];
+}
+
+//
+// SanitizeKey
+//
+// Works out a 128-bit SipHash key from the text given with --key, by
+// hashing it under a fixed key once for each half.
+//
+void SanitizeKey(const char *text, sipkey_t *key)
+{
+   static const sipkey_t fixed = 
+   {
+      { 0x73617674u, 0x65737420u }, { 0x73616e69u, 0x74697a65u }
+   };
+   byte buf[256];
+   int len = (int)strlen(text);
+
+   if(len > (int)sizeof(buf) - 1)
+      len = (int)sizeof(buf) - 1;
+
+   memcpy(buf + 1, text, len);
+
+   buf[0] = 0;
+   key->k0 = SipHash(&fixed, buf, len + 1);
+   buf[0] = 1;
+   key->k1 = SipHash(&fixed, buf, len + 1);
+}
+
+//
+// SaveFilePatch
+//
+// Overwrites some of a file's bytes, adjusting its stored checksum to match.
+//
+void SaveFilePatch(savefile_t *sf, unsigned int offset, const byte *bytes, 
+                   int len)
+{
+   byte checksum = sf->data[OFFSET_CHECKSUM];
+   int i;
+
+   for(i = 0; i < len; ++i)
+   {
+      checksum += bytes[i] - sf->data[offset + i];
+      sf->data[offset + i] = bytes[i];
+   }
+
+   sf->data[OFFSET_CHECKSUM] = checksum;
+}
+
+//
+// SanitizeSaveFile
+//
+// Replaces a file's name and jitters its time. Returns false if it has no
+// name to replace.
+//
+bool SanitizeSaveFile(savefile_t *sf, const sipkey_t *key, long jitter)
+{
+   byte name[NAME_LENGTH], timebytes[4];
+   sipword_t hash;
+   unsigned int h;
+   long tics;
+   int i, len;
+
+   // keep the name's length; unused characters at the end are 0
+   for(len = NAME_LENGTH; len > 0 && !sf->data[OFFSET_NAME + len - 1]; --len)
+      ;
+
+   if(!len)
+      return false;
+
+   hash = SipHash(key, sf->data + OFFSET_NAME, NAME_LENGTH);
+   h = hash.lo ? hash.lo : 1;
+
+   // letters only, A - Z in the name font
+   for(i = 0; i < len; ++i)
+   {
+      h ^= h << 13;
+      h ^= h >> 17;
+      h ^= h << 5;
+      name[i] = (byte)(1 + h % 26);
+   }
+
+   SaveFilePatch(sf, OFFSET_NAME, name, len);
+
+   if(jitter > 0)
+   {
+      tics = SaveFileLong(sf, OFFSET_TIME) + 
+             ((long)(hash.hi % (unsigned long)(2 * jitter + 1)) - jitter) * 
+             60;
+      if(tics < 0)
+         tics = 0;
+
+      for(i = 0; i < 4; ++i)
+         timebytes[i] = (byte)((tics >> (8 * i)) & 0xff);
+
+      SaveFilePatch(sf, OFFSET_TIME, timebytes, 4);
+   }
+
+   return true;
+}
+
+//
+// SanitizeSaveRAM
+//
+// Sanitizes the save RAM that was last read, which is still in containerbuf,
+// and writes it out. If outdir is NULL the changed slots are written back
+// into the original file; otherwise the whole container is written to a
+// file of the same name in outdir. Returns false on failure.
+//
+bool SanitizeSaveRAM(const char *path, const sipkey_t *key, long jitter, 
+                     const char *outdir)
+{
+   char outpath[SANITIZE_MAXPATH];
+   const char *base;
+   unsigned int changed = 0;
+   int i, count = 0;
+   FILE *f;
+
+   if(container.truncated)
+   {
+      return SaveFileWarning("Error: %s is too big to rewrite\n", path);
+   }
+
+   for(i = 0; i < saveformat->numslots; ++i)
+   {
+      savefile_t *sf = &savefiles[i];
+
+      if(!SanitizeSaveFile(sf, key, jitter))
+         continue;
+
+      memcpy(containerbuf + container.offset + saveformat->slotoffsets[i],
+             sf->data, saveformat->slotsize);
+      changed |= 1u << i;
+      ++count;
+   }
+
+   if(outdir)
+   {
+      // write the whole container, wrapper and all, under the same name
+      base = path + strlen(path);
+      while(base > path && base[-1] != '/' && base[-1] != '\\')
+         --base;
+
+      if(!PathJoin(outpath, sizeof(outpath), outdir, base))
+         return SaveFileWarning("Error: output path is too long\n");
+
+      if(!(f = fopen(outpath, "wb")))
+         return SaveFileWarning("Error: couldn't create %s\n", outpath);
+
+      if(fwrite(containerbuf, 1, container.size, f) != container.size)
+      {
+         fclose(f);
+         return SaveFileWarning("Error: couldn't write %s\n", outpath);
+      }
+   }
+   else
+   {
+      // only the slots that changed go back into the file
+      if(!(f = fopen(path, "r+b")))
+         return SaveFileWarning("Error: couldn't open %s to write\n", path);
+
+      for(i = 0; i < saveformat->numslots; ++i)
+      {
+         long pos = (long)(container.offset + saveformat->slotoffsets[i]);
+
+         if(!(changed & (1u << i)))
+            continue;
+
+         if(fseek(f, pos, SEEK_SET) ||
+            fwrite(containerbuf + pos, 1, saveformat->slotsize, f) != 
+            (size_t)saveformat->slotsize)
+         {
+            fclose(f);
+            return SaveFileWarning("Error: couldn't write %s\n", path);
+         }
+      }
+   }
+
+   fclose(f);
+
+   printf("%s: %d file%s sanitized\n", outdir ? outpath : path, count, 
+          count == 1 ? "" : "s");
+
+   return true;
+}
+
+//
+// Name Index
+//
+// Finds files by player name without reading any save RAM. The nameindex
+// command reads a set of files once and writes every file's name to an
+// index file, sorted by the names' font codes, so that exact and prefix
+// lookups are a binary search. For names one typo away, the index also
+// holds every name with each one of its characters deleted (a "deletion
+// neighborhood"): two names are within one insertion, deletion, or
+// substitution of each other only if one of them, or one of their deletion
+// variants, equals the other or one of its deletion variants. Those are all
+// binary searches too, and the handful of candidates they turn up are
+// checked directly.
+//
+// savtest <files...> nameindex <index>
+// savtest -names <index> <name> [--prefix | --fuzzy]
+//
+
+#define NAMEINDEX_MAGIC     "CVNAMES1"
+#define NAMEINDEX_MAGIC_LEN 8
+#define NAMEINDEX_RECSIZE   (NAME_LENGTH + 5)
+#define NAMEINDEX_DELSIZE   (NAME_LENGTH + 4)
+
+typedef struct namerec_s
+{
+   byte         key[NAME_LENGTH]; // font codes, zero padded
+   unsigned int file;             // index into the paths
+   byte         slot;
+} namerec_t;
+
+typedef struct namedel_s
+{
+   byte         key[NAME_LENGTH]; // a name with one character deleted
+   unsigned int rec;              // which namerec_t it came from
+} namedel_t;
+
+typedef struct nameindex_s
+{
+   int           numpaths;
+   char        **paths;
+   unsigned int  numrecs;
+   namerec_t    *recs;     // sorted by key
+   unsigned int  numdels;
+   namedel_t    *dels;     // sorted by key
+   unsigned int  allocrecs;
+} nameindex_t;
+
+//
+// NameKeyLength
+//
+// Returns the length of a key without its padding.
+//
+int NameKeyLength(const byte *key)
+{
+   int len = NAME_LENGTH;
+
+   while(len > 0 && !key[len - 1])
+      --len;
+
+   return len;
+}
+
+//
+// NameDelete
+//
+// Makes the key with the character at pos deleted.
+//
+void NameDelete(const byte *key, int pos, byte *out)
+{
+   memcpy(out, key, pos);
+   memcpy(out + pos, key + pos + 1, NAME_LENGTH - 1 - pos);
+   out[NAME_LENGTH - 1] = 0;
+}
+
+//
+// NameWithinOne
+//
+// Returns true if two keys are at most one insertion, deletion, or
+// substitution apart.
+//
+bool NameWithinOne(const byte *a, const byte *b)
+{
+   int alen = NameKeyLength(a), blen = NameKeyLength(b);
+   int i = 0, j;
+
+   if(alen < blen)
+   {
+      const byte *t = a; a = b; b = t;
+      j = alen; alen = blen; blen = j;
+   }
+
+   if(alen - blen > 1)
+      return false;
+
+   // skip the common start
+   while(i < blen && a[i] == b[i])
+      ++i;
+
+   if(alen == blen)
+      return !memcmp(a + i + 1, b + i + 1, alen > i ? alen - i - 1 : 0);
+
+   // a has one extra character at i
+   return !memcmp(a + i + 1, b + i, blen - i);
+}
+
+//
+// NameRecCompare
+//
+int NameRecCompare(const void *a, const void *b)
+{
+   const namerec_t *ra = a, *rb = b;
+   int c = memcmp(ra->key, rb->key, NAME_LENGTH);
+
+   if(c)
+      return c;
+   if(ra->file != rb->file)
+      return ra->file < rb->file ? -1 : 1;
+   return ra->slot - rb->slot;
+}
+
+//
+// NameDelCompare
+//
+int NameDelCompare(const void *a, const void *b)
+{
+   const namedel_t *da = a, *db = b;
+   int c = memcmp(da->key, db->key, NAME_LENGTH);
+
+   if(c)
+      return c;
+   return da->rec < db->rec ? -1 : da->rec > db->rec;
+}
+
+//
+// NameIndexAdd
+//
+// Adds a file's name to an index that's being built.
+//
+void NameIndexAdd(nameindex_t *ni, savefile_t *sf, int file, int slot)
+{
+   namerec_t *rec;
+
+   if(ni->numrecs == ni->allocrecs)
+   {
+      unsigned int newalloc = ni->allocrecs ? ni->allocrecs * 2 : 1024;
+
+      ni->recs = MemRealloc(ni->recs, ni->allocrecs * sizeof(namerec_t),
+                            newalloc * sizeof(namerec_t));
+      ni->allocrecs = newalloc;
+   }
+
+   rec = &ni->recs[ni->numrecs++];
+   memcpy(rec->key, sf->data + OFFSET_NAME, NAME_LENGTH);
+   rec->file = file;
+   rec->slot = (byte)slot;
+}
+
+//
+// NameIndexFinish
+//
+// Sorts the names and builds the deletion neighborhood.
+//
+void NameIndexFinish(nameindex_t *ni)
+{
+   unsigned int r, n = 0;
+   int pos, len;
+
+   qsort(ni->recs, ni->numrecs, sizeof(namerec_t), NameRecCompare);
+
+   for(r = 0; r < ni->numrecs; ++r)
+      n += NameKeyLength(ni->recs[r].key);
+
+   ni->dels = MemAlloc((n ? n : 1) * sizeof(namedel_t));
+   ni->numdels = 0;
+
+   for(r = 0; r < ni->numrecs; ++r)
+   {
+      const byte *key = ni->recs[r].key;
+
+      len = NameKeyLength(key);
+      for(pos = 0; pos < len; ++pos)
+      {
+         // deleting either of a run of the same character is the same
+         if(pos > 0 && key[pos] == key[pos - 1])
+            continue;
+
+         NameDelete(key, pos, ni->dels[ni->numdels].key);
+         ni->dels[ni->numdels++].rec = r;
+      }
+   }
+
+   qsort(ni->dels, ni->numdels, sizeof(namedel_t), NameDelCompare);
+}
+
+//
+// NameIndexFree
+//
+void NameIndexFree(nameindex_t *ni)
+{
+   int i;
+
+   for(i = 0; i < ni->numpaths; ++i)
+      MemFree(ni->paths[i], strlen(ni->paths[i]) + 1);
+   MemFree(ni->paths, ni->numpaths * sizeof(char *));
+   MemFree(ni->recs, ni->allocrecs * sizeof(namerec_t));
+   MemFree(ni->dels, (ni->numdels ? ni->numdels : 1) * sizeof(namedel_t));
+   memset(ni, 0, sizeof(*ni));
+}
+
+//
+// File reading and writing. Numbers are little endian.
+//
+
+void NameIndexPutLong(FILE *f, unsigned int v)
+{
+   putc(v & 0xff, f);
+   putc((v >> 8) & 0xff, f);
+   putc((v >> 16) & 0xff, f);
+   putc((v >> 24) & 0xff, f);
+}
+
+unsigned int NameIndexGetLong(const byte *p)
+{
+   return p[0] | (p[1] << 8) | ((unsigned int)p[2] << 16) | 
+          ((unsigned int)p[3] << 24);
+}
+
+//
+// NameIndexWrite
+//
+bool NameIndexWrite(nameindex_t *ni, const char *path, int numpaths, 
+                    char **paths)
+{
+   unsigned int i;
+   FILE *f;
+
+   if(!(f = fopen(path, "wb")))
+      return SaveFileWarning("Error: couldn't create %s\n", path);
+
+   fwrite(NAMEINDEX_MAGIC, 1, NAMEINDEX_MAGIC_LEN, f);
+
+   NameIndexPutLong(f, numpaths);
+   for(i = 0; i < (unsigned int)numpaths; ++i)
+   {
+      NameIndexPutLong(f, (unsigned int)strlen(paths[i]));
+      fputs(paths[i], f);
+   }
+
+   NameIndexPutLong(f, ni->numrecs);
+   for(i = 0; i < ni->numrecs; ++i)
+   {
+      fwrite(ni->recs[i].key, 1, NAME_LENGTH, f);
+      NameIndexPutLong(f, ni->recs[i].file);
+      putc(ni->recs[i].slot, f);
+   }
+
+   NameIndexPutLong(f, ni->numdels);
+   for(i = 0; i < ni->numdels; ++i)
+   {
+      fwrite(ni->dels[i].key, 1, NAME_LENGTH, f);
+      NameIndexPutLong(f, ni->dels[i].rec);
+   }
+
+   if(ferror(f))
+   {
+      fclose(f);
+      return SaveFileWarning("Error: couldn't write %s\n", path);
+   }
+
+   fclose(f);
+
+   return true;
+}
+
+//
+// NameIndexRead
+//
+// Loads an index file. The whole file is read in one go and then unpacked.
+//
+bool NameIndexRead(nameindex_t *ni, const char *path)
+{
+   byte *buf, *p, *end;
+   long size;
+   unsigned int i, n;
+   bool ok = false;
+   FILE *f;
+
+   memset(ni, 0, sizeof(*ni));
+
+   if(!(f = fopen(path, "rb")))
+      return SaveFileWarning("Error: couldn't open %s\n", path);
+
+   fseek(f, 0, SEEK_END);
+   size = ftell(f);
+   fseek(f, 0, SEEK_SET);
+
+   if(size < NAMEINDEX_MAGIC_LEN + 12)
+   {
+      fclose(f);
+      return SaveFileWarning("Error: %s is not a name index\n", path);
+   }
+
+   buf = MemAlloc(size);
+   n = (unsigned int)fread(buf, 1, size, f);
+   fclose(f);
+
+   p   = buf + NAMEINDEX_MAGIC_LEN;
+   end = buf + n;
+
+   if(n != (unsigned int)size || memcmp(buf, NAMEINDEX_MAGIC, 
+                                        NAMEINDEX_MAGIC_LEN))
+      goto done;
+
+   // paths
+   n = NameIndexGetLong(p);
+   p += 4;
+   ni->paths = MemAlloc((n ? n : 1) * sizeof(char *));
+   for(i = 0; i < n; ++i)
+   {
+      unsigned int len;
+
+      if(end - p < 4 || (unsigned int)(end - p - 4) < (len = NameIndexGetLong(p)))
+         goto done;
+      p += 4;
+      ni->paths[i] = MemAlloc(len + 1);
+      memcpy(ni->paths[i], p, len);
+      ni->paths[i][len] = '\0';
+      ni->numpaths = i + 1;
+      p += len;
+   }
+
+   // names
+   if(end - p < 4)
+      goto done;
+   n = NameIndexGetLong(p);
+   p += 4;
+   if((unsigned int)(end - p) / NAMEINDEX_RECSIZE < n)
+      goto done;
+   ni->recs = MemAlloc((n ? n : 1) * sizeof(namerec_t));
+   ni->allocrecs = n ? n : 1;
+   for(i = 0; i < n; ++i, p += NAMEINDEX_RECSIZE)
+   {
+      memcpy(ni->recs[i].key, p, NAME_LENGTH);
+      ni->recs[i].file = NameIndexGetLong(p + NAME_LENGTH);
+      ni->recs[i].slot = p[NAME_LENGTH + 4];
+      if(ni->recs[i].file >= (unsigned int)ni->numpaths)
+         goto done;
+   }
+   ni->numrecs = n;
+
+   // deletion neighborhood
+   if(end - p < 4)
+      goto done;
+   n = NameIndexGetLong(p);
+   p += 4;
+   if((unsigned int)(end - p) / NAMEINDEX_DELSIZE < n)
+      goto done;
+   ni->dels = MemAlloc((n ? n : 1) * sizeof(namedel_t));
+   for(i = 0; i < n; ++i, p += NAMEINDEX_DELSIZE)
+   {
+      memcpy(ni->dels[i].key, p, NAME_LENGTH);
+      ni->dels[i].rec = NameIndexGetLong(p + NAME_LENGTH);
+      if(ni->dels[i].rec >= ni->numrecs)
+         goto done;
+   }
+   ni->numdels = n;
+
+   ok = true;
+
+done:
+   MemFree(buf, size);
+
+   if(!ok)
+   {
+      NameIndexFree(ni);
+      return SaveFileWarning("Error: %s is not a valid name index\n", path);
+   }
+
+   return true;
+}
+
+//
+// Lookups
+//
+
+//
+// NameFindRecs
+//
+// Returns the first name whose first len characters are at least key's.
+//
+unsigned int NameFindRecs(nameindex_t *ni, const byte *key, int len)
+{
+   unsigned int lo = 0, hi = ni->numrecs;
+
+   while(lo < hi)
+   {
+      unsigned int mid = lo + (hi - lo) / 2;
+
+      if(memcmp(ni->recs[mid].key, key, len) < 0)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+
+   return lo;
+}
+
+//
+// NameFindDels
+//
+// Returns the first deletion variant that's at least key.
+//
+unsigned int NameFindDels(nameindex_t *ni, const byte *key)
+{
+   unsigned int lo = 0, hi = ni->numdels;
+
+   while(lo < hi)
+   {
+      unsigned int mid = lo + (hi - lo) / 2;
+
+      if(memcmp(ni->dels[mid].key, key, NAME_LENGTH) < 0)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+
+   return lo;
+}
+
+//
+// NameMatches
+//
+// Collects the names matching a key into a list of record numbers. Returns
+// how many there are, which may be more than fit in the list.
+//
+
+enum
+{
+   NAMEMATCH_EXACT,
+   NAMEMATCH_PREFIX,
+   NAMEMATCH_FUZZY,
+};
+
+typedef struct namematches_s
+{
+   unsigned int *recs;
+   unsigned int  count;
+   unsigned int  alloc;
+} namematches_t;
+
+void NameMatchAdd(namematches_t *nm, unsigned int rec)
+{
+   if(nm->count == nm->alloc)
+   {
+      unsigned int newalloc = nm->alloc ? nm->alloc * 2 : 64;
+
+      nm->recs = MemRealloc(nm->recs, nm->alloc * sizeof(unsigned int),
+                            newalloc * sizeof(unsigned int));
+      nm->alloc = newalloc;
+   }
+
+   nm->recs[nm->count++] = rec;
+}
+
+//
+// NameMatchRecs
+//
+// Adds all the names equal to a key (or starting with it, for a prefix).
+//
+void NameMatchRecs(nameindex_t *ni, const byte *key, int len, 
+                   namematches_t *nm)
+{
+   unsigned int r;
+
+   for(r = NameFindRecs(ni, key, len); 
+       r < ni->numrecs && !memcmp(ni->recs[r].key, key, len); ++r)
+      NameMatchAdd(nm, r);
+}
+
+//
+// NameMatchDels
+//
+// Adds the names that have a deletion variant equal to key and are within
+// one edit of the query.
+//
+void NameMatchDels(nameindex_t *ni, const byte *key, const byte *query,
+                   namematches_t *nm)
+{
+   unsigned int d;
+
+   for(d = NameFindDels(ni, key); 
+       d < ni->numdels && !memcmp(ni->dels[d].key, key, NAME_LENGTH); ++d)
+   {
+      if(NameWithinOne(ni->recs[ni->dels[d].rec].key, query))
+         NameMatchAdd(nm, ni->dels[d].rec);
+   }
+}
+
+//
+// UIntCompare
+//
+int UIntCompare(const void *a, const void *b)
+{
+   unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+
+   return x < y ? -1 : x > y;
+}
+
+//
+// NameIndexLookup
+//
+// Finds the names that match a query, in index order with no repeats.
+//
+void NameIndexLookup(nameindex_t *ni, const byte *query, int mode,
+                     namematches_t *nm)
+{
+   byte del[NAME_LENGTH];
+   int pos, len = NameKeyLength(query);
+   unsigned int i, j;
+
+   nm->count = 0;
+
+   switch(mode)
+   {
+   case NAMEMATCH_EXACT:
+      NameMatchRecs(ni, query, NAME_LENGTH, nm);
+      return;
+   case NAMEMATCH_PREFIX:
+      NameMatchRecs(ni, query, len, nm);
+      return;
+   default:
+      break;
+   }
+
+   // exact, or the name has one more character than the query
+   NameMatchRecs(ni, query, NAME_LENGTH, nm);
+   NameMatchDels(ni, query, query, nm);
+
+   for(pos = 0; pos < len; ++pos)
+   {
+      NameDelete(query, pos, del);
+
+      // the name has one less character, or one that's different
+      NameMatchRecs(ni, del, NAME_LENGTH, nm);
+      NameMatchDels(ni, del, query, nm);
+   }
+
+   // the same name can turn up more than one way
+   qsort(nm->recs, nm->count, sizeof(unsigned int), UIntCompare);
+   for(i = j = 0; i < nm->count; ++i)
+   {
+      if(!j || nm->recs[i] != nm->recs[j - 1])
+         nm->recs[j++] = nm->recs[i];
+   }
+   nm->count = j;
+}
+
+//
+// RunNameLookup
+//
+// -names <index> <name> [--prefix | --fuzzy]
+//
+int RunNameLookup(const char *path, const char *name, const char *option)
+{
+   nameindex_t ni;
+   namematches_t nm;
+   byte query[NAME_LENGTH];
+   char text[NAME_TEXT_LENGTH + 1];
+   int mode = NAMEMATCH_EXACT;
+   unsigned int i;
+
+   if(option)
+   {
+      if(!strcmp(option, "--prefix"))
+         mode = NAMEMATCH_PREFIX;
+      else if(!strcmp(option, "--fuzzy"))
+         mode = NAMEMATCH_FUZZY;
+      else
+      {
+         SaveFileWarning("Error: unexpected argument \"%s\"\n", option);
+         return 1;
+      }
+   }
+
+   if(EncodeName(name, query) < 0)
+   {
+      SaveFileWarning("Error: \"%s\" can't be a name\n", name);
+      return 1;
+   }
+
+   if(!NameIndexRead(&ni, path))
+      return 1;
+
+   memset(&nm, 0, sizeof(nm));
+   NameIndexLookup(&ni, query, mode, &nm);
+
+   for(i = 0; i < nm.count; ++i)
+   {
+      namerec_t *rec = &ni.recs[nm.recs[i]];
+
+      DecodeName(rec->key, text);
+      printf("%s:%d %s\n", ni.paths[rec->file], rec->slot + 1, text);
+   }
+
+   fprintf(stderr, "%u matches\n", nm.count);
+
+   MemFree(nm.recs, nm.alloc * sizeof(unsigned int));
+   NameIndexFree(&ni);
+
+   return 0;
+}
+
+//
+// Near-Duplicate Clustering
+//
+// Finds files that are really the same game: saved again a little later, or
+// copied to another cartridge. Every file gets a 64-bit SimHash of what it
+// has: its name, inventory, relics, DSS cards and combinations, and
+// explored map. Files that differ in only a few features have signatures
+// that differ in only a few bits.
+//
+// Rather than compare every pair, the signatures are cut into 8 bands of 8
+// bits, and only files that have a whole band in common are compared. Two
+// signatures with no more than 7 differing bits must agree on at least one
+// band, so no close pair is missed. Pairs that are close enough are joined
+// with union-find, and each cluster is numbered after its first file.
+//
+// A couple of extra map rooms and items usually moves a signature by 10 bits
+// or less, while unrelated games are 13 or more apart, so the default is to
+// join anything within 7 bits.
+//
+// Within a band bucket each file is only compared with the CLUSTER_PROBES
+// files before it in signature order. A bucket bigger than that can miss a
+// close pair that is further apart in the bucket, if nothing in between
+// joins them; a warning says when that could have happened.
+//
+// savtest <files...> cluster [--maxdist N] [--table FILE]
+//
+// --table also writes each file's cluster to a tab-separated side table of
+// path, slot, cluster and cluster size, which can be joined to the sql and
+// columns exports on path and slot.
+//
+
+#define SIMHASH_WORDS   2
+#define SIMHASH_BITS    (SIMHASH_WORDS * 32)
+#define CLUSTER_BANDS   8
+#define CLUSTER_BANDBITS (SIMHASH_BITS / CLUSTER_BANDS)
+#define CLUSTER_MAXDIST (CLUSTER_BANDS - 1)
+
+// How many earlier files in a band bucket each file is compared with. With
+// 256 values per band, buckets average one file in 256, so this only cuts
+// in on scans of tens of thousands of files, or on bands that many files
+// share; ClusterSlots counts the buckets where it did.
+#define CLUSTER_PROBES  256
+
+// feature kinds, mixed into each feature's hash
+enum
+{
+   FEAT_NAME,
+   FEAT_ITEM,
+   FEAT_RELIC,
+   FEAT_CARD,
+   FEAT_COMBO,
+   FEAT_MAP,
+};
+
+typedef struct clusterslot_s
+{
+   unsigned int sig[SIMHASH_WORDS];
+   unsigned int file;
+   int          slot;
+   unsigned int parent;   // union-find
+   char         name[NAME_TEXT_LENGTH + 1];
+} clusterslot_t;
+
+typedef struct clusterset_s
+{
+   clusterslot_t *slots;
+   unsigned int   numslots;
+   unsigned int   alloc;
+   unsigned int   bigbuckets; // band buckets too big to compare fully
+} clusterset_t;
+
+//
+// FeatureHash
+//
+// Hashes a feature of a given kind with a seed. (The 32-bit MurmurHash3
+// finalizer.)
+//
+unsigned int FeatureHash(int kind, unsigned int value, unsigned int seed)
+{
+   unsigned int h = seed ^ ((unsigned int)kind * 0x9E3779B9u) ^ value;
+
+   h ^= h >> 16;
+   h *= 0x85EBCA6Bu;
+   h ^= h >> 13;
+   h *= 0xC2B2AE35u;
+   h ^= h >> 16;
+
+   return h;
+}
+
+//
+// SimHashAdd
+//
+// Adds a weighted feature to the running SimHash totals.
+//
+void SimHashAdd(int *totals, int kind, unsigned int value, int weight)
+{
+   int w, b;
+
+   for(w = 0; w < SIMHASH_WORDS; ++w)
+   {
+      unsigned int h = FeatureHash(kind, value, 0x5BD1E995u * (w + 1));
+
+      for(b = 0; b < 32; ++b)
+         totals[w * 32 + b] += ((h >> b) & 1) ? weight : -weight;
+   }
+}
+
+//
+// SaveFileSimHash
+//
+// Works out a file's signature.
+//
+void SaveFileSimHash(savefile_t *sf, unsigned int *sig)
+{
+   int totals[SIMHASH_BITS];
+   int i;
+
+   memset(totals, 0, sizeof(totals));
+
+   // a copied game keeps its name
+   SimHashAdd(totals, FEAT_NAME,
+              DataHash(sf->data + OFFSET_NAME, NAME_LENGTH), 4);
+
+   for(i = 0; i < NUMINV; ++i)
+   {
+      if(sf->inventory[i])
+         SimHashAdd(totals, FEAT_ITEM, i * 256 + sf->inventory[i], 1);
+   }
+
+   for(i = 0; i < NUMRELICS; ++i)
+   {
+      if(sf->relics[i])
+         SimHashAdd(totals, FEAT_RELIC, i, 2);
+   }
+
+   for(i = 0; i < NUMDSS; ++i)
+   {
+      if(sf->dss_owned[i])
+         SimHashAdd(totals, FEAT_CARD, i, 1);
+   }
+
+   for(i = 0; i < NUMABILITIES; ++i)
+   {
+      if(sf->dss_used[i])
+         SimHashAdd(totals, FEAT_COMBO, i, 1);
+   }
+
+   // the packed map, a 32-bit word at a time; a little more exploring only
+   // changes a few words
+   for(i = 0; i < PACKED_MAP_WIDTH * MAP_HEIGHT; i += 4)
+   {
+      unsigned int word = (unsigned int)SaveFileLong(sf, OFFSET_MAP + i);
+
+      if(word)
+         SimHashAdd(totals, FEAT_MAP, FeatureHash(FEAT_MAP, word, i), 1);
+   }
+
+   for(i = 0; i < SIMHASH_WORDS; ++i)
+      sig[i] = 0;
+
+   for(i = 0; i < SIMHASH_BITS; ++i)
+   {
+      if(totals[i] > 0)
+         sig[i >> 5] |= 1u << (i & 31);
+   }
+}
+
+//
+// ClusterAdd
+//
+void ClusterAdd(clusterset_t *cs, savefile_t *sf, int file, int slot)
+{
+   clusterslot_t *cl;
+
+   if(cs->numslots == cs->alloc)
+   {
+      unsigned int newalloc = cs->alloc ? cs->alloc * 2 : 1024;
+
+      cs->slots = MemRealloc(cs->slots, cs->alloc * sizeof(clusterslot_t),
+                             newalloc * sizeof(clusterslot_t));
+      cs->alloc = newalloc;
+   }
+
+   cl = &cs->slots[cs->numslots];
+   SaveFileSimHash(sf, cl->sig);
+   cl->file   = file;
+   cl->slot   = slot;
+   cl->parent = cs->numslots++;
+   strcpy(cl->name, sf->name);
+}
+
+//
+// ClusterFind
+//
+// Finds a slot's cluster, halving the path as it goes.
+//
+unsigned int ClusterFind(clusterset_t *cs, unsigned int i)
+{
+   while(cs->slots[i].parent != i)
+   {
+      cs->slots[i].parent = cs->slots[cs->slots[i].parent].parent;
+      i = cs->slots[i].parent;
+   }
+
+   return i;
+}
+
+//
+// ClusterUnion
+//
+// Joins two clusters, keeping the lower number so that a cluster is always
+// named after its first file.
+//
+void ClusterUnion(clusterset_t *cs, unsigned int a, unsigned int b)
+{
+   a = ClusterFind(cs, a);
+   b = ClusterFind(cs, b);
+
+   if(a < b)
+      cs->slots[b].parent = a;
+   else if(b < a)
+      cs->slots[a].parent = b;
+}
+
+//
+// SimHashDistance
+//
+int SimHashDistance(const unsigned int *a, const unsigned int *b)
+{
+   int i, d = 0;
+
+   for(i = 0; i < SIMHASH_WORDS; ++i)
+      d += BitCount(a[i] ^ b[i]);
+
+   return d;
+}
+
+typedef struct bandentry_s
+{
+   unsigned int band;
+   unsigned int slot;
+} bandentry_t;
+
+//
+// BandCompare
+//
+int BandCompare(const void *a, const void *b)
+{
+   const bandentry_t *x = a, *y = b;
+
+   if(x->band != y->band)
+      return x->band < y->band ? -1 : 1;
+   return x->slot < y->slot ? -1 : x->slot > y->slot;
+}
+
+//
+// ClusterSlots
+//
+// Joins every pair of slots whose signatures are at most maxdist bits apart.
+// Returns the number of clusters.
+//
+unsigned int ClusterSlots(clusterset_t *cs, int maxdist)
+{
+   bandentry_t *entries;
+   unsigned int i, j, start, count = 0;
+   int band;
+
+   if(!cs->numslots)
+      return 0;
+
+   entries = MemAlloc(cs->numslots * sizeof(bandentry_t));
+   cs->bigbuckets = 0;
+
+   for(band = 0; band < CLUSTER_BANDS; ++band)
+   {
+      int word  = band * CLUSTER_BANDBITS / 32;
+      int shift = band * CLUSTER_BANDBITS % 32;
+
+      for(i = 0; i < cs->numslots; ++i)
+      {
+         entries[i].band = (cs->slots[i].sig[word] >> shift) & 
+                           ((1u << CLUSTER_BANDBITS) - 1);
+         entries[i].slot = i;
+      }
+
+      qsort(entries, cs->numslots, sizeof(bandentry_t), BandCompare);
+
+      for(start = i = 0; i < cs->numslots; ++i)
+      {
+         if(entries[i].band != entries[start].band)
+            start = i;
+
+         // from here on this bucket's first files are out of reach
+         if(i - start == CLUSTER_PROBES + 1)
+            ++cs->bigbuckets;
+
+         for(j = (i - start > CLUSTER_PROBES) ? i - CLUSTER_PROBES : start;
+             j < i; ++j)
+         {
+            clusterslot_t *a = &cs->slots[entries[i].slot];
+            clusterslot_t *b = &cs->slots[entries[j].slot];
+
+            if(SimHashDistance(a->sig, b->sig) <= maxdist)
+               ClusterUnion(cs, entries[i].slot, entries[j].slot);
+         }
+      }
+   }
+
+   MemFree(entries, cs->numslots * sizeof(bandentry_t));
+
+   for(i = 0; i < cs->numslots; ++i)
+   {
+      if(ClusterFind(cs, i) == i)
+         ++count;
+   }
+
+   return count;
+}
+
+//
+// PrintClusters
+//
+// Lists every slot with its cluster number and the number of slots in its
+// cluster, grouped by cluster.
+//
+void PrintClusters(clusterset_t *cs, char **paths)
+{
+   unsigned int *sizes, *order;
+   unsigned int i, n = cs->numslots;
+
+   if(!n)
+      return;
+
+   sizes = MemAlloc(n * sizeof(unsigned int));
+   order = MemAlloc(n * sizeof(unsigned int));
+   memset(sizes, 0, n * sizeof(unsigned int));
+
+   for(i = 0; i < n; ++i)
+   {
+      cs->slots[i].parent = ClusterFind(cs, i);
+      ++sizes[cs->slots[i].parent];
+   }
+
+   // a counting sort by cluster keeps the input order within each one
+   for(i = 1; i < n; ++i)
+      sizes[i] += sizes[i - 1];
+   for(i = n; i-- > 0; )
+      order[--sizes[cs->slots[i].parent]] = i;
+   for(i = 0; i < n; ++i)
+      sizes[i] = 0;
+   for(i = 0; i < n; ++i)
+      ++sizes[cs->slots[i].parent];
+
+   for(i = 0; i < n; ++i)
+   {
+      clusterslot_t *cl = &cs->slots[order[i]];
+
+      printf("%u\t%u\t%s:%d %s\n", cl->parent + 1, sizes[cl->parent],
+             paths[cl->file], cl->slot + 1, cl->name);
+   }
+
+   MemFree(sizes, n * sizeof(unsigned int));
+   MemFree(order, n * sizeof(unsigned int));
+}
+
+//
+// WriteClusterTable
+//
+// Writes the cluster side table for --table. Returns false if it couldn't
+// be written.
+//
+bool WriteClusterTable(clusterset_t *cs, char **paths, const char *path)
+{
+   unsigned int *sizes;
+   unsigned int i, n = cs->numslots;
+   FILE *f;
+   bool ok;
+
+   if(!(f = fopen(path, "w")))
+      return SaveFileWarning("Error: couldn't write %s\n", path);
+
+   sizes = MemAlloc((n ? n : 1) * sizeof(unsigned int));
+   memset(sizes, 0, (n ? n : 1) * sizeof(unsigned int));
+
+   for(i = 0; i < n; ++i)
+      ++sizes[ClusterFind(cs, i)];
+
+   fprintf(f, "path\tslot\tcluster\tsize\n");
+   for(i = 0; i < n; ++i)
+   {
+      clusterslot_t *cl = &cs->slots[i];
+      unsigned int root = ClusterFind(cs, i);
+
+      fprintf(f, "%s\t%d\t%u\t%u\n", paths[cl->file], cl->slot + 1, 
+              root + 1, sizes[root]);
+   }
+
+   MemFree(sizes, (n ? n : 1) * sizeof(unsigned int));
+
+   ok = !ferror(f);
+   if(fclose(f) || !ok)
+      return SaveFileWarning("Error: couldn't write %s\n", path);
+
+   return true;
+}
+
+//
+// Plausibility Model
+//
+// Flags files whose progress doesn't add up, such as the Last Key at eight
+// minutes or LV 50 with 3% of the map. The train command goes over a set of
+// trusted files. For each mode it splits them into ten buckets by map
+// percentage, and ten more by play time, and records quantiles of every
+// other feature in each bucket. The score command then finds each file's
+// buckets and looks up where its values fall. That's a handful of table
+// lookups per file, so it's fast enough to score a submission on the spot.
+//
+// savtest <files...> train <model>
+// savtest <files...> score <model> [--min SCORE]
+//
+// A value between the 5th and 95th percentile adds nothing to the score.
+// Beyond those, each check adds log10(0.05 / p), where p is the estimated
+// chance of a value at least that far out. So a value at the 1st or 99th
+// percentile adds 0.7, and past those the estimate keeps falling with the
+// distance, measured in interquartile ranges. Files scoring at least --min
+// (default 2) are listed along with the checks that failed.
+//
+// The model is a text file:
+//
+//   savtest-model 1
+//   mode <mode> <files> <9 time bucket edges in minutes>
+//   bucket <mode> <map|time> <bucket> <files> <7 quantiles per feature>
+//
+// Buckets with fewer than PLAUS_MINSAMPLES files are skipped when scoring.
+//
+
+#define PLAUS_MAGIC      "savtest-model"
+#define PLAUS_VERSION    1
+#define PLAUS_BUCKETS    10
+#define PLAUS_QUANTILES  7
+#define PLAUS_MINSAMPLES 20
+#define PLAUS_RARITY     4    // items at least this rare count as rare
+
+enum
+{
+   PF_TIME,    // minutes
+   PF_LV,
+   PF_EXP,
+   PF_MAP,     // percent * 10
+   PF_RELICS,
+   PF_UPS,     // heart, HP and MP ups together
+   PF_RARE,    // different rare items owned
+   NUMPLAUSFEATURES
+};
+
+const char *plausfeaturenames[NUMPLAUSFEATURES] =
+{
+   "time", "lv", "exp", "map", "relics", "ups", "rare",
+};
+
+// what files are bucketed by
+enum
+{
+   PC_MAP,
+   PC_TIME,
+   NUMPLAUSCONDS
+};
+
+const char *plauscondnames[NUMPLAUSCONDS] = { "map", "time" };
+
+// the feature each bucketing is taken from, which isn't checked within it
+int plauscondfeatures[NUMPLAUSCONDS] = { PF_MAP, PF_TIME };
+
+// quantiles kept, in tenths of a percent
+int plausquantiles[PLAUS_QUANTILES] = { 10, 50, 250, 500, 750, 950, 990 };
+
+typedef struct plausbucket_s
+{
+   long count;
+   long q[NUMPLAUSFEATURES][PLAUS_QUANTILES];
+} plausbucket_t;
+
+typedef struct plausmode_s
+{
+   long count;
+   long timeedges[PLAUS_BUCKETS - 1];
+   plausbucket_t buckets[NUMPLAUSCONDS][PLAUS_BUCKETS];
+} plausmode_t;
+
+typedef struct plausmodel_s
+{
+   plausmode_t modes[NUMMODES];
+} plausmodel_t;
+
+plausmodel_t plausmodel;
+
+typedef struct plaussample_s
+{
+   int  mode;
+   int  bucket[NUMPLAUSCONDS];
+   long f[NUMPLAUSFEATURES];
+} plaussample_t;
+
+typedef struct plaussamples_s
+{
+   plaussample_t *samples;
+   unsigned int   count;
+   unsigned int   alloc;
+} plaussamples_t;
+
+// one failed check
+typedef struct plausreason_s
+{
+   int    cond;
+   int    bucket;
+   int    feature;
+   long   value;
+   bool   high;
+   double score;
+} plausreason_t;
+
+typedef struct plausresult_s
+{
+   double        score;
+   int           numreasons;
+   plausreason_t reasons[NUMPLAUSCONDS * NUMPLAUSFEATURES];
+} plausresult_t;
+
+//
+// PlausFeatures
+//
+// Gets the model's features from a file.
+//
+void PlausFeatures(savefile_t *sf, long *f)
+{
+   int i;
+
+   f[PF_TIME]   = sf->time / (60 * 60);
+   f[PF_LV]     = sf->lv;
+   f[PF_EXP]    = sf->exp;
+   f[PF_MAP]    = sf->map_pct;
+   f[PF_RELICS] = 0;
+   f[PF_UPS]    = sf->numheartups + sf->numhpups + sf->nummpups;
+   f[PF_RARE]   = 0;
+
+   for(i = 0; i < NUMRELICS; ++i)
+   {
+      if(sf->relics[i])
+         ++f[PF_RELICS];
+   }
+
+   for(i = 1; i < NUMINV; ++i)
+   {
+      if(sf->inventory[i] && inventory_items[i].rarity >= PLAUS_RARITY)
+         ++f[PF_RARE];
+   }
+}
+
+//
+// PlausMapBucket
+//
+int PlausMapBucket(long map_pct)
+{
+   int bucket = (int)(map_pct / (1000 / PLAUS_BUCKETS));
+
+   return bucket < 0 ? 0 : bucket >= PLAUS_BUCKETS ? PLAUS_BUCKETS - 1 : bucket;
+}
+
+//
+// PlausTimeBucket
+//
+int PlausTimeBucket(plausmode_t *pm, long minutes)
+{
+   int bucket = 0;
+
+   while(bucket < PLAUS_BUCKETS - 1 && minutes >= pm->timeedges[bucket])
+      ++bucket;
+
+   return bucket;
+}
+
+//
+// PlausAddSample
+//
+void PlausAddSample(plaussamples_t *ps, savefile_t *sf)
+{
+   plaussample_t *s;
+
+   if(sf->mode < 0 || sf->mode >= NUMMODES)
+      return;
+
+   if(ps->count == ps->alloc)
+   {
+      unsigned int newalloc = ps->alloc ? ps->alloc * 2 : 1024;
+
+      ps->samples = MemRealloc(ps->samples, ps->alloc * sizeof(plaussample_t),
+                               newalloc * sizeof(plaussample_t));
+      ps->alloc = newalloc;
+   }
+
+   s = &ps->samples[ps->count++];
+   s->mode = (int)sf->mode;
+   PlausFeatures(sf, s->f);
+}
+
+//
+// LongCompare
+//
+int LongCompare(const void *a, const void *b)
+{
+   long x = *(const long *)a, y = *(const long *)b;
+
+   return x < y ? -1 : x > y;
+}
+
+//
+// PlausQuantiles
+//
+// Sorts a list of values and picks out the model's quantiles.
+//
+void PlausQuantiles(long *values, long n, long *q)
+{
+   int i;
+
+   qsort(values, n, sizeof(long), LongCompare);
+
+   for(i = 0; i < PLAUS_QUANTILES; ++i)
+      q[i] = values[(plausquantiles[i] * (n - 1) + 500) / 1000];
+}
+
+//
+// PlausTrain
+//
+// Builds the model from the collected samples.
+//
+void PlausTrain(plausmodel_t *pm, plaussamples_t *ps)
+{
+   long *values;
+   unsigned int i;
+   int mode, cond, bucket, f;
+
+   memset(pm, 0, sizeof(*pm));
+
+   if(!ps->count)
+      return;
+
+   values = MemAlloc(ps->count * sizeof(long));
+
+   for(mode = 0; mode < NUMMODES; ++mode)
+   {
+      plausmode_t *m = &pm->modes[mode];
+      long n = 0;
+
+      // time bucket edges split the mode's files into tenths
+      for(i = 0; i < ps->count; ++i)
+      {
+         if(ps->samples[i].mode == mode)
+            values[n++] = ps->samples[i].f[PF_TIME];
+      }
+
+      if(!(m->count = n))
+         continue;
+
+      qsort(values, n, sizeof(long), LongCompare);
+      for(bucket = 0; bucket < PLAUS_BUCKETS - 1; ++bucket)
+         m->timeedges[bucket] = values[(bucket + 1) * n / PLAUS_BUCKETS];
+
+      for(i = 0; i < ps->count; ++i)
+      {
+         plaussample_t *s = &ps->samples[i];
+
+         if(s->mode != mode)
+            continue;
+         s->bucket[PC_MAP]  = PlausMapBucket(s->f[PF_MAP]);
+         s->bucket[PC_TIME] = PlausTimeBucket(m, s->f[PF_TIME]);
+      }
+
+      for(cond = 0; cond < NUMPLAUSCONDS; ++cond)
+      {
+         for(bucket = 0; bucket < PLAUS_BUCKETS; ++bucket)
+         {
+            plausbucket_t *b = &m->buckets[cond][bucket];
+
+            for(f = 0; f < NUMPLAUSFEATURES; ++f)
+            {
+               n = 0;
+               for(i = 0; i < ps->count; ++i)
+               {
+                  plaussample_t *s = &ps->samples[i];
+
+                  if(s->mode == mode && s->bucket[cond] == bucket)
+                     values[n++] = s->f[f];
+               }
+
+               if((b->count = n))
+                  PlausQuantiles(values, n, b->q[f]);
+            }
+         }
+      }
+   }
+
+   MemFree(values, ps->count * sizeof(long));
+}
+
+//
+// PlausWrite
+//
+bool PlausWrite(plausmodel_t *pm, const char *path)
+{
+   FILE *f;
+   int mode, cond, bucket, i, j;
+
+   if(!(f = fopen(path, "w")))
+      return SaveFileWarning("Error: couldn't create %s\n", path);
+
+   fprintf(f, "%s %d\n", PLAUS_MAGIC, PLAUS_VERSION);
+
+   for(mode = 0; mode < NUMMODES; ++mode)
+   {
+      plausmode_t *m = &pm->modes[mode];
+
+      if(!m->count)
+         continue;
+
+      fprintf(f, "mode %d %ld", mode, m->count);
+      for(i = 0; i < PLAUS_BUCKETS - 1; ++i)
+         fprintf(f, " %ld", m->timeedges[i]);
+      fputc('\n', f);
+
+      for(cond = 0; cond < NUMPLAUSCONDS; ++cond)
+      {
+         for(bucket = 0; bucket < PLAUS_BUCKETS; ++bucket)
+         {
+            plausbucket_t *b = &m->buckets[cond][bucket];
+
+            if(!b->count)
+               continue;
+
+            fprintf(f, "bucket %d %s %d %ld", mode, plauscondnames[cond],
+                    bucket, b->count);
+            for(i = 0; i < NUMPLAUSFEATURES; ++i)
+            {
+               for(j = 0; j < PLAUS_QUANTILES; ++j)
+                  fprintf(f, " %ld", b->q[i][j]);
+            }
+            fputc('\n', f);
+         }
+      }
+   }
+
+   if(ferror(f))
+   {
+      fclose(f);
+      return SaveFileWarning("Error: couldn't write %s\n", path);
+   }
+
+   fclose(f);
+
+   return true;
+}
+
+//
+// PlausRead
+//
+bool PlausRead(plausmodel_t *pm, const char *path)
+{
+   FILE *f;
+   char word[16], cname[16];
+   int version, mode, cond, bucket, i, j;
+   long count;
+   bool ok = false;
+
+   if(!(f = fopen(path, "r")))
+      return SaveFileWarning("Error: couldn't open %s\n", path);
+
+   memset(pm, 0, sizeof(*pm));
+
+   if(fscanf(f, "%15s %d", word, &version) != 2 || 
+      strcmp(word, PLAUS_MAGIC) || version != PLAUS_VERSION)
+      goto done;
+
+   while(fscanf(f, "%15s %d", word, &mode) == 2)
+   {
+      if(mode < 0 || mode >= NUMMODES)
+         goto done;
+
+      if(!strcmp(word, "mode"))
+      {
+         plausmode_t *m = &pm->modes[mode];
+
+         if(fscanf(f, "%ld", &m->count) != 1)
+            goto done;
+         for(i = 0; i < PLAUS_BUCKETS - 1; ++i)
+         {
+            if(fscanf(f, "%ld", &m->timeedges[i]) != 1)
+               goto done;
+         }
+      }
+      else if(!strcmp(word, "bucket"))
+      {
+         plausbucket_t *b;
+
+         if(fscanf(f, "%15s %d %ld", cname, &bucket, &count) != 3)
+            goto done;
+
+         for(cond = 0; cond < NUMPLAUSCONDS; ++cond)
+         {
+            if(!strcmp(cname, plauscondnames[cond]))
+               break;
+         }
+         if(cond == NUMPLAUSCONDS || bucket < 0 || bucket >= PLAUS_BUCKETS)
+            goto done;
+
+         b = &pm->modes[mode].buckets[cond][bucket];
+         b->count = count;
+         for(i = 0; i < NUMPLAUSFEATURES; ++i)
+         {
+            for(j = 0; j < PLAUS_QUANTILES; ++j)
+            {
+               if(fscanf(f, "%ld", &b->q[i][j]) != 1)
+                  goto done;
+            }
+         }
+      }
+      else
+         goto done;
+   }
+
+   ok = feof(f) && !ferror(f);
+
+done:
+   fclose(f);
+
+   if(!ok)
+      return SaveFileWarning("Error: %s isn't a valid model file\n", path);
+
+   return true;
+}
+
+//
+// PlausTail
+//
+// Estimates the chance of a value at least as far out as v, on the side of
+// the median it falls on, from a bucket's quantiles.
+//
+double PlausTail(const long *q, long v, bool *high)
+{
+   double spread = (double)(q[4] - q[2]);
+   double cdf;
+   int i;
+
+   if(spread < 1.0)
+      spread = 1.0;
+
+   *high = (v > q[3]);
+
+   if(v < q[0])
+      return (plausquantiles[0] / 1000.0) / (1.0 + (q[0] - v) / spread);
+   if(v > q[PLAUS_QUANTILES - 1])
+   {
+      return (1.0 - plausquantiles[PLAUS_QUANTILES - 1] / 1000.0) / 
+             (1.0 + (v - q[PLAUS_QUANTILES - 1]) / spread);
+   }
+
+   // within the table: interpolate between the quantiles either side,
+   // taking runs of equal quantiles at the end nearer the median so that
+   // common values aren't penalized
+   if(*high)
+   {
+      for(i = PLAUS_QUANTILES - 1; q[i - 1] >= v; --i);
+      cdf = plausquantiles[i - 1] + 
+            (plausquantiles[i] - plausquantiles[i - 1]) *
+            (double)(v - q[i - 1]) / (q[i] - q[i - 1]);
+      return 1.0 - cdf / 1000.0;
+   }
+
+   for(i = 0; i < PLAUS_QUANTILES - 1 && q[i + 1] <= v; ++i);
+   if(i == PLAUS_QUANTILES - 1)
+      return plausquantiles[i] / 1000.0;
+   cdf = plausquantiles[i] + (plausquantiles[i + 1] - plausquantiles[i]) *
+         (double)(v - q[i]) / (q[i + 1] - q[i]);
+   return cdf / 1000.0;
+}
+
+//
+// PlausScore
+//
+// Scores a file against the model. Returns false if the model has nothing
+// for its mode.
+//
+bool PlausScore(plausmodel_t *pm, savefile_t *sf, plausresult_t *res)
+{
+   plausmode_t *m;
+   long f[NUMPLAUSFEATURES];
+   int cond, i, bucket[NUMPLAUSCONDS];
+
+   res->score = 0.0;
+   res->numreasons = 0;
+
+   if(sf->mode < 0 || sf->mode >= NUMMODES || 
+      !(m = &pm->modes[sf->mode])->count)
+      return false;
+
+   PlausFeatures(sf, f);
+   bucket[PC_MAP]  = PlausMapBucket(f[PF_MAP]);
+   bucket[PC_TIME] = PlausTimeBucket(m, f[PF_TIME]);
+
+   for(cond = 0; cond < NUMPLAUSCONDS; ++cond)
+   {
+      plausbucket_t *b = &m->buckets[cond][bucket[cond]];
+
+      if(b->count < PLAUS_MINSAMPLES)
+         continue;
+
+      for(i = 0; i < NUMPLAUSFEATURES; ++i)
+      {
+         plausreason_t *r;
+         double p;
+         bool high;
+
+         if(i == plauscondfeatures[cond])
+            continue;
+
+         if((p = PlausTail(b->q[i], f[i], &high)) >= 0.05)
+            continue;
+
+         r = &res->reasons[res->numreasons++];
+         r->cond    = cond;
+         r->bucket  = bucket[cond];
+         r->feature = i;
+         r->value   = f[i];
+         r->high    = high;
+         r->score   = log10(0.05 / p);
+         res->score += r->score;
+      }
+   }
+
+   return true;
+}
+
+//
+// PrintPlausResult
+//
+void PrintPlausResult(plausmodel_t *pm, savefile_t *sf, plausresult_t *res)
+{
+   plausmode_t *m = &pm->modes[sf->mode];
+   int i;
+
+   for(i = 0; i < res->numreasons; ++i)
+   {
+      plausreason_t *r = &res->reasons[i];
+
+      printf("   %s %ld is %s for ", plausfeaturenames[r->feature], r->value,
+             r->high ? "high" : "low");
+
+      if(r->cond == PC_MAP)
+      {
+         printf("map %d-%d%%", r->bucket * (100 / PLAUS_BUCKETS), 
+                (r->bucket + 1) * (100 / PLAUS_BUCKETS));
+      }
+      else if(r->bucket == 0)
+         printf("time under %ld min", m->timeedges[0]);
+      else if(r->bucket == PLAUS_BUCKETS - 1)
+         printf("time over %ld min", m->timeedges[r->bucket - 1]);
+      else
+      {
+         printf("time %ld-%ld min", m->timeedges[r->bucket - 1], 
+                m->timeedges[r->bucket]);
+      }
+
+      printf(" (+%.1f)\n", r->score);
+   }
+}
+
+//
+// Aggregate Sketches
+//
+// Corpus-wide distributions for each mode, kept in a fixed amount of memory
+// however many files go through:
+//
+// * Play time quantiles from a log-bucketed sketch. Each bucket is 2% wider
+//   than the last, so any quantile is within 1% of the true value.
+// * An exact LV histogram, since there are only 99 levels.
+// * A HyperLogLog estimate of distinct player names, about 1.6% error.
+// * The most common loadouts, from a space-saving summary. A loadout that
+//   makes up more than 1/SKETCH_TOPK of the files is always found, and its
+//   count is over by at most its listed error.
+//
+// All of these merge by adding or taking maximums, so shards can be
+// aggregated separately and their sketch files combined later.
+//
+// savtest <files...> aggregate [--save SKETCH]
+// savtest -merge <output> <sketches...>
+//
+
+#define SKETCH_MAGIC     "CVSKETCH"
+#define SKETCH_MAGIC_LEN 8
+#define SKETCH_VERSION   1
+#define SKETCH_BINS      1024
+#define SKETCH_GAMMA     1.02
+#define SKETCH_LEVELS    100   // LV 0 - 99
+#define SKETCH_TOPK      64
+#define HLL_BITS         12
+#define HLL_REGISTERS    (1 << HLL_BITS)
+#define LOADOUT_BYTES    5     // armor, arms, action and attribute cards
+
+typedef struct heavyhitter_s
+{
+   byte          loadout[LOADOUT_BYTES];
+   unsigned long count;
+   unsigned long error;   // most the count can be over by
+} heavyhitter_t;
+
+typedef struct modesketch_s
+{
+   unsigned long files;
+   unsigned long timebins[SKETCH_BINS];  // seconds, log-bucketed
+   unsigned long levels[SKETCH_LEVELS];
+   byte          hll[HLL_REGISTERS];
+   unsigned int  numhitters;
+   heavyhitter_t hitters[SKETCH_TOPK];
+} modesketch_t;
+
+typedef struct sketchset_s
+{
+   modesketch_t modes[NUMMODES];
+} sketchset_t;
+
+//
+// SketchTimeBin
+//
+// Bin 0 holds anything under a second; bin i holds values up to 
+// SKETCH_GAMMA^(i - 1).
+//
+int SketchTimeBin(long seconds)
+{
+   int bin;
+
+   if(seconds < 1)
+      return 0;
+
+   bin = 1 + (int)ceil(log((double)seconds) / log(SKETCH_GAMMA));
+
+   return bin < SKETCH_BINS ? bin : SKETCH_BINS - 1;
+}
+
+//
+// SketchTimeQuantile
+//
+// Returns the time at quantile q (0 - 1), in seconds.
+//
+long SketchTimeQuantile(modesketch_t *ms, double q)
+{
+   unsigned long rank, seen = 0;
+   int bin;
+
+   rank = (unsigned long)(q * (ms->files - 1));
+
+   for(bin = 0; bin < SKETCH_BINS; ++bin)
+   {
+      if((seen += ms->timebins[bin]) > rank)
+         break;
+   }
+
+   if(bin == 0)
+      return 0;
+   if(bin == SKETCH_BINS)
+      bin = SKETCH_BINS - 1;
+
+   // the middle of the bin, in relative terms
+   return (long)(2.0 * pow(SKETCH_GAMMA, bin - 1) / (SKETCH_GAMMA + 1.0) + 0.5);
+}
+
+//
+// HLLAdd
+//
+void HLLAdd(byte *hll, unsigned int hash)
+{
+   unsigned int reg = hash >> (32 - HLL_BITS);
+   unsigned int rest = hash << HLL_BITS;
+   byte rank = 1;
+
+   while(rank <= 32 - HLL_BITS && !(rest & 0x80000000u))
+   {
+      ++rank;
+      rest <<= 1;
+   }
+
+   if(rank > hll[reg])
+      hll[reg] = rank;
+}
+
+//
+// HLLEstimate
+//
+double HLLEstimate(const byte *hll)
+{
+   double m = HLL_REGISTERS, sum = 0.0, est;
+   int i, zeros = 0;
+
+   for(i = 0; i < HLL_REGISTERS; ++i)
+   {
+      sum += 1.0 / (double)(1u << hll[i]);
+      if(!hll[i])
+         ++zeros;
+   }
+
+   est = (0.7213 / (1.0 + 1.079 / m)) * m * m / sum;
+
+   // small counts are better estimated from the empty registers, and large
+   // ones need correcting for collisions in a 32-bit hash
+   if(est <= 2.5 * m && zeros)
+      est = m * log(m / zeros);
+   else if(est > 4294967296.0 / 30.0)
+      est = -4294967296.0 * log(1.0 - est / 4294967296.0);
+
+   return est;
+}
+
+//
+// SketchAddLoadout
+//
+// Space-saving update: count the loadout if it's already kept, otherwise
+// take over the smallest counter.
+//
+void SketchAddLoadout(modesketch_t *ms, const byte *loadout)
+{
+   heavyhitter_t *hh, *least;
+   unsigned int i;
+
+   for(i = 0; i < ms->numhitters; ++i)
+   {
+      if(!memcmp(ms->hitters[i].loadout, loadout, LOADOUT_BYTES))
+      {
+         ++ms->hitters[i].count;
+         return;
+      }
+   }
+
+   if(ms->numhitters < SKETCH_TOPK)
+   {
+      hh = &ms->hitters[ms->numhitters++];
+      memcpy(hh->loadout, loadout, LOADOUT_BYTES);
+      hh->count = 1;
+      hh->error = 0;
+      return;
+   }
+
+   least = &ms->hitters[0];
+   for(i = 1; i < ms->numhitters; ++i)
+   {
+      if(ms->hitters[i].count < least->count)
+         least = &ms->hitters[i];
+   }
+
+   memcpy(least->loadout, loadout, LOADOUT_BYTES);
+   least->error = least->count;
+   ++least->count;
+}
+
+//
+// SketchAddFile
+//
+void SketchAddFile(sketchset_t *ss, savefile_t *sf)
+{
+   modesketch_t *ms;
+   byte loadout[LOADOUT_BYTES];
+
+   if(sf->mode < 0 || sf->mode >= NUMMODES)
+      return;
+
+   ms = &ss->modes[sf->mode];
+
+   ++ms->files;
+   ++ms->timebins[SketchTimeBin(sf->time / 60)];
+   ++ms->levels[sf->lv < 0 ? 0 : sf->lv >= SKETCH_LEVELS ? 
+                SKETCH_LEVELS - 1 : sf->lv];
+
+   HLLAdd(ms->hll, FeatureHash(FEAT_NAME, 
+          DataHash(sf->data + OFFSET_NAME, NAME_LENGTH), 0));
+
+   loadout[0] = sf->armor;
+   loadout[1] = sf->arm_first;
+   loadout[2] = sf->arm_second;
+   loadout[3] = sf->action_card;
+   loadout[4] = sf->attribute_card;
+   SketchAddLoadout(ms, loadout);
+}
+
+//
+// HitterCompare
+//
+// Most common first.
+//
+int HitterCompare(const void *a, const void *b)
+{
+   const heavyhitter_t *x = a, *y = b;
+
+   if(x->count != y->count)
+      return x->count > y->count ? -1 : 1;
+   return memcmp(x->loadout, y->loadout, LOADOUT_BYTES);
+}
+
+//
+// SketchFindHitter
+//
+heavyhitter_t *SketchFindHitter(modesketch_t *ms, const byte *loadout)
+{
+   unsigned int i;
+
+   for(i = 0; i < ms->numhitters; ++i)
+   {
+      if(!memcmp(ms->hitters[i].loadout, loadout, LOADOUT_BYTES))
+         return &ms->hitters[i];
+   }
+
+   return NULL;
+}
+
+//
+// SketchMerge
+//
+// Adds one set of sketches into another. A loadout missing from a full
+// summary may have been counted up to that summary's smallest count, so
+// that's added to both its count and its error.
+//
+void SketchMerge(sketchset_t *into, sketchset_t *from)
+{
+   heavyhitter_t merged[SKETCH_TOPK * 2];
+   int mode, i;
+
+   for(mode = 0; mode < NUMMODES; ++mode)
+   {
+      modesketch_t *a = &into->modes[mode], *b = &from->modes[mode];
+      unsigned long mina = 0, minb = 0;
+      unsigned int j, n = 0;
+
+      a->files += b->files;
+      for(i = 0; i < SKETCH_BINS; ++i)
+         a->timebins[i] += b->timebins[i];
+      for(i = 0; i < SKETCH_LEVELS; ++i)
+         a->levels[i] += b->levels[i];
+      for(i = 0; i < HLL_REGISTERS; ++i)
+      {
+         if(b->hll[i] > a->hll[i])
+            a->hll[i] = b->hll[i];
+      }
+
+      if(a->numhitters == SKETCH_TOPK)
+      {
+         for(mina = a->hitters[0].count, j = 1; j < a->numhitters; ++j)
+         {
+            if(a->hitters[j].count < mina)
+               mina = a->hitters[j].count;
+         }
+      }
+      if(b->numhitters == SKETCH_TOPK)
+      {
+         for(minb = b->hitters[0].count, j = 1; j < b->numhitters; ++j)
+         {
+            if(b->hitters[j].count < minb)
+               minb = b->hitters[j].count;
+         }
+      }
+
+      for(j = 0; j < a->numhitters; ++j)
+      {
+         heavyhitter_t *other = SketchFindHitter(b, a->hitters[j].loadout);
+
+         merged[n] = a->hitters[j];
+         merged[n].count += other ? other->count : minb;
+         merged[n].error += other ? other->error : minb;
+         ++n;
+      }
+      for(j = 0; j < b->numhitters; ++j)
+      {
+         if(SketchFindHitter(a, b->hitters[j].loadout))
+            continue;
+
+         merged[n] = b->hitters[j];
+         merged[n].count += mina;
+         merged[n].error += mina;
+         ++n;
+      }
+
+      qsort(merged, n, sizeof(heavyhitter_t), HitterCompare);
+      a->numhitters = n < SKETCH_TOPK ? n : SKETCH_TOPK;
+      memcpy(a->hitters, merged, a->numhitters * sizeof(heavyhitter_t));
+   }
+}
+
+//
+// SketchWrite
+//
+// Writes a sketch file. Only the time bins in use are stored.
+//
+bool SketchWrite(sketchset_t *ss, const char *path)
+{
+   FILE *f;
+   int mode, i;
+   unsigned int j, used;
+
+   if(!(f = fopen(path, "wb")))
+      return SaveFileWarning("Error: couldn't create %s\n", path);
+
+   fwrite(SKETCH_MAGIC, 1, SKETCH_MAGIC_LEN, f);
+   NameIndexPutLong(f, SKETCH_VERSION);
+
+   for(mode = 0; mode < NUMMODES; ++mode)
+   {
+      modesketch_t *ms = &ss->modes[mode];
+
+      NameIndexPutLong(f, ms->files);
+
+      for(used = 0, i = 0; i < SKETCH_BINS; ++i)
+      {
+         if(ms->timebins[i])
+            ++used;
+      }
+      NameIndexPutLong(f, used);
+      for(i = 0; i < SKETCH_BINS; ++i)
+      {
+         if(!ms->timebins[i])
+            continue;
+         NameIndexPutLong(f, i);
+         NameIndexPutLong(f, ms->timebins[i]);
+      }
+
+      for(i = 0; i < SKETCH_LEVELS; ++i)
+         NameIndexPutLong(f, ms->levels[i]);
+
+      fwrite(ms->hll, 1, HLL_REGISTERS, f);
+
+      NameIndexPutLong(f, ms->numhitters);
+      for(j = 0; j < ms->numhitters; ++j)
+      {
+         fwrite(ms->hitters[j].loadout, 1, LOADOUT_BYTES, f);
+         NameIndexPutLong(f, ms->hitters[j].count);
+         NameIndexPutLong(f, ms->hitters[j].error);
+      }
+   }
+
+   if(ferror(f))
+   {
+      fclose(f);
+      return SaveFileWarning("Error: couldn't write %s\n", path);
+   }
+
+   fclose(f);
+
+   return true;
+}
+
+//
+// SketchGetLong
+//
+bool SketchGetLong(FILE *f, unsigned long *v)
+{
+   byte b[4];
+
+   if(fread(b, 1, 4, f) != 4)
+      return false;
+
+   *v = NameIndexGetLong(b);
+
+   return true;
+}
+
+//
+// SketchRead
+//
+bool SketchRead(sketchset_t *ss, const char *path)
+{
+   FILE *f;
+   char magic[SKETCH_MAGIC_LEN];
+   unsigned long v, used, bin, i;
+   int mode;
+   bool ok = false;
+
+   if(!(f = fopen(path, "rb")))
+      return SaveFileWarning("Error: couldn't open %s\n", path);
+
+   memset(ss, 0, sizeof(*ss));
+
+   if(fread(magic, 1, SKETCH_MAGIC_LEN, f) != SKETCH_MAGIC_LEN || 
+      memcmp(magic, SKETCH_MAGIC, SKETCH_MAGIC_LEN) ||
+      !SketchGetLong(f, &v) || v != SKETCH_VERSION)
+      goto done;
+
+   for(mode = 0; mode < NUMMODES; ++mode)
+   {
+      modesketch_t *ms = &ss->modes[mode];
+
+      if(!SketchGetLong(f, &ms->files) || !SketchGetLong(f, &used) || 
+         used > SKETCH_BINS)
+         goto done;
+
+      for(i = 0; i < used; ++i)
+      {
+         if(!SketchGetLong(f, &bin) || bin >= SKETCH_BINS || 
+            !SketchGetLong(f, &ms->timebins[bin]))
+            goto done;
+      }
+
+      for(i = 0; i < SKETCH_LEVELS; ++i)
+      {
+         if(!SketchGetLong(f, &ms->levels[i]))
+            goto done;
+      }
+
+      if(fread(ms->hll, 1, HLL_REGISTERS, f) != HLL_REGISTERS ||
+         !SketchGetLong(f, &v) || v > SKETCH_TOPK)
+         goto done;
+
+      for(ms->numhitters = v, i = 0; i < v; ++i)
+      {
+         heavyhitter_t *hh = &ms->hitters[i];
+
+         if(fread(hh->loadout, 1, LOADOUT_BYTES, f) != LOADOUT_BYTES ||
+            !SketchGetLong(f, &hh->count) || !SketchGetLong(f, &hh->error))
+            goto done;
+      }
+   }
+
+   ok = true;
+
+done:
+   fclose(f);
+
+   if(!ok)
+      return SaveFileWarning("Error: %s isn't a valid sketch file\n", path);
+
+   return true;
+}
+
+//
+// PrintSketchTime
+//
+void PrintSketchTime(const char *label, long s)
+{
+   printf("  %s %02ld:%02ld:%02ld", label, s / 3600, (s % 3600) / 60, s % 60);
+}
+
+//
+// PrintSketches
+//
+// The report for every mode that has any files.
+//
+void PrintSketches(sketchset_t *ss)
+{
+   int mode, i, j, shown;
+
+   for(mode = 0; mode < NUMMODES; ++mode)
+   {
+      modesketch_t *ms = &ss->modes[mode];
+      heavyhitter_t hitters[SKETCH_TOPK];
+      unsigned long most = 0;
+
+      if(!ms->files)
+         continue;
+
+      printf("== %s: %lu files ==\nTime:", modenames[mode], ms->files);
+      PrintSketchTime("p10", SketchTimeQuantile(ms, 0.10));
+      PrintSketchTime("p50", SketchTimeQuantile(ms, 0.50));
+      PrintSketchTime("p90", SketchTimeQuantile(ms, 0.90));
+      PrintSketchTime("p99", SketchTimeQuantile(ms, 0.99));
+
+      printf("\nDistinct names: about %.0f\nLV:\n", HLLEstimate(ms->hll));
+
+      // LV in tens
+      for(i = 0; i < SKETCH_LEVELS; i += 10)
+      {
+         unsigned long count = 0;
+
+         for(j = i; j < i + 10; ++j)
+            count += ms->levels[j];
+         if(count > most)
+            most = count;
+      }
+      for(i = 0; i < SKETCH_LEVELS; i += 10)
+      {
+         unsigned long count = 0;
+
+         for(j = i; j < i + 10; ++j)
+            count += ms->levels[j];
+         if(!count)
+            continue;
+
+         printf("  %2d-%-2d %7lu ", i, i + 9, count);
+         for(j = (int)(count * 40 / most); j > 0; --j)
+            putchar('#');
+         putchar('\n');
+      }
+
+      puts("Top loadouts:");
+      memcpy(hitters, ms->hitters, ms->numhitters * sizeof(heavyhitter_t));
+      qsort(hitters, ms->numhitters, sizeof(heavyhitter_t), HitterCompare);
+
+      shown = ms->numhitters < 10 ? (int)ms->numhitters : 10;
+      for(i = 0; i < shown; ++i)
+      {
+         const byte *lo = hitters[i].loadout;
+
+         printf("  %7lu", hitters[i].count);
+         if(hitters[i].error)
+            printf(" (+/-%lu)", hitters[i].error);
+         printf("  %s, %s, %s, %s/%s\n", 
+                inventory_items[SaveFileValidItem(lo[0])].name,
+                inventory_items[SaveFileValidItem(lo[1])].name,
+                inventory_items[SaveFileValidItem(lo[2])].name,
+                dsscards[SaveFileValidCard(lo[3])].name,
+                dsscards[SaveFileValidCard(lo[4])].name);
+      }
+      putchar('\n');
+   }
+}
+
+//
+// RunMergeSketches
+//
+// Combines sketch files into one and prints the report for the result.
+//
+int RunMergeSketches(const char *output, int numpaths, char **paths)
+{
+   sketchset_t *total, *part;
+   int i, failed = 0;
+
+   total = MemAlloc(sizeof(sketchset_t));
+   part  = MemAlloc(sizeof(sketchset_t));
+   memset(total, 0, sizeof(sketchset_t));
+
+   for(i = 0; i < numpaths; ++i)
+   {
+      if(SketchRead(part, paths[i]))
+         SketchMerge(total, part);
+      else
+         ++failed;
+   }
+
+   if(!SketchWrite(total, output))
+      ++failed;
+
+   PrintSketches(total);
+
+   MemFree(total, sizeof(sketchset_t));
+   MemFree(part, sizeof(sketchset_t));
+
+   return failed;
+}
+
+//
+// SQL Export
+//
+// Writes files out as a SQL script that creates and fills tables, for
+// loading into SQLite or anything else that takes plain SQL:
+//
+//   savtest <files...> sql [--first ID] | sqlite3 saves.db
+//
+// Every slot becomes a row in "slots", numbered from --first (default 1)
+// so that exports of separate batches can go into the same database. The
+// other tables refer back to it by slot_id. Indexes on mode, time, items
+// and relics are created so that the usual filters don't scan every row.
+//
+
+const char *sqlschema =
+   "CREATE TABLE IF NOT EXISTS slots(\n"
+   "  id INTEGER PRIMARY KEY, path TEXT, slot INTEGER, name TEXT,\n"
+   "  mode TEXT, time INTEGER, map_pct REAL, lv INTEGER, exp INTEGER,\n"
+   "  hp INTEGER, mp INTEGER, hearts_max INTEGER,\n"
+   "  str INTEGER, def INTEGER, int INTEGER, lck INTEGER,\n"
+   "  checksum_ok INTEGER);\n"
+   "CREATE TABLE IF NOT EXISTS inventory(slot_id INTEGER, item TEXT,"
+   " count INTEGER);\n"
+   "CREATE TABLE IF NOT EXISTS relics(slot_id INTEGER, relic TEXT);\n"
+   "CREATE TABLE IF NOT EXISTS dss(slot_id INTEGER, card TEXT);\n"
+   "CREATE TABLE IF NOT EXISTS dss_used(slot_id INTEGER, action TEXT,"
+   " attribute TEXT);\n"
+   "CREATE TABLE IF NOT EXISTS areas(slot_id INTEGER, area TEXT,"
+   " explored INTEGER, cells INTEGER);\n"
+   "CREATE INDEX IF NOT EXISTS slots_mode ON slots(mode, time);\n"
+   "CREATE INDEX IF NOT EXISTS slots_lv ON slots(lv);\n"
+   "CREATE INDEX IF NOT EXISTS inventory_item ON inventory(item, slot_id);\n"
+   "CREATE INDEX IF NOT EXISTS relics_relic ON relics(relic, slot_id);\n"
+   "CREATE INDEX IF NOT EXISTS dss_card ON dss(card, slot_id);\n";
+
+//
+// SQLSlot
+//
+// Appends the statements that insert one slot.
+//
+void SQLSlot(strbuf_t *sb, savefile_t *sf, long id, const char *path, 
+             int slot)
+{
+   statvec_t eff;
+   int explored[NUMAREAS];
+   int i, action, attrib;
+
+   SaveFileEffectiveStats(sf, &eff);
+
+   SB_Printf(sb, "INSERT INTO slots VALUES(%ld,", id);
+   SB_SQLString(sb, path);
+   SB_Printf(sb, ",%d,", slot + 1);
+   SB_SQLString(sb, sf->name);
+   SB_Printf(sb, ",");
+   SB_SQLString(sb, SaveFileModeName(sf));
+   SB_Printf(sb, ",%ld,%.1f,%ld,%ld,%ld,%ld,%d,%d,%d,%d,%d,%d);\n",
+             sf->time / 60, sf->map_pct / 10.0, sf->lv, sf->exp, sf->hp, 
+             sf->mp, sf->hearts_max, eff.s[STAT_STR], eff.s[STAT_DEF], 
+             eff.s[STAT_INT], eff.s[STAT_LCK], 
+             sf->checksum_calc == sf->checksum);
+
+   for(i = 1; i < NUMINV; ++i)
+   {
+      if(!sf->inventory[i])
+         continue;
+      SB_Printf(sb, "INSERT INTO inventory VALUES(%ld,", id);
+      SB_SQLString(sb, inventory_items[i].name);
+      SB_Printf(sb, ",%d);\n", sf->inventory[i]);
+   }
+
+   for(i = 0; i < NUMRELICS; ++i)
+   {
+      if(!sf->relics[i])
+         continue;
+      SB_Printf(sb, "INSERT INTO relics VALUES(%ld,", id);
+      SB_SQLString(sb, relics[i].name);
+      SB_Printf(sb, ");\n");
+   }
+
+   for(i = 1; i < NUMDSS; ++i)
+   {
+      if(!sf->dss_owned[i])
+         continue;
+      SB_Printf(sb, "INSERT INTO dss VALUES(%ld,", id);
+      SB_SQLString(sb, dsscards[i].name);
+      SB_Printf(sb, ");\n");
+   }
+
+   for(action = FIRSTACTIONCARD; action < NUMDSS; ++action)
+   {
+      for(attrib = FIRSTATTRIBCARD; attrib < FIRSTACTIONCARD; ++attrib)
+      {
+         if(!DSSComboUsed(sf, action, attrib))
+            continue;
+         SB_Printf(sb, "INSERT INTO dss_used VALUES(%ld,", id);
+         SB_SQLString(sb, dsscards[action].name);
+         SB_Printf(sb, ",");
+         SB_SQLString(sb, dsscards[attrib].name);
+         SB_Printf(sb, ");\n");
+      }
+   }
+
+   CalculateAreaExplored(sf, explored);
+   for(i = 0; i < NUMAREAS; ++i)
+   {
+      SB_Printf(sb, "INSERT INTO areas VALUES(%ld,", id);
+      SB_SQLString(sb, areanames[i]);
+      SB_Printf(sb, ",%d,%d);\n", explored[i], areacells[i]);
+   }
+}
+
+//
+// SQLite Virtual Table
+//
+// Built with SAVTEST_SQLITE defined and linked with -lsqlite3, the files can
+// be queried with SQL where they are, without exporting them first:
+//
+//   savtest <files...> sqlite "SELECT name, lv FROM saves WHERE slot = 1"
+//
+// "saves" has one row per slot, with the same columns as the slots table of
+// the SQL export (less the id). Nothing is read until the query asks for a
+// row: a file is loaded when the scan gets to it, and only the slots that
+// can match are decoded. Equality tests on path, slot and mode are passed
+// down to the scan, so asking for one path reads one file, asking for one
+// slot decodes one slot of each file, and a mode is checked against the raw
+// slot before any decoding. The effective stats are only worked out for
+// rows whose str, def, int or lck are read.
+//
+// Without SAVTEST_SQLITE, the sqlite command just says so.
+//
+
+#ifdef SAVTEST_SQLITE
+
+enum
+{
+   VT_PATH,
+   VT_SLOT,
+   VT_NAME,
+   VT_MODE,
+   VT_TIME,
+   VT_MAP_PCT,
+   VT_LV,
+   VT_EXP,
+   VT_HP,
+   VT_MP,
+   VT_HEARTS_MAX,
+   VT_STR,
+   VT_DEF,
+   VT_INT,
+   VT_LCK,
+   VT_CHECKSUM_OK
+};
+
+const char *savevtabschema =
+   "CREATE TABLE x(path TEXT, slot INTEGER, name TEXT, mode TEXT,"
+   " time INTEGER, map_pct REAL, lv INTEGER, exp INTEGER, hp INTEGER,"
+   " mp INTEGER, hearts_max INTEGER, str INTEGER, def INTEGER,"
+   " int INTEGER, lck INTEGER, checksum_ok INTEGER)";
+
+// idxNum bits for the constraints passed down, in argv order
+#define VTAB_PATH 1
+#define VTAB_SLOT 2
+#define VTAB_MODE 4
+
+// what a mode constraint is compared against; see SaveVTabMode
+#define VTAB_ANYMODE     -1
+#define VTAB_UNKNOWNMODE NUMMODES
+#define VTAB_NOMODE      (NUMMODES + 1)
+
+// the files a query runs over, shared by its tables
+typedef struct savetable_s
+{
+   int    numpaths;
+   char **paths;
+   int    loaded;   // files read, counting each scan
+   int    failed;   // files that couldn't be read
+} savetable_t;
+
+typedef struct savevtab_s
+{
+   sqlite3_vtab base;   // must be first
+   savetable_t *table;
+} savevtab_t;
+
+typedef struct savecursor_s
+{
+   sqlite3_vtab_cursor base;   // must be first
+   int          file;          // index into the paths
+   int          slot;
+   unsigned int found;         // decoded slots in the current file
+   char        *path;          // constraints passed down, if any
+   size_t       pathsize;
+   unsigned int slots;
+   int          mode;
+   savefile_t  *files;         // the current file's decoded slots
+   bool         haveeff;
+   statvec_t    eff;           // effective stats, once they've been asked for
+} savecursor_t;
+
+//
+// SaveVTabMode
+//
+// Turns a game mode into what the mode column shows, as an index into
+// modenames or VTAB_UNKNOWNMODE.
+//
+int SaveVTabMode(long mode)
+{
+   return (mode >= 0 && mode < NUMMODES) ? (int)mode : VTAB_UNKNOWNMODE;
+}
+
+//
+// SaveVTabFindMode
+//
+// Turns the text of a mode constraint into what SaveVTabMode returns, or
+// VTAB_NOMODE if no slot could have it.
+//
+int SaveVTabFindMode(const char *name)
+{
+   int i;
+
+   if(!name)
+      return VTAB_NOMODE;
+
+   for(i = 0; i < NUMMODES; ++i)
+   {
+      if(!strcmp(name, modenames[i]))
+         return i;
+   }
+
+   return strcmp(name, "Unknown") ? VTAB_NOMODE : VTAB_UNKNOWNMODE;
+}
+
+//
+// FindSaveField
+//
+// Returns the field in a format's schema that fills a savefile_t member, or
+// NULL if the format doesn't have one.
+//
+const savefield_t *FindSaveField(saveformat_t *fmt, size_t member)
+{
+   int i;
+
+   for(i = 0; i < fmt->numfields; ++i)
+   {
+      if(fmt->fields[i].member == member)
+         return &fmt->fields[i];
+   }
+
+   return NULL;
+}
+
+//
+// SaveCursorLoad
+//
+// Reads the cursor's current file, if the query can use it, and decodes the
+// slots that can match.
+//
+void SaveCursorLoad(savecursor_t *cur)
+{
+   savetable_t *table = ((savevtab_t *)cur->base.pVtab)->table;
+   const char *path = table->paths[cur->file];
+   const savefield_t *field;
+   unsigned int slots;
+   FILE *f;
+   bool ok;
+   int i;
+
+   cur->found = 0;
+
+   if(cur->path && strcmp(cur->path, path))
+      return;
+
+   if(!(f = fopen(path, "rb")))
+   {
+      SaveFileWarning("Error: couldn't open %s\n", path);
+      ++table->failed;
+      return;
+   }
+
+   ok = ReadSaveRAMImage(f);
+   fclose(f);
+   ++table->loaded;
+
+   if(!ok)
+   {
+      ++table->failed;
+      return;
+   }
+
+   slots = cur->slots & ((1u << saveformat->numslots) - 1);
+
+   // the mode is a plain field, so it can be checked before decoding
+   if(cur->mode != VTAB_ANYMODE && 
+      (field = FindSaveField(saveformat, SF_MEMBER(mode))))
+   {
+      ReadSaveFields(savefiles, slots, field, 1);
+      for(i = 0; i < saveformat->numslots; ++i)
+      {
+         if(SaveVTabMode(savefiles[i].mode) != cur->mode)
+            slots &= ~(1u << i);
+      }
+   }
+
+   if(!slots)
+      return;
+
+   cur->found = DecodeSaveSlots(saveformat, savefiles, slots);
+
+   for(i = 0; i < NUMSAVEFILES; ++i)
+   {
+      if(cur->found & (1u << i))
+         memcpy(&cur->files[i], &savefiles[i], sizeof(savefile_t));
+   }
+}
+
+//
+// SaveCursorStep
+//
+// Moves the cursor on to the next slot it can return, loading files as it
+// reaches them.
+//
+void SaveCursorStep(savecursor_t *cur)
+{
+   savetable_t *table = ((savevtab_t *)cur->base.pVtab)->table;
+
+   cur->haveeff = false;
+
+   for(;;)
+   {
+      while(++cur->slot < NUMSAVEFILES)
+      {
+         if(cur->found & (1u << cur->slot))
+            return;
+      }
+
+      if(++cur->file >= table->numpaths)
+         return;
+
+      cur->slot = -1;
+      SaveCursorLoad(cur);
+   }
+}
+
+//
+// SaveVTabConnect
+//
+int SaveVTabConnect(sqlite3 *db, void *aux, int argc, const char *const *argv,
+                    sqlite3_vtab **tab, char **err)
+{
+   savevtab_t *vt;
+   int rc;
+
+   if((rc = sqlite3_declare_vtab(db, savevtabschema)) != SQLITE_OK)
+      return rc;
+
+   vt = MemAlloc(sizeof(savevtab_t));
+   memset(vt, 0, sizeof(savevtab_t));
+   vt->table = aux;
+   *tab = &vt->base;
+
+   return SQLITE_OK;
+}
+
+//
+// SaveVTabDisconnect
+//
+int SaveVTabDisconnect(sqlite3_vtab *tab)
+{
+   MemFree(tab, sizeof(savevtab_t));
+   return SQLITE_OK;
+}
+
+//
+// SaveVTabBestIndex
+//
+// Takes any equality tests on path, slot and mode, and costs the scan by the
+// number of slots it will have to decode.
+//
+int SaveVTabBestIndex(sqlite3_vtab *tab, sqlite3_index_info *info)
+{
+   savetable_t *table = ((savevtab_t *)tab)->table;
+   int use[3] = { -1, -1, -1 };   // constraint for path, slot and mode
+   double rows = (double)table->numpaths * NUMSAVEFILES;
+   int i, k, arg = 0;
+
+   for(i = 0; i < info->nConstraint; ++i)
+   {
+      if(!info->aConstraint[i].usable || 
+         info->aConstraint[i].op != SQLITE_INDEX_CONSTRAINT_EQ)
+         continue;
+
+      switch(info->aConstraint[i].iColumn)
+      {
+      case VT_PATH: use[0] = i; break;
+      case VT_SLOT: use[1] = i; break;
+      case VT_MODE: use[2] = i; break;
+      }
+   }
+
+   // SQLite still checks them itself, as they aren't marked omit
+   info->idxNum = 0;
+   for(k = 0; k < 3; ++k)
+   {
+      if(use[k] < 0)
+         continue;
+      info->idxNum |= 1 << k;
+      info->aConstraintUsage[use[k]].argvIndex = ++arg;
+   }
+
+   if(info->idxNum & VTAB_PATH)
+      rows /= table->numpaths;
+   if(info->idxNum & VTAB_SLOT)
+      rows /= NUMSAVEFILES;
+   if(info->idxNum & VTAB_MODE)
+      rows /= NUMMODES;
+
+   info->estimatedCost = rows;
+   info->estimatedRows = (sqlite3_int64)rows + 1;
+
+   return SQLITE_OK;
+}
+
+//
+// SaveVTabOpen
+//
+int SaveVTabOpen(sqlite3_vtab *tab, sqlite3_vtab_cursor **cursor)
+{
+   savecursor_t *cur = MemAlloc(sizeof(savecursor_t));
+
+   memset(cur, 0, sizeof(savecursor_t));
+   cur->files = MemAlloc(NUMSAVEFILES * sizeof(savefile_t));
+   *cursor = &cur->base;
+
+   return SQLITE_OK;
+}
+
+//
+// SaveCursorFreePath
+//
+void SaveCursorFreePath(savecursor_t *cur)
+{
+   if(cur->path)
+      MemFree(cur->path, cur->pathsize);
+   cur->path = NULL;
+}
+
+//
+// SaveVTabClose
+//
+int SaveVTabClose(sqlite3_vtab_cursor *cursor)
+{
+   savecursor_t *cur = (savecursor_t *)cursor;
+
+   SaveCursorFreePath(cur);
+   MemFree(cur->files, NUMSAVEFILES * sizeof(savefile_t));
+   MemFree(cur, sizeof(savecursor_t));
+
+   return SQLITE_OK;
+}
+
+//
+// SaveVTabFilter
+//
+// Starts a scan with the constraints SaveVTabBestIndex took.
+//
+int SaveVTabFilter(sqlite3_vtab_cursor *cursor, int idxnum, const char *idxstr,
+                   int argc, sqlite3_value **argv)
+{
+   savecursor_t *cur = (savecursor_t *)cursor;
+   const char *text;
+   int arg = 0, slot;
+
+   SaveCursorFreePath(cur);
+   cur->slots = ~0u;
+   cur->mode = VTAB_ANYMODE;
+
+   if(idxnum & VTAB_PATH)
+   {
+      // = NULL matches nothing, and neither does an empty path
+      text = (const char *)sqlite3_value_text(argv[arg++]);
+      cur->pathsize = (text ? strlen(text) : 0) + 1;
+      cur->path = MemAlloc(cur->pathsize);
+      strcpy(cur->path, text ? text : "");
+   }
+
+   if(idxnum & VTAB_SLOT)
+   {
+      slot = sqlite3_value_int(argv[arg++]);
+      cur->slots = (slot >= 1 && slot <= NUMSAVEFILES) ? 
+         1u << (slot - 1) : 0;
+   }
+
+   if(idxnum & VTAB_MODE)
+   {
+      text = (const char *)sqlite3_value_text(argv[arg++]);
+      cur->mode = SaveVTabFindMode(text);
+   }
+
+   cur->file = -1;
+   cur->slot = NUMSAVEFILES;
+   cur->found = 0;
+   SaveCursorStep(cur);
+
+   return SQLITE_OK;
+}
+
+//
+// SaveVTabNext
+//
+int SaveVTabNext(sqlite3_vtab_cursor *cursor)
+{
+   SaveCursorStep((savecursor_t *)cursor);
+   return SQLITE_OK;
+}
+
+//
+// SaveVTabEof
+//
+int SaveVTabEof(sqlite3_vtab_cursor *cursor)
+{
+   savecursor_t *cur = (savecursor_t *)cursor;
+
+   return cur->file >= ((savevtab_t *)cursor->pVtab)->table->numpaths;
+}
+
+//
+// SaveVTabColumn
+//
+int SaveVTabColumn(sqlite3_vtab_cursor *cursor, sqlite3_context *ctx, 
+                   int col)
+{
+   savecursor_t *cur = (savecursor_t *)cursor;
+   savetable_t *table = ((savevtab_t *)cursor->pVtab)->table;
+   savefile_t *sf = &cur->files[cur->slot];
+
+   switch(col)
+   {
+   case VT_PATH:
+      sqlite3_result_text(ctx, table->paths[cur->file], -1, SQLITE_STATIC);
+      break;
+   case VT_SLOT:
+      sqlite3_result_int(ctx, cur->slot + 1);
+      break;
+   case VT_NAME:
+      sqlite3_result_text(ctx, sf->name, -1, SQLITE_TRANSIENT);
+      break;
+   case VT_MODE:
+      sqlite3_result_text(ctx, SaveFileModeName(sf), -1, SQLITE_STATIC);
+      break;
+   case VT_TIME:       sqlite3_result_int64(ctx, sf->time / 60);    break;
+   case VT_MAP_PCT:    sqlite3_result_double(ctx, sf->map_pct / 10.0); break;
+   case VT_LV:         sqlite3_result_int64(ctx, sf->lv);           break;
+   case VT_EXP:        sqlite3_result_int64(ctx, sf->exp);          break;
+   case VT_HP:         sqlite3_result_int64(ctx, sf->hp);           break;
+   case VT_MP:         sqlite3_result_int64(ctx, sf->mp);           break;
+   case VT_HEARTS_MAX: sqlite3_result_int(ctx, sf->hearts_max);     break;
+   case VT_STR:
+   case VT_DEF:
+   case VT_INT:
+   case VT_LCK:
+      if(!cur->haveeff)
+      {
+         SaveFileEffectiveStats(sf, &cur->eff);
+         cur->haveeff = true;
+      }
+      sqlite3_result_int(ctx, cur->eff.s[STAT_STR + col - VT_STR]);
+      break;
+   case VT_CHECKSUM_OK:
+      sqlite3_result_int(ctx, sf->checksum_calc == sf->checksum);
+      break;
+   }
+
+   return SQLITE_OK;
+}
+
+//
+// SaveVTabRowid
+//
+int SaveVTabRowid(sqlite3_vtab_cursor *cursor, sqlite3_int64 *rowid)
+{
+   savecursor_t *cur = (savecursor_t *)cursor;
+
+   *rowid = (sqlite3_int64)cur->file * NUMSAVEFILES + cur->slot;
+   return SQLITE_OK;
+}
+
+// eponymous-only: there is no xCreate, and the table is always "saves"
+sqlite3_module savevtabmodule =
+{
+   0,                   // iVersion
+   NULL,                // xCreate
+   SaveVTabConnect,
+   SaveVTabBestIndex,
+   SaveVTabDisconnect,
+   SaveVTabDisconnect,  // xDestroy
+   SaveVTabOpen,
+   SaveVTabClose,
+   SaveVTabFilter,
+   SaveVTabNext,
+   SaveVTabEof,
+   SaveVTabColumn,
+   SaveVTabRowid,
+};
+
+//
+// PrintSQLiteRows
+//
+// Runs one statement and prints its rows, tab-separated, under a line of
+// column names. Returns false if SQLite reports an error.
+//
+bool PrintSQLiteRows(sqlite3_stmt *stmt)
+{
+   const unsigned char *text;
+   int i, n = sqlite3_column_count(stmt), rc;
+
+   for(i = 0; i < n; ++i)
+      printf("%s%s", i ? "\t" : "", sqlite3_column_name(stmt, i));
+   if(n)
+      printf("\n");
+
+   while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+   {
+      for(i = 0; i < n; ++i)
+      {
+         text = sqlite3_column_text(stmt, i);
+         printf("%s%s", i ? "\t" : "", text ? (const char *)text : "");
+      }
+      printf("\n");
+   }
+
+   return rc == SQLITE_DONE;
+}
+
+//
+// RunSQLite
+//
+// Runs SQL against the "saves" table over a list of files. Returns the
+// number of files that couldn't be read, or all of them if the SQL fails.
+//
+int RunSQLite(const char *sql, int numpaths, char **paths)
+{
+   savetable_t table;
+   sqlite3_stmt *stmt;
+   sqlite3 *db;
+   bool ok = true;
+
+   memset(&table, 0, sizeof(table));
+   table.numpaths = numpaths;
+   table.paths = paths;
+
+   if(sqlite3_open(":memory:", &db) != SQLITE_OK ||
+      sqlite3_create_module(db, "saves", &savevtabmodule, &table) != 
+      SQLITE_OK)
+   {
+      SaveFileWarning("Error: couldn't set up SQLite: %s\n", 
+                      sqlite3_errmsg(db));
+      sqlite3_close(db);
+      return numpaths;
+   }
+
+   while(ok && *sql)
+   {
+      if(sqlite3_prepare_v2(db, sql, -1, &stmt, &sql) != SQLITE_OK)
+         ok = false;
+      else if(!stmt)   // only whitespace or comments left
+         break;
+      else
+      {
+         ok = PrintSQLiteRows(stmt);
+         sqlite3_finalize(stmt);
+      }
+   }
+
+   if(!ok)
+      SaveFileWarning("Error: %s\n", sqlite3_errmsg(db));
+
+   fprintf(stderr, "%d files read for %d given\n", table.loaded, numpaths);
+   sqlite3_close(db);
+
+   return ok ? table.failed : numpaths;
+}
+
+#else
+
+int RunSQLite(const char *sql, int numpaths, char **paths)
+{
+   SaveFileWarning("Error: sqlite needs a build with SAVTEST_SQLITE "
+                   "defined\n");
+   return numpaths;
+}
+
+#endif
+
+//
+// Column Export
+//
+// Writes the decoded files out as one flat binary file per column, plus a
+// manifest, so they can be mapped straight into NumPy without any parsing:
+//
+//   savtest <files...> columns <dir>
+//
+//   m = json.load(open(dir + "/manifest.json"))
+//   cols = { c["name"]: np.memmap(dir + "/" + c["file"], dtype=c["dtype"], 
+//                                 mode="r", shape=tuple(c["shape"]))
+//            for c in m["columns"] }
+//
+// Every column has one row per slot, and numbers are little-endian. The
+// "file" column indexes the lines of paths.txt. The map is packed the same
+// way as in the save: bit x & 7 of byte y * 8 + x / 8.
+//
+// The Python module below hands over the same columns without the files.
+//
+
+#define COLUMNS_MAXPATH 1024
+
+enum
+{
+   COL_FILE,
+   COL_SLOT,
+   COL_NAME,
+   COL_MODE,
+   COL_TIME,
+   COL_MAP_PCT,
+   COL_LV,
+   COL_EXP,
+   COL_HP,
+   COL_MP,
+   COL_STR,
+   COL_DEF,
+   COL_INT,
+   COL_LCK,
+   COL_CHECKSUM_OK,
+   COL_RELICS,
+   COL_INVENTORY,
+   COL_DSS,
+   COL_DSS_USED,
+   COL_MAP,
+   NUMCOLUMNS
+};
+
+typedef struct column_s
+{
+   const char *name;
+   const char *dtype;  // NumPy type string
+   int         size;   // bytes per value
+   int         count;  // values per row
+} column_t;
+
+column_t columns[NUMCOLUMNS] =
+{
+   { "file",        "<u4",  4, 1                },
+   { "slot",        "|u1",  1, 1                },
+   { "name",        "|S16", NAME_TEXT_LENGTH, 1 },
+   { "mode",        "<i4",  4, 1                },
+   { "time",        "<i4",  4, 1                },
+   { "map_pct",     "<i2",  2, 1                },
+   { "lv",          "<i2",  2, 1                },
+   { "exp",         "<i4",  4, 1                },
+   { "hp",          "<i4",  4, 1                },
+   { "mp",          "<i4",  4, 1                },
+   { "str",         "<i2",  2, 4                },
+   { "def",         "<i2",  2, 4                },
+   { "int",         "<i2",  2, 4                },
+   { "lck",         "<i2",  2, 4                },
+   { "checksum_ok", "|u1",  1, 1                },
+   { "relics",      "|u1",  1, NUMRELICS        },
+   { "inventory",   "|u1",  1, NUMINV           },
+   { "dss",         "|u1",  1, NUMDSS           },
+   { "dss_used",    "|u1",  1, NUMABILITIES     },
+   { "map",         "|u1",  1, MAP_MASK_SIZE    },
+};
+
+typedef struct colexport_s
+{
+   const char   *dir;
+   FILE         *files[NUMCOLUMNS];
+   unsigned long rows;
+} colexport_t;
+
+//
+// ColumnPut
+//
+// Stores a little-endian value.
+//
+void ColumnPut(byte *p, int size, long v)
+{
+   int i;
+
+   for(i = 0; i < size; ++i)
+      p[i] = (byte)((v >> (8 * i)) & 0xff);
+}
+
+//
+// ColumnRow
+//
+// Fills in one row of a column. Returns the number of bytes.
+//
+int ColumnRow(savefile_t *sf, int col, int file, int slot, byte *row)
+{
+   short *stat = NULL;
+   int i;
+
+   switch(col)
+   {
+   case COL_FILE:        ColumnPut(row, 4, file);           break;
+   case COL_SLOT:        row[0] = (byte)(slot + 1);          break;
+   case COL_MODE:        ColumnPut(row, 4, sf->mode);       break;
+   case COL_TIME:        ColumnPut(row, 4, sf->time);       break;
+   case COL_MAP_PCT:     ColumnPut(row, 2, sf->map_pct);    break;
+   case COL_LV:          ColumnPut(row, 2, sf->lv);         break;
+   case COL_EXP:         ColumnPut(row, 4, sf->exp);        break;
+   case COL_HP:          ColumnPut(row, 4, sf->hp);         break;
+   case COL_MP:          ColumnPut(row, 4, sf->mp);         break;
+   case COL_STR:         stat = sf->str;                    break;
+   case COL_DEF:         stat = sf->def;                    break;
+   case COL_INT:         stat = sf->intel;                  break;
+   case COL_LCK:         stat = sf->lck;                    break;
+   case COL_CHECKSUM_OK: row[0] = (sf->checksum_calc == sf->checksum); break;
+   case COL_NAME:
+      memset(row, 0, NAME_TEXT_LENGTH);
+      memcpy(row, sf->name, strlen(sf->name));
+      break;
+   case COL_RELICS:
+      memcpy(row, sf->relics, NUMRELICS);
+      break;
+   case COL_INVENTORY:
+      memcpy(row, sf->inventory, NUMINV);
+      break;
+   case COL_DSS:
+      for(i = 0; i < NUMDSS; ++i)
+         row[i] = (byte)sf->dss_owned[i];
+      break;
+   case COL_DSS_USED:
+      for(i = 0; i < NUMABILITIES; ++i)
+         row[i] = (byte)sf->dss_used[i];
+      break;
+   case COL_MAP:
+      memcpy(row, sf->data + OFFSET_MAP, MAP_MASK_SIZE);
+      break;
+   }
+
+   if(stat)
+   {
+      for(i = 0; i < 4; ++i)
+         ColumnPut(row + 2 * i, 2, stat[i]);
+   }
+
+   return columns[col].size * columns[col].count;
+}
+
+//
+// ColumnsOpen
+//
+bool ColumnsOpen(colexport_t *ce, const char *dir)
+{
+   char path[COLUMNS_MAXPATH];
+   int col;
+
+   memset(ce, 0, sizeof(*ce));
+   ce->dir = dir;
+
+   // leaves room for the longest file name
+   if(strlen(dir) + 32 > sizeof(path))
+      return SaveFileWarning("Error: output path is too long\n");
+
+   for(col = 0; col < NUMCOLUMNS; ++col)
+   {
+      sprintf(path, "%s/%s.bin", dir, columns[col].name);
+
+      if(!(ce->files[col] = fopen(path, "wb")))
+      {
+         SaveFileWarning("Error: couldn't create %s\n", path);
+         while(col-- > 0)
+            fclose(ce->files[col]);
+         return false;
+      }
+   }
+
+   return true;
+}
+
+//
+// ColumnsAdd
+//
+// Appends a slot to every column.
+//
+void ColumnsAdd(colexport_t *ce, savefile_t *sf, int file, int slot)
+{
+   byte row[MAP_MASK_SIZE];
+   int col, len;
+
+   for(col = 0; col < NUMCOLUMNS; ++col)
+   {
+      len = ColumnRow(sf, col, file, slot, row);
+      fwrite(row, 1, len, ce->files[col]);
+   }
+
+   ++ce->rows;
+}
+
+//
+// ColumnsClose
+//
+// Closes the column files and writes paths.txt and the manifest. Returns
+// false if anything failed to write.
+//
+bool ColumnsClose(colexport_t *ce, int numpaths, char **paths)
+{
+   char path[COLUMNS_MAXPATH];
+   bool ok = true;
+   int col, i;
+   FILE *f;
+
+   for(col = 0; col < NUMCOLUMNS; ++col)
+   {
+      if(!ce->files[col])
+         continue;
+      if(ferror(ce->files[col]))
+         ok = false;
+      fclose(ce->files[col]);
+   }
+
+   if(!ok)
+      return SaveFileWarning("Error: couldn't write columns to %s\n", ce->dir);
+
+   sprintf(path, "%s/paths.txt", ce->dir);
+   if(!(f = fopen(path, "w")))
+      return SaveFileWarning("Error: couldn't create %s\n", path);
+   for(i = 0; i < numpaths; ++i)
+      fprintf(f, "%s\n", paths[i]);
+   ok = !ferror(f);
+   fclose(f);
+
+   sprintf(path, "%s/manifest.json", ce->dir);
+   if(!(f = fopen(path, "w")))
+      return SaveFileWarning("Error: couldn't create %s\n", path);
+
+   fprintf(f, "{\"rows\":%lu,\"paths\":\"paths.txt\",\"columns\":[", 
+           ce->rows);
+   for(col = 0; col < NUMCOLUMNS; ++col)
+   {
+      fprintf(f, "%s\n {\"name\":\"%s\",\"file\":\"%s.bin\",\"dtype\":\"%s\","
+              "\"shape\":[%lu", col ? "," : "", columns[col].name, 
+              columns[col].name, columns[col].dtype, ce->rows);
+      if(columns[col].count > 1)
+         fprintf(f, ",%d", columns[col].count);
+      fprintf(f, "]}");
+   }
+   fprintf(f, "\n]}\n");
+   ok = ok && !ferror(f);
+   fclose(f);
+
+   if(!ok)
+      return SaveFileWarning("Error: couldn't write the manifest to %s\n", 
+                             ce->dir);
+
+   return true;
+}
+
+//
+// Python Module
+//
+// Built with SAVTEST_PYTHON defined, main.c is also a Python extension that
+// hands the same columns straight to Python, with no files in between:
+//
+//   cc -shared -fPIC -DSAVTEST_PYTHON $(python3-config --includes)
+//      -o savtest$(python3-config --extension-suffix) main.c -lm -lpthread
+//
+//   import savtest, numpy as np
+//   cols = savtest.load(paths)
+//   lv = np.asarray(cols["lv"])       # no copy
+//   names = memoryview(cols["name"])
+//
+// load() returns a dict from column name to a read-only buffer object with
+// the shape and type of the Column Export; the "file" column indexes the
+// paths passed in. The buffers implement the buffer protocol over the
+// memory the decoder wrote, so memoryview, numpy.asarray and
+// numpy.frombuffer all use it without copying. The GIL is released for
+// the whole read and decode, so other Python threads keep running. The
+// reader works in globals, so two loads at once take turns.
+//
+
+#ifdef SAVTEST_PYTHON
+
+typedef struct pycolumn_s
+{
+   PyObject_HEAD
+   byte       *data;
+   Py_ssize_t  shape[2];      // rows, and values per row if more than one
+   Py_ssize_t  strides[2];
+   Py_ssize_t  itemsize;
+   int         ndim;
+   char        format[8];     // struct module format
+} pycolumn_t;
+
+// decoded columns on their way to Python, filled without the GIL
+typedef struct pyload_s
+{
+   int          numpaths;
+   char       **paths;
+   byte        *data[NUMCOLUMNS];
+   size_t       rowsize[NUMCOLUMNS];
+   Py_ssize_t   rows;
+   Py_ssize_t   maxrows;      // rows allocated
+} pyload_t;
+
+PyThread_type_lock pyloadlock;
+
+//
+// PyColumnGetBuffer
+//
+int PyColumnGetBuffer(PyObject *self, Py_buffer *view, int flags)
+{
+   pycolumn_t *col = (pycolumn_t *)self;
+
+   if(flags & PyBUF_WRITABLE)
+   {
+      PyErr_SetString(PyExc_BufferError, "savtest columns are read-only");
+      view->obj = NULL;
+      return -1;
+   }
+
+   view->buf = col->data;
+   view->obj = self;
+   Py_INCREF(self);
+   view->len = col->shape[0] * col->strides[0];
+   view->readonly = 1;
+   view->itemsize = col->itemsize;
+   view->format = (flags & PyBUF_FORMAT) ? col->format : NULL;
+   view->ndim = col->ndim;
+   view->shape = (flags & PyBUF_ND) ? col->shape : NULL;
+   view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? 
+      col->strides : NULL;
+   view->suboffsets = NULL;
+   view->internal = NULL;
+
+   return 0;
+}
+
+//
+// PyColumnDealloc
+//
+void PyColumnDealloc(PyObject *self)
+{
+   PyMem_RawFree(((pycolumn_t *)self)->data);
+   Py_TYPE(self)->tp_free(self);
+}
+
+PyBufferProcs pycolumnbuffer = { PyColumnGetBuffer, NULL };
+
+PyTypeObject pycolumntype =
+{
+   PyVarObject_HEAD_INIT(NULL, 0)
+   "savtest.Column",              // tp_name
+   sizeof(pycolumn_t),            // tp_basicsize
+};
+
+//
+// PyColumnFormat
+//
+// Turns a NumPy type string from the columns table into the struct module
+// format the buffer protocol uses. The columns are little-endian, which is
+// the native order on most machines; saying so without the "<" there lets
+// memoryview index them as well as NumPy.
+//
+void PyColumnFormat(const column_t *c, char *format)
+{
+   const char *ints = c->dtype[1] == 'u' ? "BH?I" : "bh?i";
+   short one = 1;
+
+   if(c->dtype[1] == 'S')
+      sprintf(format, "%ds", c->size);
+   else
+      sprintf(format, *(byte *)&one ? "%c" : "<%c", ints[c->size - 1]);
+}
+
+//
+// PyLoadFiles
+//
+// Reads every file and stores each slot's row of every column. Runs
+// without the GIL, so it touches no Python objects.
+//
+void PyLoadFiles(pyload_t *pl)
+{
+   Py_ssize_t newrows;
+   int col, i, slot;
+
+   for(i = 0; i < pl->numpaths; ++i)
+   {
+      if(!LoadSaveRAMFile(pl->paths[i]))
+         continue;
+
+      for(slot = 0; slot < NUMSAVEFILES; ++slot)
+      {
+         if(!savefiles[slot].exists)
+            continue;
+
+         if(pl->rows == pl->maxrows)
+         {
+            newrows = pl->maxrows ? pl->maxrows * 2 : 1024;
+            for(col = 0; col < NUMCOLUMNS; ++col)
+            {
+               pl->data[col] = PyMem_RawRealloc(pl->data[col], 
+                                                newrows * pl->rowsize[col]);
+               if(!pl->data[col])
+                  SaveFileError("Error: out of memory\n");
+            }
+            pl->maxrows = newrows;
+         }
+
+         for(col = 0; col < NUMCOLUMNS; ++col)
+         {
+            ColumnRow(&savefiles[slot], col, i, slot, 
+                      pl->data[col] + pl->rows * pl->rowsize[col]);
+         }
+         ++pl->rows;
+      }
+   }
+}
+
+//
+// PyLoad
+//
+// savtest.load(paths): decodes the files and returns their columns.
+//
+PyObject *PyLoad(PyObject *self, PyObject *args)
+{
+   PyObject *list, *seq, *item, *dict = NULL;
+   pycolumn_t *pc;
+   const char *path;
+   pyload_t pl;
+   int col, i;
+
+   if(!PyArg_ParseTuple(args, "O:load", &list))
+      return NULL;
+   if(!(seq = PySequence_Fast(list, "load() needs a sequence of paths")))
+      return NULL;
+
+   memset(&pl, 0, sizeof(pl));
+   pl.numpaths = (int)PySequence_Fast_GET_SIZE(seq);
+   pl.paths = PyMem_RawCalloc(pl.numpaths + 1, sizeof(char *));
+
+   // copy the paths, since the list can change once the GIL is let go
+   for(i = 0; i < pl.numpaths; ++i)
+   {
+      item = PySequence_Fast_GET_ITEM(seq, i);
+      if(!(path = PyUnicode_Check(item) ? PyUnicode_AsUTF8(item) : NULL) ||
+         !(pl.paths[i] = PyMem_RawMalloc(strlen(path) + 1)))
+      {
+         if(!PyErr_Occurred())
+            PyErr_SetString(PyExc_TypeError, "paths must be strings");
+         goto done;
+      }
+      strcpy(pl.paths[i], path);
+   }
+
+   for(col = 0; col < NUMCOLUMNS; ++col)
+      pl.rowsize[col] = columns[col].size * columns[col].count;
+
+   Py_BEGIN_ALLOW_THREADS
+   PyThread_acquire_lock(pyloadlock, WAIT_LOCK);
+   PyLoadFiles(&pl);
+   PyThread_release_lock(pyloadlock);
+   Py_END_ALLOW_THREADS
+
+   if(!(dict = PyDict_New()))
+      goto done;
+
+   for(col = 0; col < NUMCOLUMNS; ++col)
+   {
+      if(!(pc = PyObject_New(pycolumn_t, &pycolumntype)))
+      {
+         Py_CLEAR(dict);
+         goto done;
+      }
+
+      // the column owns its memory from here on
+      pc->data = pl.data[col];
+      pl.data[col] = NULL;
+      pc->itemsize = columns[col].size;
+      pc->ndim = columns[col].count > 1 ? 2 : 1;
+      pc->shape[0] = pl.rows;
+      pc->shape[1] = columns[col].count;
+      pc->strides[0] = pl.rowsize[col];
+      pc->strides[1] = columns[col].size;
+      PyColumnFormat(&columns[col], pc->format);
+
+      i = PyDict_SetItemString(dict, columns[col].name, (PyObject *)pc);
+      Py_DECREF(pc);
+      if(i < 0)
+      {
+         Py_CLEAR(dict);
+         goto done;
+      }
+   }
+
+done:
+   for(col = 0; col < NUMCOLUMNS; ++col)
+      PyMem_RawFree(pl.data[col]);
+   for(i = 0; i < pl.numpaths; ++i)
+      PyMem_RawFree(pl.paths[i]);
+   PyMem_RawFree(pl.paths);
+   Py_DECREF(seq);
+
+   return dict;
+}
+
+PyMethodDef pymethods[] =
+{
+   { "load", PyLoad, METH_VARARGS, 
+     "load(paths) -> dict of column name to a read-only buffer" },
+   { NULL, NULL, 0, NULL }
+};
+
+PyModuleDef pymodule =
+{
+   PyModuleDef_HEAD_INIT, "savtest", 
+   "Circle of the Moon save RAM columns", -1, pymethods
+};
+
+//
+// PyInit_savtest
+//
+PyMODINIT_FUNC PyInit_savtest(void)
+{
+   pycolumntype.tp_dealloc = PyColumnDealloc;
+   pycolumntype.tp_as_buffer = &pycolumnbuffer;
+   pycolumntype.tp_flags = Py_TPFLAGS_DEFAULT;
+   pycolumntype.tp_doc = "A decoded column; use it through memoryview";
+
+   if(PyType_Ready(&pycolumntype) < 0)
+      return NULL;
+
+   if(!pyloadlock && !(pyloadlock = PyThread_allocate_lock()))
+      return PyErr_NoMemory();
+
+   // the tables main would build
+   InitStatTables();
+   InitSaveFormats();
+   InitMapAreas();
+   InitReachability();
+
+   return PyModule_Create(&pymodule);
+}
+
+#endif
+
+//
+// Scan Journal
+//
+// Long scans can be resumed. With --journal, every input that's finished
+// is added to an append-only journal along with its size, modification
+// time and a hash of its contents. Output goes into numbered shard files
+// next to the journal instead of stdout. Each shard is written under a
+// temporary name, synced to disk and renamed into place once it's
+// complete. Only then are its inputs added to the journal, in one write
+// that ends with the shard's own line, which is synced as well. When a
+// scan is run again with the same journal, inputs that are listed with an
+// unchanged size and time are skipped. One whose time has changed but whose
+// contents haven't is skipped too, once it's been hashed to make sure. So
+// an interrupted scan only has the remainder left to do.
+//
+//   savtest <files...> json stats --journal scan.jnl [--shard FILES]
+//
+// writes scan.jnl.00000, scan.jnl.00001, ... with FILES inputs apiece
+// (default 1000). Journal lines are
+//
+//   done <size> <mtime> <hash> <path>
+//   shard <number> <slots>
+//   commit
+//
+// A run of done lines only counts once the shard or commit line after it
+// is there. If a scan is cut off partway through writing them, the inputs
+// are done again and their shard is written again under the same number.
+//
+// Sanitize takes a journal too, so that files rewritten in place aren't
+// sanitized twice. It has no output, so each file is recorded, followed by
+// a commit line, as soon as it's done.
+//
+
+#define JOURNAL_MAXLINE  1100
+#define JOURNAL_MAXPATH  1024
+#define JOURNAL_SHARD    1000
+
+typedef struct journalentry_s
+{
+   char         *path;
+   long          size;
+   long          mtime;
+   unsigned int  hash;
+   int           slots;
+   unsigned long seq;           // order in the journal; later ones win
+} journalentry_t;
+
+typedef struct journal_s
+{
+   const char     *path;
+   FILE           *f;            // journal, open for appending
+
+   journalentry_t *done;         // inputs already finished, sorted by path
+   unsigned int    numdone;
+   unsigned int    allocdone;
+   unsigned int    shards;       // shards committed so far
+   unsigned long   slots;        // slots written to them
+
+   FILE           *out;          // the shard being written, if any
+   char            outpath[JOURNAL_MAXPATH];
+   journalentry_t *pending;      // inputs in the current shard
+   unsigned int    numpending;
+   unsigned int    allocpending;
+} journal_t;
+
+//
+// JournalPush
+//
+// Appends an entry to one of a journal's lists, copying the path.
+//
+void JournalPush(journalentry_t **list, unsigned int *count, 
+                 unsigned int *alloc, const char *path, long size, 
+                 long mtime, unsigned int hash, int slots)
+{
+   journalentry_t *je;
+
+   if(*count == *alloc)
+   {
+      unsigned int newalloc = *alloc ? *alloc * 2 : 256;
+
+      *list  = MemRealloc(*list, *alloc * sizeof(journalentry_t), 
+                          newalloc * sizeof(journalentry_t));
+      *alloc = newalloc;
+   }
+
+   je = &(*list)[(*count)++];
+   je->path  = MemAlloc(strlen(path) + 1);
+   strcpy(je->path, path);
+   je->size  = size;
+   je->mtime = mtime;
+   je->hash  = hash;
+   je->slots = slots;
+   je->seq   = 0;
+}
+
+//
+// JournalCompare
+//
+int JournalCompare(const void *a, const void *b)
+{
+   return strcmp(((const journalentry_t *)a)->path, 
+                 ((const journalentry_t *)b)->path);
+}
+
+//
+// JournalSortCompare
+//
+// Sorts by path, and by the order they were written for the same path.
+//
+int JournalSortCompare(const void *a, const void *b)
+{
+   const journalentry_t *ja = a, *jb = b;
+   int c = strcmp(ja->path, jb->path);
+
+   if(c)
+      return c;
+
+   return ja->seq < jb->seq ? -1 : ja->seq > jb->seq;
+}
+
+//
+// JournalFreePending
+//
+void JournalFreePending(journal_t *j)
+{
+   unsigned int i;
+
+   for(i = 0; i < j->numpending; ++i)
+      MemFree(j->pending[i].path, strlen(j->pending[i].path) + 1);
+
+   j->numpending = 0;
+}
+
+//
+// JournalSync
+//
+// Makes sure what's been written to a file is on the disk, not just in the
+// system's cache, so that it survives a crash. Returns false if it isn't.
+//
+bool JournalSync(FILE *f)
+{
+   if(fflush(f))
+      return false;
+
+#ifdef _WIN32
+   return !_commit(_fileno(f));
+#else
+   return !fsync(fileno(f));
+#endif
+}
+
+//
+// JournalSyncDir
+//
+// Syncs the directory a file is in, so that a rename into it is on the
+// disk too. Windows has no way to do this, and doesn't need one.
+//
+void JournalSyncDir(const char *path)
+{
+#ifndef _WIN32
+   char dir[JOURNAL_MAXPATH];
+   const char *sep = strrchr(path, '/');
+   int fd;
+
+   if(!sep)
+      strcpy(dir, ".");
+   else
+   {
+      memcpy(dir, path, sep - path + (sep == path));
+      dir[sep - path + (sep == path)] = '\0';
+   }
+
+   if((fd = open(dir, O_RDONLY)) >= 0)
+   {
+      fsync(fd);
+      close(fd);
+   }
+#endif
+}
+
+//
+// JournalWrite
+//
+// Appends a complete record to the journal in one write, and syncs it.
+//
+bool JournalWrite(journal_t *j, strbuf_t *sb)
+{
+   if(fwrite(sb->buf, 1, sb->len, j->f) != sb->len || !JournalSync(j->f))
+      return SaveFileWarning("Error: couldn't write to %s\n", j->path);
+
+   return true;
+}
+
+//
+// JournalOpen
+//
+// Loads what an existing journal says is finished, and opens it to add
+// more. Done lines that aren't followed by a shard or commit line, from a
+// scan that was cut off while writing them, are ignored, as is a partial
+// last line, which is ended so that new records start clean.
+//
+bool JournalOpen(journal_t *j, const char *path)
+{
+   char line[JOURNAL_MAXLINE];
+   bool partial = false;
+   unsigned long seq = 0;
+   unsigned int i;
+   FILE *f;
+
+   memset(j, 0, sizeof(*j));
+   j->path = path;
+
+   if(strlen(path) + 16 > JOURNAL_MAXPATH)
+      return SaveFileWarning("Error: journal path is too long\n");
+
+   if((f = fopen(path, "r")))
+   {
+      while(fgets(line, sizeof(line), f))
+      {
+         long size, mtime, slots;
+         unsigned int hash, shard;
+         int pos;
+         size_t len = strlen(line);
+         bool end = false;
+
+         if(!len || line[len - 1] != '\n')
+         {
+            partial = true;
+            break;
+         }
+         line[len - 1] = '\0';
+
+         if(sscanf(line, "done %ld %ld %x %n", &size, &mtime, &hash, 
+                   &pos) == 3 && line[pos])
+         {
+            JournalPush(&j->pending, &j->numpending, &j->allocpending, 
+                        line + pos, size, mtime, hash, 0);
+         }
+         else if(sscanf(line, "shard %u %ld", &shard, &slots) == 2)
+         {
+            j->shards = shard + 1;
+            j->slots += slots;
+            end = true;
+         }
+         else if(!strcmp(line, "commit"))
+            end = true;
+
+         if(!end)
+            continue;
+
+         // the record is complete; its inputs are done
+         for(i = 0; i < j->numpending; ++i)
+         {
+            journalentry_t *je = &j->pending[i];
+
+            JournalPush(&j->done, &j->numdone, &j->allocdone, je->path,
+                        je->size, je->mtime, je->hash, 0);
+            j->done[j->numdone - 1].seq = seq++;
+         }
+         JournalFreePending(j);
+      }
+      fclose(f);
+
+      JournalFreePending(j);
+      qsort(j->done, j->numdone, sizeof(journalentry_t), JournalSortCompare);
+   }
+
+   if(!(j->f = fopen(path, "a")))
+      return SaveFileWarning("Error: couldn't open %s to write\n", path);
+
+   if(partial)
+      fputc('\n', j->f);
+
+   return true;
+}
+
+//
+// JournalHashFile
+//
+// Hashes a file's contents the same way finished inputs are hashed.
+//
+bool JournalHashFile(const char *path, unsigned int *hash)
+{
+   FILE *f;
+   size_t c;
+   bool truncated;
+
+   if(!(f = fopen(path, "rb")))
+      return false;
+
+   c = ReadContainer(f, &truncated);
+   fclose(f);
+
+   *hash = DataHash(containerbuf, (int)c);
+
+   return true;
+}
+
+//
+// JournalFinished
+//
+// Returns true if the journal has an input with the same path and contents
+// as the file now. A matching size and time are taken to mean the same
+// contents; if only the time differs, the file is hashed to find out, and
+// its new time is recorded if it hasn't changed.
+//
+bool JournalFinished(journal_t *j, const char *path)
+{
+   journalentry_t key, *je;
+   long size, mtime;
+   unsigned int hash;
+   strbuf_t sb;
+
+   if(!j->numdone || !WatchStat(path, &mtime, &size))
+      return false;
+
+   key.path = (char *)path;
+   if(!(je = bsearch(&key, j->done, j->numdone, sizeof(journalentry_t), 
+                     JournalCompare)))
+      return false;
+
+   // the last record for the path is the one that counts
+   while(je + 1 < j->done + j->numdone && !strcmp(je[1].path, path))
+      ++je;
+
+   if(je->size != size)
+      return false;
+
+   if(je->mtime == mtime)
+      return true;
+
+   if(!JournalHashFile(path, &hash) || hash != je->hash)
+      return false;
+
+   je->mtime = mtime;
+
+   SB_Init(&sb);
+   SB_Printf(&sb, "done %ld %ld %08x %s\ncommit\n", size, mtime, hash, path);
+   JournalWrite(j, &sb);
+   SB_Free(&sb);
+
+   return true;
+}
+
+//
+// JournalBeginShard
+//
+// Opens the next shard under its temporary name.
+//
+bool JournalBeginShard(journal_t *j)
+{
+   sprintf(j->outpath, "%s.%05u.tmp", j->path, j->shards);
+
+   if(!(j->out = fopen(j->outpath, "wb")))
+      return SaveFileWarning("Error: couldn't create %s\n", j->outpath);
+
+   return true;
+}
+
+//
+// JournalAdd
+//
+// Notes that an input is finished, with the hash of what's now in it. It's
+// written to the journal when the shard it went into is committed. The
+// size and time are taken now, after the work, since sanitizing in place
+// changes them.
+//
+void JournalAdd(journal_t *j, const char *path, unsigned int hash, 
+                int slots)
+{
+   long size = 0, mtime = 0;
+
+   WatchStat(path, &mtime, &size);
+
+   JournalPush(&j->pending, &j->numpending, &j->allocpending, path, size, 
+               mtime, hash, slots);
+}
+
+//
+// JournalCommit
+//
+// Syncs the current shard, if there is one, and renames it into place, then
+// records its inputs. Returns false if the shard couldn't be written, in
+// which case its inputs are left to be done again.
+//
+bool JournalCommit(journal_t *j)
+{
+   char final[JOURNAL_MAXPATH];
+   unsigned long slots = 0;
+   unsigned int i;
+   strbuf_t sb;
+   bool ok = true;
+
+   final[0] = '\0';
+
+   if(j->out)
+   {
+      ok = !ferror(j->out) && JournalSync(j->out);
+      ok = !fclose(j->out) && ok;
+      j->out = NULL;
+
+      strcpy(final, j->outpath);
+      final[strlen(final) - 4] = '\0';   // drop ".tmp"
+
+#ifdef _WIN32
+      // rename won't replace a file here
+      remove(final);
+#endif
+      if(!ok || rename(j->outpath, final))
+      {
+         remove(j->outpath);
+         ok = SaveFileWarning("Error: couldn't write %s\n", final);
+      }
+      else
+         JournalSyncDir(final);
+   }
+
+   if(ok && j->numpending)
+   {
+      SB_Init(&sb);
+
+      for(i = 0; i < j->numpending; ++i)
+      {
+         journalentry_t *je = &j->pending[i];
+
+         SB_Printf(&sb, "done %ld %ld %08x %s\n", je->size, je->mtime, 
+                   je->hash, je->path);
+         slots += je->slots;
+      }
+
+      if(final[0])
+         SB_Printf(&sb, "shard %u %lu\n", j->shards, slots);
+      else
+         SB_Printf(&sb, "commit\n");
+
+      if((ok = JournalWrite(j, &sb)) && final[0])
+      {
+         ++j->shards;
+         j->slots += slots;
+      }
+
+      SB_Free(&sb);
+   }
+
+   JournalFreePending(j);
+
+   return ok;
+}
+
+//
+// JournalClose
+//
+void JournalClose(journal_t *j)
+{
+   unsigned int i;
+
+   for(i = 0; i < j->numdone; ++i)
+      MemFree(j->done[i].path, strlen(j->done[i].path) + 1);
+
+   JournalFreePending(j);
+
+   MemFree(j->done, j->allocdone * sizeof(journalentry_t));
+   MemFree(j->pending, j->allocpending * sizeof(journalentry_t));
+
+   if(j->f)
+      fclose(j->f);
+}
+
+//
+// Data Checks
+//
+// Several of the tables above were worked out by hand and are marked as
+// needing verification. The verify command holds them up against what real
+// save files contain and counts how often the two agree:
+//
+// savtest <files...> verify
+//
+// Every disagreement is listed as it is found, and a count for each check is
+// printed at the end. Run it over saves from a real cartridge; a check that
+// doesn't agree for all of them means the table it covers is wrong.
+//
+
+enum
+{
+   VERIFY_EQUIP,     // equip totals without the Star Bracelet
+   VERIFY_BRACELET1, // equip totals with the Star Bracelet on arm 1
+   VERIFY_BRACELET2, // equip totals with the Star Bracelet on arm 2
+   VERIFY_DSSMOD,    // DSS stats for the combinations in dssstatmods
+   VERIFY_DSSOTHER,  // DSS stats for every other combination
+   VERIFY_UPSMAX,    // Up counts are no more than the totals
+   VERIFY_UPSFULL,   // Up counts in a 100% map file equal the totals
+   VERIFY_NAMECODES, // name codes are all in the font or Jr
+   VERIFY_AREACELLS, // box cells agree with the map percentage
+   VERIFY_GATES,     // no area explored without the relics it needs
+   VERIFY_ENTRANCE,  // anything explored includes the entrance
+   NUMVERIFY
+};
+
+const char *verifynames[NUMVERIFY] =
+{
+   "equip totals, no Star Bracelet",
+   "equip totals, Star Bracelet on arm 1",
+   "equip totals, Star Bracelet on arm 2",
+   "DSS stats, stat-changing combinations",
+   "DSS stats, other combinations",
+   "Up counts within the totals",
+   "Up counts at 100% map match the totals",
+   "name codes in the font or Jr",
+   "area box cells match the map %",
+   "areas explored only with their relics",
+   "entrance explored",
+};
+
+typedef struct verifyset_s
+{
+   unsigned int checked[NUMVERIFY];
+   unsigned int agreed[NUMVERIFY];
+} verifyset_t;
+
+//
+// VerifyCheck
+//
+// Counts one check, and lists it if it didn't agree.
+//
+void VerifyCheck(verifyset_t *v, int check, bool agrees, const char *path,
+                 int slot, const char *what)
+{
+   ++v->checked[check];
+
+   if(agrees)
+      ++v->agreed[check];
+   else
+      printf("%s:%d %s: %s\n", path, slot + 1, verifynames[check], what);
+}
+
+//
+// VerifyStats
+//
+// Compares a computed stat vector against one column of the stats stored in
+// the file (1 for equip, 2 for DSS).
+//
+void VerifyStats(verifyset_t *v, int check, savefile_t *sf, int column,
+                 const statvec_t *computed, const char *path, int slot)
+{
+   char what[96];
+
+   sprintf(what, "computed %d/%d/%d/%d, file has %d/%d/%d/%d",
+           computed->s[STAT_STR], computed->s[STAT_DEF], 
+           computed->s[STAT_INT], computed->s[STAT_LCK],
+           sf->str[column], sf->def[column], 
+           sf->intel[column], sf->lck[column]);
+
+   VerifyCheck(v, check, 
+               computed->s[STAT_STR] == sf->str[column] &&
+               computed->s[STAT_DEF] == sf->def[column] &&
+               computed->s[STAT_INT] == sf->intel[column] &&
+               computed->s[STAT_LCK] == sf->lck[column], path, slot, what);
+}
+
+//
+// VerifyAdd
+//
+// Runs every check against one file slot.
+//
+void VerifyAdd(verifyset_t *v, savefile_t *sf, const char *path, int slot)
+{
+   statvec_t base, equip, eff, dss;
+   char what[96];
+   int explored[NUMAREAS];
+   unsigned int relicbits;
+   mapboard_t explore;
+   bool known;
+   int area, cells, boxcells;
+   int armor  = SaveFileValidItem(sf->armor);
+   int arm1   = SaveFileValidItem(sf->arm_first);
+   int arm2   = SaveFileValidItem(sf->arm_second);
+   int action = SaveFileValidCard(sf->action_card);
+   int attrib = SaveFileValidCard(sf->attribute_card);
+   int check, i, s;
+
+   // equip totals cover the armor and arm tables and the bracelet split
+   CalculateEquipStats(armor, arm1, arm2, &equip);
+
+   if(arm1 == INV_STAR_BRACELET)
+      check = VERIFY_BRACELET1;
+   else if(arm2 == INV_STAR_BRACELET)
+      check = VERIFY_BRACELET2;
+   else
+      check = VERIFY_EQUIP;
+
+   VerifyStats(v, check, sf, 1, &equip, path, slot);
+
+   // the DSS column is taken to be whatever the combination adds on top of
+   // the base and equip stats
+   SaveFileBaseStats(sf, &base);
+   SaveFileEffectiveStats(sf, &eff);
+
+   for(s = 0; s < NUMSTATS; ++s)
+      dss.s[s] = eff.s[s] - base.s[s] - equip.s[s];
+
+   check = VERIFY_DSSOTHER;
+   for(i = 0; i < NUMDSSSTATMODS; ++i)
+   {
+      if(dssstatmods[i].action == action && 
+         dssstatmods[i].attribute == attrib)
+         check = VERIFY_DSSMOD;
+   }
+
+   VerifyStats(v, check, sf, 2, &dss, path, slot);
+
+   // a count above a total means the total is too low; a complete map with
+   // fewer means it's too high, or that the player skipped some
+   sprintf(what, "hearts %d of %d, HP %d of %d, MP %d of %d",
+           sf->numheartups, TOTAL_HEARTUPS, sf->numhpups, TOTAL_HPUPS,
+           sf->nummpups, TOTAL_MPUPS);
+
+   VerifyCheck(v, VERIFY_UPSMAX, 
+               sf->numheartups <= TOTAL_HEARTUPS &&
+               sf->numhpups <= TOTAL_HPUPS &&
+               sf->nummpups <= TOTAL_MPUPS, path, slot, what);
+
+   if(sf->map_pct >= 1000)
+   {
+      VerifyCheck(v, VERIFY_UPSFULL,
+                  sf->numheartups == TOTAL_HEARTUPS &&
+                  sf->numhpups == TOTAL_HPUPS &&
+                  sf->nummpups == TOTAL_MPUPS, path, slot, what);
+   }
+
+   // a code past Jr means the font has more characters than the table
+   // (or that Jr isn't where it's thought to be)
+   strcpy(what, "codes");
+   known = true;
+   for(i = 0; i < NAME_LENGTH; ++i)
+   {
+      byte code = sf->data[OFFSET_NAME + i];
+
+      sprintf(what + strlen(what), " %d", code);
+      if(code > NAME_CODE_JR)
+         known = false;
+   }
+
+   VerifyCheck(v, VERIFY_NAMECODES, known, path, slot, what);
+
+   // the game's map percentage is of its real rooms, so explored cells 
+   // over it says how many cells the castle has; boxes with a lot of empty
+   // space in them cover more than that. Below 10% the rounding of the
+   // percentage is too coarse to tell.
+   if(sf->map_pct >= 100)
+   {
+      CalculateAreaExplored(sf, explored);
+      for(area = cells = boxcells = 0; area < NUMAREAS; ++area)
+      {
+         cells    += explored[area];
+         boxcells += areacells[area];
+      }
+      cells = (int)((long)cells * 1000 / sf->map_pct);
+
+      sprintf(what, "the boxes cover %d cells, the map %% implies %d",
+              boxcells, cells);
+      VerifyCheck(v, VERIFY_AREACELLS, 
+                  abs(cells - boxcells) <= boxcells / 100 + 1, 
+                  path, slot, what);
+   }
+
+   // nobody gets into an area without what it takes, so a file that has
+   // been in one without it shows the gate is wrong (or the box is)
+   CalculateAreaExplored(sf, explored);
+   relicbits = SaveFileRelicBits(sf);
+   for(area = 0, cells = 0; area < NUMAREAS; ++area)
+   {
+      unsigned int missing = areagates[area] & ~relicbits;
+
+      if(!explored[area] || !missing)
+         continue;
+
+      // name the first one; the rest are just counted
+      if(!cells++)
+      {
+         for(i = 0; !(missing & RELICBIT(i)); ++i)
+            ;
+         sprintf(what, "%d cells of %s without %s", explored[area], 
+                 areanames[area], relics[i].name);
+      }
+   }
+
+   if(cells > 1)
+      sprintf(what + strlen(what), ", and %d more areas", cells - 1);
+
+   VerifyCheck(v, VERIFY_GATES, !cells, path, slot, what);
+
+   // every route is measured from the entrance, so it had better be
+   // somewhere the player has been
+   MapBoardFromPacked(&explore, sf->data + OFFSET_MAP);
+   if(MapBoardCount(&explore))
+   {
+      VerifyCheck(v, VERIFY_ENTRANCE, 
+                  (explore.rows[ENTRANCE_Y][ENTRANCE_X >> 5] >> 
+                   (ENTRANCE_X & 31)) & 1, 
+                  path, slot, "the entrance cell isn't explored");
+   }
+}
+
+//
+// PrintVerify
+//
+// Prints how many slots agreed with each check.
+//
+void PrintVerify(verifyset_t *v)
+{
+   int i;
+
+   for(i = 0; i < NUMVERIFY; ++i)
+   {
+      if(!v->checked[i])
+         printf("%-40s not seen\n", verifynames[i]);
+      else
+      {
+         printf("%-40s %u of %u agree\n", verifynames[i], v->agreed[i], 
+                v->checked[i]);
+      }
+   }
+}
+
+//
+// Command Interface
+//
+// Everything the menus can show can also be run from the command line or a
+// script, over any number of save RAM files in one go:
+//
+// savtest <files...> show <screen> [--slot N]
+// savtest <files...> json <view> [--slot N]
+// savtest <files...> query '<expression>'
+// savtest <files...> rank [--top K]
+// savtest <files...> optimize <stat> [--min STAT VALUE]
+// savtest <files...> sanitize --key KEY [--jitter SECONDS] [--out DIR]
+// savtest <files...> nameindex <index>
+// savtest <files...> cluster [--maxdist N] [--table FILE]
+// savtest <files...> train <model>
+// savtest <files...> score <model> [--min SCORE]
+// savtest <files...> aggregate [--save SKETCH]
+// savtest <files...> sql [--first ID]
+// savtest <files...> sqlite '<SQL>'
+// savtest <files...> columns <dir>
+// savtest <files...> verify
+// savtest <files...> repl
+//
+// Any of json, query, sql and sanitize can also take --journal FILE and
+// --shard FILES to make the scan resumable; see Scan Journal above.
+//
+// Anywhere on the command line, --dss FILE loads names and effects for the
+// DSS combinations; see ReadDSSCatalog.
+//
+// A file that has the same name as a command is still taken as a file. To
+// be certain, put "--" between the files and the command.
+//
+// "repl" reads further commands from stdin, one per line, and runs each over
+// the same files. Queries are parsed once and then evaluated against every
+// file slot.
+//
+
+enum
+{
+   CMD_SHOW,
+   CMD_JSON,
+   CMD_QUERY,
+   CMD_RANK,
+   CMD_OPTIMIZE,
+   CMD_SANITIZE,
+   CMD_NAMEINDEX,
+   CMD_CLUSTER,
+   CMD_TRAIN,
+   CMD_SCORE,
+   CMD_AGGREGATE,
+   CMD_SQL,
+   CMD_SQLITE,
+   CMD_COLUMNS,
+   CMD_VERIFY,
+   CMD_REPL,
+   NUMCOMMANDS
+};
+
+const char *commandnames[NUMCOMMANDS] =
+{
+   "show", "json", "query", "rank", "optimize", "sanitize", "nameindex",
+   "cluster",
+   "train", "score", "aggregate", "sql", "sqlite",
+   "columns", "verify", "repl",
+};
+
+//
+// Text screens available to the show command
+//
+
+//
+// ShowDSS
+//
+// The DSS screen without its menu: owned cards and combinations.
+//
+void ShowDSS(void)
+{
+   PrintDSSCards(false);
+   ViewDSSCombos();
+}
+
+//
+// ShowReach
+//
+// Just the reachability summary from the map screen.
+//
+void ShowReach(void)
+{
+   PrintReach(&savefiles[current_file]);
+}
+
+invrange_t inventoryclasses[] =
+{
+   { "Armor",           INV_LEATHER_ARMOR,    INV_SHINING_ARMOR    },
+   { "Robes",           INV_COTTON_ROBE,      INV_SAGE_ROBE        },
+   { "Clothes",         INV_COTTON_CLOTHES,   INV_SOLDIER_FATIGUES },
+   { "Armbands",        INV_STRENGTH_ARMBAND, INV_MIRACLE_ARMBAND  },
+   { "Paired Armbands", INV_DOUBLE_GRIPS,     INV_STAR_BRACELET    },
+   { "Rings",           INV_STRENGTH_RING,    INV_CURSED_RING      },
+   { "Odd Rings",       INV_TOY_RING,         INV_BEAR_RING        },
+   { "Usable Items",    INV_POTION,           INV_HEART_MEGA       },
+};
+
+#define NUMINVCLASSES ((int)(sizeof(inventoryclasses) / sizeof(invrange_t)))
+
+//
+// ShowInventory
+//
+// The whole inventory without its menus.
+//
+void ShowInventory(void)
+{
+   int i;
+
+   for(i = 0; i < NUMINVCLASSES; ++i)
+   {
+      PrintInventoryRange(inventoryclasses[i].name, inventoryclasses[i].first,
+                          inventoryclasses[i].last);
+   }
+}
+
+typedef struct textview_s
+{
+   const char *name;
+   void (*func)(void);
+   bool perimage;      // shown once per save RAM rather than once per file
+} textview_t;
+
+textview_t textviews[] =
+{
+   { "stats",      ViewStats,          false },
+   { "equip",      ViewEquip,          false },
+   { "dss",        ShowDSS,            false },
+   { "inventory",  ShowInventory,      false },
+   { "relics",     ViewRelics,         false },
+   { "ups",        ViewUps,            false },
+   { "map",        ViewMap,            false },
+   { "reach",      ShowReach,          false },
+   { "checksum",   ViewChecksum,       false },
+   { "completion", ViewCompletion,     true  },
+   { "cartridge",  PrintCartridgeInfo, true  },
+};
+
+#define NUMTEXTVIEWS ((int)(sizeof(textviews) / sizeof(textview_t)))
+
+//
+// command_t
+//
+// A parsed command, ready to run over any number of files.
+//
+typedef struct command_s
+{
+   int     type;  // CMD_ value
+   int     view;  // text or JSON view for show and json
+   int     slot;  // 0 - 7, or -1 for all of them
+   int     top;   // number of entries for rank
+   query_t query; // compiled expression for query
+
+   loadoutquery_t loadout; // stat to maximize and minimum for optimize
+
+   // sanitize
+   const char *key;    // hash key for names
+   long        jitter; // most seconds to move times by
+   const char *outdir; // NULL to rewrite files in place
+
+   const char *output;   // index file for nameindex, model for train/score,
+                         // sketch file for aggregate, directory for columns,
+                         // side table for cluster, SQL for sqlite
+   int         maxdist;  // most signature bits apart for cluster
+   double      minscore; // lowest score listed by score
+   long        firstid;  // first slot id for sql
+
+   const char *journal;   // journal to resume from and record to, or NULL
+   int         shardsize; // inputs per output shard
+} command_t;
+
+//
+// ParseCommand
+//
+// Parses a command and its options from an argument list. Returns false and
+// prints the problem if it's not valid.
+//
+bool ParseCommand(int argc, char **argv, command_t *cmd)
+{
+   int i;
+
+   for(cmd->type = 0; cmd->type < NUMCOMMANDS; ++cmd->type)
+   {
+      if(!strcmp(argv[0], commandnames[cmd->type]))
+         break;
+   }
+
+   if(cmd->type == NUMCOMMANDS)
+      return SaveFileWarning("Error: unknown command \"%s\"\n", argv[0]);
+
+   cmd->view   = 0;
+   cmd->slot   = -1;
+   cmd->top    = 10;
+   cmd->key    = NULL;
+   cmd->jitter = 0;
+   cmd->outdir = NULL;
+   cmd->output = NULL;
+   cmd->maxdist = CLUSTER_MAXDIST;
+   cmd->minscore = 2.0;
+   cmd->firstid = 1;
+   cmd->journal = NULL;
+   cmd->shardsize = JOURNAL_SHARD;
+   cmd->loadout.minstat = -1;
+   cmd->loadout.minvalue = 0;
+
+   for(i = 1; i < argc; ++i)
+   {
+      if(!strcmp(argv[i], "--slot") && i + 1 < argc)
+      {
+         cmd->slot = atoi(argv[++i]) - 1;
+         if(cmd->slot < 0 || cmd->slot >= NUMSAVEFILES)
+            return SaveFileWarning("Error: --slot must be 1 to 8\n");
+      }
+      else if(!strcmp(argv[i], "--top") && i + 1 < argc)
+      {
+         if((cmd->top = atoi(argv[++i])) < 1)
+            return SaveFileWarning("Error: --top must be at least 1\n");
+      }
+      else if(cmd->type == CMD_SANITIZE && i + 1 < argc && 
+              !strcmp(argv[i], "--key"))
+         cmd->key = argv[++i];
+      else if(cmd->type == CMD_SANITIZE && i + 1 < argc && 
+              !strcmp(argv[i], "--jitter"))
+      {
+         if((cmd->jitter = atol(argv[++i])) < 0)
+            return SaveFileWarning("Error: --jitter can't be negative\n");
+      }
+      else if(cmd->type == CMD_SANITIZE && i + 1 < argc && 
+              !strcmp(argv[i], "--out"))
+         cmd->outdir = argv[++i];
+      else if(cmd->type == CMD_CLUSTER && i + 1 < argc &&
+              !strcmp(argv[i], "--maxdist"))
+      {
+         cmd->maxdist = atoi(argv[++i]);
+         if(cmd->maxdist < 0 || cmd->maxdist > CLUSTER_MAXDIST)
+         {
+            return SaveFileWarning("Error: --maxdist must be 0 to %d\n",
+                                   CLUSTER_MAXDIST);
+         }
+      }
+      else if(cmd->type == CMD_OPTIMIZE && i + 2 < argc &&
+              !strcmp(argv[i], "--min"))
+      {
+         if((cmd->loadout.minstat = FindStatName(argv[++i])) < 0)
+            return SaveFileWarning("Error: unknown stat \"%s\"\n", argv[i]);
+         cmd->loadout.minvalue = atoi(argv[++i]);
+      }
+      else if(cmd->type == CMD_CLUSTER && i + 1 < argc &&
+              !strcmp(argv[i], "--table"))
+         cmd->output = argv[++i];
+      else if(cmd->type == CMD_SCORE && i + 1 < argc &&
+              !strcmp(argv[i], "--min"))
+         cmd->minscore = atof(argv[++i]);
+      else if(cmd->type == CMD_AGGREGATE && i + 1 < argc &&
+              !strcmp(argv[i], "--save"))
+         cmd->output = argv[++i];
+      else if(cmd->type == CMD_SQL && i + 1 < argc &&
+              !strcmp(argv[i], "--first"))
+         cmd->firstid = atol(argv[++i]);
+      else if(!strcmp(argv[i], "--journal") && i + 1 < argc)
+         cmd->journal = argv[++i];
+      else if(!strcmp(argv[i], "--shard") && i + 1 < argc)
+      {
+         if((cmd->shardsize = atoi(argv[++i])) < 1)
+            return SaveFileWarning("Error: --shard must be at least 1\n");
+      }
+      else if(i == 1 && cmd->type == CMD_SHOW)
+      {
+         for(cmd->view = 0; cmd->view < NUMTEXTVIEWS; ++cmd->view)
+         {
+            if(!strcmp(argv[i], textviews[cmd->view].name))
+               break;
+         }
+         if(cmd->view == NUMTEXTVIEWS)
+            return SaveFileWarning("Error: unknown screen \"%s\"\n", argv[i]);
+      }
+      else if(i == 1 && cmd->type == CMD_JSON)
+      {
+         for(cmd->view = 0; cmd->view < NUMJSONVIEWS; ++cmd->view)
+         {
+            if(!strcmp(argv[i], jsonviewnames[cmd->view]))
+               break;
+         }
+         if(cmd->view == NUMJSONVIEWS)
+            return SaveFileWarning("Error: unknown view \"%s\"\n", argv[i]);
+      }
+      else if(i == 1 && cmd->type == CMD_OPTIMIZE)
+      {
+         if((cmd->loadout.stat = FindStatName(argv[i])) < 0)
+            return SaveFileWarning("Error: unknown stat \"%s\"\n", argv[i]);
+      }
+      else if(i == 1 && cmd->type == CMD_QUERY)
+      {
+         if(!QueryParse(&cmd->query, argv[i]))
+            return false;
+      }
+      else if(i == 1 && (cmd->type == CMD_NAMEINDEX || 
+                         cmd->type == CMD_TRAIN || cmd->type == CMD_SCORE ||
+                         cmd->type == CMD_SQLITE || cmd->type == CMD_COLUMNS))
+         cmd->output = argv[i];
+      else
+         return SaveFileWarning("Error: unexpected argument \"%s\"\n", argv[i]);
+   }
+
+   if(argc < 2 && 
+      (cmd->type == CMD_SHOW || cmd->type == CMD_JSON || 
+       cmd->type == CMD_QUERY || cmd->type == CMD_OPTIMIZE ||
+       cmd->type == CMD_NAMEINDEX || cmd->type == CMD_TRAIN || 
+       cmd->type == CMD_SCORE || cmd->type == CMD_SQLITE ||
+       cmd->type == CMD_COLUMNS))
+      return SaveFileWarning("Error: \"%s\" needs an argument\n", argv[0]);
+
+   if(cmd->type == CMD_SANITIZE && (!cmd->key || !*cmd->key))
+      return SaveFileWarning("Error: sanitize needs a --key\n");
+
+   if(cmd->type == CMD_SANITIZE && strlen(cmd->key) < SANITIZE_MINKEY)
+   {
+      SaveFileWarning("Warning: a --key shorter than %d characters can be "
+                      "guessed\n", SANITIZE_MINKEY);
+   }
+
+   if(cmd->journal && cmd->type != CMD_JSON && cmd->type != CMD_QUERY &&
+      cmd->type != CMD_SQL && cmd->type != CMD_SANITIZE)
+   {
+      return SaveFileWarning("Error: only json, query, sql and sanitize "
+                             "take a --journal\n");
+   }
+
+   return true;
+}
+
+//
+// RunCommand
+//
+// Runs a parsed command over a list of save RAM files. Files that can't be
+// read are reported and skipped. Returns the number of files that failed.
+//
+int RunCommand(command_t *cmd, int numpaths, char **paths)
+{
+   rankentry_t *entries = NULL;
+   rankheap_t heap;
+   nameindex_t names;
+   clusterset_t clusters;
+   plaussamples_t samples;
+   sketchset_t *sketches = NULL;
+   long sqlid = cmd->firstid;
+   colexport_t cols;
+   verifyset_t verify;
+   readahead_t ra;
+   journal_t journal;
+   sipkey_t sipkey;
+   bool *skip = NULL;
+   FILE *out = stdout;
+   strbuf_t sb;
+   int i, slot, slots, failed = 0, matches = 0, skipped = 0;
+   METRIC_TIMER(t)
+
+   if(cmd->type == CMD_SQLITE)
+      return RunSQLite(cmd->output, numpaths, paths);
+
+   SB_Init(&sb);
+   memset(&journal, 0, sizeof(journal));
+   memset(&names, 0, sizeof(names));
+   memset(&clusters, 0, sizeof(clusters));
+   memset(&samples, 0, sizeof(samples));
+   memset(&verify, 0, sizeof(verify));
+
+   if(cmd->type == CMD_SCORE && !PlausRead(&plausmodel, cmd->output))
+      return numpaths;
+
+   if(cmd->type == CMD_SANITIZE)
+      SanitizeKey(cmd->key, &sipkey);
+
+   if(cmd->type == CMD_AGGREGATE)
+   {
+      sketches = MemAlloc(sizeof(sketchset_t));
+      memset(sketches, 0, sizeof(sketchset_t));
+   }
+   else if(cmd->type == CMD_SQL && !cmd->journal)
+      printf("BEGIN TRANSACTION;\n%s", sqlschema);
+   else if(cmd->type == CMD_COLUMNS && !ColumnsOpen(&cols, cmd->output))
+      return numpaths;
+
+   if(cmd->journal)
+   {
+      if(!JournalOpen(&journal, cmd->journal))
+      {
+         JournalClose(&journal);
+         return numpaths;
+      }
+
+      skip = MemAlloc(numpaths * sizeof(bool));
+      for(i = 0; i < numpaths; ++i)
+      {
+         if((skip[i] = JournalFinished(&journal, paths[i])))
+            ++skipped;
+      }
+
+      // keep sql ids running on from the shards already written
+      sqlid += journal.slots;
+   }
+
+   if(cmd->type == CMD_RANK)
+   {
+      entries = MemAlloc(cmd->top * sizeof(rankentry_t));
+      RankHeapInit(&heap, entries, cmd->top);
+   }
+
+   ReadAheadInit(&ra, numpaths, paths, READAHEAD_DEPTH, READAHEAD_AUTO, 0);
+   ra.skip = skip;
+
+   for(i = 0; i < numpaths; ++i)
+   {
+      if(skip && skip[i])
+         continue;
+
+      if(!ReadAheadLoad(&ra, i))
+      {
+         ++failed;
+         continue;
+      }
+
+      if(cmd->type == CMD_SANITIZE)
+      {
+         // the input is only left as it was if the output goes elsewhere
+         unsigned int hash = DataHash(containerbuf, 
+                                          (int)container.size);
+
+         if(!SanitizeSaveRAM(paths[i], &sipkey, cmd->jitter, cmd->outdir))
+            ++failed;
+         else if(cmd->journal)
+         {
+            if(!cmd->outdir)
+               hash = DataHash(containerbuf, (int)container.size);
+            JournalAdd(&journal, paths[i], hash, 0);
+            if(!JournalCommit(&journal))
+               ++failed;
+         }
+         continue;
+      }
+
+      if(cmd->journal && !journal.out)
+      {
+         if(!JournalBeginShard(&journal))
+         {
+            failed += numpaths - i;
+            break;
+         }
+
+         out = journal.out;
+         if(cmd->type == CMD_SQL)
+            fprintf(out, "BEGIN TRANSACTION;\n%s", sqlschema);
+      }
+
+      if(cmd->type == CMD_SHOW)
+      {
+         printf("== %s ==\n", paths[i]);
+
+         if(textviews[cmd->view].perimage)
+         {
+            textviews[cmd->view].func();
+            continue;
+         }
+      }
+
+      for(slot = slots = 0; slot < NUMSAVEFILES; ++slot)
+      {
+         savefile_t *sf = &savefiles[slot];
+
+         if(!sf->exists || (cmd->slot >= 0 && slot != cmd->slot))
+            continue;
+
+         current_file = slot;
+         ++slots;
+
+         METRIC_START(t)
+
+         switch(cmd->type)
+         {
+         case CMD_SHOW:
+            textviews[cmd->view].func();
+            break;
+         case CMD_JSON:
+            sb.len = 0;
+            SB_Printf(&sb, "{\"path\":");
+            SB_JSONString(&sb, paths[i]);
+            SB_Printf(&sb, ",\"file\":%d,\"%s\":", slot + 1, 
+                      jsonviewnames[cmd->view]);
+            jsonviews[cmd->view](&sb, sf);
+            SB_Printf(&sb, "}\n");
+            fwrite(sb.buf, 1, sb.len, out);
+            break;
+         case CMD_QUERY:
+            if(QueryMatch(&cmd->query, sf))
+            {
+               fprintf(out, "%s:%d %s\n", paths[i], slot + 1, sf->name);
+               ++matches;
+            }
+            break;
+         case CMD_RANK:
+            {
+               completion_t comp;
+               rankentry_t entry;
+
+               CalculateCompletion(sf, &comp);
+               entry.score = comp.score;
+               entry.file  = i;
+               entry.slot  = slot;
+               strcpy(entry.name, sf->name);
+               RankHeapAdd(&heap, &entry);
+            }
+            break;
+         case CMD_OPTIMIZE:
+            if(PrintOptimized(sf, &cmd->loadout, paths[i], slot))
+               ++matches;
+            break;
+         case CMD_NAMEINDEX:
+            NameIndexAdd(&names, sf, i, slot);
+            break;
+         case CMD_CLUSTER:
+            ClusterAdd(&clusters, sf, i, slot);
+            break;
+         case CMD_TRAIN:
+            PlausAddSample(&samples, sf);
+            break;
+         case CMD_AGGREGATE:
+            SketchAddFile(sketches, sf);
+            break;
+         case CMD_SQL:
+            sb.len = 0;
+            SQLSlot(&sb, sf, sqlid++, paths[i], slot);
+            fwrite(sb.buf, 1, sb.len, out);
+            break;
+         case CMD_COLUMNS:
+            ColumnsAdd(&cols, sf, i, slot);
+            break;
+         case CMD_VERIFY:
+            VerifyAdd(&verify, sf, paths[i], slot);
+            break;
+         case CMD_SCORE:
+            {
+               plausresult_t res;
+
+               if(PlausScore(&plausmodel, sf, &res) && 
+                  res.score >= cmd->minscore)
+               {
+                  printf("%s:%d %s %.1f\n", paths[i], slot + 1, sf->name, 
+                         res.score);
+                  PrintPlausResult(&plausmodel, sf, &res);
+                  ++matches;
+               }
+            }
+            break;
+         }
+
+         METRIC_STOP(METRIC_RENDER, t)
+      }
+
+      if(cmd->journal)
+      {
+         JournalAdd(&journal, paths[i], 
+                    DataHash(containerbuf, (int)container.size), 
+                    slots);
+
+         if(journal.numpending >= (unsigned int)cmd->shardsize)
+         {
+            if(cmd->type == CMD_SQL)
+               fprintf(out, "COMMIT;\n");
+            if(!JournalCommit(&journal))
+               failed += cmd->shardsize;
+         }
+      }
+   }
+
+   ReadAheadFree(&ra);
+
+   if(cmd->journal)
+   {
+      if(journal.out)
+      {
+         int pending = journal.numpending;
+
+         if(cmd->type == CMD_SQL)
+            fprintf(journal.out, "COMMIT;\n");
+         if(!JournalCommit(&journal))
+            failed += pending;
+      }
+
+      fprintf(stderr, "%d of %d inputs already done, %u shards written\n", 
+              skipped, numpaths, journal.shards);
+      JournalClose(&journal);
+      MemFree(skip, numpaths * sizeof(bool));
+   }
+
+   if(cmd->type == CMD_QUERY)
+      fprintf(stderr, "%d matches\n", matches);
+   else if(cmd->type == CMD_OPTIMIZE)
+      fprintf(stderr, "%d files have a loadout that fits\n", matches);
+   else if(cmd->type == CMD_SCORE)
+      fprintf(stderr, "%d flagged\n", matches);
+   else if(cmd->type == CMD_TRAIN)
+   {
+      PlausTrain(&plausmodel, &samples);
+      if(PlausWrite(&plausmodel, cmd->output))
+         fprintf(stderr, "trained on %u files\n", samples.count);
+      else
+         ++failed;
+      MemFree(samples.samples, samples.alloc * sizeof(plaussample_t));
+   }
+   else if(cmd->type == CMD_AGGREGATE)
+   {
+      PrintSketches(sketches);
+      if(cmd->output && !SketchWrite(sketches, cmd->output))
+         ++failed;
+      MemFree(sketches, sizeof(sketchset_t));
+   }
+   else if(cmd->type == CMD_SQL && !cmd->journal)
+      printf("COMMIT;\n");
+   else if(cmd->type == CMD_COLUMNS)
+   {
+      if(ColumnsClose(&cols, numpaths, paths))
+         fprintf(stderr, "%lu rows\n", cols.rows);
+      else
+         ++failed;
+   }
+   else if(cmd->type == CMD_RANK)
+   {
+      int count = RankHeapSort(&heap);
+
+      for(i = 0; i < count; ++i)
+      {
+         printf("%3d. %5.1f%%  %s:%d %s\n", i + 1, entries[i].score / 10.0, 
+                paths[entries[i].file], entries[i].slot + 1, entries[i].name);
+      }
+      MemFree(entries, cmd->top * sizeof(rankentry_t));
+   }
+   else if(cmd->type == CMD_NAMEINDEX)
+   {
+      NameIndexFinish(&names);
+      if(NameIndexWrite(&names, cmd->output, numpaths, paths))
+      {
+         fprintf(stderr, "%u names, %u deletion variants\n", 
+                 names.numrecs, names.numdels);
+      }
+      else
+         ++failed;
+      NameIndexFree(&names);
+   }
+   else if(cmd->type == CMD_CLUSTER)
+   {
+      unsigned int count = ClusterSlots(&clusters, cmd->maxdist);
+
+      PrintClusters(&clusters, paths);
+      fprintf(stderr, "%u files in %u clusters\n", clusters.numslots, count);
+
+      if(clusters.bigbuckets)
+      {
+         SaveFileWarning("Warning: %u band buckets had more than %d files, so "
+                         "some close pairs may not have been compared\n",
+                         clusters.bigbuckets, CLUSTER_PROBES + 1);
+      }
+
+      if(cmd->output && !WriteClusterTable(&clusters, paths, cmd->output))
+         ++failed;
+      MemFree(clusters.slots, clusters.alloc * sizeof(clusterslot_t));
+   }
+   else if(cmd->type == CMD_VERIFY)
+      PrintVerify(&verify);
+
+   SB_Free(&sb);
+   fflush(stdout);
+
+   return failed;
+}
+
+//
+// SplitCommandLine
+//
+// Splits a line of input into arguments in place. Single or double quotes
+// group words. Returns the argument count.
+//
+int SplitCommandLine(char *line, char **argv, int maxargs)
+{
+   int argc = 0;
+
+   while(argc < maxargs)
+   {
+      char quote = 0, *out;
+
+      while(*line && isspace((unsigned char)*line))
+         ++line;
+
+      if(!*line)
+         break;
+
+      argv[argc++] = out = line;
+
+      for(; *line && (quote || !isspace((unsigned char)*line)); ++line)
+      {
+         if(!quote && (*line == '\'' || *line == '"'))
+            quote = *line;
+         else if(quote && *line == quote)
+            quote = 0;
+         else
+            *out++ = *line;
+      }
+
+      if(*line)
+         ++line;
+      *out = '\0';
+   }
+
+   return argc;
+}
+
+//
+// RunRepl
+//
+// Reads commands from stdin and runs each over the files until end of input
+// or "quit".
+//
+void RunRepl(int numpaths, char **paths)
+{
+   static command_t cmd;
+   char line[1024];
+   char *argv[32];
+   int argc;
+
+   for(;;)
+   {
+      fputs("> ", stderr);
+
+      if(!fgets(line, sizeof(line), stdin))
+         break;
+
+      if(!(argc = SplitCommandLine(line, argv, 32)))
+         continue;
+
+      if(!strcmp(argv[0], "quit") || !strcmp(argv[0], "exit"))
+         break;
+
+      if(!strcmp(argv[0], "repl"))
+         continue;
+
+      if(ParseCommand(argc, argv, &cmd))
+         RunCommand(&cmd, numpaths, paths);
+   }
+}
+
+//
+// FindCommand
+//
+// Returns the index of the command name in the argument list, or -1 if there
+// isn't one. A "--" argument ends the file list, and the command must follow
+// it; otherwise the command is the first argument that has a command's name
+// and isn't an existing file, so that a save called "rank" is still a save.
+//
+int FindCommand(int argc, char **argv)
+{
+   struct stat st;
+   int i, j;
+
+   for(i = 1; i < argc; ++i)
+   {
+      if(!strcmp(argv[i], "--"))
+         return i + 1 < argc ? i + 1 : -1;
+   }
+
+   for(i = 1; i < argc; ++i)
+   {
+      for(j = 0; j < NUMCOMMANDS; ++j)
+      {
+         if(!strcmp(argv[i], commandnames[j]) && stat(argv[i], &st))
+            return i;
+      }
+   }
+
+   return -1;
+}
+
+//
+// RunCommandLine
+//
+// Runs a command given on the command line. Returns the exit status.
+//
+int RunCommandLine(int argc, char **argv, int cmdarg)
+{
+   static command_t cmd;
+   int numpaths = cmdarg - 1;
+   char **paths = argv + 1;
+
+   batchmode = true;
+
+   if(!strcmp(argv[cmdarg - 1], "--"))
+      --numpaths;
+
+   if(!numpaths)
+   {
+      SaveFileWarning("Error: no save RAM files given\n");
+      return 1;
+   }
+
+   if(!ParseCommand(argc - cmdarg, argv + cmdarg, &cmd))
+      return 1;
+
+   if(cmd.type == CMD_REPL)
+   {
+      RunRepl(numpaths, paths);
+      return 0;
+   }
+
+   return RunCommand(&cmd, numpaths, paths) ? 1 : 0;
+}
+
+//
+// ParseGlobalOptions
+//
+// Takes --stats (metrics to stderr at exit) or --stats=<file>, and --dss
+// <catalog>, out of the command line. Returns the new argument count.
+//
+int ParseGlobalOptions(int argc, char **argv)
+{
+   int i, j;
+
+   for(i = j = 1; i < argc; ++i)
+   {
+      if(!strcmp(argv[i], "--dss") && i + 1 < argc)
+      {
+         if(!ReadDSSCatalog(argv[++i]))
+            exit(1);
+         continue;
+      }
+
+      if(!strcmp(argv[i], "--stats") || !strncmp(argv[i], "--stats=", 8))
+      {
+#ifdef SAVTEST_METRICS
+         statspath = argv[i][7] ? argv[i] + 8 : "-";
+#else
+         SaveFileWarning("Warning: --stats needs a build with "
+                         "SAVTEST_METRICS defined\n");
+#endif
+         continue;
+      }
+
+      argv[j++] = argv[i];
+   }
+
+   argv[j] = NULL;
+
+   return j;
+}
+
+//
+// Synthetic Save Generator
+//
+// Writes made-up but believable save RAM for load testing, so that nobody's
+// real saves have to be passed around. Every file in an image is built
+// around a random amount of progress through the game: a file that's
+// further along has a higher level, more of the map, more relics and cards,
+// and more Ups. The stored equip and DSS stat columns are computed with the
+// stat engine, so they agree with what the equipment screen works out, and
+// each file gets a correct checksum.
+//
+// Output is fully determined by the seed. Each image gets its own random
+// number generator seeded from the seed and the image's number, so image N
+// always comes out the same no matter how many images come before it.
+//
+
+#define GEN_IMAGESIZE   (32 * 1024)       // written as a 32 KB SRAM dump
+#define GEN_MAXTIME     (60L * 60 * 60 * 12) // 12 hours, in 60 Hz tics
+
+typedef unsigned int genrng_t;
+
+//
+// GenRandom
+//
+// xorshift32. Never returns 0 if the state isn't 0.
+//
+unsigned int GenRandom(genrng_t *rng)
+{
+   unsigned int x = *rng;
+
+   x ^= x << 13;
+   x ^= x >> 17;
+   x ^= x << 5;
+
+   return (*rng = x);
+}
+
+//
+// GenSeed
+//
+// Mixes the seed and an image number into a starting state.
+//
+void GenSeed(genrng_t *rng, unsigned int seed, unsigned long image)
+{
+   unsigned int x = seed ^ ((unsigned int)image * 0x9E3779B9u);
+
+   x ^= x >> 16;
+   x *= 0x85EBCA6Bu;
+   x ^= x >> 13;
+   x *= 0xC2B2AE35u;
+   x ^= x >> 16;
+
+   *rng = x ? x : 0x6D2B79F5u;
+}
+
+//
+// GenRange
+//
+// Returns a number from lo to hi inclusive.
+//
+int GenRange(genrng_t *rng, int lo, int hi)
+{
+   return lo + (int)(GenRandom(rng) % (unsigned int)(hi - lo + 1));
+}
+
+//
+// GenChance
+//
+// Returns true with a probability of permille / 1000.
+//
+bool GenChance(genrng_t *rng, int permille)
+{
+   return (int)(GenRandom(rng) % 1000) < permille;
+}
+
+//
+// GenPickOwned
+//
+// Picks one of the items from first to last that the file has, or INV_NONE.
+//
+int GenPickOwned(genrng_t *rng, savefile_t *sf, int first, int last)
+{
+   int items[NUMINV];
+   int i, count = 0;
+
+   for(i = first; i <= last; ++i)
+   {
+      if(sf->data[OFFSET_INVENTORY + i])
+         items[count++] = i;
+   }
+
+   return count ? items[GenRandom(rng) % count] : INV_NONE;
+}
+
+//
+// GenerateSaveFile
+//
+// Fills in one file. Modes are the header's mode flags.
+//
+void GenerateSaveFile(savefile_t *sf, genrng_t *rng, int modes)
+{
+   int progress = GenRange(rng, 0, 1000);
+   int i, lv, count, mode, armor, arm1, arm2, action, attrib;
+   int unlocked[NUMMODES], numunlocked = 0;
+   statvec_t base, equip, total;
+   byte *d = sf->data;
+
+   memset(sf, 0, sizeof(*sf));
+
+   d[OFFSET_EXISTS] = EXISTS_YES;
+
+   // name; mostly letters, the odd bit of punctuation
+   count = GenRange(rng, 1, NAME_LENGTH);
+   for(i = 0; i < count; ++i)
+   {
+      d[OFFSET_NAME + i] = GenChance(rng, 50) ? 
+         (byte)GenRange(rng, 27, 31) : (byte)GenRange(rng, 1, 26);
+   }
+
+   // a mode that's unlocked
+   for(i = 0; i < NUMMODES; ++i)
+   {
+      if(!modeflags[i] || (modes & modeflags[i]))
+         unlocked[numunlocked++] = i;
+   }
+   mode = unlocked[GenRandom(rng) % numunlocked];
+   SaveFileSetLong(sf, OFFSET_GAMEMODE, mode);
+
+   SaveFileSetLong(sf, OFFSET_TIME, 
+                   GEN_MAXTIME / 1000 * progress + GenRange(rng, 3600, 60000));
+   SaveFileSetLong(sf, OFFSET_MAP_PCT, progress);
+
+   // explored map; rooms are revealed in clumps, more of them later on
+   for(i = 0; i < PACKED_MAP_WIDTH * MAP_HEIGHT; ++i)
+   {
+      if(GenChance(rng, progress))
+         d[OFFSET_MAP + i] = (byte)(GenRandom(rng) | GenRandom(rng));
+   }
+
+   // Ups
+   d[OFFSET_HEART_UP] = (byte)(TOTAL_HEARTUPS * progress / 1000);
+   d[OFFSET_HP_UP]    = (byte)(TOTAL_HPUPS * progress / 1000);
+   d[OFFSET_MP_UP]    = (byte)(TOTAL_MPUPS * progress / 1000);
+
+   // relics come in roughly the order of the enum
+   count = (NUMRELICS * progress + GenRange(rng, 0, 999)) / 1000;
+   for(i = 0; i < count && i < NUMRELICS; ++i)
+      d[OFFSET_RELICS + i] = 1;
+
+   // level and the stats that go with it
+   lv = 1 + 49 * progress / 1000 + GenRange(rng, 0, 3);
+   SaveFileSetLong(sf, OFFSET_LEVEL, lv);
+   SaveFileSetLong(sf, OFFSET_EXP, 
+                   (long)lv * lv * 60 + GenRange(rng, 0, lv * 60));
+
+   SaveFileSetLong(sf, OFFSET_HP1, 100 + lv * 8 + d[OFFSET_HP_UP] * 10);
+   SaveFileSetLong(sf, OFFSET_HP2, SaveFileLong(sf, OFFSET_HP1));
+   SaveFileSetLong(sf, OFFSET_MP1, 30 + lv * 2 + d[OFFSET_MP_UP] * 10);
+   SaveFileSetLong(sf, OFFSET_MP2, SaveFileLong(sf, OFFSET_MP1));
+   SaveFileSetShort(sf, OFFSET_HEARTS_MAX, 
+                    (short)(100 + d[OFFSET_HEART_UP] * 10));
+   SaveFileSetShort(sf, OFFSET_HEARTS_CUR, 
+                    (short)GenRange(rng, 0, 100 + d[OFFSET_HEART_UP] * 10));
+
+   i = GenRange(rng, SUBWEAPON_NONE, SUBWEAPON_HOMINGDAGGER);
+   SaveFileSetLong(sf, OFFSET_SUBWEAPON, 
+                   i == SUBWEAPON_HOMINGDAGGER ? 
+                   SUBWEAPON_HOMINGDAGGER_FILEVAL : i);
+
+   for(i = 0; i < NUMSTATS; ++i)
+      base.s[i] = 5 + lv * 2 + GenRange(rng, 0, 10);
+
+   // DSS cards, and some of the combinations they allow
+   for(i = 1; i < NUMDSS; ++i)
+      d[OFFSET_CARDS + (i - 1)] = (byte)GenChance(rng, progress);
+
+   for(action = FIRSTACTIONCARD; action < FIRSTACTIONCARD + NUMACTIONCARDS; 
+       ++action)
+   {
+      for(attrib = FIRSTATTRIBCARD; 
+          attrib < FIRSTATTRIBCARD + NUMATTRIBCARDS; ++attrib)
+      {
+         if(d[OFFSET_CARDS + action - 1] && d[OFFSET_CARDS + attrib - 1] &&
+            GenChance(rng, 500))
+            d[OFFSET_ABILITIES + DSSCOMBO(action, attrib)] = 1;
+      }
+   }
+
+   // inventory; index 0 is the unknown byte, which is left alone
+   for(i = 1; i < NUMINV; ++i)
+   {
+      if(GenChance(rng, progress / 2))
+         d[OFFSET_INVENTORY + i] = (byte)GenRange(rng, 1, 3);
+   }
+
+   // equip some of it
+   armor = GenPickOwned(rng, sf, INV_LEATHER_ARMOR, INV_SOLDIER_FATIGUES);
+   arm1  = GenPickOwned(rng, sf, INV_DOUBLE_GRIPS, INV_BEAR_RING);
+   arm2  = GenPickOwned(rng, sf, INV_DOUBLE_GRIPS, INV_BEAR_RING);
+   d[OFFSET_EQUIP_ARMOR] = (byte)armor;
+   d[OFFSET_EQUIP_ARM1]  = (byte)arm1;
+   d[OFFSET_EQUIP_ARM2]  = (byte)arm2;
+
+   action = attrib = CARD_NONE;
+   if(GenChance(rng, 700))
+   {
+      action = FIRSTACTIONCARD + GenRange(rng, 0, NUMACTIONCARDS - 1);
+      attrib = FIRSTATTRIBCARD + GenRange(rng, 0, NUMATTRIBCARDS - 1);
+      if(!d[OFFSET_CARDS + action - 1] || !d[OFFSET_CARDS + attrib - 1])
+         action = attrib = CARD_NONE;
+   }
+   d[OFFSET_EQUIP_ATTRIB] = (byte)attrib;
+   d[OFFSET_EQUIP_ACTION] = (byte)(action ? action - 10 : 0);
+
+   // the stat columns: base, equipment, and what DSS adds on top
+   CalculateEquipStats(armor, arm1, arm2, &equip);
+   CalculateLoadoutStats(&base, armor, arm1, arm2, attrib, action, &total);
+
+   for(i = 0; i < NUMSTATS; ++i)
+   {
+      static const unsigned int statoffsets[NUMSTATS] =
+      {
+         OFFSET_STR_BASE, OFFSET_DEF_BASE, OFFSET_INT_BASE, OFFSET_LCK_BASE
+      };
+      unsigned int o = statoffsets[i];
+
+      SaveFileSetShort(sf, o,     (short)base.s[i]);
+      SaveFileSetShort(sf, o + 2, (short)equip.s[i]);
+      SaveFileSetShort(sf, o + 4, 
+                       (short)(total.s[i] - base.s[i] - equip.s[i]));
+   }
+
+   CalculateChecksum(sf);
+}
+
+//
+// GenerateSaveRAM
+//
+// Builds image number n in a GEN_IMAGESIZE buffer.
+//
+void GenerateSaveRAM(byte *image, unsigned int seed, unsigned long n)
+{
+   static savefile_t sf;
+   genrng_t rng;
+   int i, modes = MODE_FLAG_VAMPIREKILLER;
+   unsigned int slots;
+
+   GenSeed(&rng, seed, n);
+
+   memset(image, 0, GEN_IMAGESIZE);
+   memcpy(image, HEADER_MAGIC, HEADER_MAGIC_LEN);
+
+   for(i = 0; i < NUMMODES; ++i)
+   {
+      if(GenChance(&rng, 500))
+         modes |= modeflags[i];
+   }
+   image[HEADER_MODES_OFFSET] = (byte)modes;
+
+   // about three in four slots are used, and always at least one
+   slots = GenRandom(&rng) | GenRandom(&rng);
+   if(!(slots & ((1u << NUMSAVEFILES) - 1)))
+      slots = 1;
+
+   for(i = 0; i < NUMSAVEFILES; ++i)
+   {
+      if(!(slots & (1u << i)))
+         continue;
+
+      GenerateSaveFile(&sf, &rng, modes);
+      memcpy(image + fileoffsets[i], sf.data, SAVEFILESIZE);
+   }
+}
+
+//
+// RunGenerate
+//
+// Writes count images made from a seed, either as files named with a prefix
+// and the image number, or one after another to stdout if the prefix is "-".
+// Returns the number of images that couldn't be written.
+//
+int RunGenerate(unsigned long count, unsigned int seed, const char *prefix)
+{
+   static byte image[GEN_IMAGESIZE];
+   char path[1024];
+   bool tostdout = !strcmp(prefix, "-");
+   unsigned long n;
+   int failed = 0;
+   FILE *f;
+
+#ifdef _WIN32
+   if(tostdout)
+      _setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+   if(strlen(prefix) > sizeof(path) - 16)
+   {
+      SaveFileWarning("Error: output prefix is too long\n");
+      return 1;
+   }
 
-      if(invnum > maxitem)
+   for(n = 0; n < count; ++n)
+   {
+      GenerateSaveRAM(image, seed, n);
+
+      if(tostdout)
       {
-         exitflag = true;
-         invnum = 0;
+         if(fwrite(image, 1, GEN_IMAGESIZE, stdout) != GEN_IMAGESIZE)
+         {
+            SaveFileWarning("Error: couldn't write to stdout\n");
+            return 1;
+         }
+         continue;
       }
 
-      if(invnum != 0)
+      sprintf(path, "%s%06lu.sav", prefix, n);
+
+      if(!(f = fopen(path, "wb")))
       {
-         printf("\nItem - %s [%2d]\n"
-                "------------------------------------------------------------\n"
-                "Description: %s\n"
-                "STR: %+4d, DEF: %+4d, INT: %+4d, LCK: %+4d, Rarity: %d\n\n",
-                inventory_items[invnum].name,
-                sf->inventory[invnum],
-                inventory_items[invnum].description,
-                inventory_items[invnum].atk,
-                inventory_items[invnum].def,
-                inventory_items[invnum].intel,
-                inventory_items[invnum].lck,
-                inventory_items[invnum].rarity);
+         SaveFileWarning("Error: couldn't create %s\n", path);
+         ++failed;
+         continue;
+      }
 
-         fflush(stdout);
-         
-         puts("Press enter to return.");
-         while(getchar() != '\n');
+      if(fwrite(image, 1, GEN_IMAGESIZE, f) != GEN_IMAGESIZE)
+      {
+         SaveFileWarning("Error: couldn't write %s\n", path);
+         ++failed;
       }
 
-      invnum = 0;
-      choice = 0;
+      fclose(f);
    }
+
+   fflush(stdout);
+
+   return failed;
 }
 
 //
-// ViewRelics
+// Read Benchmark
 //
-// Displays the player's magic items (aka relics in most CV games; I use this
-// term to disambiguate them from everything else that's magical, which is
-// pretty much everything in the game).
+// savtest -bench [--latency MS] <files...>
 //
-void ViewRelics(void)
+// Times reading and decoding every file in each of the read-ahead's ways:
+// one at a time (sync), with the thread pool, and with io_uring where it's
+// there. Before each pass the files are dropped from the OS cache where
+// that's possible, so every pass starts cold. Each pass is reported, then
+// the fastest for each way. --latency adds MS milliseconds before every
+// open and every file's read, to stand in for slow or networked storage;
+// files already in memory mostly time the decoding.
+//
+
+#define BENCH_PASSES 3
+
+//
+// BenchEvict
+//
+void BenchEvict(int numpaths, char **paths)
 {
-   savefile_t *sf = &savefiles[current_file];
+#ifdef POSIX_FADV_DONTNEED
+   FILE *f;
    int i;
 
-   printf("\nFile %d: %s - Relics\n"
-          "------------------------------------------------------------\n",
-          current_file + 1, sf->name);
-   
-   for(i = 0; i < NUMRELICS; ++i)
+   for(i = 0; i < numpaths; ++i)
    {
-      printf("%d. %-11s [%c]\n   %s\n",
-             i+1, relics[i].name, sf->relics[i] ? 'X' : ' ', 
-             relics[i].description);
+      if((f = fopen(paths[i], "rb")))
+      {
+         posix_fadvise(fileno(f), 0, 0, POSIX_FADV_DONTNEED);
+         fclose(f);
+      }
    }
-   putchar('\n');
-
-   fflush(stdout);
-   
-   puts("Press enter to return.");
-   while(getchar() != '\n');
+#endif
 }
 
 //
-// ViewUps
-//
-// 03/16/07: Displays information on the player's collected Heart, HP, and MP
-// up items.
+// PrintBenchLine
 //
-void ViewUps(void)
+void PrintBenchLine(const char *method, const char *pass, 
+                    metrictime_t elapsed, int numpaths, double bytes, 
+                    int failed)
 {
-   savefile_t *sf = &savefiles[current_file];
-
-   printf("\nFile %d: %s - Max Increase Items\n"
-          "------------------------------------------------------------\n"
-          "Heart Max Increase: %d\n"
-          "HP Max Increase:    %d\n"
-          "MP Max Increase:    %d\n\n",
-          current_file + 1, sf->name,
-          sf->numheartups, sf->numhpups, sf->nummpups);
-
-   fflush(stdout);
-   
-   puts("Press enter to return.");
-   while(getchar() != '\n');
+   printf("%-9s %-5s %8.3fs %10.0f files/s %8.1f MB/s %6d failed\n",
+          method, pass, elapsed, numpaths / elapsed, 
+          bytes / (1024.0 * 1024.0) / elapsed, failed);
 }
 
 //
-// ViewInventory
+// RunBench
 //
-// Routine to display various subsets of the player's inventory.
+// Returns the number of reads that failed, over all the passes.
 //
-void ViewInventory(void)
+int RunBench(int numpaths, char **paths)
 {
-   savefile_t *sf = &savefiles[current_file];
-   char c, choice;
-   bool exitflag = false;
-
-   while(!exitflag)
+   static const int methods[3] = 
+   { 
+      READAHEAD_SYNC, READAHEAD_POOL, READAHEAD_URING 
+   };
+   metrictime_t start, elapsed, best[3];
+   double bytes, bestbytes[3];
+   int bestfailed[3];
+   long latency = 0;
+   readahead_t ra;
+   char name[16];
+   int pass, which, i, failed, total = 0;
+
+   if(numpaths >= 2 && !strcmp(paths[0], "--latency"))
    {
-      printf("\nFile %d: %s - Inventory\n"
-             "--------------------------------------------------\n"
-             "1. View Armor\n"
-             "2. View Robes\n"
-             "3. View Clothes\n"
-             "4. View Armbands\n"
-             "5. View Paired Armbands\n"
-             "6. View Rings\n"
-             "7. View Odd Rings\n"
-             "8. View Usable Items\n"
-             "9. View Relics\n"
-             "A. View Max Increase Items\n\n",
-             current_file + 1, sf->name);
-
-      fflush(stdout);
-      
-      puts("Select an inventory class or press enter to return.");
-      while((c = getchar()) != '\n')
-         choice = c;
-      
-      choice = toupper(choice);
-
-      switch(choice)
+      if((latency = atol(paths[1])) < 0)
       {
-      case '1':
-         ViewInventoryRange("Armor", INV_LEATHER_ARMOR, INV_SHINING_ARMOR);
-         break;
-      case '2':
-         ViewInventoryRange("Robes", INV_COTTON_ROBE, INV_SAGE_ROBE);
-         break;
-      case '3':
-         ViewInventoryRange("Clothes", INV_COTTON_CLOTHES, INV_SOLDIER_FATIGUES);
-         break;
-      case '4':
-         ViewInventoryRange("Armbands", INV_STRENGTH_ARMBAND, INV_MIRACLE_ARMBAND);
-         break;
-      case '5':
-         ViewInventoryRange("Paired Armbands", INV_DOUBLE_GRIPS, INV_STAR_BRACELET);
-         break;
-      case '6':
-         ViewInventoryRange("Rings", INV_STRENGTH_RING, INV_CURSED_RING);
-         break;
-      case '7':
-         ViewInventoryRange("Odd Rings", INV_TOY_RING, INV_BEAR_RING);
-         break;
-      case '8':
-         ViewInventoryRange("Usable Items", INV_POTION, INV_HEART_MEGA);
-         break;
-      case '9':
-         ViewRelics();
-         break;
-      case 'A':
-         ViewUps();
-         break;
-      default:
-         exitflag = true;
-         break;
+         SaveFileWarning("Error: --latency can't be negative\n");
+         return 1;
       }
+      numpaths -= 2;
+      paths += 2;
+   }
 
-      choice = 0;
+   if(numpaths < 1)
+   {
+      SaveFileWarning("Error: -bench needs some files\n");
+      return 1;
    }
-}
 
-//
-// ViewMap
-//
-// 03/14/07: Ability to view map, although it's not too pretty in text mode :)
-//
-void ViewMap(void)
-{
-   savefile_t *sf = &savefiles[current_file];
-   int block, row;
+   printf("%d files, %ld ms added to each open and read\n", numpaths, 
+          latency);
 
-   for(row = 0; row < MAP_HEIGHT; ++row)
+   for(which = 0; which < 3; ++which)
+      best[which] = -1.0;
+
+   for(pass = 0; pass < BENCH_PASSES; ++pass)
    {
-      for(block = 0; block < MAP_WIDTH; ++block)
-         putchar(sf->map[block][row]);
+      for(which = 0; which < 3; ++which)
+      {
+         BenchEvict(numpaths, paths);
 
-      putchar('\n');
-   }
+         bytes  = 0.0;
+         failed = 0;
+         start  = MetricsNow();
 
-   fflush(stdout);
-   
-   puts("\nPress enter to return.");
-   while(getchar() != '\n');
-}
+         if(!ReadAheadInit(&ra, numpaths, paths, READAHEAD_DEPTH, 
+                           methods[which], latency))
+         {
+            if(!pass)
+               printf("%-9s isn't available here\n", 
+                      readaheadnames[methods[which]]);
+            continue;
+         }
 
-void ViewChecksum(void)
-{
-   savefile_t *sf = &savefiles[current_file];
-   bool match;
+         for(i = 0; i < numpaths; ++i)
+         {
+            if(ReadAheadLoad(&ra, i))
+               bytes += container.size;
+            else
+               ++failed;
+         }
 
-   match = CalculateChecksum(sf);
+         ReadAheadFree(&ra);
 
-   if(!match)
-      printf("\nWarning! The calculated value %d doesn't match the original "
-             "checksum value of %d. Using this file will erase your save "
-             "games!\n\n", sf->data[OFFSET_CHECKSUM], sf->checksum);
-   else
-      printf("\nThe file checksum value is %d.\n\n", sf->data[OFFSET_CHECKSUM]);
+         elapsed = MetricsNow() - start;
+         total += failed;
 
-   fflush(stdout);
-   
-   puts("Press enter to return.");
-   while(getchar() != '\n');
-}
+         sprintf(name, "%d", pass + 1);
+         PrintBenchLine(readaheadnames[methods[which]], name, elapsed, 
+                        numpaths, bytes, failed);
 
-void MainMenu(void)
-{
-   char c, choice;
-   bool exitflag = false;
+         if(best[which] < 0.0 || elapsed < best[which])
+         {
+            best[which] = elapsed;
+            bestbytes[which] = bytes;
+            bestfailed[which] = failed;
+         }
+      }
+   }
 
-   while(!exitflag)
+   for(which = 0; which < 3; ++which)
    {
-      puts("\nCastlevania: Circle of the Moon Save RAM Inspector\n"
-           "--------------------------------------------------\n"
-           "1. Select file\n"
-           "2. View stats\n"
-           "3. View current equipment\n"
-           "4. View DSS\n"
-           "5. View inventory\n"
-           "6. View map\n"
-           "7. Recalculate file checksum\n"
-           "8. Exit\n");
-
-      printf("Current file selected: #%d\n", current_file + 1);
-      
-      fflush(stdout);
-      
-      while((c = getchar()) != '\n')
-         choice = c;
-      
-      switch(choice)
+      if(best[which] >= 0.0)
       {
-      case '1':
-         SelectFile();
-         break;
-      case '2':
-         ViewStats();
-         break;
-      case '3':
-         ViewEquip();
-         break;
-      case '4':
-         ViewDSS();
-         break;
-      case '5':
-         ViewInventory();
-         break;
-      case '6':
-         ViewMap();
-         break;
-      case '7':
-         ViewChecksum();
-         break;
-      case '8':
-         puts("Bye!\n");
-         exitflag = true;
-         break;
-      default:
-         puts("Bad choice, try again.\n\n");
-         break;
+         PrintBenchLine(readaheadnames[methods[which]], "best", best[which],
+                        numpaths, bestbytes[which], bestfailed[which]);
       }
-
-      choice = 0;
    }
+
+   return total;
 }
 
 //
@@ -1452,8 +13716,57 @@ void MainMenu(void)
 int main(int argc, char *argv[])
 {
    FILE *f;
+   int cmdarg;
 
-   if(argc >= 2)
+   // build lookup tables for the stat engine
+   InitStatTables();
+
+   // set up save format detection
+   InitSaveFormats();
+
+   // build the map area masks and bitboards
+   InitMapAreas();
+   InitReachability();
+
+   argc = ParseGlobalOptions(argc, argv);
+#ifdef SAVTEST_METRICS
+   atexit(WriteMetrics);
+#endif
+
+   // -serve <port> <file>: serve one save RAM image instead of the menus
+   if(argc >= 4 && !strcmp(argv[1], "-serve"))
+   {
+      if(!(f = fopen(argv[3], "rb")))
+         SaveFileError("Error: couldn't open the indicated input file.\n");
+
+      ReadSaveFiles(f);
+      fclose(f);
+
+      RunServer(atoi(argv[2]));
+   }
+   // -gen <count> <seed> <prefix>: write synthetic save RAM for testing
+   else if(argc >= 5 && !strcmp(argv[1], "-gen"))
+   {
+      return RunGenerate(strtoul(argv[2], NULL, 10), 
+                         (unsigned int)strtoul(argv[3], NULL, 0), 
+                         argv[4]) ? 1 : 0;
+   }
+   // -names <index> <name> [--prefix | --fuzzy]: look up a name index
+   else if(argc >= 4 && !strcmp(argv[1], "-names"))
+      return RunNameLookup(argv[2], argv[3], argc >= 5 ? argv[4] : NULL);
+   // -bench [--latency MS] <files>: compare the ways of reading files
+   else if(argc >= 3 && !strcmp(argv[1], "-bench"))
+      return RunBench(argc - 2, argv + 2) ? 1 : 0;
+   // -merge <output> <sketches>: combine aggregate sketch files
+   else if(argc >= 4 && !strcmp(argv[1], "-merge"))
+      return RunMergeSketches(argv[2], argc - 3, argv + 3) ? 1 : 0;
+   // -watch <files or directories>: report changes as files are written
+   else if(argc >= 3 && !strcmp(argv[1], "-watch"))
+      RunWatch(argc - 2, argv + 2);
+   // <files> <command> [options]: run a command over the files
+   else if((cmdarg = FindCommand(argc, argv)) > 0)
+      return RunCommandLine(argc, argv, cmdarg);
+   else if(argc >= 2)
    {
       if((f = fopen(argv[1], "rb")))
       {